@@ -0,0 +1,79 @@
+#ifndef BENCH_H_
+#define BENCH_H_
+
+// What the benchmarks share, included before anything else. Each one times a
+// few programs under settings it changes between runs, see bench_run().
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <time.h>
+
+#include "common.h"
+#include "eval.h"
+
+#ifndef BENCH_REPS
+#define BENCH_REPS 3 // runs of each program, the best one counts
+#endif
+
+#define BENCH_COUNT(a) (sizeof(a) / sizeof((a)[0]))
+
+struct bench_prog
+{
+	const char* name;
+	const char* expr;
+	const char* want; // the result as printed, or its leading digits and "..."
+};
+
+static inline double bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// a new global env with the definitions evaluated in it
+static inline lenv* bench_env(const char* const* defs, size_t n)
+{
+	lenv* e = lenv_new();
+	init_env(e);
+	for (size_t i = 0; i < n; i++)
+		lval_del(eval_str(e, defs[i]));
+	return e;
+}
+
+static inline int bench_check(lval* x, const struct bench_prog* p)
+{
+	size_t n = strlen(p->want);
+	int prefix = n >= 3 && 0 == strcmp(p->want + n - 3, "...");
+	if (NULL == x || LVAL_ERR == LVAL_TYPE(x))
+		return 0;
+	if (prefix) {
+		char* s = LVAL_LNG == LVAL_TYPE(x) || LVAL_BIG == LVAL_TYPE(x) ? big_str(x) : NULL;
+		int ok = s && 0 == strncmp(s, p->want, n - 3);
+		free(s);
+		return ok;
+	}
+	char s[64];
+	return lval_snprintln(x, s, sizeof(s)) > 0 && 0 == strcmp(s, p->want);
+}
+
+// the best time of BENCH_REPS runs of p in e, in seconds, exits on a wrong
+// result
+static inline double bench_run(lenv* e, const struct bench_prog* p)
+{
+	double best = 1e30;
+	for (int r = 0; r < BENCH_REPS; r++) {
+		double t = bench_now();
+		lval* x = eval_str(e, p->expr);
+		t = bench_now() - t;
+		if (!bench_check(x, p)) {
+			printf("%s: wrong result\n", p->name);
+			exit(1);
+		}
+		lval_del(x);
+		best = MIN(best, t);
+	}
+	return best;
+}
+
+#endif
@@ -0,0 +1,50 @@
+#include "bench.h"
+#include "big.h"
+#include "jit.h"
+
+// Integer programs on both engines: longs that never overflow, for the cost
+// of the overflow checks, sums that go past int64 or add bigints, a
+// factorial, whose products are a bigint and a long, and a power, whose
+// squarings are products of two bigints, with Karatsuba against limb by limb.
+
+static const char* defs[] = {
+	"def {fact} (\\ {n acc} {if (== n 0) {acc} {fact (- n 1) (* acc n)}})",
+	"def {sum} (\\ {n x acc} {if (== n 0) {acc} {sum (- n 1) x (+ acc x)}})",
+};
+
+static const struct bench_prog progs[] = {
+	{ "sum 1M longs", "sum 1000000 7 0", "7000000" },
+	{ "sum 1M 2^62", "sum 1000000 4611686018427387904 0", "4611686018427387904000000" },
+	{ "sum 1M 10^30", "sum 1000000 1000000000000000000000000000000 0", "1000000000000000000000000000000000000" },
+	{ "fact 1000", "fact 1000 1", "40238726007709377354..." },
+	{ "^ 3 200000", "^ 3 200000", "17821486768123181469..." },
+};
+
+static double run(lenv* e, int engine, int karatsuba, size_t i)
+{
+	eval_engine = engine;
+	big_karatsuba = karatsuba;
+	return bench_run(e, &progs[i]);
+}
+
+int main(void)
+{
+	// the interpreters' arithmetic, compiled code leaves it on overflow
+	jit_enabled = 0;
+	lenv* e = bench_env(defs, BENCH_COUNT(defs));
+
+	printf("%-14s %10s %10s %14s %8s  (best of %d)\n", "",
+		"tree", "vm", "limb by limb", "speedup", BENCH_REPS);
+	for (size_t i = 0; i < BENCH_COUNT(progs); i++) {
+		double a = run(e, ENGINE_TREE, BIG_KARATSUBA, i);
+		double b = run(e, ENGINE_VM, BIG_KARATSUBA, i);
+		double c = run(e, ENGINE_VM, 1 << 30, i);
+		printf("%-14s %8.1fms %8.1fms %12.1fms %7.2fx\n", progs[i].name,
+			a * 1e3, b * 1e3, c * 1e3, c / b);
+	}
+	big_karatsuba = BIG_KARATSUBA;
+	big_print_stats(stdout);
+
+	lenv_del(e);
+	return 0;
+}
@@ -0,0 +1,43 @@
+#include "bench.h"
+#include "clos.h"
+#include "jit.h"
+
+// Call heavy programs on the tree walker, with the lambda bodies walked
+// against running them compiled.
+
+static const char* defs[] = {
+	"def {fib} (\\ {n} {if (< n 2) {n} {+ (fib (- n 1)) (fib (- n 2))}})",
+	"def {ack} (\\ {m n} {if (== m 0) {+ n 1} {if (== n 0) {ack (- m 1) 1} {ack (- m 1) (ack m (- n 1))}}})",
+	"def {sum} (\\ {n acc} {if (== n 0) {acc} {sum (- n 1) (+ acc n)}})",
+	"def {build} (\\ {n acc} {if (== n 0) {acc} {build (- n 1) (cons n acc)}})",
+	"def {walk} (\\ {xs n} {if (== (len xs) 0) {n} {walk (tail xs) (+ n (eval (head xs)))}})",
+	"def {xs} (build 100000 {})",
+};
+
+static const struct bench_prog progs[] = {
+	{ "fib 24", "fib 24", "46368" },
+	{ "ack 2 300", "ack 2 300", "603" },
+	{ "sum 300000", "sum 300000 0", "45000150000" },
+	{ "walk 100000", "walk xs 0", "5000050000" },
+};
+
+int main(void)
+{
+	// the interpreter, the jit would run these itself
+	jit_enabled = 0;
+	eval_engine = ENGINE_TREE;
+	lenv* e = bench_env(defs, BENCH_COUNT(defs));
+
+	printf("%-12s %10s %10s %8s  (best of %d)\n", "", "walked", "compiled", "speedup", BENCH_REPS);
+	for (size_t i = 0; i < BENCH_COUNT(progs); i++) {
+		clos_enabled = 0;
+		double a = bench_run(e, &progs[i]);
+		clos_enabled = 1;
+		double b = bench_run(e, &progs[i]);
+		printf("%-12s %8.1fms %8.1fms %7.2fx\n", progs[i].name, a * 1e3, b * 1e3, a / b);
+	}
+	clos_print_stats(stdout);
+
+	lenv_del(e);
+	return 0;
+}
@@ -0,0 +1,68 @@
+#define BENCH_REPS 5
+
+#include "bench.h"
+
+// Global lookup latency with many definitions, the indexed lenv against the
+// linear strcmp scan it replaced.
+
+#define BENCH_GLOBALS 10000
+#define BENCH_LOOKUPS 2000000
+
+static lval* keys[BENCH_GLOBALS];
+
+// the lookup before lenv had an index, kept here as the baseline
+static lval* linear_get(lenv* e, lval* k)
+{
+	for (int i = 0; i < e->count; i++) {
+		if (strcmp(e->syms[i], k->sym) == 0)
+			return lval_copy(e->vals[i]);
+	}
+	return lval_err(LERR_BAD_SYMBOL);
+}
+
+static double bench(const char* name, lval* (*get)(lenv*, lval*), lenv* e, int n)
+{
+	double best = 1e30;
+	int64_t sum = 0;
+	for (int r = 0; r < BENCH_REPS; r++) {
+		double t = bench_now();
+		// a fixed stride visits every global, cheap and not cache friendly
+		for (int i = 0, j = 0; i < n; i++, j = (j + 7919) % BENCH_GLOBALS) {
+			lval* x = get(e, keys[j]);
+			sum += lval_get_long(x);
+			lval_del(x);
+		}
+		best = MIN(best, bench_now() - t);
+	}
+
+	double ns = best * 1e9 / n;
+	printf("%-8s %10.1f ns/lookup (checksum %lld)\n", name, ns, (long long)sum);
+	return ns;
+}
+
+int main(void)
+{
+	char name[32];
+	lenv* e = lenv_new();
+
+	double t = bench_now();
+	for (int i = 0; i < BENCH_GLOBALS; i++) {
+		sprintf(name, "global_%d", i);
+		keys[i] = lval_sym(name);
+		lval* v = lval_long(i);
+		lenv_put(e, keys[i], v);
+		lval_del(v);
+	}
+	t = bench_now() - t;
+	printf("%d globals defined in %.2f ms, best of %d\n", BENCH_GLOBALS, t * 1e3, BENCH_REPS);
+
+	// the linear scan is too slow for the full count
+	double a = bench("linear", linear_get, e, BENCH_LOOKUPS / 100);
+	double b = bench("indexed", lenv_get, e, BENCH_LOOKUPS);
+	printf("speedup: %.1fx\n", a / b);
+
+	for (int i = 0; i < BENCH_GLOBALS; i++)
+		lval_del(keys[i]);
+	lenv_del(e);
+	return 0;
+}
@@ -0,0 +1,33 @@
+#include "bench.h"
+#include "jit.h"
+
+// Call heavy programs on the tree walker and on the vm.
+
+static const char* defs[] = {
+	"def {fib} (\\ {n} {if (< n 2) {n} {+ (fib (- n 1)) (fib (- n 2))}})",
+	"def {ack} (\\ {m n} {if (== m 0) {+ n 1} {if (== n 0) {ack (- m 1) 1} {ack (- m 1) (ack m (- n 1))}}})",
+};
+
+static const struct bench_prog progs[] = {
+	{ "fib 24", "fib 24", "46368" },
+	{ "ack 2 300", "ack 2 300", "603" },
+};
+
+int main(void)
+{
+	// the engines themselves, the jit would run these itself
+	jit_enabled = 0;
+	lenv* e = bench_env(defs, BENCH_COUNT(defs));
+
+	printf("%-12s %10s %10s %8s  (best of %d)\n", "", "tree", "vm", "speedup", BENCH_REPS);
+	for (size_t i = 0; i < BENCH_COUNT(progs); i++) {
+		eval_engine = ENGINE_TREE;
+		double a = bench_run(e, &progs[i]);
+		eval_engine = ENGINE_VM;
+		double b = bench_run(e, &progs[i]);
+		printf("%-12s %8.1fms %8.1fms %7.1fx\n", progs[i].name, a * 1e3, b * 1e3, a / b);
+	}
+
+	lenv_del(e);
+	return 0;
+}
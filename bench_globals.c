@@ -0,0 +1,47 @@
+#include "bench.h"
+#include "jit.h"
+#include "opt.h"
+
+// A recursive function calling three globals per iteration, with the global
+// caches in the symbols against looking every global up, on both engines.
+
+static const char* defs[] = {
+	"def {sq} (\\ {x} {* x x})",
+	"def {dec} (\\ {x} {- x 1})",
+	"def {odd} (\\ {x} {% x 2})",
+	"def {walk} (\\ {n acc} {if (== n 0) {acc} {walk (dec n) (+ acc (sq n) (odd n))}})",
+};
+
+static const struct bench_prog progs[] = {
+	{ "walk 100000", "walk 100000 0", "333338333400000" },
+};
+
+int main(void)
+{
+	// the bodies as written and interpreted, the optimizer would inline the
+	// globals away and the jit run the loops itself
+	opt_passes = 0;
+	jit_enabled = 0;
+	lenv* e = bench_env(defs, BENCH_COUNT(defs));
+
+	printf("%-16s %10s %10s %8s %9s  (best of %d)\n", "", "lookup", "cached", "speedup", "hit rate", BENCH_REPS);
+	for (size_t i = 0; i < BENCH_COUNT(progs); i++) {
+		for (int engine = ENGINE_TREE; engine <= ENGINE_VM; engine++) {
+			struct lenv_stats before, after;
+			eval_engine = engine;
+			lenv_cache_globals = 0;
+			double a = bench_run(e, &progs[i]);
+			lenv_cache_globals = 1;
+			lenv_get_stats(&before);
+			double b = bench_run(e, &progs[i]);
+			lenv_get_stats(&after);
+			unsigned long hits = after.hits - before.hits;
+			double rate = 100.0 * hits / (hits + after.misses - before.misses);
+			printf("%-11s %-4s %8.1fms %8.1fms %7.2fx %8.1f%%\n", progs[i].name,
+				ENGINE_VM == engine ? "vm" : "tree", a * 1e3, b * 1e3, a / b, rate);
+		}
+	}
+
+	lenv_del(e);
+	return 0;
+}
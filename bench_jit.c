@@ -0,0 +1,51 @@
+#include "bench.h"
+#include "jit.h"
+
+// Numeric kernels on both engines, interpreted against run as machine code
+// once hot. Loops that call a compiled lambda run the loop interpreted and
+// the lambda compiled, loops written as a tail call run compiled.
+
+static const char* defs[] = {
+	"def {fib} (\\ {n} {if (< n 2) {n} {+ (fib (- n 1)) (fib (- n 2))}})",
+	"def {fibd} (\\ {n} {if (< n 2.0) {n} {+ (fibd (- n 1)) (fibd (- n 2))}})",
+	"def {sum} (\\ {n acc} {if (== n 0) {acc} {sum (- n 1) (+ acc n)}})",
+	"def {poly} (\\ {x} {+ (* 3 x x) (* 2 x) 1})",
+	"def {polys} (\\ {n acc} {if (== n 0) {acc} {polys (- n 1) (+ acc (poly n))}})",
+	"def {clamp} (\\ {x lo hi} {max lo (min x hi)})",
+	"def {clamps} (\\ {n acc} {if (== n 0) {acc} {clamps (- n 1) (+ acc (clamp (% n 1000) 100 900))}})",
+};
+
+static const struct bench_prog progs[] = {
+	{ "fib 25", "fib 25", "75025" },
+	{ "fibd 22.0", "fibd 22.0", "17711.000000" },
+	{ "sum 1000000", "sum 1000000 0", "500000500000" },
+	{ "poly 100000", "polys 100000 0", "1000025000250000" },
+	{ "clamp 100000", "clamps 100000 0", "49960000" },
+};
+
+static double run(lenv* e, int engine, int enabled, size_t i)
+{
+	eval_engine = engine;
+	jit_enabled = enabled;
+	return bench_run(e, &progs[i]);
+}
+
+int main(void)
+{
+	lenv* e = bench_env(defs, BENCH_COUNT(defs));
+
+	printf("%-14s %10s %10s %8s %10s %10s %8s  (best of %d)\n", "",
+		"tree", "tree jit", "speedup", "vm", "vm jit", "speedup", BENCH_REPS);
+	for (size_t i = 0; i < BENCH_COUNT(progs); i++) {
+		double a = run(e, ENGINE_TREE, 0, i);
+		double b = run(e, ENGINE_TREE, 1, i);
+		double c = run(e, ENGINE_VM, 0, i);
+		double d = run(e, ENGINE_VM, 1, i);
+		printf("%-14s %8.1fms %8.1fms %7.2fx %8.1fms %8.1fms %7.2fx\n", progs[i].name,
+			a * 1e3, b * 1e3, a / b, c * 1e3, d * 1e3, c / d);
+	}
+	jit_print_stats(stdout);
+
+	lenv_del(e);
+	return 0;
+}
@@ -0,0 +1,37 @@
+#include "bench.h"
+
+// List building and walking with room kept before long lists, against flat
+// lists that are shifted by one on every cons (lval_room_min 0).
+
+static const char* defs[] = {
+	"def {build} (\\ {n acc} {if (== n 0) {acc} {build (- n 1) (cons n acc)}})",
+	"def {cat} (\\ {n acc} {if (== n 0) {acc} {cat (- n 1) (join acc {n})}})",
+	"def {walk} (\\ {xs n} {if (== (len xs) 0) {n} {walk (tail xs) (+ n 1)}})",
+	"def {back} (\\ {xs n} {if (== (len xs) 0) {n} {back (init xs) (+ n 1)}})",
+	"def {big} (cat 100000 {})",
+};
+
+static const struct bench_prog progs[] = {
+	{ "cons 20000", "len (build 20000 {})", "20000" },
+	{ "join 20000", "len (cat 20000 {})", "20000" },
+	{ "cons 5 big", "len (cons 1 (cons 2 (cons 3 (cons 4 (cons 5 big)))))", "100005" },
+	{ "tail 100000", "walk big 0", "100000" },
+	{ "init 100000", "back big 0", "100000" },
+};
+
+int main(void)
+{
+	lenv* e = bench_env(defs, BENCH_COUNT(defs));
+
+	printf("%-12s %10s %10s %8s  (best of %d)\n", "", "flat", "room", "speedup", BENCH_REPS);
+	for (size_t i = 0; i < BENCH_COUNT(progs); i++) {
+		lval_room_min = 0;
+		double a = bench_run(e, &progs[i]);
+		lval_room_min = LVAL_ROOM_MIN;
+		double b = bench_run(e, &progs[i]);
+		printf("%-12s %8.1fms %8.1fms %7.1fx\n", progs[i].name, a * 1e3, b * 1e3, a / b);
+	}
+
+	lenv_del(e);
+	return 0;
+}
@@ -0,0 +1,43 @@
+#include "bench.h"
+#include "opt.h"
+#include "jit.h"
+
+// Loops calling small global lambdas and computing constants, run with their
+// bodies as written against the rewritten ones, on both engines.
+
+static const char* defs[] = {
+	"def {sq} (\\ {x} {* x x})",
+	"def {dec} (\\ {x} {- x 1})",
+	"def {odd} (\\ {x} {% x 2})",
+	"def {walk} (\\ {n acc} {if (== n 0) {acc} {walk (dec n) (+ acc (sq n) (odd n))}})",
+	"def {day} (\\ {n acc} {if (== n 0) {acc} {day (- n 1) (+ acc (* 60 60 24) (if (> 2 1) {n} {0}))}})",
+};
+
+static const struct bench_prog progs[] = {
+	{ "walk 100000", "walk 100000 0", "333338333400000" },
+	{ "day 100000", "day 100000 0", "13640050000" },
+};
+
+int main(void)
+{
+	// the bodies interpreted, the jit would run these itself
+	jit_enabled = 0;
+	lenv* e = bench_env(defs, BENCH_COUNT(defs));
+
+	printf("%-16s %10s %10s %8s  (best of %d)\n", "", "written", "rewritten", "speedup", BENCH_REPS);
+	for (size_t i = 0; i < BENCH_COUNT(progs); i++) {
+		for (int engine = ENGINE_TREE; engine <= ENGINE_VM; engine++) {
+			eval_engine = engine;
+			opt_passes = 0;
+			double a = bench_run(e, &progs[i]);
+			opt_passes = OPT_ALL;
+			double b = bench_run(e, &progs[i]);
+			printf("%-11s %-4s %8.1fms %8.1fms %7.2fx\n", progs[i].name,
+				ENGINE_VM == engine ? "vm" : "tree", a * 1e3, b * 1e3, a / b);
+		}
+	}
+	opt_print_stats(stdout);
+
+	lenv_del(e);
+	return 0;
+}
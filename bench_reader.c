@@ -0,0 +1,146 @@
+#define BENCH_REPS 5
+
+#include "bench.h"
+#include "parser.h"
+
+#include "mpc/mpc.h"
+
+// Reader throughput, the hand-written reader against the old mpc grammar
+// followed by the ast to lval conversion.
+
+#define BENCH_NUMS 200000
+
+static mpc_parser_t* Long;
+static mpc_parser_t* Double;
+static mpc_parser_t* Symbol;
+static mpc_parser_t* Sexpr;
+static mpc_parser_t* Qexpr;
+static mpc_parser_t* Expr;
+static mpc_parser_t* Lisp;
+
+static void mpc_init(void)
+{
+	Long		= mpc_new("long");
+	Double		= mpc_new("double");
+	Symbol		= mpc_new("symbol");
+	Sexpr		= mpc_new("sexpr");
+	Qexpr		= mpc_new("qexpr");
+	Expr		= mpc_new("expr");
+	Lisp		= mpc_new("lisp");
+
+	mpca_lang(MPCA_LANG_DEFAULT,
+		"long		: /-?\\d+/ ;"
+		"double		: /-?\\d*\\.\\d+|-?\\d+\\./ ;"
+		"symbol		: /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&\\^%]+/ ; "
+		"sexpr		: '(' <expr>* ')' ;"
+		"qexpr		: '{' <expr>* '}' ;"
+		"expr		: <double> | <long> | <symbol> | <sexpr> | <qexpr> ;"
+		"lisp		: /^/ <expr>* /$/ ;",
+		Long, Double, Symbol, Sexpr, Qexpr, Expr, Lisp);
+}
+
+static lval* ast_to_lval(mpc_ast_t* ast)
+{
+	if (strstr(ast->tag, "long")) {
+		errno = 0;
+		int64_t x = strtol(ast->contents, NULL, 10);
+		return errno ? lval_err(LERR_BAD_NUM) : lval_long(x);
+	}
+	if (strstr(ast->tag, "double")) {
+		errno = 0;
+		double x = strtod(ast->contents, NULL);
+		return errno ? lval_err(LERR_BAD_NUM) : lval_double(x);
+	}
+	if (strstr(ast->tag, "symbol"))
+		return lval_sym(ast->contents);
+
+	lval* x = NULL; // ">" is root
+	if (0 == strcmp(ast->tag, ">") || strstr(ast->tag, "sexpr"))
+		x = lval_sexpr();
+	else if (strstr(ast->tag, "qexpr"))
+		x = lval_qexpr();
+	else
+		return lval_err(LERR_OTHER);
+
+	for (int i = 0; i < ast->children_num; i++)
+	{
+		if (strcmp(ast->children[i]->contents, "(") == 0
+			|| strcmp(ast->children[i]->contents, ")") == 0
+			|| strcmp(ast->children[i]->contents, "}") == 0
+			|| strcmp(ast->children[i]->contents, "{") == 0
+			|| strcmp(ast->children[i]->tag,  "regex") == 0
+			) { continue; }
+		x = lval_add_toback(x, ast_to_lval(ast->children[i]));
+	}
+	return x;
+}
+
+static lval* mpc_read(const char* input)
+{
+	mpc_result_t r;
+	if (!mpc_parse("<bench>", input, Lisp, &r)) {
+		mpc_err_print(r.error);
+		mpc_err_delete(r.error);
+		return NULL;
+	}
+	lval* x = ast_to_lval(r.output);
+	mpc_ast_delete(r.output);
+	return x;
+}
+
+// a generated script, one big qexpr literal of numbers and some code around it
+static char* make_input(size_t* len)
+{
+	size_t cap = BENCH_NUMS * 24 + 256;
+	char* buf = malloc(cap);
+	size_t n = 0;
+
+	n += sprintf(buf+n, "def {data} {");
+	for (int i = 0; i < BENCH_NUMS; i++) {
+		if (i % 4 == 3)
+			n += sprintf(buf+n, "%d.%d ", i, i % 97);
+		else
+			n += sprintf(buf+n, "%d ", i * 7919 - 1000000);
+	}
+	n += sprintf(buf+n, "} (\\ {x y} {+ (* 7 x) (- y 2) (max x y)})");
+
+	*len = n;
+	return buf;
+}
+
+static double bench(const char* name, lval* (*read)(const char*), const char* input, size_t len)
+{
+	double best = 1e30;
+	for (int i = 0; i < BENCH_REPS; i++) {
+		double t = bench_now();
+		lval* x = read(input);
+		t = bench_now() - t;
+		if (NULL == x) {
+			printf("%s: read failed\n", name);
+			exit(1);
+		}
+		lval_del(x);
+		best = MIN(best, t);
+	}
+
+	double mbs = len / best / (1024.0 * 1024.0);
+	printf("%-8s %8.2f ms %10.2f MB/s\n", name, best * 1e3, mbs);
+	return mbs;
+}
+
+int main(void)
+{
+	size_t len;
+	char* input = make_input(&len);
+	printf("input: %.2f MB, %d numbers, best of %d\n",
+		len / (1024.0 * 1024.0), BENCH_NUMS, BENCH_REPS);
+
+	mpc_init();
+	double a = bench("mpc", mpc_read, input, len);
+	double b = bench("reader", parse, input, len);
+	printf("speedup: %.1fx\n", b / a);
+
+	mpc_cleanup(7, Long, Double, Symbol, Qexpr, Sexpr, Expr, Lisp);
+	free(input);
+	return 0;
+}
@@ -0,0 +1,566 @@
+#include <math.h>
+
+#include "big.h"
+#include "eval.h"
+#include "gc.h"
+
+#define BIG_BASE ((uint64_t)1 << 32)
+#define BIG_DEC 1000000000 // the most 10^k that fits in a limb
+#define BIG_DEC_DIGITS 9
+
+// the magnitude of a long or a bigint, a long's limbs are in buf
+struct mag
+{
+	const uint32_t* d;
+	int n;
+	int neg;
+	uint32_t buf[2];
+};
+
+int big_karatsuba = BIG_KARATSUBA;
+
+static struct big_stats stats = { 0, 0, 0, 0 };
+
+static void _view(lval* x, struct mag* m);
+static lval* _make(uint32_t* d, int n, int neg, int bigs);
+static int _cmp(const uint32_t* a, int na, const uint32_t* b, int nb);
+static uint32_t _add_to(uint32_t* r, int nr, const uint32_t* a, int na);
+static void _sub_from(uint32_t* r, int nr, const uint32_t* a, int na);
+static lval* _add(struct mag* a, struct mag* b, int sub, int bigs);
+static int _mul(uint32_t* r, const uint32_t* a, int na, const uint32_t* b, int nb);
+static void _mul_school(uint32_t* r, const uint32_t* a, int na, const uint32_t* b, int nb);
+static lval* _product(struct mag* a, struct mag* b, int bigs);
+static int _divmod(uint32_t* q, uint32_t* r, const uint32_t* a, int na, const uint32_t* b, int nb);
+static lval* _quotient(struct mag* a, struct mag* b, int mod, int bigs);
+static lval* _pow(struct mag* a, lval* y, int bigs);
+static uint32_t _div_small(uint32_t* d, int n, uint32_t y);
+
+lval* big_op(int op, lval* x, lval* y)
+{
+	struct mag a, b;
+	_view(x, &a);
+	_view(y, &b);
+	int bigs = (LVAL_BIG == LVAL_TYPE(x)) + (LVAL_BIG == LVAL_TYPE(y));
+	stats.ops++;
+
+	switch (op) {
+	case ARITH_ADD: return _add(&a, &b, 0, bigs);
+	case ARITH_SUB: return _add(&a, &b, 1, bigs);
+	case ARITH_MUL: return _product(&a, &b, bigs);
+	case ARITH_DIV: return _quotient(&a, &b, 0, bigs);
+	case ARITH_MOD: return _quotient(&a, &b, 1, bigs);
+	case ARITH_POW: return _pow(&a, y, bigs);
+	case ARITH_MIN: return lval_copy(big_cmp(x, y) <= 0 ? x : y);
+	case ARITH_MAX: return lval_copy(big_cmp(x, y) >= 0 ? x : y);
+	}
+	return lval_err(LERR_BAD_OP);
+}
+
+lval* big_neg(lval* x)
+{
+	struct mag a, z;
+	_view(x, &a);
+	z.d = z.buf;
+	z.n = z.neg = 0;
+	stats.ops++;
+	return _add(&z, &a, 1, LVAL_BIG == LVAL_TYPE(x));
+}
+
+int big_cmp(lval* x, lval* y)
+{
+	struct mag a, b;
+	_view(x, &a);
+	_view(y, &b);
+	if (a.neg != b.neg)
+		return a.neg ? -1 : 1;
+	int r = _cmp(a.d, a.n, b.d, b.n);
+	return a.neg ? -r : r;
+}
+
+double big_to_double(lval* x)
+{
+	if (LVAL_BIG != LVAL_TYPE(x))
+		return (double)lval_get_long(x);
+
+	// the top 96 bits are more than a double holds
+	int n = x->nlimbs;
+	double d = 0;
+	for (int i = n - 1; i >= 0 && i >= n - 3; i--)
+		d = d * BIG_BASE + x->limbs[i];
+	d = ldexp(d, 32 * (n > 3 ? n - 3 : 0));
+	return x->neg ? -d : d;
+}
+
+lval* big_new(const uint32_t* limbs, int n, int neg)
+{
+	uint32_t* d = (uint32_t*)malloc(sizeof(uint32_t) * (n ? n : 1));
+	if (NULL == d)
+		return lval_err(LERR_OTHER);
+	memcpy(d, limbs, sizeof(uint32_t) * n);
+	return _make(d, n, neg, 1);
+}
+
+lval* big_parse(const char* s, const char* end)
+{
+	int neg = ('-' == *s);
+	s += neg;
+	// log2(10) < 3.33, so a limb takes more than 9 digits
+	int cap = (int)((end - s) / 9) + 2;
+	uint32_t* d = (uint32_t*)calloc(cap, sizeof(uint32_t));
+	if (NULL == d)
+		return lval_err(LERR_OTHER);
+
+	int n = 0;
+	for (const char* p = s; p < end;) {
+		uint32_t chunk = 0;
+		uint32_t scale = 1;
+		for (int k = 0; k < BIG_DEC_DIGITS && p < end; k++, p++) {
+			chunk = chunk * 10 + (*p - '0');
+			scale *= 10;
+		}
+		// d = d * scale + chunk
+		uint64_t c = chunk;
+		for (int i = 0; i < n; i++) {
+			c += (uint64_t)d[i] * scale;
+			d[i] = (uint32_t)c;
+			c >>= 32;
+		}
+		if (c)
+			d[n++] = (uint32_t)c;
+	}
+	stats.ops++;
+	return _make(d, n, neg, 0);
+}
+
+char* big_str(lval* x)
+{
+	struct mag a;
+	_view(x, &a);
+	uint32_t* d = (uint32_t*)malloc(sizeof(uint32_t) * (a.n ? a.n : 1));
+	// a limb is at most 10 digits
+	size_t cap = (size_t)a.n * 10 + 2;
+	char* s = (char*)malloc(cap + 1);
+	if (NULL == d || NULL == s) {
+		free(d);
+		free(s);
+		return NULL;
+	}
+	memcpy(d, a.d, sizeof(uint32_t) * a.n);
+
+	// digits from the end of s backwards, 9 at a time
+	char* p = s + cap;
+	*p = '\0';
+	int n = a.n;
+	do {
+		uint32_t r = _div_small(d, n, BIG_DEC);
+		while (n && 0 == d[n-1])
+			n--;
+		for (int k = 0; k < BIG_DEC_DIGITS && (n || r); k++) {
+			*--p = '0' + r % 10;
+			r /= 10;
+		}
+	} while (n);
+	if (p == s + cap)
+		*--p = '0';
+	if (a.neg)
+		*--p = '-';
+	memmove(s, p, s + cap - p + 1);
+	free(d);
+	return s;
+}
+
+void big_get_stats(struct big_stats* st)
+{
+	*st = stats;
+}
+
+void big_print_stats(FILE* fp)
+{
+	fprintf(fp, "karatsuba from: %d limbs\n", big_karatsuba);
+	fprintf(fp, "ops: %lu, promoted: %lu, demoted: %lu, karatsuba products: %lu\n",
+		stats.ops, stats.promotions, stats.demotions, stats.karatsuba);
+}
+
+// private functions: //////////////////////////////////////////////////////////
+
+static void _view(lval* x, struct mag* m)
+{
+	if (LVAL_BIG == LVAL_TYPE(x)) {
+		m->d = x->limbs;
+		m->n = x->nlimbs;
+		m->neg = x->neg;
+		return;
+	}
+
+	int64_t v = lval_get_long(x);
+	uint64_t u = v < 0 ? -(uint64_t)v : (uint64_t)v;
+	m->buf[0] = (uint32_t)u;
+	m->buf[1] = (uint32_t)(u >> 32);
+	m->d = m->buf;
+	m->n = (u >> 32) ? 2 : u ? 1 : 0;
+	m->neg = v < 0;
+}
+
+// takes d, the n limbs of a magnitude, bigs is how many operands were bigints
+static lval* _make(uint32_t* d, int n, int neg, int bigs)
+{
+	while (n && 0 == d[n-1])
+		n--;
+
+	uint64_t u = n > 1 ? (uint64_t)d[1] << 32 | d[0] : n ? d[0] : 0;
+	if (n <= 2 && u <= (uint64_t)INT64_MAX + neg) {
+		free(d);
+		if (bigs)
+			stats.demotions++;
+		return lval_long(neg ? (int64_t)-u : (int64_t)u);
+	}
+
+	lval* v = gc_lval(LVAL_BIG);
+	if (NULL == v) {
+		free(d);
+		return lval_err(LERR_OTHER);
+	}
+	if (!bigs)
+		stats.promotions++;
+	v->limbs = d;
+	v->nlimbs = n;
+	v->neg = neg;
+	return v;
+}
+
+static int _cmp(const uint32_t* a, int na, const uint32_t* b, int nb)
+{
+	while (na && 0 == a[na-1])
+		na--;
+	while (nb && 0 == b[nb-1])
+		nb--;
+	if (na != nb)
+		return na < nb ? -1 : 1;
+	for (int i = na - 1; i >= 0; i--) {
+		if (a[i] != b[i])
+			return a[i] < b[i] ? -1 : 1;
+	}
+	return 0;
+}
+
+// r += a, na <= nr, the carry out of r
+static uint32_t _add_to(uint32_t* r, int nr, const uint32_t* a, int na)
+{
+	uint64_t c = 0;
+	int i = 0;
+	for (; i < na; i++) {
+		c += (uint64_t)r[i] + a[i];
+		r[i] = (uint32_t)c;
+		c >>= 32;
+	}
+	for (; c && i < nr; i++) {
+		c += r[i];
+		r[i] = (uint32_t)c;
+		c >>= 32;
+	}
+	return (uint32_t)c;
+}
+
+// r -= a, na <= nr and a <= r
+static void _sub_from(uint32_t* r, int nr, const uint32_t* a, int na)
+{
+	uint64_t b = 0;
+	int i = 0;
+	for (; i < na; i++) {
+		uint64_t t = (uint64_t)r[i] - a[i] - b;
+		r[i] = (uint32_t)t;
+		b = t >> 63;
+	}
+	for (; b && i < nr; i++) {
+		uint64_t t = (uint64_t)r[i] - b;
+		r[i] = (uint32_t)t;
+		b = t >> 63;
+	}
+}
+
+// a + b, or a - b when sub is set
+static lval* _add(struct mag* a, struct mag* b, int sub, int bigs)
+{
+	// the longer magnitude less or plus the other, with the sign of the larger
+	int bneg = b->neg ^ sub;
+	const struct mag* x = a;
+	const struct mag* y = b;
+	int neg = a->neg;
+	if (_cmp(a->d, a->n, b->d, b->n) < 0) {
+		x = b;
+		y = a;
+		neg = bneg;
+	}
+
+	uint32_t* d = (uint32_t*)malloc(sizeof(uint32_t) * (x->n + 1));
+	if (NULL == d)
+		return lval_err(LERR_OTHER);
+	memcpy(d, x->d, sizeof(uint32_t) * x->n);
+	d[x->n] = 0;
+	if (a->neg == bneg)
+		_add_to(d, x->n + 1, y->d, y->n);
+	else
+		_sub_from(d, x->n, y->d, y->n);
+	return _make(d, x->n + 1, neg, bigs);
+}
+
+// r = a * b in the na + nb limbs at r, 1 when out of memory
+static int _mul(uint32_t* r, const uint32_t* a, int na, const uint32_t* b, int nb)
+{
+	if (na < nb) {
+		const uint32_t* t = a;
+		a = b;
+		b = t;
+		int n = na;
+		na = nb;
+		nb = n;
+	}
+	memset(r, 0, sizeof(uint32_t) * (na + nb));
+	// (a0 + a1)(b0 + b1) is shorter than a b from 4 limbs on
+	if (nb < big_karatsuba || nb < 4) {
+		_mul_school(r, a, na, b, nb);
+		return 0;
+	}
+
+	// a far longer than b is multiplied a piece as long as b at a time
+	int m = (na + 1) / 2;
+	if (nb <= m) {
+		uint32_t* t = (uint32_t*)malloc(sizeof(uint32_t) * 2 * nb);
+		if (NULL == t)
+			return 1;
+		for (int i = 0; i < na; i += nb) {
+			int k = MIN(nb, na - i);
+			if (_mul(t, a + i, k, b, nb)) {
+				free(t);
+				return 1;
+			}
+			_add_to(r + i, na + nb - i, t, k + nb);
+		}
+		free(t);
+		return 0;
+	}
+
+	// a = a1 B^m + a0 and b = b1 B^m + b0, a0 b0 and a1 b1 go straight into r,
+	// a1 b0 + a0 b1 is (a0 + a1)(b0 + b1) - a0 b0 - a1 b1
+	stats.karatsuba++;
+	uint32_t* t = (uint32_t*)malloc(sizeof(uint32_t) * 4 * (m + 1));
+	if (NULL == t)
+		return 1;
+	uint32_t* sa = t;
+	uint32_t* sb = t + m + 1;
+	uint32_t* z = t + 2 * (m + 1);
+	memcpy(sa, a, sizeof(uint32_t) * m);
+	sa[m] = _add_to(sa, m, a + m, na - m);
+	memcpy(sb, b, sizeof(uint32_t) * m);
+	sb[m] = _add_to(sb, m, b + m, nb - m);
+
+	if (_mul(r, a, m, b, m) || _mul(r + 2 * m, a + m, na - m, b + m, nb - m)
+		|| _mul(z, sa, m + 1, sb, m + 1)) {
+		free(t);
+		return 1;
+	}
+	int nz = 2 * (m + 1);
+	_sub_from(z, nz, r, 2 * m);
+	_sub_from(z, nz, r + 2 * m, na + nb - 2 * m);
+	while (nz && 0 == z[nz-1])
+		nz--;
+	_add_to(r + m, na + nb - m, z, nz);
+	free(t);
+	return 0;
+}
+
+// r is zeroed, a limb product and two limbs always fit in 64 bits
+static void _mul_school(uint32_t* r, const uint32_t* a, int na, const uint32_t* b, int nb)
+{
+	for (int i = 0; i < nb; i++) {
+		uint64_t c = 0;
+		uint64_t y = b[i];
+		for (int j = 0; j < na; j++) {
+			c += a[j] * y + r[i+j];
+			r[i+j] = (uint32_t)c;
+			c >>= 32;
+		}
+		r[i+na] = (uint32_t)c;
+	}
+}
+
+static lval* _product(struct mag* a, struct mag* b, int bigs)
+{
+	if (0 == a->n || 0 == b->n)
+		return lval_long(0);
+	if (a->n + b->n > BIG_MAX_LIMBS)
+		return lval_err(LERR_BAD_NUM);
+
+	uint32_t* d = (uint32_t*)malloc(sizeof(uint32_t) * (a->n + b->n));
+	if (NULL == d || _mul(d, a->d, a->n, b->d, b->n)) {
+		free(d);
+		return lval_err(LERR_OTHER);
+	}
+	return _make(d, a->n + b->n, a->neg != b->neg, bigs);
+}
+
+// Knuth's algorithm D: q gets the na - nb + 1 limbs of a / b and r the nb of
+// a % b, na >= nb and b has no leading zero limb, 1 when out of memory
+static int _divmod(uint32_t* q, uint32_t* r, const uint32_t* a, int na, const uint32_t* b, int nb)
+{
+	if (1 == nb) {
+		memcpy(q, a, sizeof(uint32_t) * na);
+		r[0] = _div_small(q, na, b[0]);
+		return 0;
+	}
+
+	// shift b until its top bit is set, so each guess is off by 2 at most
+	int s = __builtin_clz(b[nb-1]);
+	uint32_t* t = (uint32_t*)malloc(sizeof(uint32_t) * (na + 1 + nb));
+	if (NULL == t)
+		return 1;
+	uint32_t* u = t;
+	uint32_t* v = t + na + 1;
+	for (int i = nb - 1; i > 0; i--)
+		v[i] = (b[i] << s) | (uint32_t)((uint64_t)b[i-1] >> (32 - s));
+	v[0] = b[0] << s;
+	u[na] = (uint32_t)((uint64_t)a[na-1] >> (32 - s));
+	for (int i = na - 1; i > 0; i--)
+		u[i] = (a[i] << s) | (uint32_t)((uint64_t)a[i-1] >> (32 - s));
+	u[0] = a[0] << s;
+
+	for (int j = na - nb; j >= 0; j--) {
+		uint64_t num = (uint64_t)u[j+nb] << 32 | u[j+nb-1];
+		uint64_t qhat = num / v[nb-1];
+		uint64_t rhat = num % v[nb-1];
+		while (qhat >= BIG_BASE || qhat * v[nb-2] > (rhat << 32 | u[j+nb-2])) {
+			qhat--;
+			rhat += v[nb-1];
+			if (rhat >= BIG_BASE)
+				break;
+		}
+
+		// u -= qhat v from j on, added back once if that went below zero
+		uint64_t borrow = 0;
+		uint64_t carry = 0;
+		for (int i = 0; i < nb; i++) {
+			uint64_t p = qhat * v[i] + carry;
+			carry = p >> 32;
+			uint64_t d = (uint64_t)u[i+j] - (uint32_t)p - borrow;
+			u[i+j] = (uint32_t)d;
+			borrow = d >> 63;
+		}
+		uint64_t d = (uint64_t)u[j+nb] - carry - borrow;
+		u[j+nb] = (uint32_t)d;
+		q[j] = (uint32_t)qhat;
+		if (d >> 63) {
+			q[j]--;
+			u[j+nb] += _add_to(u + j, nb, v, nb);
+		}
+	}
+
+	for (int i = 0; i < nb; i++)
+		r[i] = (u[i] >> s) | (uint32_t)((uint64_t)u[i+1] << (32 - s));
+	free(t);
+	return 0;
+}
+
+// truncated like C, the remainder has the sign of a
+static lval* _quotient(struct mag* a, struct mag* b, int mod, int bigs)
+{
+	if (0 == b->n)
+		return lval_err(LERR_DIV_ZERO);
+	if (_cmp(a->d, a->n, b->d, b->n) < 0 && !mod)
+		return lval_long(0);
+	if (_cmp(a->d, a->n, b->d, b->n) < 0) {
+		uint32_t* d = (uint32_t*)malloc(sizeof(uint32_t) * (a->n ? a->n : 1));
+		if (NULL == d)
+			return lval_err(LERR_OTHER);
+		memcpy(d, a->d, sizeof(uint32_t) * a->n);
+		return _make(d, a->n, a->neg, bigs);
+	}
+
+	uint32_t* q = (uint32_t*)malloc(sizeof(uint32_t) * (a->n - b->n + 1));
+	uint32_t* r = (uint32_t*)malloc(sizeof(uint32_t) * b->n);
+	if (NULL == q || NULL == r || _divmod(q, r, a->d, a->n, b->d, b->n)) {
+		free(q);
+		free(r);
+		return lval_err(LERR_OTHER);
+	}
+	if (mod) {
+		free(q);
+		return _make(r, b->n, a->neg, bigs);
+	}
+	free(r);
+	return _make(q, a->n - b->n + 1, a->neg != b->neg, bigs);
+}
+
+// by squaring, a negative exponent gives what truncating a^y gives
+static lval* _pow(struct mag* a, lval* y, int bigs)
+{
+	int one = 1 == a->n && 1 == a->d[0];
+	if (LVAL_BIG == LVAL_TYPE(y) || lval_get_long(y) < 0) {
+		int odd = LVAL_BIG == LVAL_TYPE(y) ? y->limbs[0] & 1 : lval_get_long(y) & 1;
+		if (one)
+			return lval_long(a->neg && odd ? -1 : 1);
+		if (LVAL_BIG != LVAL_TYPE(y) || y->neg || 0 == a->n)
+			return lval_long(0);
+		return lval_err(LERR_BAD_NUM);
+	}
+
+	uint64_t n = (uint64_t)lval_get_long(y);
+	if (0 == n)
+		return lval_long(1);
+	if (0 == a->n)
+		return lval_long(0);
+	if (one)
+		return lval_long(a->neg && (n & 1) ? -1 : 1);
+	uint64_t bits = 32 * (uint64_t)a->n - __builtin_clz(a->d[a->n-1]);
+	if (n > (uint64_t)32 * BIG_MAX_LIMBS / bits)
+		return lval_err(LERR_BAD_NUM);
+
+	// x is a^(2^k) and p the product of those picked so far, limb counts in nx, np
+	int cap = (int)((bits * n + 31) / 32) + 1;
+	uint32_t* x = (uint32_t*)malloc(sizeof(uint32_t) * cap);
+	uint32_t* p = (uint32_t*)malloc(sizeof(uint32_t) * cap);
+	uint32_t* t = (uint32_t*)malloc(sizeof(uint32_t) * 2 * cap);
+	if (NULL == x || NULL == p || NULL == t)
+		goto fail;
+	int nx = a->n;
+	int np = 1;
+	memcpy(x, a->d, sizeof(uint32_t) * nx);
+	p[0] = 1;
+	for (uint64_t k = n;;) {
+		if (k & 1) {
+			if (_mul(t, p, np, x, nx))
+				goto fail;
+			for (np += nx; np > 1 && 0 == t[np-1]; np--)
+				;
+			memcpy(p, t, sizeof(uint32_t) * np);
+		}
+		k >>= 1;
+		if (0 == k)
+			break;
+		if (_mul(t, x, nx, x, nx))
+			goto fail;
+		for (nx *= 2; nx > 1 && 0 == t[nx-1]; nx--)
+			;
+		memcpy(x, t, sizeof(uint32_t) * nx);
+	}
+	free(x);
+	free(t);
+	return _make(p, np, a->neg && (n & 1), bigs);
+
+fail:
+	free(x);
+	free(p);
+	free(t);
+	return lval_err(LERR_OTHER);
+}
+
+// d /= y in place, the remainder
+static uint32_t _div_small(uint32_t* d, int n, uint32_t y)
+{
+	uint64_t r = 0;
+	for (int i = n - 1; i >= 0; i--) {
+		uint64_t c = r << 32 | d[i];
+		d[i] = (uint32_t)(c / y);
+		r = c % y;
+	}
+	return (uint32_t)r;
+}
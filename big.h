@@ -0,0 +1,46 @@
+#ifndef BIG_H_
+#define BIG_H_
+
+#include "common.h"
+
+// Integers past int64. An LVAL_BIG is a sign and a magnitude in 32 bit limbs,
+// least significant first, without leading zero limbs, and only ever holds a
+// value that does not fit in an int64: every result is demoted to an
+// LVAL_LNG when it fits, so a long and a bigint are never equal.
+//
+// builtin_op() folds longs with overflow checks and carries on with big_op()
+// from the cell that overflowed or was a bigint. Products whose shorter
+// operand has big_karatsuba limbs or more are split the Karatsuba way, the
+// others are multiplied limb by limb.
+
+#define BIG_KARATSUBA 32 // limbs
+#define BIG_MAX_LIMBS (1 << 22) // 128 Mbit, larger results are LERR_BAD_NUM
+
+extern int big_karatsuba;
+
+struct big_stats
+{
+	unsigned long ops;
+	unsigned long promotions; // results of longs that needed a bigint
+	unsigned long demotions; // results of bigints that fit in a long
+	unsigned long karatsuba; // products split
+};
+
+// x op y for an ARITH_OP of eval.h, both longs or bigints, nothing is taken.
+// The result is a long when it fits, or an error.
+lval* big_op(int op, lval* x, lval* y);
+lval* big_neg(lval* x); // x a long or a bigint, not taken
+
+int big_cmp(lval* x, lval* y); // <0, 0 or >0, longs or bigints
+double big_to_double(lval* x); // within a bit of the nearest double
+
+// a copy of the n limbs at limbs, a long when it fits
+lval* big_new(const uint32_t* limbs, int n, int neg);
+// the decimal digits from s to end, after an optional '-'
+lval* big_parse(const char* s, const char* end);
+char* big_str(lval* x); // decimal, malloc'd, NULL when out of memory
+
+void big_get_stats(struct big_stats* st);
+void big_print_stats(FILE* fp);
+
+#endif
@@ -0,0 +1,215 @@
+#include "cache.h"
+#include "parser.h"
+
+#define PCACHE_MIN_BUCKETS 64
+
+struct pcache_entry
+{
+	uint64_t hash;
+	char* key;
+	size_t len;
+	size_t size; // accounted bytes
+	lval* tmpl;
+
+	struct pcache_entry* chain; // next in bucket
+	struct pcache_entry* prev; // lru list, most recent first
+	struct pcache_entry* next;
+};
+
+static struct pcache_entry** buckets = NULL;
+static size_t nbuckets = 0;
+static struct pcache_entry* lru_head = NULL;
+static struct pcache_entry* lru_tail = NULL;
+static struct pcache_stats stats = { 0, 0, 0, 0, 0, PCACHE_DEFAULT_BUDGET };
+
+static size_t _lval_size(lval* v);
+static void _lru_unlink(struct pcache_entry* x);
+static void _lru_push(struct pcache_entry* x);
+static void _evict(struct pcache_entry* x);
+static void _shrink_to(size_t budget);
+static void _grow(void);
+
+lval* pcache_parse(const char* input)
+{
+	size_t len = strlen(input);
+	uint64_t h = hash_bytes(input, len);
+
+	if (nbuckets) {
+		for (struct pcache_entry* x = buckets[h & (nbuckets-1)]; x; x = x->chain) {
+			if (x->hash == h && x->len == len && 0 == memcmp(x->key, input, len)) {
+				stats.hits++;
+				_lru_unlink(x);
+				_lru_push(x);
+				return lval_copy(x->tmpl);
+			}
+		}
+	}
+
+	stats.misses++;
+	lval* v = parse_n(input, len);
+	if (NULL == v)
+		return NULL;
+
+	size_t size = sizeof(struct pcache_entry) + len + _lval_size(v);
+	if (size > stats.budget)
+		return v;
+
+	_shrink_to(stats.budget - size);
+	if (stats.entries >= nbuckets)
+		_grow();
+	if (0 == nbuckets)
+		return v;
+
+	struct pcache_entry* x = (struct pcache_entry*)calloc(1, sizeof(struct pcache_entry));
+	if (NULL == x)
+		return v;
+	x->key = (char*)malloc(len);
+	if (NULL == x->key) {
+		free(x);
+		return v;
+	}
+	memcpy(x->key, input, len);
+	x->hash = h;
+	x->len = len;
+	x->size = size;
+	x->tmpl = lval_copy(v);
+
+	size_t b = h & (nbuckets-1);
+	x->chain = buckets[b];
+	buckets[b] = x;
+	_lru_push(x);
+	stats.entries++;
+	stats.bytes += size;
+	return v;
+}
+
+void pcache_set_budget(size_t budget)
+{
+	stats.budget = budget;
+	_shrink_to(budget);
+}
+
+void pcache_trace(void (*visit)(lval*))
+{
+	for (struct pcache_entry* x = lru_head; x; x = x->next)
+		visit(x->tmpl);
+}
+
+void pcache_clear(void)
+{
+	while (lru_tail)
+		_evict(lru_tail);
+	free(buckets);
+	buckets = NULL;
+	nbuckets = 0;
+}
+
+void pcache_get_stats(struct pcache_stats* st)
+{
+	*st = stats;
+}
+
+void pcache_print_stats(FILE* fp)
+{
+	unsigned long lookups = stats.hits + stats.misses;
+	fprintf(fp, "entries: %zu, bytes: %zu/%zu\n", stats.entries, stats.bytes, stats.budget);
+	fprintf(fp, "hits: %lu, misses: %lu, evictions: %lu, hit rate: %.1f%%\n",
+		stats.hits, stats.misses, stats.evictions,
+		lookups ? 100.0 * stats.hits / lookups : 0.0);
+}
+
+// private functions: //////////////////////////////////////////////////////////
+
+static size_t _lval_size(lval* v)
+{
+	if (LVAL_IS_IMM(v))
+		return 0;
+
+	size_t n = lval_sizeof(v->type);
+	switch (LVAL_TYPE(v)) {
+	case LVAL_STR:
+		n += strlen(v->str) + 1;
+		break;
+	case LVAL_BIG:
+		n += sizeof(uint32_t) * v->nlimbs;
+		break;
+	case LVAL_SEXPR:
+	case LVAL_QEXPR:
+		if (v->cell && v->cell != v->cells_inline && NULL == v->base)
+			n += sizeof(lval*) * (v->front + v->cap);
+		for (int i = 0; i < v->count; i++)
+			n += _lval_size(v->cell[i]);
+		break;
+	}
+	return n;
+}
+
+static void _lru_unlink(struct pcache_entry* x)
+{
+	if (x->prev)
+		x->prev->next = x->next;
+	else
+		lru_head = x->next;
+
+	if (x->next)
+		x->next->prev = x->prev;
+	else
+		lru_tail = x->prev;
+	x->prev = x->next = NULL;
+}
+
+static void _lru_push(struct pcache_entry* x)
+{
+	x->prev = NULL;
+	x->next = lru_head;
+	if (lru_head)
+		lru_head->prev = x;
+	lru_head = x;
+	if (NULL == lru_tail)
+		lru_tail = x;
+}
+
+static void _evict(struct pcache_entry* x)
+{
+	struct pcache_entry** p = &buckets[x->hash & (nbuckets-1)];
+	while (*p != x)
+		p = &(*p)->chain;
+	*p = x->chain;
+
+	_lru_unlink(x);
+	stats.entries--;
+	stats.bytes -= x->size;
+	lval_del(x->tmpl);
+	free(x->key);
+	free(x);
+}
+
+static void _shrink_to(size_t budget)
+{
+	while (lru_tail && stats.bytes > budget) {
+		_evict(lru_tail);
+		stats.evictions++;
+	}
+}
+
+static void _grow(void)
+{
+	size_t n = nbuckets ? 2 * nbuckets : PCACHE_MIN_BUCKETS;
+	struct pcache_entry** b = (struct pcache_entry**)calloc(n, sizeof(struct pcache_entry*));
+	if (NULL == b)
+		return;
+
+	for (size_t i = 0; i < nbuckets; i++) {
+		struct pcache_entry* x = buckets[i];
+		while (x) {
+			struct pcache_entry* next = x->chain;
+			x->chain = b[x->hash & (n-1)];
+			b[x->hash & (n-1)] = x;
+			x = next;
+		}
+	}
+	free(buckets);
+	buckets = b;
+	nbuckets = n;
+}
+
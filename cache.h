@@ -0,0 +1,35 @@
+#ifndef CACHE_H_
+#define CACHE_H_
+
+#include <stddef.h>
+
+#include "common.h"
+
+#define PCACHE_DEFAULT_BUDGET (4 << 20) // bytes
+
+// Bounded LRU cache of parsed input. The key is the exact input text, found
+// through a 64 bit hash, and the value is the lval template parse() built, a
+// hit costs one hash, one compare and one copy of the template.
+
+struct pcache_stats
+{
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+	size_t entries;
+	size_t bytes; // estimated size of keys and templates
+	size_t budget;
+};
+
+// like parse() but served from the cache when possible, the caller owns the
+// returned lval, NULL on empty or malformed input (which is not cached)
+lval* pcache_parse(const char* input);
+
+void pcache_set_budget(size_t budget); // evicts down to the new budget
+void pcache_clear(void);
+void pcache_trace(void (*visit)(lval*)); // the cached templates, for gc_collect()
+void pcache_get_stats(struct pcache_stats* st);
+void pcache_print_stats(FILE* fp);
+
+#endif
+
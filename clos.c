@@ -0,0 +1,398 @@
+#include "clos.h"
+#include "eval.h"
+#include "gc.h"
+#include "opt.h"
+#include "symtab.h"
+
+typedef struct lnode lnode;
+
+// tail is only set by a call the body ends with
+typedef lval* (*lnode_run)(lnode* n, lenv* e, lval** tail);
+
+struct lnode
+{
+	lnode_run run;
+	lval* val; // the constant, the symbol loaded or the head of a call
+	lbuiltin func; // called directly while val is bound to it
+	uint32_t rebinds; // SYM_REBINDS() of val when func was found
+	int slot; // of a formal in the frame
+	int tail; // a call in place of the frame
+	int argc;
+	lnode** argv; // the cells of a call, head first
+	lnode* branch[2]; // the code of the branches of if
+};
+
+struct lclos
+{
+	int refs;
+	unsigned gc_epoch; // of the last lclos_trace() that reached it
+	lenv* root; // the global frame the builtins were found in
+	lnode* node;
+	int nsyms;
+	int syms_cap;
+	const char** syms; // the names of the builtins called directly
+	uint32_t* rebinds; // SYM_REBINDS() of each then
+	int failed; // a node could not be allocated
+};
+
+int clos_enabled = 1;
+
+static struct clos_stats stats = { 0, 0, 0 };
+
+static lclos* _compile(lenv* e, lval* f, lval* body);
+static int _valid(lenv* e, lclos* c);
+static lnode* _node(lclos* c, lnode_run run, lval* val, int argc);
+static void _node_del(lnode* n);
+static void _node_trace(lnode* n, void (*visit)(lval*));
+static int _slot(lval* formals, const char* sym);
+static lval* _global(lclos* c, lval* formals, const char* sym);
+static void _rely(lclos* c, const char* sym);
+static lnode* _expr(lclos* c, lval* formals, lval* x);
+static lnode* _code(lclos* c, lval* formals, lval* q, int tail);
+static lnode* _call(lclos* c, lval* formals, lval* x, int tail);
+static lval* _cells(lnode* n, lenv* e, int from);
+static lval* _run_const(lnode* n, lenv* e, lval** tail);
+static lval* _run_local(lnode* n, lenv* e, lval** tail);
+static lval* _run_global(lnode* n, lenv* e, lval** tail);
+static lval* _run_builtin(lnode* n, lenv* e, lval** tail);
+static lval* _run_if(lnode* n, lenv* e, lval** tail);
+static lval* _run_call(lnode* n, lenv* e, lval** tail);
+
+lclos* clos_body(lenv* e, lval* f, lval* body)
+{
+	lclos** slot = clos_enabled ? opt_clos(f, body) : NULL;
+	if (NULL == slot)
+		return NULL;
+	if (*slot && _valid(e, *slot))
+		return *slot;
+
+	lclos_release(*slot);
+	return *slot = _compile(e, f, body);
+}
+
+lval* clos_run(lclos* c, lenv* e, lval** tail)
+{
+	stats.runs++;
+	*tail = NULL;
+	return c->node->run(c->node, e, tail);
+}
+
+lclos* lclos_retain(lclos* c)
+{
+	c->refs++;
+	return c;
+}
+
+void lclos_release(lclos* c)
+{
+	if (NULL == c || --c->refs > 0)
+		return;
+	_node_del(c->node);
+	free(c->syms);
+	free(c->rebinds);
+	free(c);
+}
+
+void lclos_trace(lclos* c, unsigned epoch, void (*visit)(lval*))
+{
+	if (c->gc_epoch == epoch)
+		return;
+	c->gc_epoch = epoch;
+	_node_trace(c->node, visit);
+}
+
+void clos_get_stats(struct clos_stats* st)
+{
+	*st = stats;
+}
+
+void clos_print_stats(FILE* fp)
+{
+	fprintf(fp, "closures: %s\n", clos_enabled ? "on" : "off");
+	fprintf(fp, "compiled: %lu, runs: %lu, builtins looked up again: %lu\n",
+		stats.compiles, stats.runs, stats.guards);
+}
+
+// private functions: //////////////////////////////////////////////////////////
+
+static lclos* _compile(lenv* e, lval* f, lval* body)
+{
+	lclos* c = (lclos*)calloc(1, sizeof(lclos));
+	if (NULL == c)
+		return NULL;
+	c->refs = 1;
+	c->root = e->root ? e->root : e;
+
+	// the body runs like the sexpr it would be turned into
+	c->node = _code(c, f->formals, body, 1);
+	if (NULL == c->node || c->failed) {
+		lclos_release(c);
+		return NULL;
+	}
+	c->rebinds = (uint32_t*)malloc(sizeof(uint32_t) * (c->nsyms + 1));
+	if (NULL == c->rebinds) {
+		lclos_release(c);
+		return NULL;
+	}
+	for (int i = 0; i < c->nsyms; i++)
+		c->rebinds[i] = SYM_REBINDS(c->syms[i]);
+	stats.compiles++;
+	return c;
+}
+
+// a name shadowed by a frame is looked up by the node, only rebinding it
+// calls for the body to be compiled again
+static int _valid(lenv* e, lclos* c)
+{
+	if ((e->root ? e->root : e) != c->root)
+		return 0;
+	for (int i = 0; i < c->nsyms; i++) {
+		if (c->rebinds[i] != SYM_REBINDS(c->syms[i]))
+			return 0;
+	}
+	return 1;
+}
+
+static lnode* _node(lclos* c, lnode_run run, lval* val, int argc)
+{
+	lnode* n = (lnode*)calloc(1, sizeof(lnode));
+	if (n && argc)
+		n->argv = (lnode**)calloc(argc, sizeof(lnode*));
+	if (NULL == n || (argc && NULL == n->argv)) {
+		free(n);
+		c->failed = 1;
+		return NULL;
+	}
+	n->run = run;
+	n->val = val ? lval_copy(val) : NULL;
+	n->argc = argc;
+	return n;
+}
+
+static void _node_del(lnode* n)
+{
+	if (NULL == n)
+		return;
+	for (int i = 0; i < n->argc; i++)
+		_node_del(n->argv[i]);
+	_node_del(n->branch[0]);
+	_node_del(n->branch[1]);
+	if (n->val)
+		lval_del(n->val);
+	free(n->argv);
+	free(n);
+}
+
+static void _node_trace(lnode* n, void (*visit)(lval*))
+{
+	if (NULL == n)
+		return;
+	for (int i = 0; i < n->argc; i++)
+		_node_trace(n->argv[i], visit);
+	_node_trace(n->branch[0], visit);
+	_node_trace(n->branch[1], visit);
+	if (n->val)
+		visit(n->val);
+}
+
+// the position of the formal sym in the frame of a call, see _lval_bind()
+static int _slot(lval* formals, const char* sym)
+{
+	int slot = 0;
+	for (int i = 0; i < formals->count; i++) {
+		if (SYM_AMP == formals->cell[i]->sym)
+			continue;
+		if (formals->cell[i]->sym == sym)
+			return slot;
+		slot++;
+	}
+	return -1;
+}
+
+// the global value of sym, NULL when it is a formal or a frame binds it
+static lval* _global(lclos* c, lval* formals, const char* sym)
+{
+	if (_slot(formals, sym) >= 0 || 1 != SYM_BINDS(sym))
+		return NULL;
+	int i = lenv_slot(c->root, sym);
+	return i < 0 ? NULL : c->root->vals[i];
+}
+
+static void _rely(lclos* c, const char* sym)
+{
+	for (int i = 0; i < c->nsyms; i++) {
+		if (c->syms[i] == sym)
+			return;
+	}
+	if (c->nsyms == c->syms_cap) {
+		int cap = c->syms_cap ? 2 * c->syms_cap : 8;
+		const char** syms = (const char**)realloc(c->syms, sizeof(char*) * cap);
+		if (NULL == syms) {
+			c->failed = 1;
+			return;
+		}
+		c->syms = syms;
+		c->syms_cap = cap;
+	}
+	c->syms[c->nsyms++] = sym;
+}
+
+// a cell that is evaluated, a sexpr in it is not in place of the frame
+static lnode* _expr(lclos* c, lval* formals, lval* x)
+{
+	switch (LVAL_TYPE(x)) {
+	case LVAL_SYM: {
+		int slot = _slot(formals, x->sym);
+		lnode* n = _node(c, slot < 0 ? _run_global : _run_local, x, 0);
+		if (n)
+			n->slot = slot;
+		return n;
+	}
+	case LVAL_SEXPR:
+		if (0 == x->count)
+			return _node(c, _run_const, x, 0);
+		if (1 == x->count)
+			return _expr(c, formals, x->cell[0]);
+		return _call(c, formals, x, 0);
+	default:
+		return _node(c, _run_const, x, 0);
+	}
+}
+
+// the qexpr q run as a sexpr, a body or a branch of if
+static lnode* _code(lclos* c, lval* formals, lval* q, int tail)
+{
+	if (0 == q->count) {
+		lval* x = lval_sexpr();
+		lnode* n = _node(c, _run_const, x, 0);
+		lval_del(x);
+		return n;
+	}
+	if (1 == q->count)
+		return _expr(c, formals, q->cell[0]);
+	return _call(c, formals, q, tail);
+}
+
+// the cells of quote and list are not evaluated, a builtin bound globally
+// is called directly, if with its branches written out runs one of them
+static lnode* _call(lclos* c, lval* formals, lval* x, int tail)
+{
+	lval* head = x->cell[0];
+	int quoted = LVAL_SYM == LVAL_TYPE(head) && (SYM_QUOTE == head->sym || SYM_LIST == head->sym);
+	lval* f = LVAL_SYM == LVAL_TYPE(head) ? _global(c, formals, head->sym) : NULL;
+	lbuiltin func = f && LVAL_FUN == LVAL_TYPE(f) ? f->builtin : NULL;
+	if (builtin_eval == func || (builtin_if == func && (4 != x->count || quoted
+		|| LVAL_QEXPR != LVAL_TYPE(x->cell[2]) || LVAL_QEXPR != LVAL_TYPE(x->cell[3]))))
+		func = NULL;
+
+	lnode_run run = builtin_if == func ? _run_if : func ? _run_builtin : _run_call;
+	lnode* n = _node(c, run, head, x->count);
+	if (NULL == n)
+		return NULL;
+	n->func = func;
+	n->tail = tail;
+	if (func) {
+		n->rebinds = SYM_REBINDS(head->sym);
+		_rely(c, head->sym);
+	}
+
+	for (int i = 0; i < x->count; i++)
+		n->argv[i] = i && quoted ? _node(c, _run_const, x->cell[i], 0) : _expr(c, formals, x->cell[i]);
+	if (builtin_if == func) {
+		n->branch[0] = _code(c, formals, x->cell[2], tail);
+		n->branch[1] = _code(c, formals, x->cell[3], tail);
+	}
+	return n;
+}
+
+// a sexpr of the values of the cells from from on, or the first error
+static lval* _cells(lnode* n, lenv* e, int from)
+{
+	lval* a = lval_sexpr();
+	if (n->argc > from && gc_cells(a, n->argc - from)) {
+		lval_del(a);
+		return lval_err(LERR_OTHER);
+	}
+	for (int i = from; i < n->argc; i++) {
+		lval* x = n->argv[i]->run(n->argv[i], e, NULL);
+		if (LVAL_ERR == LVAL_TYPE(x)) {
+			lval_del(a);
+			return x;
+		}
+		a->cell[a->count++] = x;
+	}
+	return a;
+}
+
+static lval* _run_const(lnode* n, lenv* e, lval** tail)
+{
+	(void)e;
+	(void)tail;
+	return lval_copy(n->val);
+}
+
+// the frame binds the formals in order, unless some are named alike
+static lval* _run_local(lnode* n, lenv* e, lval** tail)
+{
+	(void)tail;
+	if (n->slot < e->count && e->syms[n->slot] == n->val->sym)
+		return lval_copy(e->vals[n->slot]);
+	return lenv_get(e, n->val);
+}
+
+static lval* _run_global(lnode* n, lenv* e, lval** tail)
+{
+	(void)tail;
+	return lenv_get(e, n->val);
+}
+
+static lval* _run_builtin(lnode* n, lenv* e, lval** tail)
+{
+	const char* sym = n->val->sym;
+	if (1 != SYM_BINDS(sym) || n->rebinds != SYM_REBINDS(sym)) {
+		stats.guards++;
+		return _run_call(n, e, tail);
+	}
+
+	lval* a = _cells(n, e, 1);
+	if (LVAL_ERR == LVAL_TYPE(a))
+		return a;
+	return n->func(e, a);
+}
+
+static lval* _run_if(lnode* n, lenv* e, lval** tail)
+{
+	const char* sym = n->val->sym;
+	if (1 != SYM_BINDS(sym) || n->rebinds != SYM_REBINDS(sym)) {
+		stats.guards++;
+		return _run_call(n, e, tail);
+	}
+
+	lval* x = n->argv[1]->run(n->argv[1], e, NULL);
+	if (LVAL_IS_NUM(x)) {
+		lnode* b = n->branch[GET_LVAL_NUM_TYPE(x) ? 0 : 1];
+		lval_del(x);
+		return b->run(b, e, tail);
+	}
+	if (LVAL_ERR == LVAL_TYPE(x))
+		return x;
+
+	// if itself says what is wrong
+	lval* a = lval_add_toback(lval_sexpr(), x);
+	lval_add_toback(a, lval_copy(n->argv[2]->val));
+	lval_add_toback(a, lval_copy(n->argv[3]->val));
+	return builtin_if(e, a);
+}
+
+// anything else is evaluated like the sexpr it was, from its values on
+static lval* _run_call(lnode* n, lenv* e, lval** tail)
+{
+	lval* v = _cells(n, e, 0);
+	if (LVAL_ERR == LVAL_TYPE(v))
+		return v;
+	if (n->tail && tail) {
+		*tail = v;
+		return NULL;
+	}
+	return eval_apply(e, v);
+}
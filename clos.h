@@ -0,0 +1,42 @@
+#ifndef CLOS_H_
+#define CLOS_H_
+
+#include "common.h"
+
+// Lambda bodies compiled for the tree walker into trees of nodes, each a C
+// function and what it works on: a constant, a formal at its slot in the
+// frame, a global looked up through its symbol, a builtin called directly or
+// any other call. So a call runs the root node in the new frame rather than
+// copying the body and evaluating its cells again.
+//
+// A builtin called directly is the one its name was bound to globally when
+// the body was compiled. Its node checks that the name was not rebound since
+// and that no frame binds it, and calls whatever the name is bound to
+// otherwise, the body is compiled again on the next call then.
+
+extern int clos_enabled; // 1, 0 walks every body
+
+struct clos_stats
+{
+	unsigned long compiles;
+	unsigned long runs;
+	unsigned long guards; // calls of a builtin looked up after its name was rebound
+};
+
+// the compiled body of f to run body with, compiled now if it was not or a
+// builtin it calls was rebound since, NULL to walk body
+lclos* clos_body(lenv* e, lval* f, lval* body);
+
+// The value of the body run in the frame e, or NULL with tail set to the
+// call the body ends with, a sexpr of the function and its arguments, for
+// the caller to make in place of the frame.
+lval* clos_run(lclos* c, lenv* e, lval** tail);
+
+lclos* lclos_retain(lclos* c);
+void lclos_release(lclos* c);
+void lclos_trace(lclos* c, unsigned epoch, void (*visit)(lval*));
+
+void clos_get_stats(struct clos_stats* st);
+void clos_print_stats(FILE* fp);
+
+#endif
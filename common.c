@@ -1,13 +1,60 @@
 
 #include "common.h"
+#include "cache.h"
+#include "image.h"
+#include "slab.h"
+#include "symtab.h"
+#include "vm.h"
+#include "opt.h"
+#include "clos.h"
+#include "jit.h"
+#include "big.h"
+#include "eval.h"
+#include "gc.h"
 #include "assert.h"
+#include <limits.h>
+#include <inttypes.h>
+#include <stddef.h>
+
+// the header and the fields up to f, in whole words
+#define LVAL_END(f) ((offsetof(lval, f) + sizeof(((lval*)0)->f) + 7) & ~(size_t)7)
+
+static const size_t LVAL_SIZES[] =
+{
+	[LVAL_LNG] = LVAL_END(data),
+	[LVAL_DBL] = LVAL_END(data),
+	[LVAL_SYM] = LVAL_END(hit),
+	[LVAL_STR] = LVAL_END(str),
+	[LVAL_FUN] = LVAL_END(opt),
+	[LVAL_SEXPR] = LVAL_END(cells_inline),
+	[LVAL_QEXPR] = LVAL_END(cells_inline),
+	[LVAL_ERR] = LVAL_END(err),
+	[LVAL_BIG] = LVAL_END(neg),
+};
+static const char* const LVAL_TYPE_STRINGS[] = { FOREACH_LVAL_TYPE(GENERATE_STRING) };
 
 static void _lval_expr_print(lval* v, const char open, const char close, FILE* fp);
 static long _lval_expr_snprint(lval* v, const char open, const char close, char* str, const long n);
 static void _lval_print(lval* v, FILE *fp);
+static char* _str_escape(const char* s);
 static long _lval_snprint(lval* v, char* str, const long n);
 int _lenv_print(lenv* e);
 int _lenv_fprint(lenv* e, FILE* f);
+static uint32_t _lenv_slot(lenv* e, const char* sym);
+static int _lenv_find(lenv* e, const char* sym);
+static int _lenv_append(lenv* e, const char* sym, lval* v);
+static int _lenv_reindex(lenv* e, uint32_t cap);
+static void _lenv_cache(lenv* g, lval* k, lval* v);
+
+FILE* logfp = NULL;
+FILE* errfp = NULL;
+int lval_room_min = LVAL_ROOM_MIN;
+int lenv_cache_globals = 1;
+
+static struct lenv_stats stats = { 0, 0 };
+// the last one given to a global frame, 64 bits never wrap around to a stamp
+// a symbol still holds with a freed hit
+static uint64_t stamps = 0;
 
 void lval_println(lval* v)
 {
@@ -19,47 +66,152 @@ int lval_snprintln(lval *v, char* str, const long n)
 	return _lval_snprint(v, str, n);
 }
 
+size_t lval_sizeof(int type)
+{
+	return LVAL_SIZES[type];
+}
+
 lval* lval_err(enum LVAL_ERRS e)
 {
-	lval* v = (lval*)calloc(1, sizeof(lval));
+	lval* v = gc_lval(LVAL_ERR);
 	if (NULL == v) { return NULL; }
-	v->type = LVAL_ERR;
 	v->err = e;
 	return v;
 }
 
+lval* lval_long(int64_t x)
+{
+	if (x >= -((int64_t)1 << 61) && x < ((int64_t)1 << 61))
+		return (lval*)(uintptr_t)((uint64_t)x << 2 | LVAL_TAG_LNG);
+
+	lval* v = gc_lval(LVAL_LNG);
+	if (NULL == v) { return NULL; }
+	v->data.lng = x;
+	return v;
+}
+
+lval* lval_double(double x)
+{
+	uint64_t bits;
+	memcpy(&bits, &x, sizeof(bits));
+	uint64_t e = (bits >> 52) & 0x7ff;
+	uint64_t m = bits & ((1ULL << 52) - 1);
+	if ((0 == e && 0 == m) || (e > LVAL_DBL_BIAS && e < LVAL_DBL_BIAS + 512)) {
+		uint64_t w = (bits >> 63) << 61 | (e ? e - LVAL_DBL_BIAS : 0) << 52 | m;
+		return (lval*)(uintptr_t)(w << 2 | LVAL_TAG_DBL);
+	}
+
+	lval* v = gc_lval(LVAL_DBL);
+	if (NULL == v)
+		return NULL;
+	v->data.dbl = x;
+	return v;
+}
+
+lval* lval_sym(const char sym[])
+{
+	return lval_sym_n(sym, strlen(sym));
+}
+
+lval* lval_sym_n(const char* sym, size_t n)
+{
+	lval* v = gc_lval(LVAL_SYM);
+	if (NULL == v)
+		return NULL;
+	v->sym = sym_intern(sym, n);
+	if (NULL == v->sym) {
+		lval_del(v);
+		return NULL;
+	}
+	return v;
+}
+
+lval* lval_str(const char str[])
+{
+	return lval_str_n(str, strlen(str));
+}
+
+lval* lval_str_n(const char* str, size_t n)
+{
+	lval* v = gc_lval(LVAL_STR);
+	if (NULL == v)
+		return NULL;
+	v->str = (char*)malloc(n+1);
+	if (NULL == v->str)
+		return NULL;
+	memcpy(v->str, str, n);
+	v->str[n] = '\0';
+	return v;
+}
+
+lval* lval_sexpr(void)
+{
+	lval* v = gc_lval(LVAL_SEXPR);
+	if (NULL == v)
+		return NULL;
+	v->count = 0;
+	v->cell = NULL;
+	return v;
+}
+
+lval* lval_qexpr(void)
+{
+	lval* v = gc_lval(LVAL_QEXPR);
+	if (NULL == v)
+		return NULL;
+	v->count = 0;
+	v->cell = NULL;
+	return v;
+}
+
+lval* lval_add_toback(lval* v, lval* x)
+{
+	// TODO v and return value are the same
+	if (gc_cells(v, v->count+1))
+		return NULL;
+	v->cell[v->count++] = x; // set the last element
+	return v;
+}
+
 void lval_del(lval* v)
 {
-	switch (v->type) {
-	case LVAL_DBL: break;
-	case LVAL_LNG: break;
-	case LVAL_ERR: break;
-	case LVAL_FUN:
-		if (!v->builtin) {
-			lenv_del(v->env);
-			lval_del(v->body);
-			lval_del(v->formals);
-		}
-		break;
-	case LVAL_SYM: free(v->sym); break;
-	case LVAL_QEXPR:
-	case LVAL_SEXPR:
-		for (int i = 0; i < v->count; i++)
-			lval_del(v->cell[i]);
-		free(v->cell);
-		break;
+	if (LVAL_IS_IMM(v) || image_contains(v))
+		return;
+	if (v->refs) {
+		v->refs--;
+		return;
 	}
-	free(v);
+	gc_dead(v);
 }
 
+// Values are shared and never changed while shared: a copy is another
+// reference, and code about to change a value calls lval_own() first. Values
+// in a loaded image are never freed, so they are not counted.
 lval* lval_copy(lval* v)
 {
-	lval* x = (lval*)calloc(1, sizeof(lval));
+	if (!LVAL_IS_IMM(v) && !image_contains(v))
+		v->refs++;
+	return v;
+}
+
+// the cells, formals, body and arguments of the copy are shared with v
+lval* lval_own(lval* v)
+{
+	if (LVAL_IS_IMM(v))
+		return v;
+	if (0 == v->refs && !image_contains(v)) {
+		// a slice's cells belong to its base, see gc_cells()
+		if ((LVAL_SEXPR == v->type || LVAL_QEXPR == v->type)
+			&& (lval_is_slice(v) || lval_held(v) > v->count || lval_lead(v))
+			&& gc_cells(v, v->count))
+			return NULL;
+		return v;
+	}
+
+	lval* x = gc_lval(v->type);
 	if (NULL == x)
 		return NULL;
 
-	x->type = v->type;
-
 	switch (v->type)
 	{
 	case LVAL_FUN:
@@ -67,9 +219,11 @@ lval* lval_copy(lval* v)
 			x->builtin = v->builtin;
 		else {
 			x->builtin = NULL;
-			x->env = lenv_copy(v->env);
-			x->formals = lval_copy(v->formals);
-			x->body = lval_copy(v->body);
+			x->args = v->args ? lval_copy(v->args) : NULL;
+			x->formals = v->formals ? lval_copy(v->formals) : NULL;
+			x->body = v->body ? lval_copy(v->body) : NULL;
+			x->code = v->code ? lcode_retain(v->code) : NULL;
+			x->opt = opt_of(v) ? lopt_retain(opt_of(v)) : NULL;
 		}
 		break;
 	case LVAL_DBL:
@@ -82,34 +236,67 @@ lval* lval_copy(lval* v)
 		x->err = v->err;
 		break;
 	case LVAL_SYM:
-		x->sym = (char*)malloc(strlen(v->sym) + 1);
-		strcpy(x->sym, v->sym);
+		x->sym = v->sym;
+		x->slot = v->slot;
+		break;
+	case LVAL_STR:
+		x->str = (char*)malloc(strlen(v->str) + 1);
+		strcpy(x->str, v->str);
+		break;
+	case LVAL_BIG:
+		x->limbs = (uint32_t*)malloc(sizeof(uint32_t) * v->nlimbs);
+		memcpy(x->limbs, v->limbs, sizeof(uint32_t) * v->nlimbs);
+		x->nlimbs = v->nlimbs;
+		x->neg = v->neg;
 		break;
 	case LVAL_SEXPR:
 	case LVAL_QEXPR:
-		x->count = v->count;
-		x->cell = malloc(sizeof(lval*) * x->count);
-		for (int i = 0; i < x->count; i++)
+		gc_cells(x, v->count);
+		for (int i = 0; i < v->count; i++)
 			x->cell[i] = lval_copy(v->cell[i]);
-		break;
-	default:
-		// something terrible happened
-		v->type = LVAL_ERR;
-		v->err = LERR_OTHER;
+		x->count = v->count;
 		break;
 	}
 
+	lval_del(v);
+	return x;
+}
+
+// A long slice shares the cells of v, or of the list v is a slice of, and
+// holds that list so the cells stay, a short one copies them inline. So
+// walking a list with tail is linear and not quadratic, at the price of
+// keeping the whole list while a slice of it is around.
+lval* lval_slice(lval* v, int i, int n)
+{
+	lval* x = gc_lval(v->type);
+	if (NULL == x)
+		return NULL;
+
+	if (n <= LVAL_INLINE_CELLS) {
+		x->cell = x->cells_inline;
+		for (int j = 0; j < n; j++)
+			x->cell[j] = lval_copy(v->cell[i + j]);
+	}
+	else {
+		x->cell = v->cell + i;
+		x->base = lval_copy(lval_is_slice(v) ? v->base : v);
+	}
+	x->count = n;
+	lval_del(v);
 	return x;
 }
 
 lenv* lenv_copy(lenv* e)
 {
-	lenv* n = calloc(1 ,sizeof(lenv));
+	lenv* n = gc_lenv();
 	if (NULL == n)
 		return NULL;
 
 	n->par = e->par;
+	n->root = e->root;
+	n->stamp = 0;
 	n->count = e->count;
+	n->cap = e->count;
 
 	n->syms = malloc(sizeof(char*) * n->count);
 	if (NULL == n->syms)
@@ -119,36 +306,38 @@ lenv* lenv_copy(lenv* e)
 	if (NULL == n->vals)
 		return NULL;
 
+	if (n->count)
+		memcpy(n->syms, e->syms, sizeof(char*) * n->count);
 	for (int i = 0; i < e->count; i++) {
-		n->syms[i] = malloc(strlen(e->syms[i]) + 1);
-		if (NULL == n->syms[i])
-			return NULL;
-		strcpy(n->syms[i], e->syms[i]);
 		n->vals[i] = lval_copy(e->vals[i]);
+		SYM_BINDS(n->syms[i])++;
 	}
+
+	// image envs are saved without an index, so it is rebuilt rather than copied
+	if (n->count >= LENV_INDEX_MIN && _lenv_reindex(n, e->index_cap ? e->index_cap : 16))
+		return NULL;
 	return n;
 }
 
 lenv* lenv_new(void)
 {
-	lenv* e = (lenv*)calloc(1, sizeof(lenv));
+	lenv* e = gc_lenv();
 	if (NULL == e) return NULL;
 	e->count = 0;
+	e->cap = 0;
 	e->syms = NULL;
 	e->vals = NULL;
+	e->index = NULL;
+	e->index_cap = 0;
 	e->par = NULL;
-	e->debug = 1;
+	e->root = NULL;
+	e->stamp = 0;
 	return e;
 }
 
 void lenv_del(lenv* e)
 {
-	for (int i = 0; i < e->count && NULL != e->syms[i]; i++)
-	{
-		free(e->syms[i]);
-		lval_del(e->vals[i]);
-	}
-	e->count = 0;
+	lenv_clear(e);
 
 	if (NULL != e->syms)
 		free(e->syms);
@@ -158,44 +347,155 @@ void lenv_del(lenv* e)
 		free(e->vals);
 	e->vals = NULL;
 
-	free(e);
-	e = NULL;
+	free(e->index);
+	gc_unroot(e);
+	gc_free_lenv(e);
 }
 
-lval* lenv_get(lenv* e, lval* k)
+void lenv_set_par(lenv* e, lenv* par)
+{
+	e->par = par;
+	e->root = par ? (par->root ? par->root : par) : NULL;
+}
+
+void lenv_clear(lenv* e)
 {
+	// the bindings of a global frame go away for good, those of a call frame
+	// only as the call returns
 	for (int i = 0; i < e->count; i++) {
-		if (strcmp(e->syms[i], k->sym) == 0) // FIXME buffer overflow
-			return lval_copy(e->vals[i]);
+		lval_del(e->vals[i]);
+		SYM_BINDS(e->syms[i])--;
+		if (NULL == e->par)
+			SYM_REBINDS(e->syms[i])++;
 	}
+	e->count = 0;
+	e->par = NULL;
+	e->root = NULL;
+	e->stamp = 0;
 
-	// look in parent if symbol is not found
-	if (e->par)
-		return lenv_get(e->par, k);
+	if (e->index)
+		memset(e->index, 0, sizeof(uint32_t) * e->index_cap);
+}
 
-	if (e->debug)
-		debug("Symbol: '%s' not found.", k->sym);
+lval* lenv_get(lenv* e, lval* k)
+{
+	lval* v = lenv_ref(e, k);
+	if (v)
+		return lval_copy(v);
+
+	debug("Symbol: '%s' not found.", k->sym);
 	return lval_err(LERR_BAD_SYMBOL);
 }
 
-int lenv_put(lenv* e, lval* k, lval* v) {
+lval* lenv_ref(lenv* e, lval* k)
+{
+	int i = k->slot - 1;
+	if (k->slot > 0 && i < e->count && e->syms[i] == k->sym)
+		return e->vals[i];
+
+	// a global that is bound nowhere else needs no walk through the frames,
+	// names used before their def have no hint but are found the same way
+	lenv* g = e->root ? e->root : e;
+	i = -k->slot - 1;
+	if (1 == SYM_BINDS(k->sym)) {
+		if (g->stamp && k->stamp == g->stamp) {
+			stats.hits++;
+			return k->hit;
+		}
+		stats.misses++;
+		if (k->slot >= 0 || i >= g->count || g->syms[i] != k->sym)
+			i = _lenv_find(g, k->sym);
+		if (i >= 0) {
+			_lenv_cache(g, k, g->vals[i]);
+			return g->vals[i];
+		}
+	}
+	else
+		stats.misses++;
+
+	for (; e->par; e = e->par) {
+		i = _lenv_find(e, k->sym);
+		if (i >= 0)
+			return e->vals[i];
+	}
+
+	// e is the global frame now
+	i = -k->slot - 1;
+	if (k->slot < 0 && i < e->count && e->syms[i] == k->sym)
+		return e->vals[i];
+	i = _lenv_find(e, k->sym);
+	return i >= 0 ? e->vals[i] : NULL;
+}
+
+int lenv_put(lenv* e, lval* k, lval* v)
+{
+	return lenv_bind(e, k->sym, lval_copy(v));
+}
+
+int lenv_bind(lenv* e, const char* sym, lval* v)
+{
+	int i = _lenv_find(e, sym);
+	if (i >= 0) {
+		lval_del(e->vals[i]);
+		e->vals[i] = v;
+		e->stamp = 0;
+		SYM_REBINDS(sym)++;
+		return 0;
+	}
+	return _lenv_append(e, sym, v);
+}
 
-	for (int i = 0; i < e->count; i++) {
-		if (strcmp(e->syms[i], k->sym) == 0) {
-			lval_del(e->vals[i]);
-			e->vals[i] = lval_copy(v);
+int lenv_slot(lenv* e, const char* sym)
+{
+	return _lenv_find(e, sym);
+}
+
+int lenv_shadows(lenv* e, lenv* par)
+{
+	for (int i = 0; i < par->count; i++) {
+		if (_lenv_find(e, par->syms[i]) < 0)
 			return 0;
-		}
 	}
+	return 1;
+}
 
-	// TODO need error checking
-	e->count++;
-	e->vals = realloc(e->vals, sizeof(lval*) * e->count);
-	e->syms = realloc(e->syms, sizeof(char*) * e->count);
+// backward shift deletion, the table never holds tombstones
+int lenv_remove(lenv* e, const char* sym)
+{
+	int pos = _lenv_find(e, sym);
+	if (pos < 0)
+		return 1;
+
+	if (e->index) {
+		uint32_t mask = e->index_cap - 1;
+		uint32_t hole = _lenv_slot(e, sym);
+		while (e->index[hole] != (uint32_t)pos + 1)
+			hole = (hole + 1) & mask;
+
+		for (uint32_t i = (hole + 1) & mask; e->index[i]; i = (i + 1) & mask) {
+			// an entry moves back unless its home lies cyclically in (hole, i]
+			uint32_t home = _lenv_slot(e, e->syms[e->index[i] - 1]);
+			if (((i - home) & mask) >= ((i - hole) & mask)) {
+				e->index[hole] = e->index[i];
+				hole = i;
+			}
+		}
+		e->index[hole] = 0;
+
+		// the bindings after pos move down by one
+		for (uint32_t i = 0; i < e->index_cap; i++) {
+			if (e->index[i] > (uint32_t)pos + 1)
+				e->index[i]--;
+		}
+	}
 
-	e->vals[e->count-1] = lval_copy(v);
-	e->syms[e->count-1] = malloc(strlen(k->sym)+1);
-	strcpy(e->syms[e->count-1], k->sym);
+	lval_del(e->vals[pos]);
+	SYM_BINDS(sym)--;
+	SYM_REBINDS(sym)++;
+	e->stamp = 0;
+	memmove(e->syms + pos, e->syms + pos + 1, sizeof(char*) * (e->count - pos - 1));
+	memmove(e->vals + pos, e->vals + pos + 1, sizeof(lval*) * (e->count - pos - 1));
+	e->count--;
 	return 0;
 }
 
@@ -212,6 +512,48 @@ int lenv_print(lenv* e)
 	return 0;
 }
 
+void lenv_get_stats(struct lenv_stats* st)
+{
+	*st = stats;
+}
+
+void lenv_print_stats(FILE* fp)
+{
+	unsigned long n = stats.hits + stats.misses;
+	fprintf(fp, "global caches: %s, %lu hits, %lu misses, %.1f%% hit rate\n",
+		lenv_cache_globals ? "on" : "off", stats.hits, stats.misses, n ? 100.0 * stats.hits / n : 0.0);
+}
+
+
+// 8 bytes at a time multiply-xorshift mixing, good enough for a hash table
+uint64_t hash_bytes(const void* data, size_t n)
+{
+	const char* s = (const char*)data;
+	const uint64_t m = 0xc6a4a7935bd1e995ULL;
+	uint64_t h = 0x9e3779b97f4a7c15ULL ^ (n * m);
+	uint64_t k;
+
+	for (; n >= 8; s += 8, n -= 8) {
+		memcpy(&k, s, 8);
+		k *= m;
+		k ^= k >> 47;
+		k *= m;
+		h ^= k;
+		h *= m;
+	}
+
+	if (n) {
+		k = 0;
+		memcpy(&k, s, n);
+		h ^= k;
+		h *= m;
+	}
+
+	h ^= h >> 47;
+	h *= m;
+	h ^= h >> 47;
+	return h;
+}
 
 int colon_commands(const char* input, lenv* e)
 {
@@ -223,26 +565,236 @@ int colon_commands(const char* input, lenv* e)
 	}
 	else if (!strncmp(input, ":debug", 6)) {
 		if (!strncmp(input+6, " true", 5)) {
-			e->debug = 1;
+			log_level = LOG_DEBUG;
 			printf("debug mode on\n");
 		}
 		else if (!strncmp(input+6, " false", 6)) {
-			e->debug = 0;
+			log_level = LOG_INFO;
 			printf("debug mode off\n");
 		}
 		else // TODO we can improve error reporting, maybe
 			printf("ERROR: valid options are 'true' or 'false'\n");
 		action = COLON_CONTINUE;
 	}
+	else if (!strncmp(input, ":cache", 6)) {
+		if (!strncmp(input+6, " clear", 6))
+			pcache_clear();
+		else if (!strncmp(input+6, " budget ", 8))
+			pcache_set_budget(strtoul(input+14, NULL, 10));
+		pcache_print_stats(stdout);
+		action = COLON_CONTINUE;
+	}
+	else if (!strncmp(input, ":gc", 3)) {
+		if (!strncmp(input+3, " budget ", 8))
+			gc_set_budget(strtoul(input+11, NULL, 10));
+		else if (!strncmp(input+3, " threshold ", 11))
+			gc_set_threshold(strtoul(input+14, NULL, 10));
+		else
+			gc_collect();
+		gc_print_stats(stdout);
+		slab_print_stats(stdout);
+		action = COLON_CONTINUE;
+	}
+	else if (!strncmp(input, ":save ", 6)) {
+		if (image_save(e, input+6))
+			printf("ERROR: could not save image to '%s'\n", input+6);
+		else
+			printf("image saved to '%s'\n", input+6);
+		action = COLON_CONTINUE;
+	}
+	else if (!strncmp(input, ":engine", 7)) {
+		if (!strncmp(input+7, " vm", 3))
+			eval_engine = ENGINE_VM;
+		else if (!strncmp(input+7, " tree", 5))
+			eval_engine = ENGINE_TREE;
+		else if (input[7])
+			printf("ERROR: valid options are 'tree' or 'vm'\n");
+		printf("engine: %s\n", ENGINE_VM == eval_engine ? "vm" : "tree");
+		action = COLON_CONTINUE;
+	}
+	else if (!strncmp(input, ":depth", 6)) {
+		if (input[6]) {
+			long n = strtol(input+6, NULL, 10);
+			if (n > 0 && n <= INT_MAX)
+				eval_max_depth = (int)n;
+			else
+				printf("ERROR: the depth must be a positive number\n");
+		}
+		printf("max depth: %d\n", eval_max_depth);
+		action = COLON_CONTINUE;
+	}
+	else if (!strncmp(input, ":sizeof", 7)) {
+		for (size_t i = 0; i < sizeof(LVAL_SIZES) / sizeof(LVAL_SIZES[0]); i++)
+			printf("%-12s %zu bytes\n", LVAL_TYPE_STRINGS[i], LVAL_SIZES[i]);
+		printf("%-12s %zu bytes, %d inline cells\n", "struct lval", sizeof(lval), LVAL_INLINE_CELLS);
+		printf("%-12s %zu bytes\n", "struct lenv", sizeof(lenv));
+		action = COLON_CONTINUE;
+	}
 	else if (!strncmp(input, ":env", 4)) {
 		lenv_print(e);
 		action = COLON_CONTINUE;
 	}
+	else if (!strncmp(input, ":ic", 3)) {
+		if (!strncmp(input+3, " off", 4))
+			lenv_cache_globals = 0;
+		else if (!strncmp(input+3, " on", 3))
+			lenv_cache_globals = 1;
+		else if (input[3])
+			printf("ERROR: valid options are 'on' or 'off'\n");
+		lenv_print_stats(stdout);
+		action = COLON_CONTINUE;
+	}
+	else if (!strncmp(input, ":opt", 4)) {
+		if (!strncmp(input+4, " off", 4))
+			opt_passes = 0;
+		else if (!strncmp(input+4, " on", 3))
+			opt_passes = OPT_ALL;
+		else if (!strncmp(input+4, " inline", 7))
+			opt_passes ^= OPT_INLINE;
+		else if (!strncmp(input+4, " fold", 5))
+			opt_passes ^= OPT_FOLD;
+		else if (!strncmp(input+4, " dce", 4))
+			opt_passes ^= OPT_DCE;
+		else if (!strncmp(input+4, " dump", 5))
+			opt_dump = !opt_dump;
+		else if (input[4])
+			printf("ERROR: valid options are 'on', 'off', 'inline', 'fold', 'dce' or 'dump'\n");
+		opt_print_stats(stdout);
+		action = COLON_CONTINUE;
+	}
+	else if (!strncmp(input, ":clos", 5)) {
+		if (!strncmp(input+5, " off", 4))
+			clos_enabled = 0;
+		else if (!strncmp(input+5, " on", 3))
+			clos_enabled = 1;
+		else if (input[5])
+			printf("ERROR: valid options are 'on' or 'off'\n");
+		clos_print_stats(stdout);
+		action = COLON_CONTINUE;
+	}
+	else if (!strncmp(input, ":jit", 4)) {
+		if (!strncmp(input+4, " off", 4))
+			jit_enabled = 0;
+		else if (!strncmp(input+4, " on", 3))
+			jit_enabled = 1;
+		else if (!strncmp(input+4, " threshold ", 11))
+			jit_threshold = strtoul(input+15, NULL, 10);
+		else if (input[4])
+			printf("ERROR: valid options are 'on', 'off' or 'threshold N'\n");
+		jit_print_stats(stdout);
+		action = COLON_CONTINUE;
+	}
+	else if (!strncmp(input, ":big", 4)) {
+		if (!strncmp(input+4, " karatsuba ", 11)) {
+			long n = strtol(input+15, NULL, 10);
+			if (n >= 4 && n <= INT_MAX)
+				big_karatsuba = (int)n;
+			else
+				printf("ERROR: the threshold must be 4 limbs or more\n");
+		}
+		else if (input[4])
+			printf("ERROR: valid options are 'karatsuba N'\n");
+		big_print_stats(stdout);
+		action = COLON_CONTINUE;
+	}
 	return action;
 }
 
 // private functions: //////////////////////////////////////////////////////////
 
+// interned symbols are unique pointers, only the address needs mixing
+static uint32_t _lenv_slot(lenv* e, const char* sym)
+{
+	uint64_t h = (uint64_t)(uintptr_t)sym * 0x9e3779b97f4a7c15ULL;
+	return (uint32_t)(h >> 32) & (e->index_cap - 1);
+}
+
+static int _lenv_find(lenv* e, const char* sym)
+{
+	if (NULL == e->index) {
+		for (int i = 0; i < e->count; i++) {
+			if (e->syms[i] == sym)
+				return i;
+		}
+		return -1;
+	}
+
+	uint32_t mask = e->index_cap - 1;
+	for (uint32_t i = _lenv_slot(e, sym); e->index[i]; i = (i + 1) & mask) {
+		if (e->syms[e->index[i] - 1] == sym)
+			return e->index[i] - 1;
+	}
+	return -1;
+}
+
+static int _lenv_append(lenv* e, const char* sym, lval* v)
+{
+	if (e->count == e->cap) {
+		int cap = e->cap ? 2 * e->cap : 4;
+		const char** syms = realloc(e->syms, sizeof(char*) * cap);
+		if (NULL == syms)
+			return 1;
+		e->syms = syms;
+		lval** vals = realloc(e->vals, sizeof(lval*) * cap);
+		if (NULL == vals)
+			return 1;
+		e->vals = vals;
+		e->cap = cap;
+	}
+
+	e->syms[e->count] = sym;
+	e->vals[e->count] = v;
+	e->count++;
+	SYM_BINDS(sym)++;
+
+	if (e->index && 2 * (uint32_t)e->count <= e->index_cap) {
+		uint32_t mask = e->index_cap - 1;
+		uint32_t i = _lenv_slot(e, sym);
+		while (e->index[i])
+			i = (i + 1) & mask;
+		e->index[i] = e->count;
+	}
+	else if (e->count >= LENV_INDEX_MIN)
+		return _lenv_reindex(e, e->index_cap ? 2 * e->index_cap : 16);
+	return 0;
+}
+
+static int _lenv_reindex(lenv* e, uint32_t cap)
+{
+	while (cap < 2 * (uint32_t)e->count)
+		cap *= 2;
+	uint32_t* index = (uint32_t*)calloc(cap, sizeof(uint32_t));
+	if (NULL == index)
+		return 1;
+
+	free(e->index);
+	e->index = index;
+	e->index_cap = cap;
+	for (int j = 0; j < e->count; j++) {
+		uint32_t i = _lenv_slot(e, e->syms[j]);
+		while (e->index[i])
+			i = (i + 1) & (cap - 1);
+		e->index[i] = j + 1;
+	}
+	return 0;
+}
+
+// image symbols are read only and keep missing, turning the caches off drops
+// the stamp so the ones filled before miss as well
+static void _lenv_cache(lenv* g, lval* k, lval* v)
+{
+	if (!lenv_cache_globals) {
+		g->stamp = 0;
+		return;
+	}
+	if (image_contains(k))
+		return;
+	if (0 == g->stamp)
+		g->stamp = ++stamps;
+	k->stamp = g->stamp;
+	k->hit = v;
+}
+
 static void _lval_expr_print(lval* v, const char open, const char close, FILE* fp)
 {
 	putc(open, fp);
@@ -296,10 +848,22 @@ static long _lval_expr_snprint(lval* v, const char open, const char close, char*
 
 static void _lval_print(lval* v, FILE *fp)
 {
-	switch (v->type) {
-		case LVAL_LNG:		fprintf(fp, "%li", v->data.lng);	break;
-		case LVAL_DBL:		fprintf(fp, "%f", v->data.dbl);	break;
+	switch (LVAL_TYPE(v)) {
+		case LVAL_LNG:		fprintf(fp, "%" PRId64, lval_get_long(v));	break;
+		case LVAL_DBL:		fprintf(fp, "%f", lval_get_double(v));	break;
+		case LVAL_BIG: {
+			char* digits = big_str(v);
+			fprintf(fp, "%s", digits ? digits : "");
+			free(digits);
+			break;
+		}
 		case LVAL_SYM:		fprintf(fp, "%s", v->sym);	break;
+		case LVAL_STR: {
+			char* esc = _str_escape(v->str);
+			fprintf(fp, "\"%s\"", esc ? esc : "");
+			free(esc);
+			break;
+		}
 		case LVAL_SEXPR:
 			_lval_expr_print(v, '(', ')', fp);
 			break;
@@ -310,9 +874,14 @@ static void _lval_print(lval* v, FILE *fp)
 			if (v->builtin)
 				fprintf(fp, "%s", "<builtin>");
 			else {
-				fprintf(fp, "(\\ ");
-				_lval_print(v->formals, fp);
-				fputc(' ', fp);
+				// the formals left, the arguments given take the first ones
+				fprintf(fp, "(\\ {");
+				for (int i = v->args ? v->args->count : 0; i < v->formals->count; i++) {
+					_lval_print(v->formals->cell[i], fp);
+					if (i != v->formals->count - 1)
+						putc(' ', fp);
+				}
+				fprintf(fp, "} ");
 				_lval_print(v->body, fp);
 				fputc(')', fp);
 			}
@@ -332,10 +901,22 @@ static long _lval_snprint(lval* v, char* str, const long n)
 	if (n < 0)
 		return ret;
 
-	switch (v->type) {
-		case LVAL_LNG:		ret = snprintf(str, n, "%li", v->data.lng);	break;
-		case LVAL_DBL:		ret = snprintf(str, n, "%f", v->data.dbl);	break;
+	switch (LVAL_TYPE(v)) {
+		case LVAL_LNG:		ret = snprintf(str, n, "%" PRId64, lval_get_long(v));	break;
+		case LVAL_DBL:		ret = snprintf(str, n, "%f", lval_get_double(v));	break;
+		case LVAL_BIG: {
+			char* digits = big_str(v);
+			ret = snprintf(str, n, "%s", digits ? digits : "");
+			free(digits);
+			break;
+		}
 		case LVAL_SYM:		ret = snprintf(str, n, "%s", v->sym);		break;
+		case LVAL_STR: {
+			char* esc = _str_escape(v->str);
+			ret = snprintf(str, n, "\"%s\"", esc ? esc : "");
+			free(esc);
+			break;
+		}
 		case LVAL_FUN:		ret = snprintf(str, n, "%s", "<function>");	break;
 		case LVAL_SEXPR:
 			ret = _lval_expr_snprint(v, '(', ')', str, n);
@@ -353,6 +934,27 @@ static long _lval_snprint(lval* v, char* str, const long n)
 	return ret;
 }
 
+// the inverse of what the reader does with a string literal
+static char* _str_escape(const char* s)
+{
+	char* esc = (char*)malloc(2*strlen(s) + 1);
+	char* p = esc;
+	if (NULL == esc)
+		return NULL;
+
+	for (; *s; s++) {
+		switch (*s) {
+		case '\n': *p++ = '\\'; *p++ = 'n'; break;
+		case '\t': *p++ = '\\'; *p++ = 't'; break;
+		case '"': *p++ = '\\'; *p++ = '"'; break;
+		case '\\': *p++ = '\\'; *p++ = '\\'; break;
+		default: *p++ = *s; break;
+		}
+	}
+	*p = '\0';
+	return esc;
+}
+
 int _lenv_fprint(lenv* e, FILE* f)
 {
 	int i = 0;
@@ -2,21 +2,27 @@
 #define COMMON_H_
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
-#include "mpc/mpc.h"
+#include <string.h>
+#include <errno.h>
+
+#include "log.h"
 
 #define LOGFILE "logs/logs.txt"
 #define ERRFILE "logs/logs.err.txt"
 
+#define TOYLISP_VERSION "0.1"
+
 #define MIN(a,b) (((a)<(b))?(a):(b))
 #define MAX(a,b) (((a)>(b))?(a):(b))
 
-// error macros, taken from zed shaw
+// error macros, taken from zed shaw, records go through the leveled logger
 #define clean_errno() (errno == 0 ? "None" : strerror(errno))
-#define log_err_to(fd, M, ...) fprintf(fd, "[ERROR] (%s:%d: errno: %s) " M "\n", __FILE__ , __LINE__ , clean_errno() , __VA_ARGS__)
-#define log_warn_to(fd, M, ...) fprintf(fd, "[WARN] (%s:%d: errno: %s) " M "\n", __FILE__, __LINE__, clean_errno(), __VA_ARGS__)
-#define log_info_to(fd, M, ...) fprintf(fd, "[INFO] (%s:%d) " M "\n", __FILE__, __LINE__, __VA_ARGS__)
-#define debug_to(fd, M, ...) fprintf(fd, "[DEBUG] (%s:%d %s): " M "\n", __FILE__ , __LINE__ , __func__, __VA_ARGS__)
+#define log_err_to(fd, M, ...) LOG_AT(fd, LOG_ERR, "[ERROR] (%s:%d: errno: %s) " M, __FILE__ , __LINE__ , clean_errno() , __VA_ARGS__)
+#define log_warn_to(fd, M, ...) LOG_AT(fd, LOG_WARN, "[WARN] (%s:%d: errno: %s) " M, __FILE__, __LINE__, clean_errno(), __VA_ARGS__)
+#define log_info_to(fd, M, ...) LOG_AT(fd, LOG_INFO, "[INFO] (%s:%d) " M, __FILE__, __LINE__, __VA_ARGS__)
+#define debug_to(fd, M, ...) LOG_AT(fd, LOG_DEBUG, "[DEBUG] (%s:%d %s): " M, __FILE__ , __LINE__ , __func__, __VA_ARGS__)
 
 #define log_err(M, ...) log_err_to(stderr, M, __VA_ARGS__)
 #define log_warn(M, ...) log_warn_to(stderr, M, __VA_ARGS__)
@@ -31,10 +37,12 @@
 	TYPE(LVAL_LNG) \
 	TYPE(LVAL_DBL) \
 	TYPE(LVAL_SYM) \
+	TYPE(LVAL_STR) \
 	TYPE(LVAL_FUN) \
 	TYPE(LVAL_SEXPR) \
 	TYPE(LVAL_QEXPR) \
 	TYPE(LVAL_ERR) \
+	TYPE(LVAL_BIG) \
 
 enum LVAL_TYPES { FOREACH_LVAL_TYPE(GENERATE_ENUM) };
 // static const char* LVAL_TYPE_STRINGS[] = { FOREACH_LVAL_TYPE(GENERATE_STRING) };
@@ -51,7 +59,9 @@ enum LVAL_TYPES { FOREACH_LVAL_TYPE(GENERATE_ENUM) };
 	TYPE(LERR_BAD_ARGS_COUNT) \
 	TYPE(LERR_BAD_TYPE) \
 	TYPE(LERR_EMPTY) \
+	TYPE(LERR_IO) \
 	TYPE(LERR_OTHER) \
+	TYPE(LERR_DEPTH) \
 
 enum LVAL_ERRS { FOREACH_LVAL_ERR(GENERATE_ENUM) };
 // static const char* LVAL_ERR_STRINGS[] = { FOREACH_LVAL_ERR(GENERATE_STRING) };
@@ -69,7 +79,9 @@ static const char* const LVAL_ERR_DESCRIPTIONS[] =
 	"Function passed wrong number of arguments!\n",
 	"Function passed incorrect type!\n",
 	"Function passed {}!\n",
-	"Critical Error!\n"
+	"Could not read file!\n",
+	"Critical Error!\n",
+	"Maximum recursion depth exceeded!\n"
 };
 
 enum COLON_COMMAND_ACTION
@@ -84,58 +96,219 @@ struct lval;
 struct lenv;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lcode lcode;
+typedef struct lopt lopt;
+typedef struct lclos lclos;
+typedef struct ljit ljit;
 
 // type declarations
 typedef lval*(*lbuiltin)(lenv*, lval*);
 
+#define LVAL_INLINE_CELLS 5 // a list this short keeps its cells in the lval
+#define LVAL_ROOM_MIN 64 // lists this long keep room before their cells
+
+// A header and the fields of one type, an lval is allocated with the size of
+// its type only, see lval_sizeof(). Lists point cell at cells_inline until
+// they outgrow it, see gc_cells(), so a list of a few values is one object.
+// Out of line, cell is either in an array the list owns, with cap cells from
+// cell on and front before it, or the cells of base the list is a slice of,
+// see lval_slice(). Slices appended to while the list is shared write past
+// its count, fill says how far, slices consed onto write before cell, lead
+// says how far.
 struct lval
 {
 	int type;
 	int count; // of cells
-	int err;
-	union
+	int refs; // holders besides the first, see lval_copy()
+	uint32_t gc; // position in the collector's table, 0 off the heap, see gc.h
+	__extension__ union
 	{
-		int64_t lng;
-		double dbl;
-	} data;
-	char* sym; // op
-	lval** cell;
-
-	lbuiltin builtin;
-	lenv* env;
-	lval* formals;
-	lval* body;
+		union
+		{
+			int64_t lng;
+			double dbl;
+		} data;
+		int err;
+		__extension__ struct
+		{
+			const char* sym; // interned, see symtab.h
+			int slot; // LVAL_SYM lookup hint, see lenv_get()
+			uint64_t stamp; // of the global frame hit was found in, 0 for none
+			lval* hit; // held by that frame, see lenv_ref()
+		};
+		char* str;
+		__extension__ struct
+		{
+			uint32_t* limbs; // least significant first, see big.h
+			int nlimbs;
+			int neg;
+		};
+		__extension__ struct
+		{
+			lval** cell;
+			__extension__ union
+			{
+				lval* cells_inline[LVAL_INLINE_CELLS];
+				__extension__ struct
+				{
+					lval* base; // held, NULL when the cells are owned
+					int cap;
+					int fill; // cells held past count for slices, see gc_cells()
+					int front;
+					int lead; // cells held before cell for slices
+				};
+			};
+		};
+		__extension__ struct
+		{
+			lbuiltin builtin;
+			lval* args; // supplied so far, a qexpr or NULL, see lval_call()
+			lval* formals; // never changed, the args take the first ones
+			lval* body;
+			lcode* code; // compiled body, shared by copies, see vm.h
+			lopt* opt; // rewritten body, shared by copies, see opt.h
+		};
+	};
 };
 
+// Most numbers are not allocated: the lval* of a long that fits in 62 bits, or
+// of a double whose exponent fits in 9 bits, is the number itself with a tag
+// in the low bits, other numbers are boxed. So read the type of any value with
+// LVAL_TYPE() and numbers with lval_get_long()/lval_get_double(), never with
+// ->, lval_copy() and lval_del() cost nothing for immediates.
+#define LVAL_TAG_MASK ((uintptr_t)3)
+#define LVAL_TAG_LNG ((uintptr_t)1)
+#define LVAL_TAG_DBL ((uintptr_t)2)
+#define LVAL_DBL_BIAS 767 // the double exponent of the smallest immediate one, less one
+#define LVAL_IS_IMM(v) (0 != ((uintptr_t)(v) & LVAL_TAG_MASK))
+#define LVAL_TYPE(v) \
+	(LVAL_IS_IMM(v) ? (LVAL_TAG_LNG == ((uintptr_t)(v) & LVAL_TAG_MASK) ? LVAL_LNG : LVAL_DBL) : (v)->type)
+
+static inline int64_t lval_get_long(const lval* v)
+{
+	if (!LVAL_IS_IMM(v))
+		return v->data.lng;
+	return (int64_t)(uintptr_t)v >> 2;
+}
+
+// sign, 9 bits of exponent and the mantissa, a 0 exponent is zero
+static inline double lval_get_double(const lval* v)
+{
+	if (!LVAL_IS_IMM(v))
+		return v->data.dbl;
+
+	uint64_t w = (uint64_t)(uintptr_t)v >> 2;
+	uint64_t e = (w >> 52) & 0x1ff;
+	uint64_t bits = (w >> 61) << 63 | (e ? (e + LVAL_DBL_BIAS) << 52 : 0) | (w & ((1ULL << 52) - 1));
+	double d;
+	memcpy(&d, &bits, sizeof(d));
+	return d;
+}
+
+// a slice holds its base and none of the cells it shows
+static inline int lval_is_slice(const lval* v)
+{
+	return v->cell && v->cell != v->cells_inline && v->base;
+}
+
+// the cells a list that is not a slice holds from cell on, past its count
+// once slices of it were grown, and before cell
+static inline int lval_held(const lval* v)
+{
+	if (NULL == v->cell || v->cell == v->cells_inline || v->base)
+		return v->count;
+	return MAX(v->count, v->fill);
+}
+
+static inline int lval_lead(const lval* v)
+{
+	if (NULL == v->cell || v->cell == v->cells_inline || v->base)
+		return 0;
+	return v->lead;
+}
+
+// A symbol in a lambda body is resolved when the lambda is built, to a slot of
+// the frame the body runs in or else a slot of the global frame. Scoping is
+// dynamic, so a hint is only used after checking the slot holds the symbol.
+#define LVAL_SLOT_LOCAL(i) ((i) + 1)
+#define LVAL_SLOT_GLOBAL(i) (-(i) - 1)
+
+// Each symbol is also an inline cache of the global value it was last found
+// to name. The global frame is stamped when a lookup first needs it and the
+// stamp is dropped whenever one of its bindings is replaced or removed, so a
+// symbol holding the current stamp of the global frame and bound nowhere else
+// is its value without any lookup.
+struct lenv_stats
+{
+	unsigned long hits;
+	unsigned long misses; // global lookups that searched
+};
+
+// Bindings are kept in insertion order in syms/vals. Once a frame holds
+// LENV_INDEX_MIN of them, an open addressing table of positions keyed by the
+// interned symbol pointer is kept as well, smaller frames are scanned.
+#define LENV_INDEX_MIN 8
+
 struct lenv
 {
 	int count;
-	char** syms;
+	int cap; // of syms and vals
+	const char** syms; // interned
 	lval** vals;
+	uint32_t* index; // position + 1, 0 when empty, NULL for small frames
+	uint32_t index_cap; // a power of two, at least twice count
+	uint32_t gc; // see struct lval
 	lenv* par; // parent
-	int debug;
+	lenv* root; // the global frame at the end of par, NULL when par is
+	uint64_t stamp; // of the bindings cached in symbols, 0 before one is, see lenv_ref()
 };
 
 // globals variables
-FILE* logfp;
-FILE* errfp;
+extern FILE* logfp;
+extern FILE* errfp;
+extern int lval_room_min; // LVAL_ROOM_MIN, 0 for never
+extern int lenv_cache_globals; // 1, 0 looks globals up every time
 
 // lval global functions
 void lval_del(lval* v);
 void lval_println(lval* v);
-lval* lval_copy(lval* v);
+lval* lval_copy(lval* v); // shares v, O(1)
+lval* lval_own(lval* v); // v or a copy of it that can be changed, takes v
+lval* lval_slice(lval* v, int i, int n); // n cells of v from i, O(1), takes v
 lval* lval_err(enum LVAL_ERRS e);
+size_t lval_sizeof(int type); // of an lval of that type
+
+// lval constructors
+lval* lval_long(int64_t x);
+lval* lval_double(double x);
+lval* lval_sym(const char sym[]);
+lval* lval_sym_n(const char* sym, size_t n); // sym need not be '\0' terminated
+lval* lval_str(const char str[]);
+lval* lval_str_n(const char* str, size_t n);
+lval* lval_sexpr(void);
+lval* lval_qexpr(void);
+lval* lval_add_toback(lval* v, lval* x);
 
 // lenv global functions
 lenv* lenv_new(void);
 void lenv_del(lenv* e);
+void lenv_clear(lenv* e); // drops the bindings and keeps the storage
+void lenv_set_par(lenv* e, lenv* par); // par and root, e has no children
 lval* lenv_get(lenv* e, lval* k);
+lval* lenv_ref(lenv* e, lval* k); // the bound value itself, NULL if unbound
 int lenv_put(lenv* e, lval* k, lval* v);
+int lenv_bind(lenv* e, const char* sym, lval* v); // sym interned, takes v
 int lenv_def(lenv* e, lval* k, lval* v);
+int lenv_remove(lenv* e, const char* sym); // 0 if sym was bound in e
+int lenv_slot(lenv* e, const char* sym); // position in e, -1 if not bound
+int lenv_shadows(lenv* e, lenv* par); // whether e binds every name par binds
 lenv* lenv_copy(lenv* e);
 int lenv_print(lenv* e);
+void lenv_get_stats(struct lenv_stats* st);
+void lenv_print_stats(FILE* fp);
 
 // others
+uint64_t hash_bytes(const void* data, size_t n);
 int colon_commands(const char* input, lenv* e);
 
 // TODO: this function sometimes returns -1 if the output is truncated,
@@ -1,271 +1,346 @@
 
+#define _XOPEN_SOURCE 700
+
+#include <pthread.h>
+#include <sys/resource.h>
+
 #include "eval.h"
+#include "cache.h"
+#include "clos.h"
+#include "gc.h"
+#include "image.h"
+#include "jit.h"
+#include "load.h"
+#include "opt.h"
+#include "symtab.h"
+#include "vm.h"
 
 #include <math.h>
+#include <inttypes.h>
 #include <string.h>
 #include <float.h>
 #include <assert.h>
 
-static lval* _eval_sexpr(lenv* e, lval* v);
+static lval* _eval_sexpr(lenv* e, lval* v, int evaluated);
+static int _stack_low(void);
+static lval* _eval_deeper(lenv* e, lval* v, int evaluated);
+static struct segment* _segment(int lv);
+static void* _segment_main(void* p);
+static lval* _lval_bind(lval* f, lval* a, lenv** frame, int take);
+static lval* _if_branch(lenv* e, lval* a);
+static lval* _eval_body(lenv* e, lval* a);
 static lval* _lval_take(lval* v, int i);
 static lval* _lval_pop(lval* v, int i);
 static lval* _lval_join(lval* x, lval* y);
-static lval* _lval_sexpr(void);
-static lval* _lval_qexpr(void);
-static lval* _lval_add_toback(lval* v, lval* x);
+static lval* _lval_room(lval* x, int n);
 static lval* _lval_add_tofront(lval*v, lval* x);
-static lval* _ast_to_long(mpc_ast_t* ast);
-static lval* _lval_long(int64_t x);
-static lval* _ast_to_double(mpc_ast_t* ast);
-static lval* _lval_double(double x);
-static lval* _lval_sym(const char sym[]);
 static lval* _lval_fun(lbuiltin func);
-static lval* _lval_lambda(lval* formals, lval* body);
-static lval* _lval_call(lenv* e, lval* f, lval* a);
-static int _add_builtin_to_env(lenv* e, char name[], lbuiltin func);
+static int _add_builtin_to_env(lenv* e, const char name[], lbuiltin func);
+static void _resolve(lval* x, lval* formals, lenv* global);
+static int _lval_eq(lval* x, lval* y);
+static int _fold_lng(int op, lval** xs, int n, int64_t* acc, int* done);
+static int _fold_big(int op, lval** xs, int n, lval** acc);
+static int _fold_dbl(int op, lval** xs, int n, double* acc);
+static int _ipow(int64_t b, int64_t n, int64_t* r);
+
+// name and function of every builtin, in the order they go into the env
+static const struct builtin_entry
+{
+	const char* name;
+	lbuiltin func;
+} BUILTINS[] =
+{
+	{ "quote", builtin_quote },
+	{ "head", builtin_head },
+	{ "tail", builtin_tail },
+	{ "join", builtin_join },
+	{ "eval", builtin_eval },
+	{ "cons", builtin_cons },
+	{ "len",  builtin_len  },
+	{ "init", builtin_init },
+	{ "load", builtin_load },
+
+	{ "+", builtin_add },
+	{ "-", builtin_sub },
+	{ "*", builtin_mul },
+	{ "/", builtin_div },
+	{ "%", builtin_mod },
+	{ "^", builtin_pow },
+	{ "min", builtin_min },
+	{ "max", builtin_max },
+
+	{ "\\", builtin_lambda },
+	{ "def", builtin_def },
+	{ "=", builtin_put },
+
+	{ ">", builtin_gt },
+	{ "<", builtin_lt },
+	{ ">=", builtin_ge },
+	{ "<=", builtin_le },
+	{ "==", builtin_eq },
+	{ "!=", builtin_ne },
+	{ "if", builtin_if },
+
+	// builtins under different name
+	{ "list", builtin_quote },
+	{ "car", builtin_head },
+	{ "cdr", builtin_tail },
+};
+
+#define NBUILTINS ((int)(sizeof(BUILTINS) / sizeof(BUILTINS[0])))
+
+int eval_engine = ENGINE_TREE;
+int eval_max_depth = EVAL_MAX_DEPTH;
+int eval_depth = 0;
+
+// where the outermost eval() runs, or the last stack segment began, and how
+// far below it the C stack may go
+static uintptr_t stack_top = 0;
+static size_t stack_budget = 0;
+
+// a nested evaluation carried on on a stack segment of its own
+struct deeper
+{
+	lenv* e;
+	lval* v;
+	int evaluated;
+	lval* r;
+};
+
+// the thread of a stack segment, started the first time an evaluation gets
+// that deep and kept waiting for the next one
+struct segment
+{
+	pthread_t t;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct deeper* d; // handed over, NULL again once it is done
+	int level;
+};
+
+static struct segment** segments = NULL; // segments[i] is at level i+1
+static int nsegments = 0;
+static int level = 0; // of the segment running now, 0 for the first thread
 
 // public functions ////////////////////////////////////////////////////////////
 int init_env(lenv* e)
 {
-	_add_builtin_to_env(e, "quote", builtin_quote);
-	_add_builtin_to_env(e, "head", builtin_head);
-	_add_builtin_to_env(e, "tail", builtin_tail);
-	_add_builtin_to_env(e, "join", builtin_join);
-	_add_builtin_to_env(e, "eval", builtin_eval);
-	_add_builtin_to_env(e, "cons", builtin_cons);
-	_add_builtin_to_env(e, "len",  builtin_len );
-	_add_builtin_to_env(e, "init", builtin_init);
-
-	_add_builtin_to_env(e, "+", builtin_add);
-	_add_builtin_to_env(e, "-", builtin_sub);
-	_add_builtin_to_env(e, "*", builtin_mul);
-	_add_builtin_to_env(e, "/", builtin_div);
-	_add_builtin_to_env(e, "%", builtin_mod);
-	_add_builtin_to_env(e, "^", builtin_pow);
-	_add_builtin_to_env(e, "min", builtin_min);
-	_add_builtin_to_env(e, "max", builtin_max);
-
-	_add_builtin_to_env(e, "\\", builtin_lambda);
-	_add_builtin_to_env(e, "def", builtin_def);
-	_add_builtin_to_env(e, "=", builtin_put);
-
-	_add_builtin_to_env(e, ">", builtin_gt);
-	_add_builtin_to_env(e, "<", builtin_lt);
-	_add_builtin_to_env(e, ">=", builtin_ge);
-	_add_builtin_to_env(e, "<=", builtin_le);
-
-	// builtins under different name
-	_add_builtin_to_env(e, "list", builtin_quote);
-	_add_builtin_to_env(e, "car", builtin_head);
-	_add_builtin_to_env(e, "cdr", builtin_tail);
+	for (int i = 0; i < NBUILTINS; i++)
+		_add_builtin_to_env(e, BUILTINS[i].name, BUILTINS[i].func);
 
+	gc_root(e);
 	return 0; // TODO error checking
 }
 
+int builtin_index(lbuiltin func)
+{
+	for (int i = 0; i < NBUILTINS; i++) {
+		if (BUILTINS[i].func == func)
+			return i;
+	}
+	return -1;
+}
+
+lbuiltin builtin_at(int i)
+{
+	return (i >= 0 && i < NBUILTINS) ? BUILTINS[i].func : NULL;
+}
+
+const char* builtin_name_at(int i)
+{
+	return (i >= 0 && i < NBUILTINS) ? BUILTINS[i].name : NULL;
+}
+
 lval* eval(lenv* e, lval* v)
 {
-	if (v->type == LVAL_SYM) {
+	if (LVAL_TYPE(v) == LVAL_SYM) {
 		lval* x = lenv_get(e, v);
 		lval_del(v);
 		return x;
 	}
-	if (v->type == LVAL_SEXPR)
-		return _eval_sexpr(e, v);
+	if (LVAL_TYPE(v) == LVAL_SEXPR) {
+		if (eval_depth >= eval_max_depth) {
+			lval_del(v);
+			return lval_err(LERR_DEPTH);
+		}
+		int low = _stack_low();
+		// a top level form is rewritten once before it runs, see opt.h
+		if (0 == eval_depth && opt_passes)
+			v = opt_form(e, v);
+		eval_depth++;
+		lval* x = low ? _eval_deeper(e, v, 0)
+			: ENGINE_VM == eval_engine ? vm_eval(e, v) : _eval_sexpr(e, v, 0);
+		eval_depth--;
+		return x;
+	}
 
 	return v; // return same v if not sexpr
 }
 
-lval* builtin_op(lenv* e, lval* v, char* op)
+lval* eval_apply(lenv* e, lval* v)
 {
-	for (int i = 0; i < v->count; i++) { // ensure all children are numbers
-		if (v->cell[i]->type != LVAL_LNG && v->cell[i]->type != LVAL_DBL) {
-			if (e->debug)
-				debug("Not all children are numbers - type: %d", v->cell[i]->type);
+	if (eval_depth >= eval_max_depth) {
+		lval_del(v);
+		return lval_err(LERR_DEPTH);
+	}
+	int low = _stack_low();
+	eval_depth++;
+	lval* x = low ? _eval_deeper(e, v, 1) : _eval_sexpr(e, v, 1);
+	eval_depth--;
+	return x;
+}
+
+lval* eval_str(lenv* e, const char* input)
+{
+	lval* v = pcache_parse(input);
+	if (NULL == v)
+		return NULL;
+	return eval(e, v);
+}
+
+lval* builtin_op(lenv* e, lval* v, int op)
+{
+	LVAL_ASSERT(e, v, (v->count > 0), LERR_BAD_ARGS_COUNT);
+	int dbl = v->count; // position of the first double
+	for (int i = v->count - 1; i >= 0; i--) { // ensure all children are numbers
+		if (!LVAL_IS_NUM(v->cell[i])) {
+			debug("Not all children are numbers - type: %d", LVAL_TYPE(v->cell[i]));
 			lval_del(v);
 			return lval_err(LERR_BAD_NUM);
 		}
+		if (LVAL_DBL == LVAL_TYPE(v->cell[i]))
+			dbl = i;
 	}
 
-	lval* x = _lval_pop(v, 0);
-	if ((strcmp(op, "-") == 0) && v->count == 0) {
-		if (LVAL_DBL == x->type) { x->data.dbl = -x->data.dbl; }
-		if (LVAL_LNG == x->type) { x->data.lng = -x->data.lng; }
+	// longs are folded up to the first double, or to the cell a long would
+	// overflow with or a bigint, bigints from there up to the first double,
+	// then doubles
+	lval* x = v->cell[0];
+	lval* big = NULL; // the fold so far once it went past longs
+	int64_t n = 0;
+	double d = 0;
+	int err = -1;
+	if (ARITH_SUB == op && 1 == v->count) {
+		if (LVAL_LNG == LVAL_TYPE(x) && INT64_MIN != lval_get_long(x))
+			n = -lval_get_long(x);
+		else if (LVAL_DBL != LVAL_TYPE(x))
+			big = big_neg(x);
+		d = -GET_LVAL_NUM_TYPE(x);
 	}
-
-	while (v->count > 0) {
-		lval* y = _lval_pop(v, 0);
-
-		if (x->type == LVAL_DBL || y->type == LVAL_DBL) {
-			TO_LVAL_DBL(x); TO_LVAL_DBL(y);
-			if (!strcmp(op, "+")) { x->data.dbl += y->data.dbl; }
-			if (!strcmp(op, "-")) { x->data.dbl -= y->data.dbl; }
-			if (!strcmp(op, "*")) { x->data.dbl *= y->data.dbl; }
-
-			if (!strcmp(op, "/")) {
-				if (DBL_EPSILON > y->data.dbl) {
-					if (e->debug)
-						debug("Division by zero! (%f/%f)", x->data.dbl, y->data.dbl);
-					lval_del(x);
-					lval_del(y); // v is deleted after while
-					x = lval_err(LERR_DIV_ZERO);
-					break;
-				}
-				x->data.dbl /= y->data.dbl;
-			}
-
-			if (!strcmp(op, "^")) { x->data.dbl = pow(x->data.dbl, y->data.dbl); }
-			if (!strcmp(op, "min")) { x->data.dbl = MIN(x->data.dbl, y->data.dbl); }
-			if (!strcmp(op, "max")) { x->data.dbl = MAX(x->data.dbl, y->data.dbl); }
+	else if (dbl > 0) {
+		int i = 0; // cells _fold_lng() folded
+		if (LVAL_LNG == LVAL_TYPE(x)) {
+			n = lval_get_long(x);
+			err = _fold_lng(op, v->cell + 1, dbl - 1, &n, &i);
 		}
-		else {
-			if (!strcmp(op, "+")) { x->data.lng += y->data.lng; }
-			if (!strcmp(op, "-")) { x->data.lng -= y->data.lng; }
-			if (!strcmp(op, "*")) { x->data.lng *= y->data.lng; }
-
-			if (!strcmp(op, "/")) {
-				if (0 == y->data.lng) {
-					if (e->debug)
-						debug("Division by zero! (%ld/%ld)", x->data.lng, y->data.lng);
-					lval_del(x); lval_del(y); // v is deleted after while
-					x = lval_err(LERR_DIV_ZERO);
-					break;
-				}
-				x->data.lng /= y->data.lng;
-			}
-
-			if (!strcmp(op, "%")) { x->data.lng %= y->data.lng; }
-			if (!strcmp(op, "^")) { x->data.lng = (long)pow(x->data.lng, y->data.lng); }
-			if (!strcmp(op, "min")) { x->data.lng = MIN(x->data.lng, y->data.lng); }
-			if (!strcmp(op, "max")) { x->data.lng = MAX(x->data.lng, y->data.lng); }
+		if (err < 0 && (LVAL_BIG == LVAL_TYPE(x) || 1 + i < dbl)) {
+			big = LVAL_BIG == LVAL_TYPE(x) ? lval_copy(x) : lval_long(n);
+			err = _fold_big(op, v->cell + 1 + i, dbl - 1 - i, &big);
 		}
-		lval_del(y);
+		d = big ? GET_LVAL_NUM_TYPE(big) : (double)n;
+		if (err < 0 && dbl < v->count)
+			err = _fold_dbl(op, v->cell + dbl, v->count - dbl, &d);
 	}
-	lval_del(v);
-	return x;
-}
-
-lval* ast_to_lval(mpc_ast_t* ast)
-{
-	if (NULL == ast)
-		return lval_err(LERR_OTHER);
-
-	if (strstr(ast->tag, "long"))
-		return _ast_to_long(ast);
-	else if (strstr(ast->tag, "double"))
-		return _ast_to_double(ast);
-	else if (strstr(ast->tag, "symbol"))
-		return _lval_sym(ast->contents);
-
-	lval* x = NULL; // ">" is root
-	if (0 == strcmp(ast->tag, ">"))
-		x = _lval_sexpr();
-	else if (strstr(ast->tag, "sexpr"))
-		x = _lval_sexpr();
-	else if (strstr(ast->tag, "qexpr"))
-		x = _lval_qexpr();
-
-	if (NULL == x)
-		return lval_err(LERR_OTHER);
-
-	for (int i = 0; i < ast->children_num; i++)
-	{
-		if (strcmp(ast->children[i]->contents, "(") == 0
-			|| strcmp(ast->children[i]->contents, ")") == 0
-			|| strcmp(ast->children[i]->contents, "}") == 0
-			|| strcmp(ast->children[i]->contents, "{") == 0
-			|| strcmp(ast->children[i]->tag,  "regex") == 0
-			) { continue; }
-		x = _lval_add_toback(x, ast_to_lval(ast->children[i]));
+	else {
+		d = lval_get_double(x);
+		err = _fold_dbl(op, v->cell + 1, v->count - 1, &d);
 	}
 
-	return x;
+	int is_dbl = dbl < v->count;
+	lval_del(v);
+	if (big && (err >= 0 || is_dbl))
+		lval_del(big);
+	if (err >= 0)
+		return lval_err(err);
+	if (is_dbl)
+		return lval_double(d);
+	return big ? big : lval_long(n);
 }
 
-lval* builtin_ord(lenv* e, lval *a, char* op) {
+lval* builtin_ord(lenv* e, lval *a, int op) {
 	LVAL_ASSERT(e, a, (a->count == 2), LERR_TOO_MANY_ARGS);
 	for (int i = 0; i < 2; i++) {
-		LVAL_ASSERT(e, a,
-			(a->cell[i]->type == LVAL_DBL || a->cell[i]->type == LVAL_LNG),
-			LERR_BAD_TYPE);
+		LVAL_ASSERT(e, a, LVAL_IS_NUM(a->cell[i]), LERR_BAD_TYPE);
 	}
 
 	int r;
-	double val[2];
-
-	for (int i = 0; i < 2; i++) {
-		if (a->cell[i]->type == LVAL_DBL) {
-			val[i] = a->cell[i]->data.dbl;
-		}
-		else if (a->cell[i]->type == LVAL_LNG) {
-			val[i]= (double)a->cell[i]->data.lng;
-		}
-		else {
-			return lval_err(LERR_OTHER);
-		}
-	}
+	lval* x = a->cell[0];
+	lval* y = a->cell[1];
 
+	// longs and bigints are compared as they are, doubles lose the low bits
+	// of big ones
 	// TODO need to consider epsilon for when comparing doubles after conversion
-	if (strcmp(op, ">")  == 0) {
-		r = val[0] > val[1];
-	}
-	if (strcmp(op, "<")  == 0) {
-		r = val[0] < val[1];
-	}
-	if (strcmp(op, ">=") == 0) {
-		r = val[0] >= val[1];
-	}
-	if (strcmp(op, "<=") == 0) {
-		r = val[0] <= val[1];
+	if (LVAL_LNG == LVAL_TYPE(x) && LVAL_LNG == LVAL_TYPE(y))
+		r = ORD_APPLY(op, lval_get_long(x), lval_get_long(y));
+	else if (LVAL_DBL != LVAL_TYPE(x) && LVAL_DBL != LVAL_TYPE(y)) {
+		int c = big_cmp(x, y);
+		r = ORD_APPLY(op, c, 0);
 	}
+	else
+		r = ORD_APPLY(op, GET_LVAL_NUM_TYPE(x), GET_LVAL_NUM_TYPE(y));
+
+	lval_del(a);
+	return lval_long(r);
+}
+
+lval* builtin_cmp(lenv* e, lval* a, int op)
+{
+	LVAL_ASSERT(e, a, (a->count == 2), LERR_BAD_ARGS_COUNT);
+
+	int r = _lval_eq(a->cell[0], a->cell[1]);
+	if (CMP_NE == op)
+		r = !r;
 
 	lval_del(a);
-	return _lval_long(r);
+	return lval_long(r);
+}
+
+// if cond {then} {else}, only the chosen branch is evaluated
+lval* builtin_if(lenv* e, lval* a)
+{
+	lval* x = _if_branch(e, a);
+	return LVAL_ERR == LVAL_TYPE(x) ? x : eval(e, x);
 }
 
 lval* builtin_head(lenv* e, lval* a)
 {
 	LVAL_ASSERT(e, a, (a->count == 1), LERR_TOO_MANY_ARGS);
-	LVAL_ASSERT(e, a, (a->cell[0]->type == LVAL_QEXPR), LERR_BAD_TYPE);
+	LVAL_ASSERT(e, a, (LVAL_TYPE(a->cell[0]) == LVAL_QEXPR), LERR_BAD_TYPE);
 	LVAL_ASSERT(e, a, (a->cell[0]->count != 0), LERR_EMPTY);
 
-	lval* v = _lval_take(a, 0);
-	while (v->count > 1)
-		lval_del(_lval_pop(v, 1));
+	lval* v = lval_add_toback(lval_qexpr(), lval_copy(a->cell[0]->cell[0]));
+	lval_del(a);
 	return v;
 }
 
 lval* builtin_tail(lenv* e, lval* a)
 {
 	LVAL_ASSERT(e, a, (a->count == 1), LERR_TOO_MANY_ARGS);
-	LVAL_ASSERT(e, a, (a->cell[0]->type == LVAL_QEXPR), LERR_BAD_TYPE);
+	LVAL_ASSERT(e, a, (LVAL_TYPE(a->cell[0]) == LVAL_QEXPR), LERR_BAD_TYPE);
 	LVAL_ASSERT(e, a, (a->cell[0]->count != 0), LERR_EMPTY);
 
 	lval* v = _lval_take(a, 0);
-	lval_del(_lval_pop(v, 0));
-	return v;
+	return lval_slice(v, 1, v->count - 1);
 }
 
 lval* builtin_quote(lenv* e, lval* a)
 {
-	(void*)e;
+	(void)e;
+	a = lval_own(a);
 	a->type = LVAL_QEXPR;
 	return a;
 }
 
 lval* builtin_eval(lenv* e, lval* a)
 {
-	LVAL_ASSERT(e, a, (a->count == 1), LERR_TOO_MANY_ARGS);
-	LVAL_ASSERT(e, a, (a->cell[0]->type == LVAL_QEXPR), LERR_BAD_TYPE);
-
-	lval* x = _lval_take(a, 0);
-	x->type = LVAL_SEXPR;
-	return eval(e, x);
+	lval* x = _eval_body(e, a);
+	return LVAL_ERR == LVAL_TYPE(x) ? x : eval(e, x);
 }
 
 lval* builtin_join(lenv* e, lval* a)
 {
 	for (int i = 0; i < a->count; i++)
-		LVAL_ASSERT(e, a, (a->cell[i]->type == LVAL_QEXPR), LERR_BAD_TYPE);
+		LVAL_ASSERT(e, a, (LVAL_TYPE(a->cell[i]) == LVAL_QEXPR), LERR_BAD_TYPE);
 
 	lval* x = _lval_pop(a, 0);
 
@@ -278,13 +353,13 @@ lval* builtin_join(lenv* e, lval* a)
 lval* builtin_cons(lenv* e, lval* a)
 {
 	LVAL_ASSERT(e, a, (2 == a->count), LERR_BAD_ARGS_COUNT);
-	LVAL_ASSERT(e, a, (LVAL_QEXPR == a->cell[1]->type), LERR_BAD_TYPE);
+	LVAL_ASSERT(e, a, (LVAL_QEXPR == LVAL_TYPE(a->cell[1])), LERR_BAD_TYPE);
 
 	lval* item = _lval_pop(a, 0);
 
 	// !!! TODO this may not be correct, if the user goes: cons {a} {1 2}
 	// do we return {a 1 2} or {{a} 1 2}?
-	if (item->count == 1) {
+	if (!LVAL_IS_IMM(item) && item->count == 1) {
 		item = _lval_take(item, 0);
 	}
 
@@ -296,9 +371,9 @@ lval* builtin_cons(lenv* e, lval* a)
 lval* builtin_len(lenv* e, lval* a)
 {
 	LVAL_ASSERT(e, a, (1 == a->count), LERR_TOO_MANY_ARGS);
-	LVAL_ASSERT(e, a, (LVAL_QEXPR == a->cell[0]->type), LERR_BAD_TYPE);
+	LVAL_ASSERT(e, a, (LVAL_QEXPR == LVAL_TYPE(a->cell[0])), LERR_BAD_TYPE);
 
-	lval* x = _lval_long(a->cell[0]->count);
+	lval* x = lval_long(a->cell[0]->count);
 	lval_del(a);
 	return x;
 }
@@ -306,22 +381,21 @@ lval* builtin_len(lenv* e, lval* a)
 lval* builtin_init(lenv* e, lval* a)
 {
 	LVAL_ASSERT(e, a, (1 == a->count), LERR_TOO_MANY_ARGS);
-	LVAL_ASSERT(e, a, (LVAL_QEXPR == a->cell[0]->type), LERR_BAD_TYPE);
+	LVAL_ASSERT(e, a, (LVAL_QEXPR == LVAL_TYPE(a->cell[0])), LERR_BAD_TYPE);
 	LVAL_ASSERT(e, a, (0 != a->cell[0]->count), LERR_EMPTY);
 
 	lval* v = _lval_take(a, 0); // take main qexpr
-	lval_del(_lval_pop(v, v->count-1));
-	return v;
+	return lval_slice(v, 0, v->count - 1);
 }
 
 lval* builtin_lambda(lenv* e, lval* a)
 {
 	LVAL_ASSERT(e, a, (a->count == 2), LERR_BAD_ARGS_COUNT);
-	LVAL_ASSERT(e, a, (a->cell[0]->type == LVAL_QEXPR), LERR_BAD_TYPE);
-	LVAL_ASSERT(e, a, (a->cell[1]->type == LVAL_QEXPR), LERR_BAD_TYPE);
+	LVAL_ASSERT(e, a, (LVAL_TYPE(a->cell[0]) == LVAL_QEXPR), LERR_BAD_TYPE);
+	LVAL_ASSERT(e, a, (LVAL_TYPE(a->cell[1]) == LVAL_QEXPR), LERR_BAD_TYPE);
 
 	for (int i = 0; i < a->cell[0]->count; i++) {
-		LVAL_ASSERT(e, a, (LVAL_SYM == a->cell[0]->cell[i]->type), LERR_BAD_TYPE);
+		LVAL_ASSERT(e, a, (LVAL_SYM == LVAL_TYPE(a->cell[0]->cell[i])), LERR_BAD_TYPE);
 //		LASSERT(e, a, (a->cell[0]->cell[i]->type == LVAL_SYM),
 //				"Cannot define non-symbol. Got %s, Expected %s.",
 //				ltype_name(a->cell[0]->cell[i]->type), ltype_name(LVAL_SYM));
@@ -332,17 +406,26 @@ lval* builtin_lambda(lenv* e, lval* a)
 	lval* body = _lval_pop(a, 0);
 	lval_del(a);
 
-	return _lval_lambda(formals, body);
+	while (e->par)
+		e = e->par;
+	_resolve(body, formals, e);
+
+	lval* f = lval_lambda(formals, body);
+	if (opt_passes || clos_enabled || jit_enabled)
+		f->opt = opt_lambda(e, f);
+	if (f->opt)
+		clos_body(e, f, opt_body(e, f));
+	return f;
 }
 
 lval* builtin_var(lenv* e, lval* a, char* func)
 {
-	LVAL_ASSERT(e, a, (LVAL_QEXPR == a->cell[0]->type), LERR_BAD_TYPE);
+	LVAL_ASSERT(e, a, (LVAL_QEXPR == LVAL_TYPE(a->cell[0])), LERR_BAD_TYPE);
 //	LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
 
 	lval* syms = a->cell[0];
 	for (int i = 0; i < syms->count; i++) {
-		LVAL_ASSERT(e, a, (LVAL_SYM == syms->cell[i]->type), LERR_BAD_SYMBOL);
+		LVAL_ASSERT(e, a, (LVAL_SYM == LVAL_TYPE(syms->cell[i])), LERR_BAD_SYMBOL);
 //		LASSERT(a, (syms->cell[i]->type == LVAL_SYM),
 //			"Function '%s' cannot define non-symbol. Got %s, Expected %s.",
 //			func, ltype_name(syms->cell[i]->type), ltype_name(LVAL_SYM));
@@ -361,216 +444,510 @@ lval* builtin_var(lenv* e, lval* a, char* func)
 	}
 
 	lval_del(a);
-	return _lval_sexpr();
+	return lval_sexpr();
 }
 
-lval* builtin_add(lenv* e, lval* a) { return builtin_op(e, a, "+"); }
-lval* builtin_sub(lenv* e, lval* a) { return builtin_op(e, a, "-"); }
-lval* builtin_mul(lenv* e, lval* a) { return builtin_op(e, a, "*"); }
-lval* builtin_div(lenv* e, lval* a) { return builtin_op(e, a, "/"); }
-lval* builtin_mod(lenv* e, lval* a) { return builtin_op(e, a, "%"); }
-lval* builtin_pow(lenv* e, lval* a) { return builtin_op(e, a, "^"); }
-lval* builtin_min(lenv* e, lval* a) { return builtin_op(e, a, "min"); }
-lval* builtin_max(lenv* e, lval* a) { return builtin_op(e, a, "max"); }
+lval* builtin_add(lenv* e, lval* a) { return builtin_op(e, a, ARITH_ADD); }
+lval* builtin_sub(lenv* e, lval* a) { return builtin_op(e, a, ARITH_SUB); }
+lval* builtin_mul(lenv* e, lval* a) { return builtin_op(e, a, ARITH_MUL); }
+lval* builtin_div(lenv* e, lval* a) { return builtin_op(e, a, ARITH_DIV); }
+lval* builtin_mod(lenv* e, lval* a) { return builtin_op(e, a, ARITH_MOD); }
+lval* builtin_pow(lenv* e, lval* a) { return builtin_op(e, a, ARITH_POW); }
+lval* builtin_min(lenv* e, lval* a) { return builtin_op(e, a, ARITH_MIN); }
+lval* builtin_max(lenv* e, lval* a) { return builtin_op(e, a, ARITH_MAX); }
 
 lval* builtin_def(lenv* e, lval* a) { return builtin_var(e, a, "def"); }
 lval* builtin_put(lenv* e, lval* a) { return builtin_var(e, a, "="); }
 
-lval* builtin_gt(lenv* e, lval* a) { return builtin_ord(e, a, ">"); }
-lval* builtin_lt(lenv* e, lval* a) { return builtin_ord(e, a, "<"); }
-lval* builtin_ge(lenv* e, lval* a) { return builtin_ord(e, a, ">="); }
-lval* builtin_le(lenv* e, lval* a) { return builtin_ord(e, a, "<="); }
+lval* builtin_gt(lenv* e, lval* a) { return builtin_ord(e, a, ORD_GT); }
+lval* builtin_lt(lenv* e, lval* a) { return builtin_ord(e, a, ORD_LT); }
+lval* builtin_ge(lenv* e, lval* a) { return builtin_ord(e, a, ORD_GE); }
+lval* builtin_le(lenv* e, lval* a) { return builtin_ord(e, a, ORD_LE); }
+lval* builtin_eq(lenv* e, lval* a) { return builtin_cmp(e, a, CMP_EQ); }
+lval* builtin_ne(lenv* e, lval* a) { return builtin_cmp(e, a, CMP_NE); }
 
-// private functions: //////////////////////////////////////////////////////////
+lval* lval_call(lenv* e, lval* f, lval* a)
+{
+	if (f->builtin)
+		return f->builtin(e, a);
 
-static lval* _lval_lambda(lval* formals, lval* body) {
-	lval* v = calloc(1, sizeof(lval));
-	v->type = LVAL_FUN;
+	lenv* frame;
+	lval* r = _lval_bind(f, a, &frame, 0);
+	if (r)
+		return r;
+
+	lenv_set_par(frame, e);
+	// TODO do we need to fix f->body's type? i.e. "(\{x & xy} {+ x xy}) 1 2" fails
+	lval* body = opt_body(e, f);
+	r = builtin_eval(frame, lval_add_toback(lval_sexpr(), lval_copy(body ? body : f->body)));
+	lenv_del(frame);
+	return r;
+}
+
+lval* lval_lambda(lval* formals, lval* body)
+{
+	lval* v = gc_lval(LVAL_FUN);
 	v->builtin = NULL;
-	v->env = lenv_new();
 	v->formals = formals;
 	v->body = body;
 	return v;
 }
 
-static lval* _lval_add_toback(lval* v, lval* x)
-{
-	// TODO v and return value are the same
-	v->count++;
-	v->cell = (lval**)realloc(v->cell, sizeof(lval*)*v->count);
-	if (NULL == v->cell)
-		return NULL;
-	v->cell[v->count-1] = x; // set the last element
-	return v;
-}
+// private functions: //////////////////////////////////////////////////////////
 
+// Takes v and x. When v is shared and starts where the cells of its list
+// start, with room before them, x goes there and a slice over it and v's
+// cells is returned, like _lval_room() at the other end. A list of
+// lval_room_min cells or more gets room before its cells, as many as it has,
+// so consing onto a long list is amortized O(1), shorter ones are shifted.
 static lval* _lval_add_tofront(lval*v, lval* x)
 {
-	// TODO v and return value are the same
-	v->count++;
-	v->cell = (lval**)realloc(v->cell, sizeof(lval*)*v->count);
-	if (NULL == v->cell)
+	int shared = v->refs || image_contains(v);
+	lval* b = lval_is_slice(v) ? v->base : v;
+	if ((shared || b != v) && b->cell && b->cell != b->cells_inline && NULL == b->base
+		&& !image_contains(b) && v->cell == b->cell - b->lead && b->lead < b->front) {
+		lval* s = shared ? gc_lval(v->type) : v;
+		if (NULL == s)
+			return NULL;
+		b->lead++;
+		b->cell[-b->lead] = x;
+		s->cell = v->cell - 1;
+		s->count = v->count + 1;
+		if (s != v) {
+			s->base = lval_copy(b);
+			lval_del(v);
+		}
+		return s;
+	}
+
+	v = lval_own(v);
+	if (NULL == v)
 		return NULL;
-	memmove(v->cell+1, v->cell, sizeof(lval*)*(v->count-1));
+	if (lval_room_min && v->count >= lval_room_min) {
+		if (gc_front(v, 1))
+			return NULL;
+		v->cell--;
+		v->front--;
+		v->cap++;
+	}
+	else {
+		if (gc_cells(v, v->count+1))
+			return NULL;
+		memmove(v->cell+1, v->cell, sizeof(lval*)*v->count);
+	}
 	v->cell[0] = x;
+	v->count++;
 	return v;
 }
 
-static lval* _eval_sexpr(lenv* e, lval* v)
+// lambda bodies and the branches of if and eval in tail position go around the
+// loop instead of down the C stack, in the frames of the lambdas owned here,
+// and so do the calls compiled bodies end with, see clos.h. The cells of v are
+// values already if evaluated says so.
+static lval* _eval_sexpr(lenv* e, lval* v, int evaluated)
 {
-	int is_qexpr = 0;
-	if (v->cell && v->cell[0] && v->cell[0]->sym)
-		is_qexpr = (0 == strncmp("quote", v->cell[0]->sym, 5))
-			|| (0 == strncmp("list", v->cell[0]->sym, 4));
-	// TODO change the above to regex
+	lenv* top = e;
+	lval* r;
+
+	for (;;) {
+		// the cells are replaced by their values below
+		v = lval_own(v);
+		int is_qexpr = 0;
+		if (v->count > 0 && LVAL_SYM == LVAL_TYPE(v->cell[0]))
+			is_qexpr = SYM_QUOTE == v->cell[0]->sym || SYM_LIST == v->cell[0]->sym;
+		// TODO change the above to regex
+
+		int i;
+		for (i = 0; i < v->count && !evaluated; i++) {
+			// skip eval if the function is qexpr
+			if (!is_qexpr || 0 == i)
+				v->cell[i] = eval(e, v->cell[i]);
+			if (LVAL_TYPE(v->cell[i]) == LVAL_ERR)
+				break;
+		}
+		if (i < v->count && !evaluated) {
+			r = _lval_take(v, i);
+			break;
+		}
+		evaluated = 0;
 
-	for (int i = 0; i < v->count; i++) {
-		// skip eval if the function is qexpr
-		if (!is_qexpr || 0 == i)
-			v->cell[i] = eval(e, v->cell[i]);
-		if (v->cell[i]->type == LVAL_ERR)
-			return _lval_take(v, i);
-	}
+		if (v->count == 0) {
+			r = v;
+			break;
+		}
+		if (v->count == 1) {
+			r = _lval_take(v, 0);
+			break;
+		}
+
+		// take the first element and make sure it's a function
+		lval* f = _lval_pop(v, 0);
+		if (LVAL_TYPE(f) != LVAL_FUN) {
+			debug("First element must be a symbol, not of type %d", LVAL_TYPE(f));
+			lval_del(f);
+			lval_del(v);
+			r = lval_err(LERR_BAD_SEXPR_START);
+			break;
+		}
+
+		if (builtin_if == f->builtin || builtin_eval == f->builtin) {
+			r = builtin_if == f->builtin ? _if_branch(e, v) : _eval_body(e, v);
+			lval_del(f);
+			if (LVAL_ERR == LVAL_TYPE(r))
+				break;
+			v = r;
+			continue;
+		}
+		if (f->builtin) {
+			r = f->builtin(e, v);
+			lval_del(f);
+			break;
+		}
+
+		// hot numeric lambdas run as machine code
+		if (jit_hot(e, f) && (r = jit_run(e, f, v->cell, v->count))) {
+			lval_del(f);
+			lval_del(v);
+			break;
+		}
 
-	if (v->count == 0)
-		return v;
-	if (v->count == 1)
-		return _lval_take(v, 0);
+		lenv* frame;
+		r = _lval_bind(f, v, &frame, !f->refs && !image_contains(f));
+		if (r) {
+			lval_del(f);
+			break;
+		}
 
-	// take the first element and make sure it's a function
-	lval* f = _lval_pop(v, 0);
-	if (f->type != LVAL_FUN) {
-		if (e->debug)
-			debug("First element must be a symbol, not of type %d", f->type);
+		// the body replaces v, or its compiled code runs, and the new frame
+		// is ours
+		lval* body = opt_body(e, f);
+		lclos* c = body ? clos_body(e, f, body) : NULL;
+		if (c)
+			lclos_retain(c);
+		else {
+			v = lval_own(lval_copy(body ? body : f->body));
+			v->type = LVAL_SEXPR;
+		}
 		lval_del(f);
-		lval_del(v);
-		return lval_err(LERR_BAD_SEXPR_START);
+
+		// a frame binding everything the one before it does hides that one
+		// completely, so a loop written as a tail call runs in constant space
+		lenv_set_par(frame, e);
+		if (e != top && lenv_shadows(frame, e)) {
+			lenv_set_par(frame, e->par);
+			lenv_del(e);
+		}
+		e = frame;
+
+		if (c) {
+			r = clos_run(c, e, &v);
+			lclos_release(c);
+			if (r)
+				break;
+			evaluated = 1;
+		}
 	}
 
-	lval* result = _lval_call(e, f, v);
-	lval_del(f);
-	return result;
+	while (e != top) {
+		lenv* par = e->par;
+		lenv_del(e);
+		e = par;
+	}
+	return r;
 }
 
-static lval* _lval_pop(lval* v, int i)
+// the outermost eval() records the stack position, nested ones check how far
+// below it they are
+static int _stack_low(void)
 {
-	lval* x = v->cell[i];
-	memmove(&v->cell[i], &v->cell[i+1], sizeof(lval*)*(v->count-i-1));
-
-	v->count--;
-	v->cell = (lval**)realloc(v->cell, sizeof(lval*)*v->count);
-	if (0 != v->count && NULL == v->cell )
-		return NULL;
-	return x;
+	char here;
+	uintptr_t sp = (uintptr_t)&here;
+
+	if (0 == stack_budget) {
+		struct rlimit rl;
+		size_t limit = 8 << 20;
+		if (0 == getrlimit(RLIMIT_STACK, &rl) && RLIM_INFINITY != rl.rlim_cur)
+			limit = MIN((size_t)rl.rlim_cur, (size_t)256 << 20);
+		stack_budget = limit - limit / 8;
+	}
+	if (0 == eval_depth) {
+		stack_top = sp;
+		return 0;
+	}
+	return stack_top > sp && stack_top - sp > stack_budget;
 }
 
-static lval* _lval_take(lval* v, int i)
+// Runs v on the thread of the next stack segment, waiting for it, so the
+// depth is bounded by eval_max_depth and not by the C stack. The segment is
+// only reserved, the pages the evaluation does not reach are never touched.
+static lval* _eval_deeper(lenv* e, lval* v, int evaluated)
 {
-	lval* x = _lval_pop(v, i);
-	lval_del(v);
-	return x;
+	uintptr_t top = stack_top;
+	size_t budget = stack_budget;
+	int lv = level;
+	struct deeper d = { e, v, evaluated, NULL };
+	struct segment* s = _segment(lv);
+	if (s) {
+		pthread_mutex_lock(&s->lock);
+		s->d = &d;
+		pthread_cond_signal(&s->cond);
+		while (s->d)
+			pthread_cond_wait(&s->cond, &s->lock);
+		pthread_mutex_unlock(&s->lock);
+	}
+	stack_top = top;
+	stack_budget = budget;
+	level = lv;
+	if (NULL == s) {
+		lval_del(v);
+		return lval_err(LERR_DEPTH);
+	}
+	return d.r;
 }
 
-static lval* _ast_to_long(mpc_ast_t* ast)
+// the segment past level lv, segments are entered one at a time so only the
+// next one is ever new
+static struct segment* _segment(int lv)
 {
-	errno = 0;
-	int64_t x = strtol(ast->contents, NULL, 10);
-	if (errno)
-	{
-		// log_err("strtol conversion failed for %s", ast->contents);
-		return lval_err(LERR_BAD_NUM);
+	if (lv < nsegments)
+		return segments[lv];
+
+	struct segment** a = realloc(segments, sizeof(struct segment*) * (nsegments+1));
+	if (NULL == a)
+		return NULL;
+	segments = a;
+
+	struct segment* s = (struct segment*)calloc(1, sizeof(struct segment));
+	pthread_attr_t attr;
+	if (NULL == s)
+		return NULL;
+	s->level = lv+1;
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->cond, NULL);
+	int failed = pthread_attr_init(&attr);
+	if (!failed) {
+		failed = pthread_attr_setstacksize(&attr, EVAL_STACK_SEGMENT)
+			|| pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED)
+			|| pthread_create(&s->t, &attr, _segment_main, s);
+		pthread_attr_destroy(&attr);
+	}
+	if (failed) {
+		pthread_cond_destroy(&s->cond);
+		pthread_mutex_destroy(&s->lock);
+		free(s);
+		return NULL;
 	}
-	return _lval_long(x);
+	segments[nsegments++] = s;
+	return s;
 }
 
-static lval* _lval_long(int64_t x)
+static void* _segment_main(void* p)
 {
-	lval* v = (lval*)calloc(1, sizeof(lval));
-	if (NULL == v) { return NULL; }
-	v->type = LVAL_LNG;
-	v->data.lng = x;
-	return v;
+	struct segment* s = (struct segment*)p;
+	char here;
+	pthread_mutex_lock(&s->lock);
+	for (;;) {
+		while (NULL == s->d)
+			pthread_cond_wait(&s->cond, &s->lock);
+		struct deeper* d = s->d;
+		pthread_mutex_unlock(&s->lock);
+
+		stack_top = (uintptr_t)&here;
+		stack_budget = EVAL_STACK_SEGMENT - EVAL_STACK_SEGMENT / 8;
+		level = s->level;
+		d->r = ENGINE_VM == eval_engine && !d->evaluated ? vm_eval(d->e, d->v) : _eval_sexpr(d->e, d->v, d->evaluated);
+
+		pthread_mutex_lock(&s->lock);
+		s->d = NULL;
+		pthread_cond_signal(&s->cond);
+	}
+	return NULL;
 }
 
-static lval* _lval_sym(const char sym[])
+// Binds the arguments f was given before and those in a to the formals of f
+// in a new frame, NULL when all are bound and the body can run, otherwise an
+// error or the partially applied function. A partial application shares the
+// formals, body and code of f and only adds the arguments in a to the ones f
+// holds, see _lval_join(). f is not changed unless take says the caller holds
+// it alone, then its arguments move. Takes a.
+static lval* _lval_bind(lval* f, lval* a, lenv** frame, int take)
 {
-	lval* v = (lval*)calloc(1, sizeof(lval));
-	if (NULL == v)
-		return NULL;
-	v->type = LVAL_SYM;
-	v->sym = (char*)calloc(strlen(sym)+1, sizeof(char));
-	if (NULL == v->sym)
-		return NULL;
-	strcpy(v->sym, sym);
-	return v;
+	lval* formals = f->formals;
+	int given = f->args ? f->args->count : 0;
+	int n = given + a->count;
+	debug("given: %d, total: %d", n, formals->count);
+
+	int fixed = 0;
+	while (fixed < formals->count && SYM_AMP != formals->cell[fixed]->sym)
+		fixed++;
+	if (fixed == formals->count && n > fixed) {
+		lval_del(a);
+		return lval_err(LERR_TOO_MANY_ARGS);
+	}
+	if (fixed < formals->count && n >= fixed && fixed != formals->count - 2) {
+		// '&' must be followed by a single symbol
+		lval_del(a);
+		return lval_err(LERR_BAD_SYMBOL);
+	}
+
+	a->type = LVAL_QEXPR;
+	if (n < fixed) {
+		lval* g = gc_lval(LVAL_FUN);
+		if (NULL == g) {
+			lval_del(a);
+			return lval_err(LERR_OTHER);
+		}
+		g->formals = lval_copy(formals);
+		g->body = lval_copy(f->body);
+		g->code = f->code ? lcode_retain(f->code) : NULL;
+		g->opt = opt_of(f) ? lopt_retain(opt_of(f)) : NULL;
+		// an f nobody else holds hands its arguments on instead of copying them
+		g->args = NULL == f->args ? a : _lval_join(take ? f->args : lval_copy(f->args), a);
+		if (take)
+			f->args = NULL;
+		return g;
+	}
+
+	// the arguments in a are moved into the frame, the ones before shared
+	*frame = lenv_new();
+	for (int i = 0; i < fixed; i++) {
+		lval* val = i < given ? lval_copy(f->args->cell[i]) : a->cell[i - given];
+		lenv_bind(*frame, formals->cell[i]->sym, val);
+	}
+	if (fixed < formals->count) {
+		lval* rest = lval_qexpr();
+		for (int i = fixed; i < n; i++)
+			lval_add_toback(rest, i < given ? lval_copy(f->args->cell[i]) : a->cell[i - given]);
+		lenv_bind(*frame, formals->cell[fixed + 1]->sym, rest);
+	}
+	a->count = 0;
+	lval_del(a);
+	return NULL;
 }
 
-static lval* _ast_to_double(mpc_ast_t* ast)
+// the branch of if cond {then} {else} to evaluate, as a sexpr
+static lval* _if_branch(lenv* e, lval* a)
 {
-	errno = 0;
-	double x = strtod(ast->contents, NULL);
-	if (errno)
-	{
-		// log_err("strtod conversion failed for %s", ast->contents);
-		return lval_err(LERR_BAD_NUM);
-	}
-	return _lval_double(x);
+	LVAL_ASSERT(e, a, (a->count == 3), LERR_BAD_ARGS_COUNT);
+	LVAL_ASSERT(e, a,
+		LVAL_IS_NUM(a->cell[0]),
+		LERR_BAD_TYPE);
+	LVAL_ASSERT(e, a, (LVAL_TYPE(a->cell[1]) == LVAL_QEXPR), LERR_BAD_TYPE);
+	LVAL_ASSERT(e, a, (LVAL_TYPE(a->cell[2]) == LVAL_QEXPR), LERR_BAD_TYPE);
+
+	lval* x = lval_own(_lval_take(a, GET_LVAL_NUM_TYPE(a->cell[0]) ? 1 : 2));
+	x->type = LVAL_SEXPR;
+	return x;
 }
 
-static lval* _lval_double(double x)
+// the qexpr given to eval, as a sexpr
+static lval* _eval_body(lenv* e, lval* a)
 {
-	lval* v = (lval*)calloc(1, sizeof(lval));
-	if (NULL == v)
-		return NULL;
-	v->type = LVAL_DBL;
-	v->data.dbl = x;
-	return v;
+	LVAL_ASSERT(e, a, (a->count == 1), LERR_TOO_MANY_ARGS);
+	LVAL_ASSERT(e, a, (LVAL_TYPE(a->cell[0]) == LVAL_QEXPR), LERR_BAD_TYPE);
+
+	lval* x = lval_own(_lval_take(a, 0));
+	x->type = LVAL_SEXPR;
+	return x;
 }
 
-static lval* _lval_sexpr(void)
+// the cells are never shrunk, a slice only moves its ends
+static lval* _lval_pop(lval* v, int i)
 {
-	lval* v = (lval*)calloc(1, sizeof(lval));
-	if (NULL == v)
-		return NULL;
-	v->type = LVAL_SEXPR;
-	v->count = 0;
-	v->cell = NULL;
-	return v;
+	if (lval_is_slice(v)) {
+		if (0 == i || v->count - 1 == i) {
+			lval* x = lval_copy(v->cell[i]);
+			if (0 == i)
+				v->cell++;
+			v->count--;
+			return x;
+		}
+		if (gc_cells(v, v->count))
+			return NULL;
+	}
+
+	lval* x = v->cell[i];
+	memmove(&v->cell[i], &v->cell[i+1], sizeof(lval*)*(v->count-i-1));
+	v->count--;
+	return x;
 }
 
-static lval* _lval_qexpr(void)
+// v may be shared, the cell is then shared too
+static lval* _lval_take(lval* v, int i)
 {
-	lval* v = (lval*)calloc(1, sizeof(lval));
-	if (NULL == v)
-		return NULL;
-	v->type = LVAL_QEXPR;
-	v->count = 0;
-	v->cell = NULL;
-	return v;
+	lval* x = lval_copy(v->cell[i]);
+	lval_del(v);
+	return x;
 }
 
 static lval* _lval_fun(lbuiltin func)
 {
-	lval* v = (lval*)calloc(1, sizeof(lval));
+	lval* v = gc_lval(LVAL_FUN);
 	if (NULL == v)
 		return NULL;
-	v->type = LVAL_FUN;
 	v->builtin = func;
 	return v;
 }
 
+// the cells of a y nothing else holds are moved, not copied
 static lval* _lval_join(lval* x, lval* y)
 {
-	while (y->count)
-		x = _lval_add_toback(x, _lval_pop(y, 0));
+	x = _lval_room(x, y->count);
+	if (NULL == x)
+		return NULL;
+	int move = 0 == y->refs && !image_contains(y) && !lval_is_slice(y);
+	for (int i = 0; i < y->count; i++)
+		x->cell[x->count++] = move ? y->cell[i] : lval_copy(y->cell[i]);
+	if (move)
+		y->count = 0;
 
 	lval_del(y);
-	return x; // x is reallocated so it's fine
+	return x;
+}
+
+// A list in place of x with room for n cells after its own, takes x. One only
+// x holds is grown. When x is shared and ends where the cells of its list end,
+// with room after them, the room is taken and a slice over x's cells and it
+// is returned, like appending to a slice in Go, else x is copied with room to
+// grow. So appending to a list bound to a name is amortized O(1) as well.
+static lval* _lval_room(lval* x, int n)
+{
+	int shared = x->refs || image_contains(x);
+	if (!shared && !lval_is_slice(x)) {
+		x = lval_own(x);
+		return gc_cells(x, x->count + n) ? NULL : x;
+	}
+
+	lval* s = shared ? gc_lval(x->type) : x;
+	if (NULL == s)
+		return NULL;
+	lval* b = lval_is_slice(x) ? x->base : x;
+	if (b->cell && b->cell != b->cells_inline && NULL == b->base && !image_contains(b)
+		&& x->cell + x->count == b->cell + lval_held(b) && lval_held(b) + n <= b->cap) {
+		b->fill = lval_held(b) + n;
+		if (s != x) {
+			s->cell = x->cell;
+			s->count = x->count;
+			s->base = lval_copy(b);
+			lval_del(x);
+		}
+		return s;
+	}
+	if (s == x)
+		return gc_cells(x, x->count + n) ? NULL : x;
+
+	if (gc_cells(s, 2 * (x->count + n)))
+		return NULL;
+	for (int i = 0; i < x->count; i++)
+		s->cell[i] = lval_copy(x->cell[i]);
+	s->count = x->count;
+	lval_del(x);
+	return s;
 }
 
-static int _add_builtin_to_env(lenv* e, char name[], lbuiltin func)
+static int _add_builtin_to_env(lenv* e, const char name[], lbuiltin func)
 {
-	lval* k = _lval_sym(name);
+	lval* k = lval_sym(name);
 	lval* v = _lval_fun(func);
 	lenv_put(e, k, v);
 	lval_del(k);
@@ -578,78 +955,223 @@ static int _add_builtin_to_env(lenv* e, char name[], lbuiltin func)
 	return 0;
 }
 
-
-static lval* _lval_call(lenv* e, lval* f, lval* a)
+// symbols naming a formal get the slot it is bound to when the lambda is called,
+// the rest the global slot they have now, if any
+static void _resolve(lval* x, lval* formals, lenv* global)
 {
-	if (f->builtin)
-		return f->builtin(e, a);
-
-	if (e->debug)
-		debug("given: %d, total: %d", a->count, f->formals->count) ;
-
-	while (a->count) {
-		if (f->formals->count == 0) {
-			lval_del(a);
-			return lval_err(LERR_TOO_MANY_ARGS);
+	if (LVAL_SEXPR == LVAL_TYPE(x) || LVAL_QEXPR == LVAL_TYPE(x)) {
+		for (int i = 0; i < x->count; i++)
+			_resolve(x->cell[i], formals, global);
+		return;
+	}
+	// an image is read only, its symbols keep the hints they were saved with
+	if (LVAL_SYM != LVAL_TYPE(x) || image_contains(x))
+		return;
+
+	for (int i = 0, slot = 0; i < formals->count; i++) {
+		if (SYM_AMP == formals->cell[i]->sym)
+			continue;
+		if (formals->cell[i]->sym == x->sym) {
+			x->slot = LVAL_SLOT_LOCAL(slot);
+			return;
 		}
+		slot++;
+	}
 
-		lval* sym = _lval_pop(f->formals, 0);
-		if (e->debug)
-			debug("processing symbol: %s", sym->sym);
+	int i = lenv_slot(global, x->sym);
+	x->slot = i < 0 ? 0 : LVAL_SLOT_GLOBAL(i);
+}
 
-		// special case to deal with '&'
-		if (strcmp(sym->sym, "&") == 0) {
-			if (f->formals->count != 1) {
-				lval_del(a);
-				return lval_err(LERR_BAD_SYMBOL);
-				// return lval_err("Function format invalid. Symbol '&' not followed by single symbol.");
+// The folds apply op to acc and each of xs in turn, and give -1 or the error.
+// One loop per operator, _fold_lng() stops at the first cell that is a
+// bigint or that the result would overflow with, leaving acc as it was
+// before it and done at the number of cells folded.
+static int _fold_lng(int op, lval** xs, int n, int64_t* acc, int* done)
+{
+	int64_t x = *acc;
+	int64_t y;
+	int64_t r;
+	int i = 0;
+
+	switch (op) {
+	case ARITH_ADD:
+		for (; i < n; i++) {
+			if (LVAL_LNG != LVAL_TYPE(xs[i]) || __builtin_add_overflow(x, lval_get_long(xs[i]), &r))
+				break;
+			x = r;
+		}
+		break;
+	case ARITH_SUB:
+		for (; i < n; i++) {
+			if (LVAL_LNG != LVAL_TYPE(xs[i]) || __builtin_sub_overflow(x, lval_get_long(xs[i]), &r))
+				break;
+			x = r;
+		}
+		break;
+	case ARITH_MUL:
+		for (; i < n; i++) {
+			if (LVAL_LNG != LVAL_TYPE(xs[i]) || __builtin_mul_overflow(x, lval_get_long(xs[i]), &r))
+				break;
+			x = r;
+		}
+		break;
+	case ARITH_DIV:
+	case ARITH_MOD:
+		for (; i < n && LVAL_LNG == LVAL_TYPE(xs[i]); i++) {
+			y = lval_get_long(xs[i]);
+			if (0 == y) {
+				debug("Division by zero! (%" PRId64 "/%" PRId64 ")", x, y);
+				*done = i;
+				*acc = x;
+				return LERR_DIV_ZERO;
 			}
-			lval* nsym = _lval_pop(f->formals, 0);
-			if (e->debug)
-				debug("processing symbol after &: %s", nsym->sym);
-
-			lenv_put(f->env, nsym, builtin_quote(e, a));
-			lval_del(sym);
-			lval_del(nsym);
-			break;
+			// INT64_MIN / -1 traps, the quotient is a bigint
+			if (-1 == y && ARITH_DIV == op && INT64_MIN == x)
+				break;
+			x = -1 == y ? (ARITH_DIV == op ? -x : 0) : ARITH_DIV == op ? x / y : x % y;
 		}
-
-		lval* val = _lval_pop(a, 0);
-		lenv_put(f->env, sym, val);
-		lval_del(sym);
-		lval_del(val);
+		break;
+	case ARITH_POW:
+		for (; i < n; i++) {
+			if (LVAL_LNG != LVAL_TYPE(xs[i]) || _ipow(x, lval_get_long(xs[i]), &r))
+				break;
+			x = r;
+		}
+		break;
+	case ARITH_MIN:
+		for (; i < n && LVAL_LNG == LVAL_TYPE(xs[i]); i++)
+			x = MIN(x, lval_get_long(xs[i]));
+		break;
+	case ARITH_MAX:
+		for (; i < n && LVAL_LNG == LVAL_TYPE(xs[i]); i++)
+			x = MAX(x, lval_get_long(xs[i]));
+		break;
 	}
 
-	lval_del(a);
+	*done = i;
+	*acc = x;
+	return -1;
+}
 
-	// if '&' remains in formal list it should be bound to empty list
-	if (f->formals->count > 0 && strcmp(f->formals->cell[0]->sym, "&") == 0) {
-		if (f->formals->count != 2) {
-			return lval_err(LERR_BAD_SYMBOL);
-			// return lval_err("Function format invalid. Symbol '&' not followed by single symbol.");
+// acc is a long or a bigint, and one or the other again after each cell
+static int _fold_big(int op, lval** xs, int n, lval** acc)
+{
+	for (int i = 0; i < n; i++) {
+		lval* x = big_op(op, *acc, xs[i]);
+		if (LVAL_ERR == LVAL_TYPE(x)) {
+			int err = x->err;
+			lval_del(x);
+			return err;
 		}
-
-		if (e->debug)
-			debug("'&' still in formal list%s", "");
-
-		lval_del(_lval_pop(f->formals, 0));
-		lval* sym = _lval_pop(f->formals, 0);
-		lval* val = _lval_qexpr();
-
-		lenv_put(f->env, sym, val);
-		lval_del(sym);
-		lval_del(val);
+		lval_del(*acc);
+		*acc = x;
 	}
+	return -1;
+}
 
-	if (f->formals->count == 0) {
-		f->env->par = e;
-		// TODO do we need to fix f->body's type? i.e. "(\{x & xy} {+ x xy}) 1 2" fails
-		return builtin_eval(f->env, _lval_add_toback(_lval_sexpr(), lval_copy(f->body)));
+// xs may hold longs too, they are converted one by one
+static int _fold_dbl(int op, lval** xs, int n, double* acc)
+{
+	double x = *acc;
+	double y;
+
+	switch (op) {
+	case ARITH_ADD:
+		for (int i = 0; i < n; i++)
+			x += GET_LVAL_NUM_TYPE(xs[i]);
+		break;
+	case ARITH_SUB:
+		for (int i = 0; i < n; i++)
+			x -= GET_LVAL_NUM_TYPE(xs[i]);
+		break;
+	case ARITH_MUL:
+		for (int i = 0; i < n; i++)
+			x *= GET_LVAL_NUM_TYPE(xs[i]);
+		break;
+	case ARITH_DIV:
+	case ARITH_MOD:
+		for (int i = 0; i < n; i++) {
+			y = GET_LVAL_NUM_TYPE(xs[i]);
+			if (DBL_EPSILON > fabs(y)) {
+				debug("Division by zero! (%f/%f)", x, y);
+				return LERR_DIV_ZERO;
+			}
+			x = ARITH_DIV == op ? x / y : fmod(x, y);
+		}
+		break;
+	case ARITH_POW:
+		for (int i = 0; i < n; i++)
+			x = pow(x, GET_LVAL_NUM_TYPE(xs[i]));
+		break;
+	case ARITH_MIN:
+		for (int i = 0; i < n; i++)
+			x = MIN(x, GET_LVAL_NUM_TYPE(xs[i]));
+		break;
+	case ARITH_MAX:
+		for (int i = 0; i < n; i++)
+			x = MAX(x, GET_LVAL_NUM_TYPE(xs[i]));
+		break;
 	}
 
-	// return partially evalulated function otherwise
-	return lval_copy(f);
+	*acc = x;
+	return -1;
 }
 
+// *r = b^n by squaring, 1 if that overflows, a negative n gives what
+// truncating b^n gives
+static int _ipow(int64_t b, int64_t n, int64_t* r)
+{
+	if (n < 0) {
+		*r = 1 == b ? 1 : -1 == b ? (n % 2 ? -1 : 1) : 0;
+		return 0;
+	}
 
+	int64_t p = 1;
+	for (;;) {
+		if ((n & 1) && __builtin_mul_overflow(p, b, &p))
+			return 1;
+		n >>= 1;
+		if (0 == n)
+			break;
+		if (__builtin_mul_overflow(b, b, &b))
+			return 1;
+	}
+	*r = p;
+	return 0;
+}
 
+// numbers compare by value, everything else structurally
+static int _lval_eq(lval* x, lval* y)
+{
+	if (LVAL_IS_NUM(x) && LVAL_IS_NUM(y)) {
+		if (LVAL_LNG == LVAL_TYPE(x) && LVAL_LNG == LVAL_TYPE(y))
+			return lval_get_long(x) == lval_get_long(y);
+		if (LVAL_DBL != LVAL_TYPE(x) && LVAL_DBL != LVAL_TYPE(y))
+			return 0 == big_cmp(x, y);
+		return GET_LVAL_NUM_TYPE(x) == GET_LVAL_NUM_TYPE(y);
+	}
+	if (LVAL_TYPE(x) != LVAL_TYPE(y))
+		return 0;
+
+	switch (LVAL_TYPE(x)) {
+	case LVAL_SYM: return x->sym == y->sym;
+	case LVAL_STR: return 0 == strcmp(x->str, y->str);
+	case LVAL_ERR: return x->err == y->err;
+	case LVAL_FUN:
+		if (x->builtin || y->builtin)
+			return x->builtin == y->builtin;
+		if (!x->args != !y->args || (x->args && !_lval_eq(x->args, y->args)))
+			return 0;
+		return _lval_eq(x->formals, y->formals) && _lval_eq(x->body, y->body);
+	case LVAL_SEXPR:
+	case LVAL_QEXPR:
+		if (x->count != y->count)
+			return 0;
+		for (int i = 0; i < x->count; i++) {
+			if (!_lval_eq(x->cell[i], y->cell[i]))
+				return 0;
+		}
+		return 1;
+	}
+	return 0;
+}
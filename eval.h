@@ -2,24 +2,22 @@
 #ifndef EVAL_H_
 #define EVAL_H_
 
-#include "mpc/mpc.h"
 #include "common.h"
+#include "big.h"
 
-// assume lval.type cannot be error, only double or long
+// assume lval.type cannot be error, only double, long or bigint
 #define GET_LVAL_NUM_TYPE(LVAL) \
-	(LVAL_DBL == LVAL->type? LVAL->data.dbl : LVAL->data.lng)
+	(LVAL_DBL == LVAL_TYPE(LVAL) ? lval_get_double(LVAL) \
+		: LVAL_BIG == LVAL_TYPE(LVAL) ? big_to_double(LVAL) : lval_get_long(LVAL))
 
-#define TO_LVAL_DBL(LVAL) \
-	if (LVAL_LNG == LVAL->type) { \
-		LVAL->data.dbl = (double)LVAL->data.lng; \
-		LVAL->type = LVAL_DBL; \
-	}
+#define LVAL_IS_NUM(LVAL) \
+	(LVAL_LNG == LVAL_TYPE(LVAL) || LVAL_DBL == LVAL_TYPE(LVAL) || LVAL_BIG == LVAL_TYPE(LVAL))
 
 // TODO add type checking, improve assert
 #define LVAL_ASSERT(e, args, cond, err) \
 	if (!(cond)) { \
-		if (e->debug) \
-			debug("LVAL_ASSERT failed - %s", #cond); \
+		(void)(e); \
+		debug("LVAL_ASSERT failed - %s", #cond); \
 		lval_del(args); \
 		return lval_err(err); \
 	}
@@ -31,10 +29,40 @@
 		return lval_err(err); \
 	}
 
-lval* ast_to_lval(mpc_ast_t* ast);
+// the operators of the numeric builtins, picked once per call
+enum ARITH_OP { ARITH_ADD, ARITH_SUB, ARITH_MUL, ARITH_DIV, ARITH_MOD, ARITH_POW, ARITH_MIN, ARITH_MAX };
+enum ORD_OP { ORD_GT, ORD_LT, ORD_GE, ORD_LE };
+enum CMP_OP { CMP_EQ, CMP_NE };
+
+#define ORD_APPLY(op, x, y) \
+	(ORD_GT == (op) ? (x) > (y) : ORD_LT == (op) ? (x) < (y) : \
+	 ORD_GE == (op) ? (x) >= (y) : (x) <= (y))
+
+enum EVAL_ENGINE { ENGINE_TREE, ENGINE_VM };
+extern int eval_engine; // which one eval() runs a sexpr on, see vm.h
+
+// Nested evaluations, and nested calls on the vm, past eval_max_depth give
+// LERR_DEPTH. Calls in tail position do not nest. The tree walker recurses on
+// the C stack, and carries on on the next segment of EVAL_STACK_SEGMENT
+// bytes when it nears the end of one, each segment has a thread started once
+// and kept. The vm keeps calls on the heap.
+#define EVAL_MAX_DEPTH 100000
+#define EVAL_STACK_SEGMENT ((size_t)64 << 20)
+extern int eval_max_depth;
+extern int eval_depth;
+
 lval* eval(lenv* e, lval* v);
+lval* eval_apply(lenv* e, lval* v); // v a sexpr of a function and the values of its arguments
+lval* eval_str(lenv* e, const char* input); // NULL if input does not parse
 int init_env(lenv* e);
-lval* builtin_op(lenv* e, lval* v, char* op);
+lval* lval_call(lenv* e, lval* f, lval* a); // a is the sexpr of arguments
+lval* lval_lambda(lval* formals, lval* body); // takes both, no checks
+
+// the builtin registry, indices are stable for a given build
+int builtin_index(lbuiltin func); // -1 if func is not a builtin
+lbuiltin builtin_at(int i);
+const char* builtin_name_at(int i);
+lval* builtin_op(lenv* e, lval* v, int op); // op is an ARITH_OP
 lval* builtin(lval* a, char* x);
 
 lval* builtin_head(lenv* e, lval* a);
@@ -57,11 +85,15 @@ lval* builtin_lambda(lenv* e, lval* a);
 lval* builtin_var(lenv* e, lval* a, char* func);
 lval* builtin_def(lenv* e, lval* a);
 lval* builtin_put(lenv* e, lval* a);
-lval* builtin_ord(lenv* e, lval *a, char* op);
+lval* builtin_ord(lenv* e, lval *a, int op); // op is an ORD_OP
 lval* builtin_gt(lenv* e, lval* a);
 lval* builtin_lt(lenv* e, lval* a);
 lval* builtin_ge(lenv* e, lval* a);
 lval* builtin_le(lenv* e, lval* a);
+lval* builtin_cmp(lenv* e, lval* a, int op); // op is a CMP_OP
+lval* builtin_eq(lenv* e, lval* a);
+lval* builtin_ne(lenv* e, lval* a);
+lval* builtin_if(lenv* e, lval* a);
 
 #endif
 
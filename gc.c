@@ -0,0 +1,670 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <time.h>
+
+#include "gc.h"
+#include "eval.h"
+#include "cache.h"
+#include "image.h"
+#include "opt.h"
+#include "vm.h"
+#include "slab.h"
+#include "symtab.h"
+
+// position 0 of the tables is never used, the gc field of an object that is
+// not on the heap (an image one) is 0. A free position holds the next free
+// one, shifted and tagged with 1, so freeing touches nothing but the table.
+struct table
+{
+	void** objs;
+	uint32_t count; // positions ever used
+	uint32_t cap;
+	uint32_t live;
+	uint32_t free; // 0 for none
+};
+
+static struct table lvals = { NULL, 1, 0, 0, 0 };
+static struct table lenvs = { NULL, 1, 0, 0, 0 };
+
+// values with no holders left, freed a budget at a time
+static lval** dead = NULL;
+static size_t ndead = 0;
+static size_t dead_cap = 0;
+static int draining = 0;
+
+static lenv** roots = NULL;
+static size_t nroots = 0;
+static size_t roots_cap = 0;
+static lval** handles = NULL;
+static size_t nhandles = 0;
+static size_t handles_cap = 0;
+
+static struct gc_stats stats = { 0, 0, { 0 }, 0, 0, 0, 0, 0, 0, 0, 0, GC_DEFAULT_BUDGET, GC_DEFAULT_THRESHOLD };
+static size_t allocs = 0; // since the last trace
+static unsigned epoch = 0; // of lcode_trace()
+
+// state of a trace
+static uint8_t* lmarks = NULL;
+static uint8_t* emarks = NULL;
+static uint32_t* inrefs = NULL; // holders among the unreached objects
+static lval** lstack = NULL;
+static size_t nlstack = 0;
+static size_t lstack_cap = 0;
+static lenv** estack = NULL;
+static size_t nestack = 0;
+static size_t estack_cap = 0;
+
+static uint32_t _register(struct table* t, void* p);
+static void _unregister(struct table* t, uint32_t i);
+static void* _at(struct table* t, uint32_t i);
+static void _compact(struct table* t);
+static int _push(void*** a, size_t* n, size_t* cap, void* p);
+static int _unslice(lval* v, size_t n);
+static int _move(lval* v, size_t front, size_t cap);
+static void _trim(lval* v);
+static int _on_heap(lval* v);
+static void _drain(size_t budget);
+static int _free_lval(lval* v, size_t* budget);
+static size_t _lval_bytes(lval* v);
+static size_t _lenv_bytes(lenv* e);
+static double _now(void);
+static void _record_pause(double t);
+static void _children(lval* v, void (*visit)(lval*));
+static void _mark(lval* v);
+static void _mark_env(lenv* e);
+static void _count(lval* v);
+
+lval* gc_lval(int type)
+{
+	if (ndead && !draining)
+		_drain(GC_ALLOC_WORK);
+
+	lval* v = (lval*)slab_alloc(lval_sizeof(type));
+	if (NULL == v)
+		return NULL;
+	v->type = type;
+	v->gc = _register(&lvals, v);
+	if (0 == v->gc) {
+		slab_free(v, lval_sizeof(type));
+		return NULL;
+	}
+	allocs++;
+	return v;
+}
+
+// the count cells of v are kept, a list starts out with its inline ones and
+// grows its own array geometrically, a slice gets its cells copied first and
+// the cells slices were grown into are dropped
+int gc_cells(lval* v, size_t n)
+{
+	if (ndead && !draining && n > (size_t)v->count)
+		_drain(n - v->count);
+
+	if (lval_is_slice(v))
+		return _unslice(v, n);
+	if (lval_held(v) > v->count || lval_lead(v))
+		_trim(v);
+	if (NULL == v->cell || v->cell == v->cells_inline) {
+		if (n <= LVAL_INLINE_CELLS) {
+			v->cell = v->cells_inline;
+			return 0;
+		}
+		return _move(v, 0, MAX(n, 2 * LVAL_INLINE_CELLS));
+	}
+
+	if (n <= (size_t)v->cap)
+		return 0;
+	size_t cap = MAX(n, 2 * (size_t)v->cap);
+	lval** cell = (lval**)slab_array(v->cell - v->front, sizeof(lval*) * (v->front + cap));
+	if (NULL == cell)
+		return 1;
+	v->cell = cell + v->front;
+	v->cap = cap;
+	return 0;
+}
+
+// the count cells of v are kept, with room for n more before them
+int gc_front(lval* v, size_t n)
+{
+	if (gc_cells(v, v->count))
+		return 1;
+	if (v->cell && v->cell != v->cells_inline && (size_t)v->front >= n)
+		return 0;
+	size_t cap = v->cell && v->cell != v->cells_inline ? (size_t)v->cap : (size_t)v->count;
+	return _move(v, MAX(n, (size_t)v->count), MAX(cap, 1));
+}
+
+lenv* gc_lenv(void)
+{
+	if (ndead && !draining)
+		_drain(GC_ALLOC_WORK);
+
+	lenv* e = (lenv*)slab_alloc(sizeof(lenv));
+	if (NULL == e)
+		return NULL;
+	e->gc = _register(&lenvs, e);
+	if (0 == e->gc) {
+		slab_free(e, sizeof(lenv));
+		return NULL;
+	}
+	allocs++;
+	return e;
+}
+
+// a lone value is freed right away, a pause only starts when it held more
+void gc_dead(lval* v)
+{
+	if (draining || ndead) {
+		_push((void***)&dead, &ndead, &dead_cap, v);
+		if (!draining)
+			_drain(stats.budget);
+		return;
+	}
+
+	size_t budget = stats.budget;
+	draining = 1;
+	if (!_free_lval(v, &budget))
+		_push((void***)&dead, &ndead, &dead_cap, v);
+	draining = 0;
+	if (ndead)
+		_drain(budget);
+}
+
+void gc_free_lenv(lenv* e)
+{
+	if (e->gc)
+		_unregister(&lenvs, e->gc);
+	slab_free(e, sizeof(lenv));
+}
+
+void gc_root(lenv* e)
+{
+	_push((void***)&roots, &nroots, &roots_cap, e);
+}
+
+void gc_unroot(lenv* e)
+{
+	for (size_t i = 0; i < nroots; i++) {
+		if (roots[i] == e) {
+			roots[i] = roots[--nroots];
+			return;
+		}
+	}
+}
+
+void gc_protect(lval* v)
+{
+	_push((void***)&handles, &nhandles, &handles_cap, v);
+}
+
+void gc_unprotect(lval* v)
+{
+	for (size_t i = 0; i < nhandles; i++) {
+		if (handles[i] == v) {
+			handles[i] = handles[--nhandles];
+			return;
+		}
+	}
+}
+
+// Marks from the roots, then counts for every unreached value how many
+// unreached objects hold it. That is what its count should be, whatever
+// leaked it held on to the rest. The ones nothing holds are queued, freeing
+// them releases the others in turn, and the values they share with reached
+// ones are released like on any other free. Values cannot form cycles, they
+// are only changed while nothing else holds them, see lval_own().
+int gc_collect(void)
+{
+	if (eval_depth)
+		return -1;
+
+	// queued values are not held by anything either, they go first
+	double t = _now();
+	_drain((size_t)-1);
+
+	lmarks = (uint8_t*)calloc(lvals.count, 1);
+	emarks = (uint8_t*)calloc(lenvs.count, 1);
+	inrefs = (uint32_t*)calloc(lvals.count, sizeof(uint32_t));
+	if (NULL == lmarks || NULL == emarks || NULL == inrefs) {
+		free(lmarks);
+		free(emarks);
+		free(inrefs);
+		return -1;
+	}
+
+	epoch++;
+	for (size_t i = 0; i < nroots; i++)
+		_mark_env(roots[i]);
+	for (size_t i = 0; i < nhandles; i++)
+		_mark(handles[i]);
+	pcache_trace(_mark);
+	vm_trace(epoch, _mark, _mark_env);
+	opt_trace(epoch, _mark);
+	while (nlstack || nestack) {
+		if (nlstack)
+			_children(lstack[--nlstack], _mark);
+		else {
+			lenv* e = estack[--nestack];
+			for (int i = 0; i < e->count; i++)
+				_mark(e->vals[i]);
+		}
+	}
+
+	epoch++;
+	for (uint32_t i = 1; i < lvals.count; i++) {
+		lval* v = (lval*)_at(&lvals, i);
+		if (v && !lmarks[i])
+			_children(v, _count);
+	}
+	for (uint32_t i = 1; i < lenvs.count; i++) {
+		lenv* e = (lenv*)_at(&lenvs, i);
+		if (e && !emarks[i]) {
+			for (int j = 0; j < e->count; j++)
+				_count(e->vals[j]);
+		}
+	}
+
+	// nothing is freed before every count is set
+	lenv** free_lenvs = NULL;
+	size_t nfree_lenvs = 0, free_lenvs_cap = 0;
+	int found = 0;
+	for (uint32_t i = 1; i < lvals.count; i++) {
+		lval* v = (lval*)_at(&lvals, i);
+		if (NULL == v || lmarks[i])
+			continue;
+		found++;
+		stats.collected++;
+		stats.collected_bytes += _lval_bytes(v);
+		if (inrefs[i])
+			v->refs = inrefs[i] - 1;
+		else {
+			v->refs = 0;
+			_push((void***)&dead, &ndead, &dead_cap, v);
+		}
+	}
+	for (uint32_t i = 1; i < lenvs.count; i++) {
+		lenv* e = (lenv*)_at(&lenvs, i);
+		if (NULL == e || emarks[i])
+			continue;
+		found++;
+		stats.collected++;
+		stats.collected_bytes += _lenv_bytes(e);
+		_push((void***)&free_lenvs, &nfree_lenvs, &free_lenvs_cap, e);
+	}
+	free(lmarks);
+	free(emarks);
+	free(inrefs);
+	lmarks = emarks = NULL;
+	inrefs = NULL;
+
+	draining = 1;
+	for (size_t i = 0; i < nfree_lenvs; i++)
+		lenv_del(free_lenvs[i]);
+	draining = 0;
+	free(free_lenvs);
+
+	_drain(stats.budget);
+	_compact(&lvals);
+	_compact(&lenvs);
+	stats.collections++;
+	allocs = 0;
+	_record_pause(_now() - t);
+	return found;
+}
+
+void gc_safepoint(void)
+{
+	if (stats.threshold && allocs >= stats.threshold)
+		gc_collect();
+}
+
+void gc_set_budget(size_t budget)
+{
+	stats.budget = budget ? budget : 1;
+}
+
+void gc_set_threshold(size_t threshold)
+{
+	stats.threshold = threshold;
+}
+
+void gc_get_stats(struct gc_stats* st)
+{
+	stats.objects = lvals.live + lenvs.live;
+	stats.bytes = 0;
+	for (uint32_t i = 1; i < lvals.count; i++) {
+		if (_at(&lvals, i))
+			stats.bytes += _lval_bytes((lval*)lvals.objs[i]);
+	}
+	for (uint32_t i = 1; i < lenvs.count; i++) {
+		if (_at(&lenvs, i))
+			stats.bytes += _lenv_bytes((lenv*)lenvs.objs[i]);
+	}
+	stats.queued = ndead;
+	*st = stats;
+}
+
+void gc_print_stats(FILE* fp)
+{
+	static const char* const buckets[GC_HIST_BUCKETS] =
+		{ "<1us", "<10us", "<100us", "<1ms", "<10ms", "<100ms", ">=100ms" };
+	struct gc_stats st;
+	gc_get_stats(&st);
+
+	fprintf(fp, "heap: %zu objects, %zu bytes, %zu queued\n", st.objects, st.bytes, st.queued);
+	fprintf(fp, "freed: %lu objects, %zu bytes\n", st.freed, st.freed_bytes);
+	fprintf(fp, "collections: %lu, leaked: %lu objects, %zu bytes\n",
+		st.collections, st.collected, st.collected_bytes);
+	fprintf(fp, "budget: %zu, threshold: %zu\n", st.budget, st.threshold);
+	fprintf(fp, "pauses: %lu, max: %.3fms\n", st.pauses, st.max_pause * 1e3);
+	for (int i = 0; i < GC_HIST_BUCKETS; i++)
+		fprintf(fp, "  %-8s %lu\n", buckets[i], st.hist[i]);
+}
+
+// private functions: //////////////////////////////////////////////////////////
+
+static uint32_t _register(struct table* t, void* p)
+{
+	uint32_t i = t->free;
+	if (i)
+		t->free = (uint32_t)((uintptr_t)t->objs[i] >> 1);
+	else {
+		if (t->count >= t->cap) {
+			uint32_t cap = t->cap ? 2 * t->cap : 1024;
+			void** objs = (void**)realloc(t->objs, sizeof(void*) * cap);
+			if (NULL == objs)
+				return 0;
+			t->objs = objs;
+			t->cap = cap;
+		}
+		i = t->count++;
+	}
+	t->objs[i] = p;
+	t->live++;
+	return i;
+}
+
+static void _unregister(struct table* t, uint32_t i)
+{
+	t->objs[i] = (void*)((uintptr_t)t->free << 1 | 1);
+	t->free = i;
+	t->live--;
+}
+
+// NULL for a free position
+static void* _at(struct table* t, uint32_t i)
+{
+	void* p = t->objs[i];
+	return ((uintptr_t)p & 1) ? NULL : p;
+}
+
+// so the next trace is as long as the heap is now, not as it once was
+static void _compact(struct table* t)
+{
+	uint32_t n = 1;
+	for (uint32_t i = 1; i < t->count; i++) {
+		void* p = _at(t, i);
+		if (NULL == p)
+			continue;
+		t->objs[n] = p;
+		if (&lvals == t)
+			((lval*)p)->gc = n;
+		else
+			((lenv*)p)->gc = n;
+		n++;
+	}
+	t->count = n;
+	t->free = 0;
+
+	uint32_t cap = t->cap;
+	while (cap > 1024 && n < cap / 4)
+		cap /= 2;
+	if (cap < t->cap) {
+		void** objs = (void**)realloc(t->objs, sizeof(void*) * cap);
+		if (objs) {
+			t->objs = objs;
+			t->cap = cap;
+		}
+	}
+}
+
+static int _push(void*** a, size_t* n, size_t* cap, void* p)
+{
+	if (*n == *cap) {
+		size_t c = *cap ? 2 * *cap : 256;
+		void** x = (void**)realloc(*a, sizeof(void*) * c);
+		if (NULL == x)
+			return 1;
+		*a = x;
+		*cap = c;
+	}
+	(*a)[(*n)++] = p;
+	return 0;
+}
+
+// the cells are copied out of the base, so writing them leaves it alone
+static int _unslice(lval* v, size_t n)
+{
+	lval* base = v->base;
+	lval** from = v->cell;
+	n = MAX(n, (size_t)v->count);
+
+	lval** cell = v->cells_inline;
+	if (n > LVAL_INLINE_CELLS) {
+		cell = (lval**)slab_array(NULL, sizeof(lval*) * n);
+		if (NULL == cell)
+			return 1;
+	}
+	for (int i = 0; i < v->count; i++)
+		cell[i] = lval_copy(from[i]);
+	v->cell = cell;
+	if (cell != v->cells_inline) {
+		v->base = NULL;
+		v->cap = n;
+		v->fill = 0;
+		v->front = 0;
+		v->lead = 0;
+	}
+	lval_del(base);
+	return 0;
+}
+
+// into a new array of front and cap cells, v is not a slice
+static int _move(lval* v, size_t front, size_t cap)
+{
+	lval** cell = (lval**)slab_array(NULL, sizeof(lval*) * (front + cap));
+	if (NULL == cell)
+		return 1;
+	if (v->count)
+		memcpy(cell + front, v->cell, sizeof(lval*) * v->count);
+	if (v->cell && v->cell != v->cells_inline)
+		slab_array_free(v->cell - v->front);
+	v->cell = cell + front;
+	v->base = NULL;
+	v->cap = cap;
+	v->fill = 0;
+	v->front = front;
+	v->lead = 0;
+	return 0;
+}
+
+// the cells held for slices are let go, nothing holds v but its owner
+static void _trim(lval* v)
+{
+	for (int held = lval_held(v); held > v->count; held--)
+		lval_del(v->cell[held - 1]);
+	for (int i = 1; i <= v->lead; i++)
+		lval_del(v->cell[-i]);
+	v->fill = 0;
+	v->lead = 0;
+}
+
+static int _on_heap(lval* v)
+{
+	return !LVAL_IS_IMM(v) && !image_contains(v);
+}
+
+// freeing a value releases what it holds, which may queue more
+static void _drain(size_t budget)
+{
+	if (0 == ndead)
+		return;
+
+	// the many short ones, like an argument list going, are not timed
+	double t = ndead >= GC_TIMED_WORK ? _now() : 0;
+	draining = 1;
+	while (ndead && budget) {
+		// what v releases goes on top, it is done once its cells are
+		size_t i = ndead - 1;
+		if (_free_lval(dead[i], &budget))
+			dead[i] = dead[--ndead];
+	}
+	draining = 0;
+	if (t)
+		_record_pause(_now() - t);
+}
+
+// releases at most budget cells of a list, 0 if some are left
+static int _free_lval(lval* v, size_t* budget)
+{
+	switch (v->type) {
+	case LVAL_FUN:
+		if (v->args)
+			lval_del(v->args);
+		if (v->body)
+			lval_del(v->body);
+		if (v->formals)
+			lval_del(v->formals);
+		if (v->code)
+			lcode_release(v->code);
+		if (v->opt)
+			lopt_release(v->opt);
+		break;
+	case LVAL_STR:
+		stats.freed_bytes += strlen(v->str) + 1;
+		free(v->str);
+		break;
+	case LVAL_BIG:
+		stats.freed_bytes += sizeof(uint32_t) * v->nlimbs;
+		free(v->limbs);
+		break;
+	case LVAL_QEXPR:
+	case LVAL_SEXPR:
+		if (lval_is_slice(v)) {
+			lval_del(v->base);
+			break;
+		}
+		// the cells held for slices go as well
+		if (v->count < lval_held(v) || lval_lead(v)) {
+			v->count = lval_held(v) + v->lead;
+			v->cell -= v->lead;
+			v->front -= v->lead;
+			v->fill = 0;
+			v->lead = 0;
+		}
+		for (; v->count && *budget; (*budget)--) {
+			lval_del(v->cell[--v->count]);
+			stats.freed_bytes += sizeof(lval*);
+		}
+		if (v->count)
+			return 0;
+		if (v->cell && v->cell != v->cells_inline)
+			slab_array_free(v->cell - v->front);
+		break;
+	}
+
+	if (*budget)
+		(*budget)--;
+	stats.freed++;
+	stats.freed_bytes += lval_sizeof(v->type);
+	if (v->gc)
+		_unregister(&lvals, v->gc);
+	slab_free(v, lval_sizeof(v->type));
+	return 1;
+}
+
+static size_t _lval_bytes(lval* v)
+{
+	size_t n = lval_sizeof(v->type);
+	if ((LVAL_SEXPR == v->type || LVAL_QEXPR == v->type) && v->cell
+		&& v->cell != v->cells_inline && NULL == v->base)
+		n += sizeof(lval*) * (v->front + v->cap);
+	else if (LVAL_STR == v->type)
+		n += strlen(v->str) + 1;
+	else if (LVAL_BIG == v->type)
+		n += sizeof(uint32_t) * v->nlimbs;
+	return n;
+}
+
+static size_t _lenv_bytes(lenv* e)
+{
+	return sizeof(lenv) + (sizeof(char*) + sizeof(lval*)) * e->cap
+		+ sizeof(uint32_t) * e->index_cap;
+}
+
+static double _now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void _record_pause(double t)
+{
+	int i = 0;
+	for (double limit = 1e-6; i < GC_HIST_BUCKETS - 1 && t >= limit; limit *= 10)
+		i++;
+	stats.hist[i]++;
+	stats.pauses++;
+	stats.max_pause = MAX(stats.max_pause, t);
+}
+
+static void _children(lval* v, void (*visit)(lval*))
+{
+	switch (v->type) {
+	case LVAL_FUN:
+		if (v->args)
+			visit(v->args);
+		if (v->formals)
+			visit(v->formals);
+		if (v->body)
+			visit(v->body);
+		if (v->code)
+			lcode_trace(v->code, epoch, visit);
+		if (v->opt)
+			lopt_trace(v->opt, epoch, visit);
+		break;
+	case LVAL_QEXPR:
+	case LVAL_SEXPR:
+		if (lval_is_slice(v)) {
+			visit(v->base);
+			break;
+		}
+		for (int i = -lval_lead(v); i < lval_held(v); i++)
+			visit(v->cell[i]);
+		break;
+	}
+}
+
+static void _mark(lval* v)
+{
+	if (!_on_heap(v) || lmarks[v->gc])
+		return;
+	lmarks[v->gc] = 1;
+	_push((void***)&lstack, &nlstack, &lstack_cap, v);
+}
+
+static void _mark_env(lenv* e)
+{
+	if (0 == e->gc || emarks[e->gc])
+		return;
+	emarks[e->gc] = 1;
+	_push((void***)&estack, &nestack, &estack_cap, e);
+}
+
+static void _count(lval* v)
+{
+	if (_on_heap(v) && !lmarks[v->gc])
+		inrefs[v->gc]++;
+}
+
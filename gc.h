@@ -0,0 +1,69 @@
+#ifndef GC_H_
+#define GC_H_
+
+#include <stddef.h>
+
+#include "common.h"
+
+#define GC_DEFAULT_BUDGET 4096 // objects freed per pause
+#define GC_DEFAULT_THRESHOLD (1 << 20) // allocations between traces, 0 for never
+#define GC_ALLOC_WORK 4 // queued objects freed by every allocation
+#define GC_TIMED_WORK 64 // pauses starting with fewer queued are not timed
+#define GC_HIST_BUCKETS 7 // pauses under 1us, 10us, ... 100ms, and the rest
+
+// Every heap lval and lenv is allocated and freed here. Reference counts say
+// when a value is dead (see lval_copy()), the collector decides when it goes:
+//
+// A value whose count drops to zero is queued, a pause frees at most budget
+// queued objects or cells of a queued list, so dropping a long list is spread
+// out instead of freeing it all at once, and nothing recurses. Allocating
+// pays as well, GC_ALLOC_WORK for an object and one for every new cell, so
+// the queue cannot grow faster than it is worked off.
+//
+// gc_collect() is a precise trace from the roots: the envs passed to
+// gc_root(), the host handles passed to gc_protect(), the parse cache and the
+// vm's tables. It only runs with nothing on the eval stack (eval_depth is 0),
+// anything it does not reach was leaked, gets counts that match what is left
+// holding it and is queued like above. gc_safepoint() runs it every threshold
+// allocations, the repl calls it between inputs and load_stream() between
+// the forms of a file or piped stdin.
+
+struct gc_stats
+{
+	unsigned long collections;
+	unsigned long pauses;
+	unsigned long hist[GC_HIST_BUCKETS];
+	double max_pause; // seconds
+	unsigned long freed; // objects freed once their count dropped to zero
+	size_t freed_bytes;
+	unsigned long collected; // leaked objects found by gc_collect()
+	size_t collected_bytes;
+	size_t objects; // lvals and lenvs on the heap now
+	size_t bytes; // held by them
+	size_t queued;
+	size_t budget;
+	size_t threshold;
+};
+
+lval* gc_lval(int type); // zeroed, lval_sizeof(type) bytes
+lenv* gc_lenv(void); // zeroed
+int gc_cells(lval* v, size_t n); // 0 once v->cell has room for n cells
+int gc_front(lval* v, size_t n); // 0 once v has room for n cells before its own
+void gc_dead(lval* v); // v has no holders left, see lval_del()
+void gc_free_lenv(lenv* e); // its bindings are gone already
+
+void gc_root(lenv* e);
+void gc_unroot(lenv* e);
+void gc_protect(lval* v);
+void gc_unprotect(lval* v);
+
+int gc_collect(void); // objects found leaked, -1 when eval is running
+void gc_safepoint(void);
+
+void gc_set_budget(size_t budget);
+void gc_set_threshold(size_t threshold);
+void gc_get_stats(struct gc_stats* st); // objects and bytes are counted then
+void gc_print_stats(FILE* fp);
+
+#endif
+
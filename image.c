@@ -0,0 +1,408 @@
+#define _DEFAULT_SOURCE
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "image.h"
+#include "eval.h"
+#include "symtab.h"
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000 // linux >= 4.17, a plain hint before that
+#endif
+
+struct image_header
+{
+	char magic[8];
+	char version[16];
+	uint32_t layout;
+	uint32_t lval_size;
+	uint32_t lenv_size;
+	uint32_t nbuiltins;
+	uint64_t base;
+	uint64_t size; // of the object region, which starts at IMAGE_ALIGN
+	uint64_t root;
+	uint64_t nrelocs; // pointer fields, only needed when not at base
+	uint64_t nfixups; // builtin fields, (offset, index) pairs
+	uint64_t symtab_base;
+	uint64_t symtab_used; // bytes of the symbol table snapshot
+	uint64_t nsymrelocs; // symbol fields, only needed when the names moved
+};
+
+// the global bindings, the first object in the region
+struct image_root
+{
+	uint64_t count;
+	const char** syms;
+	lval** vals;
+};
+
+struct writer
+{
+	char* data;
+	size_t len;
+	size_t cap;
+	uint64_t* relocs;
+	size_t nrelocs;
+	size_t relocs_cap;
+	uint64_t* fixups;
+	size_t nfixups;
+	size_t fixups_cap;
+	uint64_t* symrelocs;
+	size_t nsymrelocs;
+	size_t symrelocs_cap;
+};
+
+static uintptr_t image_lo = 0;
+static size_t image_size = 0;
+static int relocated = 0;
+
+static uint64_t _w_alloc(struct writer* w, size_t n);
+static void _w_push(uint64_t** a, size_t* n, size_t* cap, uint64_t x);
+static void _w_ptr(struct writer* w, uint64_t at, uint64_t target);
+static uint64_t _w_str(struct writer* w, const char* s);
+static void _w_sym(struct writer* w, uint64_t at, const char* sym);
+static uint64_t _w_lval(struct writer* w, lval* v);
+static int _is_own_builtin(const char* sym, lval* v);
+static void _header(struct image_header* h);
+static int _write(FILE* fp, const void* p, size_t size, size_t n);
+static int _patch_builtins(char* p, uint64_t* fixups, uint64_t n, int writable);
+static void _relocate(char* p, uint64_t* relocs, uint64_t n, uint64_t delta);
+
+int image_save(lenv* e, const char* path)
+{
+	struct writer w;
+	struct image_header h;
+	memset(&w, 0, sizeof(w));
+
+	// builtins under their own name come back with init_env()
+	uint64_t count = 0;
+	for (int i = 0; i < e->count; i++)
+		count += !_is_own_builtin(e->syms[i], e->vals[i]);
+
+	uint64_t root = _w_alloc(&w, sizeof(struct image_root));
+	uint64_t syms = _w_alloc(&w, sizeof(char*) * count);
+	uint64_t vals = _w_alloc(&w, sizeof(lval*) * count);
+	memcpy(w.data + root + offsetof(struct image_root, count), &count, sizeof(count));
+	_w_ptr(&w, root + offsetof(struct image_root, syms), syms);
+	_w_ptr(&w, root + offsetof(struct image_root, vals), vals);
+
+	for (int i = 0, j = 0; i < e->count; i++) {
+		if (_is_own_builtin(e->syms[i], e->vals[i]))
+			continue;
+		_w_sym(&w, syms + sizeof(char*) * j, e->syms[i]);
+		_w_ptr(&w, vals + sizeof(lval*) * j, _w_lval(&w, e->vals[i]));
+		j++;
+	}
+
+	_header(&h);
+	h.size = w.len;
+	h.root = root;
+	h.nrelocs = w.nrelocs;
+	h.nfixups = w.nfixups / 2;
+	h.symtab_base = symtab_base();
+	h.symtab_used = symtab_used();
+	h.nsymrelocs = w.nsymrelocs;
+
+	int ret = 1;
+	char pad[IMAGE_ALIGN] = { 0 };
+	FILE* fp = fopen(path, "wb");
+	if (NULL == fp) {
+		log_warn("could not open %s", path);
+		goto out;
+	}
+
+	if (_write(fp, &h, sizeof(h), 1)
+		&& _write(fp, pad, IMAGE_ALIGN - sizeof(h), 1)
+		&& _write(fp, w.data, 1, w.len)
+		&& _write(fp, w.relocs, sizeof(uint64_t), w.nrelocs)
+		&& _write(fp, w.fixups, sizeof(uint64_t), w.nfixups)
+		&& _write(fp, w.symrelocs, sizeof(uint64_t), w.nsymrelocs)
+		&& _write(fp, symtab_data(), 1, h.symtab_used))
+		ret = 0;
+	if (fclose(fp))
+		ret = 1;
+
+out:
+	free(w.data);
+	free(w.relocs);
+	free(w.fixups);
+	free(w.symrelocs);
+	return ret;
+}
+
+int image_load(lenv* e, const char* path)
+{
+	struct image_header h, want;
+	uint64_t* tables = NULL;
+	char* snap = NULL;
+	intptr_t symdelta;
+	int ret = 1;
+
+	if (image_lo) {
+		log_warn("an image is already loaded, not loading %s", path);
+		return 1;
+	}
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		log_warn("could not open %s", path);
+		return 1;
+	}
+
+	_header(&want);
+	if (pread(fd, &h, sizeof(h), 0) != sizeof(h)
+		|| memcmp(h.magic, want.magic, sizeof(h.magic) + sizeof(h.version))
+		|| h.layout != want.layout || h.lval_size != want.lval_size
+		|| h.lenv_size != want.lenv_size || h.nbuiltins != want.nbuiltins
+		|| h.base != want.base || 0 == h.size) {
+		log_warn("%s is not an image for this interpreter", path);
+		goto out;
+	}
+
+	size_t ntables = h.nrelocs + 2 * h.nfixups + h.nsymrelocs;
+	off_t at = IMAGE_ALIGN + h.size + sizeof(uint64_t) * ntables;
+	tables = (uint64_t*)malloc(sizeof(uint64_t) * (ntables + 1));
+	snap = (char*)malloc(h.symtab_used + 1);
+	if (NULL == tables || NULL == snap
+		|| pread(fd, tables, sizeof(uint64_t) * ntables, IMAGE_ALIGN + h.size)
+			!= (ssize_t)(sizeof(uint64_t) * ntables)
+		|| pread(fd, snap, h.symtab_used, at) != (ssize_t)h.symtab_used)
+		goto out;
+
+	// symbol fields hold interned pointers of the saving run
+	if (symtab_restore(snap, h.symtab_used, h.symtab_base, &symdelta)) {
+		log_warn("the symbols of %s do not match this run", path);
+		goto out;
+	}
+
+	char* p = MAP_FAILED;
+	if (0 == symdelta)
+		p = mmap((void*)(uintptr_t)h.base, h.size, PROT_READ,
+			MAP_PRIVATE | MAP_FIXED_NOREPLACE, fd, IMAGE_ALIGN);
+
+	if (MAP_FAILED == p || (uintptr_t)p != h.base) {
+		// the base address is taken, relocate a private copy
+		if (MAP_FAILED != p)
+			munmap(p, h.size);
+		p = mmap(NULL, h.size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, IMAGE_ALIGN);
+		if (MAP_FAILED == p)
+			goto out;
+
+		uint64_t delta = (uintptr_t)p - h.base;
+		_relocate(p, tables, h.nrelocs, delta);
+		_relocate(p, tables + h.nrelocs + 2 * h.nfixups, h.nsymrelocs, symdelta);
+		relocated = 1;
+	}
+	else
+		relocated = 0;
+
+	if (_patch_builtins(p, tables + h.nrelocs, h.nfixups, relocated)) {
+		munmap(p, h.size);
+		goto out;
+	}
+	if (relocated)
+		mprotect(p, h.size, PROT_READ);
+
+	image_lo = (uintptr_t)p;
+	image_size = h.size;
+
+	struct image_root* root = (struct image_root*)(p + h.root);
+	for (uint64_t i = 0; i < root->count; i++)
+		lenv_bind(e, root->syms[i], root->vals[i]);
+	ret = 0;
+
+out:
+	free(tables);
+	free(snap);
+	close(fd);
+	return ret;
+}
+
+int image_contains(const void* p)
+{
+	return (uintptr_t)p - image_lo < image_size;
+}
+
+int image_relocated(void)
+{
+	return relocated;
+}
+
+// private functions: //////////////////////////////////////////////////////////
+
+static void _header(struct image_header* h)
+{
+	memset(h, 0, sizeof(*h));
+	memcpy(h->magic, IMAGE_MAGIC, sizeof(h->magic));
+	strncpy(h->version, TOYLISP_VERSION, sizeof(h->version) - 1);
+	h->layout = IMAGE_LAYOUT;
+	h->lval_size = sizeof(lval);
+	h->lenv_size = sizeof(lenv);
+	while (builtin_at(h->nbuiltins))
+		h->nbuiltins++;
+	h->base = IMAGE_BASE;
+}
+
+// skips zero-length writes, p may be NULL then, non zero when all n went out
+static int _write(FILE* fp, const void* p, size_t size, size_t n)
+{
+	return 0 == n || fwrite(p, size, n, fp) == n;
+}
+
+// zeroed and pointer aligned
+static uint64_t _w_alloc(struct writer* w, size_t n)
+{
+	n = (n + 7) & ~(size_t)7;
+	if (w->len + n > w->cap) {
+		size_t cap = w->cap ? 2 * w->cap : IMAGE_ALIGN;
+		while (cap < w->len + n)
+			cap *= 2;
+		w->data = (char*)realloc(w->data, cap);
+		w->cap = cap;
+	}
+	uint64_t off = w->len;
+	memset(w->data + off, 0, n);
+	w->len += n;
+	return off;
+}
+
+static void _w_push(uint64_t** a, size_t* n, size_t* cap, uint64_t x)
+{
+	if (*n == *cap) {
+		*cap = *cap ? 2 * *cap : 256;
+		*a = (uint64_t*)realloc(*a, sizeof(uint64_t) * *cap);
+	}
+	(*a)[(*n)++] = x;
+}
+
+// a pointer field at offset at, pointing to the object at offset target
+static void _w_ptr(struct writer* w, uint64_t at, uint64_t target)
+{
+	uint64_t x = IMAGE_BASE + target;
+	memcpy(w->data + at, &x, sizeof(x));
+	_w_push(&w->relocs, &w->nrelocs, &w->relocs_cap, at);
+}
+
+static uint64_t _w_str(struct writer* w, const char* s)
+{
+	size_t n = strlen(s) + 1;
+	uint64_t off = _w_alloc(w, n);
+	memcpy(w->data + off, s, n);
+	return off;
+}
+
+// symbols are stored as the interned pointer, the table goes into the image
+static void _w_sym(struct writer* w, uint64_t at, const char* sym)
+{
+	memcpy(w->data + at, &sym, sizeof(sym));
+	_w_push(&w->symrelocs, &w->nsymrelocs, &w->symrelocs_cap, at);
+}
+
+static uint64_t _w_lval(struct writer* w, lval* v)
+{
+	uint64_t off = _w_alloc(w, sizeof(lval));
+	lval x;
+	memset(&x, 0, sizeof(x));
+	x.type = LVAL_TYPE(v);
+	// immediates go in boxed, lval_copy() unboxes them again
+	if (LVAL_LNG == x.type)
+		x.data.lng = lval_get_long(v);
+	else if (LVAL_DBL == x.type)
+		x.data.dbl = lval_get_double(v);
+	else if (LVAL_ERR == x.type)
+		x.err = v->err;
+	else if (LVAL_SYM == x.type)
+		x.slot = v->slot;
+	else if (LVAL_BIG == x.type) {
+		x.nlimbs = v->nlimbs;
+		x.neg = v->neg;
+	}
+	else
+		x.count = v->count;
+	memcpy(w->data + off, &x, sizeof(x));
+
+	switch (LVAL_TYPE(v)) {
+	case LVAL_SYM:
+		_w_sym(w, off + offsetof(lval, sym), v->sym);
+		break;
+	case LVAL_STR:
+		_w_ptr(w, off + offsetof(lval, str), _w_str(w, v->str));
+		break;
+	case LVAL_BIG: {
+		uint64_t limbs = _w_alloc(w, sizeof(uint32_t) * v->nlimbs);
+		memcpy(w->data + limbs, v->limbs, sizeof(uint32_t) * v->nlimbs);
+		_w_ptr(w, off + offsetof(lval, limbs), limbs);
+		break;
+	}
+	case LVAL_SEXPR:
+	case LVAL_QEXPR:
+		if (v->count) {
+			uint64_t cells = _w_alloc(w, sizeof(lval*) * v->count);
+			for (int i = 0; i < v->count; i++)
+				_w_ptr(w, cells + sizeof(lval*) * i, _w_lval(w, v->cell[i]));
+			_w_ptr(w, off + offsetof(lval, cell), cells);
+		}
+		break;
+	case LVAL_FUN:
+		if (v->builtin) {
+			_w_push(&w->fixups, &w->nfixups, &w->fixups_cap, off + offsetof(lval, builtin));
+			_w_push(&w->fixups, &w->nfixups, &w->fixups_cap, builtin_index(v->builtin));
+		}
+		else {
+			if (v->args)
+				_w_ptr(w, off + offsetof(lval, args), _w_lval(w, v->args));
+			_w_ptr(w, off + offsetof(lval, formals), _w_lval(w, v->formals));
+			_w_ptr(w, off + offsetof(lval, body), _w_lval(w, v->body));
+		}
+		break;
+	}
+	return off;
+}
+
+static int _is_own_builtin(const char* sym, lval* v)
+{
+	if (LVAL_FUN != LVAL_TYPE(v) || NULL == v->builtin)
+		return 0;
+	for (int i = 0; builtin_at(i); i++) {
+		if (builtin_at(i) == v->builtin && 0 == strcmp(builtin_name_at(i), sym))
+			return 1;
+	}
+	return 0;
+}
+
+// builtin addresses differ between runs, only the pages holding them get dirty
+static int _patch_builtins(char* p, uint64_t* fixups, uint64_t n, int writable)
+{
+	long page = sysconf(_SC_PAGESIZE);
+
+	for (uint64_t i = 0; i < n; i++) {
+		uint64_t off = fixups[2*i];
+		lbuiltin f = builtin_at(fixups[2*i + 1]);
+		if (NULL == f)
+			return 1;
+
+		char* at = (char*)((uintptr_t)(p + off) & ~(uintptr_t)(page - 1));
+		size_t len = (p + off + sizeof(f)) - at;
+		if (!writable)
+			mprotect(at, len, PROT_READ | PROT_WRITE);
+		memcpy(p + off, &f, sizeof(f));
+		if (!writable)
+			mprotect(at, len, PROT_READ);
+	}
+	return 0;
+}
+
+static void _relocate(char* p, uint64_t* relocs, uint64_t n, uint64_t delta)
+{
+	for (uint64_t i = 0; i < n; i++) {
+		uint64_t x;
+		memcpy(&x, p + relocs[i], sizeof(x));
+		x += delta;
+		memcpy(p + relocs[i], &x, sizeof(x));
+	}
+}
+
@@ -0,0 +1,31 @@
+#ifndef IMAGE_H_
+#define IMAGE_H_
+
+#include "common.h"
+
+// Heap images. image_save() lays out every binding of the global env (values,
+// lambda formals, bodies and arguments) as ready to use lval and lenv structs
+// addressed from IMAGE_BASE. image_load() maps that region read-only
+// at IMAGE_BASE, so nothing has to be re-evaluated or fixed up and workers
+// started from the same image share its pages. If the address is taken the
+// region is mapped privately elsewhere and relocated instead. Builtins are
+// restored by init_env(), a builtin stored as a value is patched by index.
+// Symbols are interned pointers, the image carries the symbol table it was
+// saved with and can only be loaded while this run's table is a prefix of it,
+// i.e. right after init_env().
+//
+// Image objects are never freed, lval_del() and lenv_del() skip them.
+
+#define IMAGE_MAGIC "TLSPIMG\1"
+#define IMAGE_LAYOUT 12 // bump whenever struct lval or struct lenv change
+#define IMAGE_BASE 0x3e0000000000ULL
+#define IMAGE_ALIGN 4096
+
+int image_save(lenv* e, const char* path); // 0 on success
+int image_load(lenv* e, const char* path); // binds into e, after init_env()
+
+int image_contains(const void* p);
+int image_relocated(void); // the last load could not use IMAGE_BASE
+
+#endif
+
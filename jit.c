@@ -0,0 +1,918 @@
+#define _DEFAULT_SOURCE
+
+#include <float.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "jit.h"
+#include "eval.h"
+#include "opt.h"
+#include "symtab.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+#define JIT_NATIVE 1
+#else
+#define JIT_NATIVE 0
+#endif
+
+#define JIT_MAX_SYMS 16 // names called, the builtins that can be and the lambda
+
+struct ljit
+{
+	unsigned long calls; // until the code is compiled
+	unsigned long runs;
+	unsigned long misses; // of the argument types since the code was compiled
+	int failed; // the body cannot be compiled
+	int interpreting; // calls that left the code being made by the interpreter
+	const char* name; // global, NULL when the lambda is not bound to one
+	lenv* root; // the global frame the names were looked up in
+	int nargs;
+	int types[JIT_MAX_ARGS]; // LVAL_LNG or LVAL_DBL
+	int ret; // the type of the value
+	int nsyms;
+	const char* syms[JIT_MAX_SYMS]; // the names called
+	uint32_t rebinds[JIT_MAX_SYMS]; // SYM_REBINDS() of each then
+	unsigned char* code; // executable, NULL until compiled
+	size_t size;
+	size_t mapped;
+	size_t frame; // bytes of stack one call takes
+	ljit* prev; // in the list of compiled ones
+	ljit* next;
+};
+
+// one compile of a body for a type of the value
+struct jc
+{
+	lval* f;
+	lval* src; // the body the interpreter runs, see opt_body()
+	lenv* root;
+	int nargs;
+	int types[JIT_MAX_ARGS];
+	int ret; // taken to be the type of calls of the lambda itself
+	unsigned char* buf;
+	size_t n;
+	size_t cap;
+	int oom;
+	int depth; // values pushed
+	int max_depth;
+	size_t body; // where a call in place of the frame jumps to
+	size_t* bails; // rel32 of each jump to the bail stub
+	int nbails;
+	int bails_cap;
+	int nsyms;
+	const char* syms[JIT_MAX_SYMS];
+	int later; // a frame binds a name called, it may compile on another call
+};
+
+enum JIT_KIND { JIT_ARITH, JIT_ORD, JIT_CMP };
+
+// the builtins with templates and what they do
+static const struct
+{
+	lbuiltin func;
+	int kind;
+	int op;
+} OPS[] =
+{
+	{ builtin_add, JIT_ARITH, ARITH_ADD },
+	{ builtin_sub, JIT_ARITH, ARITH_SUB },
+	{ builtin_mul, JIT_ARITH, ARITH_MUL },
+	{ builtin_div, JIT_ARITH, ARITH_DIV },
+	{ builtin_mod, JIT_ARITH, ARITH_MOD },
+	{ builtin_min, JIT_ARITH, ARITH_MIN },
+	{ builtin_max, JIT_ARITH, ARITH_MAX },
+	{ builtin_gt, JIT_ORD, ORD_GT },
+	{ builtin_lt, JIT_ORD, ORD_LT },
+	{ builtin_ge, JIT_ORD, ORD_GE },
+	{ builtin_le, JIT_ORD, ORD_LE },
+	{ builtin_eq, JIT_CMP, CMP_EQ },
+	{ builtin_ne, JIT_CMP, CMP_NE },
+};
+
+#define NOPS ((int)(sizeof(OPS) / sizeof(OPS[0])))
+
+// int entry(const void* code, const int64_t* args, int n, int64_t out[2])
+typedef int (*jit_entry)(const void*, const int64_t*, int, int64_t*);
+
+int jit_enabled = JIT_NATIVE;
+unsigned long jit_threshold = JIT_THRESHOLD;
+
+static struct jit_stats stats = { 0, 0, 0, 0, 0, 0 };
+static ljit* compiled = NULL;
+static unsigned char* entry_code = NULL;
+
+// read and written by the code
+static int64_t budget; // calls it may still nest
+static uint64_t bail_sp; // of the entry, what a bail returns to
+
+#define EMIT(c, s) _emit((c), (s), sizeof(s) - 1)
+
+static ljit* _ljit(lval* f);
+static int _valid(lenv* e, lval* f, ljit* j);
+static void _drop(ljit* j);
+static lval* _interpret(lenv* e, lval* f, ljit* j, lval** argv, int n);
+static int _compile(lenv* e, lval* f, ljit* j, lval** argv, int n);
+static int _body(struct jc* c);
+static const char* _name(lenv* root, lval* f);
+static unsigned char* _map(const unsigned char* code, size_t n, size_t* mapped);
+static jit_entry _entry(void);
+static void _emit(struct jc* c, const char* bytes, size_t n);
+static void _imm32(struct jc* c, int32_t x);
+static void _imm64(struct jc* c, uint64_t x);
+static size_t _jump(struct jc* c, const char* op, size_t n);
+static void _patch(struct jc* c, size_t at, size_t target);
+static void _bail(struct jc* c, const char* op, size_t n);
+static int _slot(lval* formals, const char* sym);
+static lval* _global(struct jc* c, const char* sym);
+static int _rely(struct jc* c, const char* sym);
+static int _operand(struct jc* c, lval* x, int second);
+static void _push(struct jc* c, int t);
+static void _pop(struct jc* c, int t);
+static int _next(struct jc* c, lval* x, int t);
+static int _expr(struct jc* c, lval* x, int tail);
+static int _code(struct jc* c, lval* q, int tail);
+static int _call(struct jc* c, lval* x, int tail);
+static int _arith(struct jc* c, lval* x, int op);
+static int _ord(struct jc* c, lval* x, int kind, int op);
+static int _if(struct jc* c, lval* x, int tail);
+static int _self(struct jc* c, lval* x, int tail);
+
+int jit_hot(lenv* e, lval* f)
+{
+	if (!JIT_NATIVE || !jit_enabled || LVAL_FUN != LVAL_TYPE(f) || f->builtin || f->args)
+		return 0;
+	ljit* j = _ljit(f);
+	if (NULL == j || j->failed || j->interpreting)
+		return 0;
+	if (j->code) {
+		if (_valid(e, f, j))
+			return 1;
+		// the code is only of use again once a frame stops binding a name
+		for (int i = 0; i < j->nsyms; i++) {
+			if (j->rebinds[i] != SYM_REBINDS(j->syms[i])) {
+				stats.dropped++;
+				_drop(j);
+				break;
+			}
+		}
+		return 0;
+	}
+	return ++j->calls >= jit_threshold;
+}
+
+lval* jit_run(lenv* e, lval* f, lval** argv, int n)
+{
+	if (!JIT_NATIVE || !jit_enabled || LVAL_FUN != LVAL_TYPE(f) || f->builtin || f->args)
+		return NULL;
+	ljit* j = _ljit(f);
+	if (NULL == j || j->failed || j->interpreting)
+		return NULL;
+	if (NULL == j->code && (j->calls < jit_threshold || _compile(e, f, j, argv, n)))
+		return NULL;
+
+	int64_t args[JIT_MAX_ARGS];
+	int i = n == j->nargs ? 0 : -1;
+	for (; i >= 0 && i < n; i++) {
+		if (LVAL_TYPE(argv[i]) != j->types[i])
+			break;
+		if (LVAL_LNG == j->types[i])
+			args[i] = lval_get_long(argv[i]);
+		else {
+			double d = lval_get_double(argv[i]);
+			memcpy(&args[i], &d, sizeof(d));
+		}
+	}
+	if (i != n) {
+		stats.guards++;
+		if (++j->misses >= jit_threshold)
+			_drop(j);
+		return NULL;
+	}
+	if (!_valid(e, f, j))
+		return NULL;
+	budget = MIN((int64_t)(eval_max_depth - eval_depth), (int64_t)(JIT_STACK / j->frame));
+	if (budget <= 0)
+		return NULL;
+	int64_t out[2];
+	stats.runs++;
+	j->runs++;
+	if (_entry()(j->code, args, n, out))
+		return _interpret(e, f, j, argv, n);
+	if (LVAL_LNG == j->ret)
+		return lval_long(out[0]);
+	double d;
+	memcpy(&d, &out[1], sizeof(d));
+	return lval_double(d);
+}
+
+void ljit_release(ljit* j)
+{
+	if (NULL == j)
+		return;
+	_drop(j);
+	free(j);
+}
+
+void jit_get_stats(struct jit_stats* st)
+{
+	*st = stats;
+}
+
+void jit_print_stats(FILE* fp)
+{
+	fprintf(fp, "jit: %s, threshold %lu\n", jit_enabled ? "on" : "off", jit_threshold);
+	fprintf(fp, "compiled: %lu, failed: %lu, runs: %lu, bails: %lu, argument types missed: %lu, dropped: %lu\n",
+		stats.compiles, stats.failed, stats.runs, stats.bails, stats.guards, stats.dropped);
+	for (ljit* j = compiled; j; j = j->next) {
+		fprintf(fp, "  %s (", j->name ? j->name : "<lambda>");
+		for (int i = 0; i < j->nargs; i++)
+			fprintf(fp, "%s%s", i ? " " : "", LVAL_LNG == j->types[i] ? "long" : "double");
+		fprintf(fp, ") -> %s: %zu bytes, %lu runs\n",
+			LVAL_LNG == j->ret ? "long" : "double", j->size, j->runs);
+	}
+}
+
+// private functions: //////////////////////////////////////////////////////////
+
+static ljit* _ljit(lval* f)
+{
+	ljit** slot = opt_jit(f);
+	if (NULL == slot)
+		return NULL;
+	if (NULL == *slot)
+		*slot = (ljit*)calloc(1, sizeof(ljit));
+	return *slot;
+}
+
+// the names the code calls and those the rewrite it was compiled from relied
+// on are bound as they were
+static int _valid(lenv* e, lval* f, ljit* j)
+{
+	if ((e->root ? e->root : e) != j->root)
+		return 0;
+	for (int i = 0; i < j->nsyms; i++) {
+		if (1 != SYM_BINDS(j->syms[i]) || j->rebinds[i] != SYM_REBINDS(j->syms[i]))
+			return 0;
+	}
+	return opt_valid(e, opt_of(f));
+}
+
+// back to counting calls
+static void _drop(ljit* j)
+{
+	if (NULL == j->code)
+		return;
+	munmap(j->code, j->mapped);
+	j->code = NULL;
+	j->calls = 0;
+	j->misses = 0;
+	if (j->prev)
+		j->prev->next = j->next;
+	else
+		compiled = j->next;
+	if (j->next)
+		j->next->prev = j->prev;
+	j->prev = j->next = NULL;
+}
+
+// The call that left the code, the calls made for it do not run the code,
+// they would leave it again. The lambda holds on to j while it is called.
+static lval* _interpret(lenv* e, lval* f, ljit* j, lval** argv, int n)
+{
+	stats.bails++;
+	lopt* o = lopt_retain(opt_of(f));
+	lval* a = lval_sexpr();
+	for (int i = 0; i < n; i++)
+		lval_add_toback(a, lval_copy(argv[i]));
+	j->interpreting++;
+	lval* r = lval_call(e, f, a);
+	j->interpreting--;
+	lopt_release(o);
+	return r;
+}
+
+// non zero when there is no code to run the call with, failed is set when
+// there never will be
+static int _compile(lenv* e, lval* f, ljit* j, lval** argv, int n)
+{
+	int nargs = 0;
+	for (int i = 0; i < f->formals->count; i++) {
+		if (SYM_AMP == f->formals->cell[i]->sym)
+			nargs = JIT_MAX_ARGS + 1;
+		nargs++;
+	}
+	if (nargs > JIT_MAX_ARGS) {
+		j->failed = 1;
+		stats.failed++;
+		return 1;
+	}
+	// counted again from 0, so calls do not all wait on a compile meanwhile
+	if (n != nargs || NULL == _entry() || !opt_valid(e, opt_of(f))) {
+		j->calls = 0;
+		return 1;
+	}
+
+	struct jc c;
+	memset(&c, 0, sizeof(c));
+	c.f = f;
+	c.src = opt_body(e, f);
+	c.root = e->root ? e->root : e;
+	c.nargs = n;
+	for (int i = 0; i < n; i++) {
+		c.types[i] = LVAL_TYPE(argv[i]);
+		if (LVAL_LNG != c.types[i] && LVAL_DBL != c.types[i]) {
+			j->failed = 1;
+			stats.failed++;
+			return 1;
+		}
+	}
+
+	// the type of a call of the lambda itself is taken to be long and then
+	// double, until the value turns out to have it
+	int t = -1;
+	for (c.ret = LVAL_LNG; c.ret <= LVAL_DBL && !c.later; c.ret++) {
+		c.n = c.depth = c.max_depth = c.nbails = c.nsyms = 0;
+		if ((t = _body(&c)) == c.ret && !c.oom)
+			break;
+	}
+	unsigned char* code = t == c.ret && !c.oom ? _map(c.buf, c.n, &j->mapped) : NULL;
+	free(c.buf);
+	free(c.bails);
+	if (NULL == code) {
+		if (!c.later && !c.oom) {
+			j->failed = 1;
+			stats.failed++;
+		}
+		else
+			j->calls = 0;
+		return 1;
+	}
+
+	j->code = code;
+	j->size = c.n;
+	j->name = _name(c.root, f);
+	j->root = c.root;
+	j->nargs = n;
+	memcpy(j->types, c.types, sizeof(c.types));
+	j->ret = c.ret;
+	j->nsyms = c.nsyms;
+	for (int i = 0; i < c.nsyms; i++) {
+		j->syms[i] = c.syms[i];
+		j->rebinds[i] = SYM_REBINDS(c.syms[i]);
+	}
+	j->frame = 8 * (n + 2 + c.max_depth);
+	j->misses = 0;
+	j->next = compiled;
+	if (compiled)
+		compiled->prev = j;
+	compiled = j;
+	stats.compiles++;
+	return 0;
+}
+
+// the lambda with its prologue, epilogue and bail stub, the type of its value
+static int _body(struct jc* c)
+{
+	// push rbp; mov rbp, rsp; dec qword [budget]; js bail
+	EMIT(c, "\x55\x48\x89\xe5\x48\xb9");
+	_imm64(c, (uint64_t)(uintptr_t)&budget);
+	EMIT(c, "\x48\xff\x09");
+	_bail(c, "\x0f\x88", 2);
+	c->body = c->n;
+
+	int t = _code(c, c->src, 1);
+
+	// inc qword [budget]; leave; ret
+	EMIT(c, "\x48\xb9");
+	_imm64(c, (uint64_t)(uintptr_t)&budget);
+	EMIT(c, "\x48\xff\x01\xc9\xc3");
+
+	// back to the entry, which returns 1: mov rsp, [bail_sp]; pop rcx;
+	// pop rbp; mov eax, 1; ret
+	size_t stub = c->n;
+	EMIT(c, "\x48\xb9");
+	_imm64(c, (uint64_t)(uintptr_t)&bail_sp);
+	EMIT(c, "\x48\x8b\x21\x59\x5d\xb8\x01\x00\x00\x00\xc3");
+	for (int i = 0; i < c->nbails; i++)
+		_patch(c, c->bails[i], stub);
+	return t;
+}
+
+// the global the lambda is bound to, for jit_print_stats()
+static const char* _name(lenv* root, lval* f)
+{
+	for (int i = 0; i < root->count; i++) {
+		lval* g = root->vals[i];
+		if (LVAL_FUN == LVAL_TYPE(g) && NULL == g->builtin && NULL == g->args && opt_of(g) == opt_of(f))
+			return root->syms[i];
+	}
+	return NULL;
+}
+
+// pages written and then made executable
+static unsigned char* _map(const unsigned char* code, size_t n, size_t* mapped)
+{
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	size_t size = (n + page - 1) / page * page;
+	unsigned char* p = (unsigned char*)mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (MAP_FAILED == p)
+		return NULL;
+	memcpy(p, code, n);
+	if (mprotect(p, size, PROT_READ | PROT_EXEC)) {
+		munmap(p, size);
+		return NULL;
+	}
+	*mapped = size;
+	return p;
+}
+
+// Pushes the arguments, keeps rsp for a bail and calls the code, then stores
+// rax and xmm0 in out and returns 0. Made once, NULL if the pages could not
+// be mapped.
+static jit_entry _entry(void)
+{
+	static const unsigned char head[] =
+	{
+		0x55, // push rbp
+		0x51, // push rcx
+		0x48, 0xb8, // mov rax, &bail_sp
+	};
+	static const unsigned char call[] =
+	{
+		0x48, 0x89, 0x20, // mov [rax], rsp
+		0x48, 0x63, 0xd2, // movsxd rdx, edx
+		0x48, 0x85, 0xd2, // test rdx, rdx
+		0x74, 0x0b, // jz .call
+		0xff, 0x36, // .push: push qword [rsi]
+		0x48, 0x83, 0xc6, 0x08, // add rsi, 8
+		0x48, 0xff, 0xca, // dec rdx
+		0x75, 0xf5, // jnz .push
+		0xff, 0xd7, // .call: call rdi
+		0x48, 0xb9, // mov rcx, &bail_sp
+	};
+	static const unsigned char tail[] =
+	{
+		0x48, 0x8b, 0x21, // mov rsp, [rcx]
+		0x59, // pop rcx
+		0x48, 0x89, 0x01, // mov [rcx], rax
+		0xf2, 0x0f, 0x11, 0x41, 0x08, // movsd [rcx+8], xmm0
+		0x31, 0xc0, // xor eax, eax
+		0x5d, // pop rbp
+		0xc3, // ret
+	};
+
+	if (NULL == entry_code) {
+		unsigned char code[sizeof(head) + sizeof(call) + sizeof(tail) + 16];
+		uint64_t sp = (uint64_t)(uintptr_t)&bail_sp;
+		size_t n = 0;
+		memcpy(code + n, head, sizeof(head));
+		n += sizeof(head);
+		memcpy(code + n, &sp, 8);
+		n += 8;
+		memcpy(code + n, call, sizeof(call));
+		n += sizeof(call);
+		memcpy(code + n, &sp, 8);
+		n += 8;
+		memcpy(code + n, tail, sizeof(tail));
+		n += sizeof(tail);
+		size_t mapped;
+		entry_code = _map(code, n, &mapped);
+		if (NULL == entry_code)
+			return NULL;
+	}
+	jit_entry entry;
+	memcpy(&entry, &entry_code, sizeof(entry));
+	return entry;
+}
+
+static void _emit(struct jc* c, const char* bytes, size_t n)
+{
+	if (c->oom)
+		return;
+	if (c->n + n > c->cap) {
+		size_t cap = MAX(2 * c->cap, c->n + n + 256);
+		unsigned char* buf = (unsigned char*)realloc(c->buf, cap);
+		if (NULL == buf) {
+			c->oom = 1;
+			return;
+		}
+		c->buf = buf;
+		c->cap = cap;
+	}
+	memcpy(c->buf + c->n, bytes, n);
+	c->n += n;
+}
+
+static void _imm32(struct jc* c, int32_t x)
+{
+	char b[4];
+	memcpy(b, &x, 4);
+	_emit(c, b, 4);
+}
+
+static void _imm64(struct jc* c, uint64_t x)
+{
+	char b[8];
+	memcpy(b, &x, 8);
+	_emit(c, b, 8);
+}
+
+// op and a rel32 patched later, where that is
+static size_t _jump(struct jc* c, const char* op, size_t n)
+{
+	_emit(c, op, n);
+	_imm32(c, 0);
+	return c->n - 4;
+}
+
+static void _patch(struct jc* c, size_t at, size_t target)
+{
+	if (c->oom)
+		return;
+	int32_t rel = (int32_t)((int64_t)target - (int64_t)(at + 4));
+	memcpy(c->buf + at, &rel, 4);
+}
+
+static void _bail(struct jc* c, const char* op, size_t n)
+{
+	size_t at = _jump(c, op, n);
+	if (c->nbails == c->bails_cap) {
+		int cap = c->bails_cap ? 2 * c->bails_cap : 8;
+		size_t* bails = (size_t*)realloc(c->bails, sizeof(size_t) * cap);
+		if (NULL == bails) {
+			c->oom = 1;
+			return;
+		}
+		c->bails = bails;
+		c->bails_cap = cap;
+	}
+	c->bails[c->nbails++] = at;
+}
+
+static int _slot(lval* formals, const char* sym)
+{
+	for (int i = 0; i < formals->count; i++) {
+		if (formals->cell[i]->sym == sym)
+			return i;
+	}
+	return -1;
+}
+
+// the global value of sym, NULL when it is a formal or a frame binds it
+static lval* _global(struct jc* c, const char* sym)
+{
+	if (_slot(c->f->formals, sym) >= 0)
+		return NULL;
+	if (1 != SYM_BINDS(sym)) {
+		c->later = 1;
+		return NULL;
+	}
+	int i = lenv_slot(c->root, sym);
+	return i < 0 ? NULL : c->root->vals[i];
+}
+
+static int _rely(struct jc* c, const char* sym)
+{
+	for (int i = 0; i < c->nsyms; i++) {
+		if (c->syms[i] == sym)
+			return 0;
+	}
+	if (JIT_MAX_SYMS == c->nsyms)
+		return 1;
+	c->syms[c->nsyms++] = sym;
+	return 0;
+}
+
+// A number or a formal into rax or xmm0, or rcx or xmm1 when second, the
+// type, -1 for anything else.
+static int _operand(struct jc* c, lval* x, int second)
+{
+	int t = LVAL_TYPE(x);
+	if (LVAL_SYM == t) {
+		int i = _slot(c->f->formals, x->sym);
+		if (i < 0)
+			return -1;
+		// mov rax/rcx, [rbp+disp]; movsd xmm0/xmm1, [rbp+disp]
+		t = c->types[i];
+		if (LVAL_LNG == t)
+			_emit(c, second ? "\x48\x8b\x8d" : "\x48\x8b\x85", 3);
+		else
+			_emit(c, second ? "\xf2\x0f\x10\x8d" : "\xf2\x0f\x10\x85", 4);
+		_imm32(c, 16 + 8 * (c->nargs - 1 - i));
+		return t;
+	}
+	if (LVAL_LNG == t) {
+		int64_t n = lval_get_long(x);
+		if (n >= INT32_MIN && n <= INT32_MAX) {
+			// mov rax/rcx, imm32
+			_emit(c, second ? "\x48\xc7\xc1" : "\x48\xc7\xc0", 3);
+			_imm32(c, (int32_t)n);
+		}
+		else {
+			_emit(c, second ? "\x48\xb9" : "\x48\xb8", 2);
+			_imm64(c, (uint64_t)n);
+		}
+		return t;
+	}
+	if (LVAL_DBL == t) {
+		double d = lval_get_double(x);
+		uint64_t bits;
+		memcpy(&bits, &d, sizeof(d));
+		// mov rax/rcx, imm64; movq xmm0/xmm1, rax/rcx
+		_emit(c, second ? "\x48\xb9" : "\x48\xb8", 2);
+		_imm64(c, bits);
+		_emit(c, second ? "\x66\x48\x0f\x6e\xc9" : "\x66\x48\x0f\x6e\xc0", 5);
+		return t;
+	}
+	return -1;
+}
+
+static void _push(struct jc* c, int t)
+{
+	if (LVAL_DBL == t)
+		EMIT(c, "\x66\x48\x0f\x7e\xc0"); // movq rax, xmm0
+	EMIT(c, "\x50"); // push rax
+	c->max_depth = MAX(c->max_depth, ++c->depth);
+}
+
+static void _pop(struct jc* c, int t)
+{
+	EMIT(c, "\x58"); // pop rax
+	if (LVAL_DBL == t)
+		EMIT(c, "\x66\x48\x0f\x6e\xc0"); // movq xmm0, rax
+	c->depth--;
+}
+
+// x into rcx or xmm1 with the value of type t kept in rax or xmm0, the type
+// of x
+static int _next(struct jc* c, lval* x, int t)
+{
+	int u = _operand(c, x, 1);
+	if (u >= 0)
+		return u;
+	_push(c, t);
+	u = _expr(c, x, 0);
+	if (LVAL_LNG == u)
+		EMIT(c, "\x48\x89\xc1"); // mov rcx, rax
+	else if (LVAL_DBL == u)
+		EMIT(c, "\x66\x0f\x28\xc8"); // movapd xmm1, xmm0
+	_pop(c, t);
+	return u;
+}
+
+// a cell that is evaluated
+static int _expr(struct jc* c, lval* x, int tail)
+{
+	int t = _operand(c, x, 0);
+	if (t >= 0 || LVAL_SEXPR != LVAL_TYPE(x))
+		return t;
+	return _code(c, x, tail);
+}
+
+// the cells of a body, a branch or a sexpr
+static int _code(struct jc* c, lval* q, int tail)
+{
+	if (0 == q->count)
+		return -1;
+	if (1 == q->count)
+		return _expr(c, q->cell[0], tail);
+	return _call(c, q, tail);
+}
+
+static int _call(struct jc* c, lval* x, int tail)
+{
+	lval* h = x->cell[0];
+	if (LVAL_SYM != LVAL_TYPE(h))
+		return -1;
+	lval* g = _global(c, h->sym);
+	if (NULL == g || LVAL_FUN != LVAL_TYPE(g) || _rely(c, h->sym))
+		return -1;
+
+	if (builtin_if == g->builtin)
+		return _if(c, x, tail);
+	if (NULL == g->builtin)
+		return NULL == g->args && opt_of(g) == opt_of(c->f) ? _self(c, x, tail) : -1;
+	for (int i = 0; i < NOPS; i++) {
+		if (OPS[i].func == g->builtin)
+			return JIT_ARITH == OPS[i].kind ? _arith(c, x, OPS[i].op) : _ord(c, x, OPS[i].kind, OPS[i].op);
+	}
+	return -1;
+}
+
+// longs up to the first double and then doubles, like builtin_op()
+static int _arith(struct jc* c, lval* x, int op)
+{
+	if (x->count < 2)
+		return -1;
+	int t = _expr(c, x->cell[1], 0);
+	if (t < 0)
+		return -1;
+	if (ARITH_SUB == op && 2 == x->count) {
+		if (LVAL_LNG == t) {
+			EMIT(c, "\x48\xf7\xd8"); // neg rax; jo bail
+			_bail(c, "\x0f\x80", 2);
+		}
+		else {
+			// xorpd xmm0, the sign bit
+			EMIT(c, "\x48\xb9");
+			_imm64(c, 1ULL << 63);
+			EMIT(c, "\x66\x48\x0f\x6e\xc9\x66\x0f\x57\xc1");
+		}
+		return t;
+	}
+
+	for (int i = 2; i < x->count; i++) {
+		int u = _next(c, x->cell[i], t);
+		if (u < 0)
+			return -1;
+		if (LVAL_LNG == t && LVAL_DBL == u) {
+			EMIT(c, "\xf2\x48\x0f\x2a\xc0"); // cvtsi2sd xmm0, rax
+			t = LVAL_DBL;
+		}
+		else if (LVAL_DBL == t && LVAL_LNG == u)
+			EMIT(c, "\xf2\x48\x0f\x2a\xc9"); // cvtsi2sd xmm1, rcx
+
+		if (LVAL_LNG == t) {
+			// a long that overflows is a bigint, which only the interpreter has:
+			// jo bail after each
+			switch (op) {
+			case ARITH_ADD: EMIT(c, "\x48\x01\xc8"); _bail(c, "\x0f\x80", 2); break; // add rax, rcx
+			case ARITH_SUB: EMIT(c, "\x48\x29\xc8"); _bail(c, "\x0f\x80", 2); break; // sub rax, rcx
+			case ARITH_MUL: EMIT(c, "\x48\x0f\xaf\xc1"); _bail(c, "\x0f\x80", 2); break; // imul rax, rcx
+			case ARITH_MIN: EMIT(c, "\x48\x39\xc1\x48\x0f\x4c\xc1"); break; // cmp rcx, rax; cmovl rax, rcx
+			case ARITH_MAX: EMIT(c, "\x48\x39\xc1\x48\x0f\x4f\xc1"); break; // cmp rcx, rax; cmovg rax, rcx
+			case ARITH_DIV:
+			case ARITH_MOD: {
+				// test rcx, rcx; jz bail; cmp rcx, -1; jne .div
+				EMIT(c, "\x48\x85\xc9");
+				_bail(c, "\x0f\x84", 2);
+				EMIT(c, "\x48\x83\xf9\xff");
+				size_t at = _jump(c, "\x0f\x85", 2);
+				// INT64_MIN / -1 traps: neg rax; jo bail or xor eax, eax; jmp .done
+				if (ARITH_DIV == op) {
+					EMIT(c, "\x48\xf7\xd8");
+					_bail(c, "\x0f\x80", 2);
+				}
+				else
+					EMIT(c, "\x31\xc0");
+				size_t done = _jump(c, "\xe9", 1);
+				// .div: cqo; idiv rcx; mov rax, rdx for the remainder
+				_patch(c, at, c->n);
+				EMIT(c, "\x48\x99\x48\xf7\xf9");
+				if (ARITH_MOD == op)
+					EMIT(c, "\x48\x89\xd0");
+				_patch(c, done, c->n);
+				break;
+			}
+			default:
+				return -1;
+			}
+			continue;
+		}
+
+		switch (op) {
+		case ARITH_ADD: EMIT(c, "\xf2\x0f\x58\xc1"); break; // addsd xmm0, xmm1
+		case ARITH_SUB: EMIT(c, "\xf2\x0f\x5c\xc1"); break; // subsd
+		case ARITH_MUL: EMIT(c, "\xf2\x0f\x59\xc1"); break; // mulsd
+		case ARITH_MIN: EMIT(c, "\xf2\x0f\x5d\xc1"); break; // minsd, x < y ? x : y
+		case ARITH_MAX: EMIT(c, "\xf2\x0f\x5f\xc1"); break; // maxsd, x > y ? x : y
+		case ARITH_DIV:
+			// |y| below DBL_EPSILON bails: movq rax, xmm1; shl rax, 1;
+			// shr rax, 1; movq xmm2, rax; movq xmm3, DBL_EPSILON;
+			// ucomisd xmm3, xmm2; ja bail
+			EMIT(c, "\x66\x48\x0f\x7e\xc8\x48\xd1\xe0\x48\xd1\xe8\x66\x48\x0f\x6e\xd0\x48\xb8");
+			{
+				double eps = DBL_EPSILON;
+				uint64_t bits;
+				memcpy(&bits, &eps, sizeof(eps));
+				_imm64(c, bits);
+			}
+			EMIT(c, "\x66\x48\x0f\x6e\xd8\x66\x0f\x2e\xda");
+			_bail(c, "\x0f\x87", 2);
+			EMIT(c, "\xf2\x0f\x5e\xc1"); // divsd xmm0, xmm1
+			break;
+		default: // fmod has no instruction
+			return -1;
+		}
+	}
+	return t;
+}
+
+// a long, 1 or 0, of two numbers compared as longs if both are and as doubles
+// otherwise, NaN is unordered and unequal to anything
+static int _ord(struct jc* c, lval* x, int kind, int op)
+{
+	if (3 != x->count)
+		return -1;
+	int t = _expr(c, x->cell[1], 0);
+	int u = t < 0 ? -1 : _next(c, x->cell[2], t);
+	if (u < 0)
+		return -1;
+
+	if (LVAL_LNG == t && LVAL_LNG == u) {
+		EMIT(c, "\x48\x39\xc8"); // cmp rax, rcx
+		if (JIT_CMP == kind)
+			_emit(c, CMP_EQ == op ? "\x0f\x94\xc0" : "\x0f\x95\xc0", 3); // sete/setne al
+		else {
+			switch (op) {
+			case ORD_GT: EMIT(c, "\x0f\x9f\xc0"); break; // setg al
+			case ORD_LT: EMIT(c, "\x0f\x9c\xc0"); break; // setl al
+			case ORD_GE: EMIT(c, "\x0f\x9d\xc0"); break; // setge al
+			default: EMIT(c, "\x0f\x9e\xc0"); break; // setle al
+			}
+		}
+	}
+	else {
+		if (LVAL_LNG == t)
+			EMIT(c, "\xf2\x48\x0f\x2a\xc0"); // cvtsi2sd xmm0, rax
+		if (LVAL_LNG == u)
+			EMIT(c, "\xf2\x48\x0f\x2a\xc9"); // cvtsi2sd xmm1, rcx
+		if (JIT_CMP == kind) {
+			// ucomisd xmm0, xmm1; then sete al; setnp cl; and al, cl
+			// or setne al; setp cl; or al, cl
+			EMIT(c, "\x66\x0f\x2e\xc1");
+			if (CMP_EQ == op)
+				EMIT(c, "\x0f\x94\xc0\x0f\x9b\xc1\x20\xc8");
+			else
+				EMIT(c, "\x0f\x95\xc0\x0f\x9a\xc1\x08\xc8");
+		}
+		else {
+			// x > y and x >= y are seta and setae after ucomisd xmm0, xmm1,
+			// x < y and x <= y the same after ucomisd xmm1, xmm0
+			if (ORD_GT == op || ORD_GE == op)
+				EMIT(c, "\x66\x0f\x2e\xc1");
+			else
+				EMIT(c, "\x66\x0f\x2e\xc8");
+			if (ORD_GT == op || ORD_LT == op)
+				EMIT(c, "\x0f\x97\xc0");
+			else
+				EMIT(c, "\x0f\x93\xc0");
+		}
+	}
+	EMIT(c, "\x0f\xb6\xc0"); // movzx eax, al
+	return LVAL_LNG;
+}
+
+// if cond {then} {else}, any number but 0 is true, NaN too
+static int _if(struct jc* c, lval* x, int tail)
+{
+	if (4 != x->count || LVAL_QEXPR != LVAL_TYPE(x->cell[2]) || LVAL_QEXPR != LVAL_TYPE(x->cell[3]))
+		return -1;
+	int t = _expr(c, x->cell[1], 0);
+	size_t other;
+	if (LVAL_LNG == t) {
+		EMIT(c, "\x48\x85\xc0"); // test rax, rax
+		other = _jump(c, "\x0f\x84", 2);
+	}
+	else if (LVAL_DBL == t) {
+		// xorpd xmm1, xmm1; ucomisd xmm0, xmm1; jp .then; jz .else
+		EMIT(c, "\x66\x0f\x57\xc9\x66\x0f\x2e\xc1");
+		size_t nan = _jump(c, "\x0f\x8a", 2);
+		other = _jump(c, "\x0f\x84", 2);
+		_patch(c, nan, c->n);
+	}
+	else
+		return -1;
+
+	int a = _code(c, x->cell[2], tail);
+	size_t done = _jump(c, "\xe9", 1);
+	_patch(c, other, c->n);
+	int b = _code(c, x->cell[3], tail);
+	_patch(c, done, c->n);
+	return a >= 0 && a == b ? a : -1;
+}
+
+// A call of the lambda itself with arguments of the types it is compiled for.
+// In place of the frame the arguments are stored over the ones of this call
+// and the body is jumped to.
+static int _self(struct jc* c, lval* x, int tail)
+{
+	int n = x->count - 1;
+	if (n != c->nargs)
+		return -1;
+	for (int i = 0; i < n; i++) {
+		int t = _expr(c, x->cell[i+1], 0);
+		if (t != c->types[i])
+			return -1;
+		_push(c, t);
+	}
+
+	if (tail) {
+		for (int i = n - 1; i >= 0; i--) {
+			// pop rax; mov [rbp+disp], rax
+			EMIT(c, "\x58\x48\x89\x85");
+			_imm32(c, 16 + 8 * (c->nargs - 1 - i));
+			c->depth--;
+		}
+		_patch(c, _jump(c, "\xe9", 1), c->body);
+		return c->ret;
+	}
+
+	// call the start; add rsp, 8n
+	_patch(c, _jump(c, "\xe8", 1), 0);
+	EMIT(c, "\x48\x81\xc4");
+	_imm32(c, 8 * n);
+	c->depth -= n;
+	return c->ret;
+}
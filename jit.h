@@ -0,0 +1,59 @@
+#ifndef JIT_H_
+#define JIT_H_
+
+#include "common.h"
+
+// Machine code for hot numeric lambdas, on Linux x86-64. A lambda called
+// jit_threshold times is compiled for the types of the arguments of the next
+// call, when its body only uses its formals, number constants, the arithmetic
+// builtins but ^, the comparisons, if with {...} branches and calls of the
+// lambda itself through its global name, all on longs and doubles. Each
+// template keeps a long in rax and a double in xmm0 and pushes what it holds
+// while the next cell is worked out, the arguments are pushed by the caller.
+//
+// The body compiled is the one the interpreter runs, rewritten if it was, see
+// opt.h. The code relies on the global bindings of the names it calls and
+// those the rewrite relied on, on no frame binding them, and on the arguments
+// having the types it was compiled for, all are checked before it runs and
+// the call is interpreted otherwise.
+// A division by zero, a long that overflows into a bigint, see big.h, or
+// recursion past the depth left or the stack set aside for it, leaves the
+// code and the call is made again by the interpreter, which gives the error
+// or the bigint if there is one, the calls it makes for it do not run the
+// code. Code that misses its argument types jit_threshold times is
+// dropped and compiled again for the new ones. A lambda that is hot with an
+// argument that is no number is never compiled, so the vm keeps making its
+// calls in place, see vm.h.
+
+#define JIT_THRESHOLD 100
+#define JIT_MAX_ARGS 8
+#define JIT_STACK (512 << 10) // bytes of C stack the code may use
+
+extern int jit_enabled; // 1 on x86-64 Linux, 0 interprets every call
+extern unsigned long jit_threshold;
+
+struct jit_stats
+{
+	unsigned long compiles;
+	unsigned long failed; // lambdas that cannot be compiled
+	unsigned long runs;
+	unsigned long bails; // runs that left the code for the interpreter
+	unsigned long guards; // calls interpreted because an argument had another type
+	unsigned long dropped; // code thrown away after a name it called was rebound
+};
+
+// whether the call of f that is about to be made is run as machine code,
+// counting it towards jit_threshold, f being the value of any callee
+int jit_hot(lenv* e, lval* f);
+
+// The value of f called with the n values in argv, compiling f for their
+// types if it was not compiled yet, or NULL to interpret the call. Nothing is
+// taken, the value may be an error when the code left it to the interpreter.
+lval* jit_run(lenv* e, lval* f, lval** argv, int n);
+
+void ljit_release(ljit* j);
+
+void jit_get_stats(struct jit_stats* st);
+void jit_print_stats(FILE* fp); // and every function compiled, with its code size
+
+#endif
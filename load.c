@@ -0,0 +1,280 @@
+#define _XOPEN_SOURCE 700
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "load.h"
+#include "eval.h"
+#include "gc.h"
+#include "parser.h"
+#include "serial.h"
+
+#define LOAD_CHUNK 65536
+
+struct load_ctx
+{
+	lenv* env;
+	struct sbuf out; // precompiled forms
+	unsigned long nforms;
+	int bad; // a form had no encoding
+	int print; // every result, not only errors
+};
+
+static struct load_stats stats = { 0, 0, 0 };
+
+static char* _cache_path(const char* path, const char* key);
+static void _put_header(struct sbuf* b, const char* key, struct stat* st, unsigned long nforms);
+static lval* _read_cached(const char* cpath, const char* key, struct stat* st);
+static int _read_source(const char* path, struct load_ctx* ctx);
+static void _load_form(lval* form, void* arg);
+static void _stream_form(lval* form, void* arg);
+static void _eval_form(lenv* e, lval* form);
+static void _write_cache(const char* cpath, struct sbuf* head, struct sbuf* body);
+
+lval* builtin_load(lenv* e, lval* a)
+{
+	LVAL_ASSERT(e, a, (1 == a->count), LERR_BAD_ARGS_COUNT);
+	LVAL_ASSERT(e, a, (LVAL_STR == LVAL_TYPE(a->cell[0])), LERR_BAD_TYPE);
+
+	const char* path = a->cell[0]->str;
+	struct stat st;
+	if (stat(path, &st)) {
+		log_warn("could not stat %s", path);
+		lval_del(a);
+		return lval_err(LERR_IO);
+	}
+
+	// key on the absolute path so the same file is found from any cwd
+	char* abs = realpath(path, NULL);
+	const char* key = abs ? abs : path;
+	char* cpath = _cache_path(path, key);
+	lval* forms = cpath ? _read_cached(cpath, key, &st) : NULL;
+
+	if (forms) {
+		stats.hits++;
+		for (int i = 0; i < forms->count; i++)
+			_eval_form(e, forms->cell[i]);
+		forms->count = 0; // the forms were consumed by eval
+		lval_del(forms);
+		free(cpath);
+		free(abs);
+		lval_del(a);
+		return lval_sexpr();
+	}
+
+	stats.misses++;
+	struct load_ctx ctx = { e, { NULL, 0, 0 }, 0, 0, 0 };
+	int err = _read_source(path, &ctx);
+
+	if (!err && !ctx.bad && cpath) {
+		struct sbuf head = { NULL, 0, 0 };
+		_put_header(&head, key, &st, ctx.nforms);
+		_write_cache(cpath, &head, &ctx.out);
+		sbuf_free(&head);
+	}
+
+	sbuf_free(&ctx.out);
+	free(cpath);
+	free(abs);
+	lval_del(a);
+	return err < 0 ? lval_err(LERR_IO) : lval_sexpr();
+}
+
+int load_stream(lenv* e, FILE* fp, const char* name, int print)
+{
+	static char buf[LOAD_CHUNK];
+	struct load_ctx ctx = { e, { NULL, 0, 0 }, 0, 0, print };
+	int ret = 0;
+
+	lreader* r = lreader_new(name, _stream_form, &ctx);
+	if (NULL == r)
+		return 1;
+
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+		if (lreader_feed(r, buf, n) < 0)
+			ret = 1;
+	}
+	if (lreader_finish(r) < 0 || ferror(fp))
+		ret = 1;
+
+	lreader_del(r);
+	return ret;
+}
+
+void load_get_stats(struct load_stats* st)
+{
+	*st = stats;
+}
+
+// private functions: //////////////////////////////////////////////////////////
+
+static char* _cache_path(const char* path, const char* key)
+{
+	const char* dir = getenv(LOAD_CACHE_ENV);
+	char* cpath;
+
+	if (NULL == dir || '\0' == *dir) {
+		cpath = (char*)malloc(strlen(path) + 2);
+		if (cpath)
+			sprintf(cpath, "%sc", path);
+		return cpath;
+	}
+
+	cpath = (char*)malloc(strlen(dir) + 24);
+	if (cpath)
+		sprintf(cpath, "%s/%016llx.tlc", dir,
+			(unsigned long long)hash_bytes(key, strlen(key)));
+	return cpath;
+}
+
+static void _put_header(struct sbuf* b, const char* key, struct stat* st, unsigned long nforms)
+{
+	char version[16] = { 0 };
+	strncpy(version, TOYLISP_VERSION, sizeof(version) - 1);
+
+	sbuf_put(b, LOAD_MAGIC, 8);
+	sbuf_put(b, version, sizeof(version));
+	sbuf_put_uint(b, SERIAL_VERSION);
+	sbuf_put_str(b, key);
+	sbuf_put_int(b, st->st_mtim.tv_sec);
+	sbuf_put_int(b, st->st_mtim.tv_nsec);
+	sbuf_put_int(b, st->st_size);
+	sbuf_put_uint(b, nforms);
+}
+
+// all forms of an up to date precompiled file, NULL if there is none
+static lval* _read_cached(const char* cpath, const char* key, struct stat* st)
+{
+	struct sbuf want = { NULL, 0, 0 };
+	lval* forms = NULL;
+	char* data = NULL;
+	FILE* fp = fopen(cpath, "rb");
+	struct stat cst;
+
+	if (NULL == fp)
+		return NULL;
+	if (fstat(fileno(fp), &cst) || NULL == (data = malloc(cst.st_size + 1)))
+		goto out;
+	if (fread(data, 1, cst.st_size, fp) != (size_t)cst.st_size)
+		goto out;
+
+	// the header up to the form count must match byte for byte
+	_put_header(&want, key, st, 0);
+	want.len--;
+	if ((size_t)cst.st_size < want.len || memcmp(data, want.data, want.len))
+		goto out;
+
+	const char* p = data + want.len;
+	const char* end = data + cst.st_size;
+	uint64_t n;
+	if (sbuf_get_uint(&p, end, &n))
+		goto out;
+
+	forms = lval_sexpr();
+	for (uint64_t i = 0; i < n; i++) {
+		lval* x = lval_deserialize(&p, end);
+		if (NULL == x) {
+			lval_del(forms);
+			forms = NULL;
+			break;
+		}
+		lval_add_toback(forms, x);
+	}
+
+out:
+	sbuf_free(&want);
+	free(data);
+	fclose(fp);
+	return forms;
+}
+
+// 0 on success, 1 on a syntax error and -1 if the file could not be read
+static int _read_source(const char* path, struct load_ctx* ctx)
+{
+	static char buf[LOAD_CHUNK];
+	int ret = 0;
+	FILE* fp = fopen(path, "r");
+	if (NULL == fp)
+		return -1;
+
+	lreader* r = lreader_new(path, _load_form, ctx);
+	if (NULL == r) {
+		fclose(fp);
+		return -1;
+	}
+
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+		if (lreader_feed(r, buf, n) < 0)
+			ret = 1;
+	}
+	if (lreader_finish(r) < 0)
+		ret = 1;
+	if (ferror(fp))
+		ret = -1;
+
+	lreader_del(r);
+	fclose(fp);
+	return ret;
+}
+
+static void _load_form(lval* form, void* arg)
+{
+	struct load_ctx* ctx = (struct load_ctx*)arg;
+	if (lval_serialize(&ctx->out, form))
+		ctx->bad = 1;
+	ctx->nforms++;
+	_eval_form(ctx->env, form);
+}
+
+// nothing is precompiled, the result is dropped before the safepoint so the
+// trace does not take it for a leak
+static void _stream_form(lval* form, void* arg)
+{
+	struct load_ctx* ctx = (struct load_ctx*)arg;
+	ctx->nforms++;
+	if (ctx->print) {
+		lval* x = eval(ctx->env, form);
+		lval_println(x);
+		lval_del(x);
+	}
+	else
+		_eval_form(ctx->env, form);
+	gc_safepoint();
+}
+
+static void _eval_form(lenv* e, lval* form)
+{
+	lval* x = eval(e, form);
+	if (LVAL_ERR == LVAL_TYPE(x))
+		lval_println(x);
+	lval_del(x);
+}
+
+// written to a temporary name first so readers never see half a file
+static void _write_cache(const char* cpath, struct sbuf* head, struct sbuf* body)
+{
+	char* tmp = (char*)malloc(strlen(cpath) + 32);
+	if (NULL == tmp)
+		return;
+	sprintf(tmp, "%s.%ld.tmp", cpath, (long)getpid());
+
+	FILE* fp = fopen(tmp, "wb");
+	if (NULL == fp) {
+		debug("could not write %s", tmp);
+		free(tmp);
+		return;
+	}
+
+	int ok = fwrite(head->data, 1, head->len, fp) == head->len
+		&& fwrite(body->data, 1, body->len, fp) == body->len;
+	ok = (0 == fclose(fp)) && ok;
+
+	if (ok && 0 == rename(tmp, cpath))
+		stats.writes++;
+	else
+		remove(tmp);
+	free(tmp);
+}
+
@@ -0,0 +1,33 @@
+#ifndef LOAD_H_
+#define LOAD_H_
+
+#include "common.h"
+
+// load "file" evaluates every top level form of a source file. The forms are
+// also written in the serial.h encoding to a precompiled file, keyed by the
+// source path, mtime, size, interpreter version and SERIAL_VERSION, so
+// loading an unchanged file again skips the reader entirely. The precompiled file goes next to the
+// source ("file" + "c") or, when TOYLISP_CACHE_DIR is set, into that directory
+// named after a hash of the source path.
+
+#define LOAD_MAGIC "TLSPC\0\0\1"
+#define LOAD_CACHE_ENV "TOYLISP_CACHE_DIR"
+
+struct load_stats
+{
+	unsigned long hits; // loads served from a precompiled file
+	unsigned long misses;
+	unsigned long writes; // precompiled files written
+};
+
+lval* builtin_load(lenv* e, lval* a);
+
+// Evaluates the top level forms read from fp as soon as each is complete,
+// with constant buffering, printing the results (only errors unless print),
+// and runs gc_safepoint() after every form. 1 on a syntax or read error.
+int load_stream(lenv* e, FILE* fp, const char* name, int print);
+
+void load_get_stats(struct load_stats* st);
+
+#endif
+
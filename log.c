@@ -0,0 +1,223 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+#include "log.h"
+
+#define RING_MASK (LOG_RING_SIZE - 1)
+
+// single producer (the owning thread), single consumer (whoever holds
+// rings_lock), head and tail only ever grow and are masked on access
+struct log_ring
+{
+	char buf[LOG_RING_SIZE];
+	size_t head;
+	size_t tail;
+	int dead; // owning thread has exited, freed once drained
+	struct log_ring* next;
+};
+
+struct log_hdr
+{
+	FILE* fp;
+	size_t len;
+};
+
+int log_level = LOG_INFO;
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct log_ring* rings = NULL;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static __thread struct log_ring* my_ring = NULL;
+
+static pthread_t flusher;
+static int running = 0;
+static int stopping = 0;
+static unsigned long dropped = 0;
+
+static void _make_ring_key(void);
+static void _ring_exit(void* p);
+static struct log_ring* _ring_new(void);
+static void _ring_put(struct log_ring* r, size_t at, const void* src, size_t n);
+static void _ring_get(struct log_ring* r, size_t at, void* dst, size_t n);
+static void _drain(void);
+static void* _flusher_main(void* arg);
+
+int log_init(void)
+{
+	if (__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+		return 0;
+
+	__atomic_store_n(&stopping, 0, __ATOMIC_RELEASE);
+	if (pthread_create(&flusher, NULL, _flusher_main, NULL))
+		return 1;
+	__atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void log_shutdown(void)
+{
+	if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+		return;
+
+	__atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+	pthread_join(flusher, NULL);
+	_drain();
+}
+
+void log_flush(void)
+{
+	_drain();
+}
+
+unsigned long log_dropped(void)
+{
+	return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
+
+void log_write(FILE* fp, const char* fmt, ...)
+{
+	va_list ap;
+	if (NULL == fp)
+		return;
+
+	// no flusher yet (or any more), fall back to plain stdio
+	if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+		va_start(ap, fmt);
+		vfprintf(fp, fmt, ap);
+		va_end(ap);
+		return;
+	}
+
+	char line[LOG_LINE_MAX];
+	va_start(ap, fmt);
+	int n = vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+	if (n < 0)
+		return;
+	if (n >= (int)sizeof(line)) { // truncated, keep the newline
+		n = sizeof(line) - 1;
+		line[n-1] = '\n';
+	}
+
+	struct log_ring* r = my_ring ? my_ring : _ring_new();
+	struct log_hdr h = { fp, (size_t)n };
+	size_t need = sizeof(h) + n;
+	if (NULL == r) {
+		__atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	size_t head = r->head;
+	size_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	if (LOG_RING_SIZE - (head - tail) < need) {
+		__atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	_ring_put(r, head, &h, sizeof(h));
+	_ring_put(r, head + sizeof(h), line, n);
+	__atomic_store_n(&r->head, head + need, __ATOMIC_RELEASE);
+}
+
+// private functions: //////////////////////////////////////////////////////////
+
+static void _make_ring_key(void)
+{
+	pthread_key_create(&ring_key, _ring_exit);
+}
+
+static void _ring_exit(void* p)
+{
+	struct log_ring* r = (struct log_ring*)p;
+	__atomic_store_n(&r->dead, 1, __ATOMIC_RELEASE);
+}
+
+static struct log_ring* _ring_new(void)
+{
+	struct log_ring* r = (struct log_ring*)calloc(1, sizeof(struct log_ring));
+	if (NULL == r)
+		return NULL;
+
+	pthread_once(&ring_key_once, _make_ring_key);
+	pthread_setspecific(ring_key, r);
+
+	pthread_mutex_lock(&rings_lock);
+	r->next = rings;
+	rings = r;
+	pthread_mutex_unlock(&rings_lock);
+
+	my_ring = r;
+	return r;
+}
+
+static void _ring_put(struct log_ring* r, size_t at, const void* src, size_t n)
+{
+	size_t i = at & RING_MASK;
+	size_t first = MIN(n, LOG_RING_SIZE - i);
+	memcpy(r->buf + i, src, first);
+	memcpy(r->buf, (const char*)src + first, n - first);
+}
+
+static void _ring_get(struct log_ring* r, size_t at, void* dst, size_t n)
+{
+	size_t i = at & RING_MASK;
+	size_t first = MIN(n, LOG_RING_SIZE - i);
+	memcpy(dst, r->buf + i, first);
+	memcpy((char*)dst + first, r->buf, n - first);
+}
+
+static void _drain(void)
+{
+	char line[LOG_LINE_MAX];
+	int wrote = 0;
+
+	pthread_mutex_lock(&rings_lock);
+	for (struct log_ring** pr = &rings; *pr; ) {
+		struct log_ring* r = *pr;
+		int dead = __atomic_load_n(&r->dead, __ATOMIC_ACQUIRE);
+		size_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		size_t tail = r->tail;
+
+		while (tail != head) {
+			struct log_hdr h;
+			_ring_get(r, tail, &h, sizeof(h));
+			_ring_get(r, tail + sizeof(h), line, h.len);
+			fwrite(line, 1, h.len, h.fp);
+			tail += sizeof(h) + h.len;
+			wrote = 1;
+		}
+		__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+
+		if (dead) {
+			*pr = r->next;
+			free(r);
+		}
+		else
+			pr = &r->next;
+	}
+
+	if (wrote)
+		fflush(NULL);
+	pthread_mutex_unlock(&rings_lock);
+}
+
+static void* _flusher_main(void* arg)
+{
+	struct timespec ts = { 0, LOG_FLUSH_INTERVAL_MS * 1000000L };
+	(void)arg;
+
+	while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+		_drain();
+		nanosleep(&ts, NULL);
+	}
+	return NULL;
+}
+
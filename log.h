@@ -0,0 +1,52 @@
+#ifndef LOG_H_
+#define LOG_H_
+
+#include <stdio.h>
+
+// Leveled logging. A level above LOG_COMPILE_LEVEL is compiled out, the rest
+// cost one branch on log_level when disabled. Enabled records are formatted
+// into a per-thread ring buffer and written out by a background flusher, so
+// logging never blocks evaluation on stdio. When the ring is full the record
+// is dropped and counted rather than waiting for the flusher.
+
+enum LOG_LEVELS
+{
+	LOG_ERR,
+	LOG_WARN,
+	LOG_INFO,
+	LOG_DEBUG
+};
+
+#ifndef LOG_COMPILE_LEVEL
+#ifdef NDEBUG
+#define LOG_COMPILE_LEVEL LOG_INFO
+#else
+#define LOG_COMPILE_LEVEL LOG_DEBUG
+#endif
+#endif
+
+#define LOG_RING_SIZE (1 << 16) // bytes per thread, must be a power of two
+#define LOG_LINE_MAX 512
+#define LOG_FLUSH_INTERVAL_MS 10
+
+#define LOG_ENABLED(LVL) \
+	((LVL) <= LOG_COMPILE_LEVEL && __builtin_expect((LVL) <= log_level, 0))
+
+#define LOG_AT(FP, LVL, M, ...) \
+	do { \
+		if (LOG_ENABLED(LVL)) \
+			log_write(FP, M "\n", __VA_ARGS__); \
+	} while (0)
+
+extern int log_level; // runtime level, LOG_INFO by default
+
+int log_init(void); // starts the flusher, records are written synchronously before
+void log_shutdown(void); // drains all rings and stops the flusher
+void log_flush(void);
+unsigned long log_dropped(void);
+
+void log_write(FILE* fp, const char* fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+#endif
+
@@ -1,41 +1,25 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <editline/readline.h>
 
 #include "common.h"
-#include "parser.h"
 #include "eval.h"
+#include "cache.h"
+#include "image.h"
+#include "gc.h"
+#include "load.h"
 
-int main(void)
+static int run_repl(lenv* e)
 {
-	int ret = 0;
-	// TODO make this optional, i.e. parse argc argv
-	logfp = fopen(LOGFILE, "w+");
-	if (NULL == logfp)
-	{
-		log_err("freopen failed on %s", LOGFILE);
-		return 1;
-	}
-
 	puts("toylist v0.1");
-	ret = init_parser();
-	if ( 0 != ret )
-		goto cleanup;
-
-	lenv* e = lenv_new();
-	if (NULL == e)
-	{
-		ret = 1;
-		goto cleanup;
-	}
-
-	ret = init_env(e);
-	if ( 0 != ret )
-		goto cleanup_env;
-
 	for (;;)
 	{
 		char* input = readline("->> ");
+		if (NULL == input)
+			break;
 		add_history(input);
 
 		int command = colon_commands(input, e);
@@ -48,30 +32,108 @@ int main(void)
 			break;
 		}
 
-		mpc_ast_t* ast = parse(input);
+		lval* x = eval_str(e, input);
 
-		if (!ast)
+		if (!x)
 		{
 			free(input);
 			continue;
 		}
 
-		lval* x = eval(e, ast_to_lval(ast));
 		lval_println(x);
 		lval_del(x);
+		gc_safepoint();
 
-		mpc_ast_delete(ast);
 		free(input);
 	}
+	clear_history();
+	return 0;
+}
+
+// usage: toylisp [--image file] [--engine tree|vm] [--max-depth n] [file...]
+// Files and piped stdin are streamed, where every top level expression is a
+// form of its own, a terminal gets the line based repl. An image saved with
+// :save is restored before anything runs.
+int main(int argc, char* argv[])
+{
+	const char* image = NULL;
+	int first = 1;
+	int ret = 0;
+	// TODO make this optional, i.e. parse argc argv
+	logfp = fopen(LOGFILE, "w+");
+	if (NULL == logfp)
+	{
+		log_err("freopen failed on %s", LOGFILE);
+		return 1;
+	}
+	log_init();
+
+	lenv* e = lenv_new();
+	if (NULL == e)
+	{
+		ret = 1;
+		goto cleanup;
+	}
+
+	ret = init_env(e);
+	if ( 0 != ret )
+		goto cleanup_env;
+
+	for (; first + 1 < argc; first += 2) {
+		if (0 == strcmp(argv[first], "--image"))
+			image = argv[first + 1];
+		else if (0 == strcmp(argv[first], "--engine")) {
+			if (0 == strcmp(argv[first + 1], "tree"))
+				eval_engine = ENGINE_TREE;
+			else if (0 == strcmp(argv[first + 1], "vm"))
+				eval_engine = ENGINE_VM;
+			else {
+				log_err("unknown engine %s, valid options are tree or vm", argv[first + 1]);
+				ret = 1;
+				goto cleanup_env;
+			}
+		}
+		else if (0 == strcmp(argv[first], "--max-depth")) {
+			eval_max_depth = atoi(argv[first + 1]);
+			if (eval_max_depth <= 0) {
+				log_err("the max depth must be positive, not %s", argv[first + 1]);
+				ret = 1;
+				goto cleanup_env;
+			}
+		}
+		else
+			break;
+	}
+
+	if (image) {
+		ret = image_load(e, image);
+		if ( 0 != ret )
+			goto cleanup_env;
+	}
+
+	if (argc > first) {
+		for (int i = first; i < argc && 0 == ret; i++) {
+			FILE* fp = fopen(argv[i], "r");
+			if (NULL == fp) {
+				log_err("fopen failed on %s", argv[i]);
+				ret = 1;
+				break;
+			}
+			ret = load_stream(e, fp, argv[i], 1);
+			fclose(fp);
+		}
+	}
+	else if (!isatty(fileno(stdin)))
+		ret = load_stream(e, stdin, "<stdin>", 1);
+	else
+		ret = run_repl(e);
 
 cleanup_env:
 	lenv_del(e);
+	pcache_clear();
 cleanup:
-	clear_history();
-	mpc_cleanup(7, Long, Double, Symbol, Qexpr, Sexpr, Expr, Lisp);
+	log_shutdown();
 	fclose(logfp);
 	return ret;
 }
 
-
-
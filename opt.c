@@ -0,0 +1,619 @@
+#include "opt.h"
+#include "clos.h"
+#include "eval.h"
+#include "image.h"
+#include "jit.h"
+#include "symtab.h"
+
+struct lopt
+{
+	int refs;
+	unsigned gc_epoch; // of the last lopt_trace() that reached it
+	lenv* root; // the global frame the names were looked up in
+	lval* body; // rewritten, a qexpr like the one it stands for, or that one
+	lclos* clos; // body compiled for the tree walker, see clos.h
+	ljit* jit; // the lambda as machine code, see jit.h
+	int nsyms;
+	const char** syms; // the names relied on
+	uint32_t* rebinds; // SYM_REBINDS() of each then
+};
+
+// one rewrite of a body or a form
+struct opt
+{
+	lenv* root;
+	lval* formals; // of the lambda, NULL for a top level form
+	int effects; // a call that could rebind a name ran before the code looked at
+	int rewrites;
+	int nsyms;
+	int syms_cap;
+	const char** syms;
+};
+
+typedef lval* (*opt_rule)(struct opt* o, lval* x);
+
+// image lambdas are read-only, their lopts are kept here
+struct image_opt
+{
+	const lval* f;
+	lopt* opt;
+	struct image_opt* next;
+};
+
+#define IMAGE_OPT_BUCKETS 256
+
+// builtins that change nothing and do not look at the env, fold says whether
+// a call on constants may be made right away
+static const struct
+{
+	lbuiltin func;
+	int fold;
+} PURE[] =
+{
+	{ builtin_head, 1 }, { builtin_tail, 1 }, { builtin_join, 1 }, { builtin_cons, 1 },
+	{ builtin_len, 1 }, { builtin_init, 1 },
+	{ builtin_add, 1 }, { builtin_sub, 1 }, { builtin_mul, 1 }, { builtin_div, 1 },
+	{ builtin_mod, 1 }, { builtin_pow, 1 }, { builtin_min, 1 }, { builtin_max, 1 },
+	{ builtin_gt, 1 }, { builtin_lt, 1 }, { builtin_ge, 1 }, { builtin_le, 1 },
+	{ builtin_eq, 1 }, { builtin_ne, 1 },
+	{ builtin_quote, 0 }, { builtin_lambda, 0 },
+};
+
+int opt_passes = OPT_ALL;
+int opt_dump = 0;
+
+static struct opt_stats stats = { 0, 0, 0, 0, 0, 0, 0 };
+static struct image_opt* image_opts[IMAGE_OPT_BUCKETS];
+
+static lopt** _slot(lenv* e, lval* f);
+static lval* _copy(lval* x);
+static int _cells(lval* x);
+static int _constant(lval* x);
+static int _local(struct opt* o, const char* sym);
+static lval* _global(struct opt* o, const char* sym);
+static void _rely(struct opt* o, const char* sym);
+static lbuiltin _pure(struct opt* o, lval* head, int fold);
+static int _is_if(struct opt* o, lval* x);
+static lval* _walk(struct opt* o, lval* x, opt_rule rule);
+static lval* _code(struct opt* o, lval* q, opt_rule rule);
+static int _calls_pure(struct opt* o, lval* x, lval* formals);
+static int _harmless(struct opt* o, lval* head);
+static lval* _subst(struct opt* o, lval* x, lval* formals, lval* call);
+static lval* _inline(struct opt* o, lval* x);
+static lval* _fold(struct opt* o, lval* x);
+static lval* _dce(struct opt* o, lval* x);
+static lval* _passes(struct opt* o, lval* x, int body);
+
+static const struct
+{
+	const char* name;
+	int pass;
+	opt_rule rule;
+} PASSES[] =
+{
+	{ "inline", OPT_INLINE, _inline },
+	{ "fold", OPT_FOLD, _fold },
+	{ "dce", OPT_DCE, _dce },
+};
+
+#define NPASSES ((int)(sizeof(PASSES) / sizeof(PASSES[0])))
+
+lopt* opt_lambda(lenv* e, lval* f)
+{
+	if (NULL == f->formals)
+		return NULL;
+
+	// without a rewrite the body is kept as written, relying on nothing
+	struct opt o = { e->root ? e->root : e, f->formals, 0, 0, 0, 0, NULL };
+	lval* body = opt_passes ? _passes(&o, f->body, 1) : lval_copy(f->body);
+	if (0 == o.rewrites) {
+		lval_del(body);
+		body = lval_copy(f->body);
+		o.nsyms = 0;
+	}
+	lopt* p = (lopt*)calloc(1, sizeof(lopt));
+	if (p)
+		p->rebinds = (uint32_t*)malloc(sizeof(uint32_t) * (o.nsyms + 1));
+	if (NULL == p || NULL == p->rebinds) {
+		free(p);
+		free(o.syms);
+		lval_del(body);
+		return NULL;
+	}
+
+	p->refs = 1;
+	p->root = o.root;
+	p->body = body;
+	p->nsyms = o.nsyms;
+	p->syms = o.syms;
+	for (int i = 0; i < o.nsyms; i++)
+		p->rebinds[i] = SYM_REBINDS(o.syms[i]);
+	if (o.rewrites)
+		stats.lambdas++;
+	return p;
+}
+
+lval* opt_form(lenv* e, lval* v)
+{
+	if (0 == opt_passes || e->par || LVAL_SEXPR != LVAL_TYPE(v))
+		return v;
+
+	// it runs right away, nothing it relies on can change before
+	struct opt o = { e, NULL, 0, 0, 0, 0, NULL };
+	lval* x = _passes(&o, v, 0);
+	free(o.syms);
+	if (0 == o.rewrites) {
+		lval_del(x);
+		return v;
+	}
+	lval_del(v);
+	stats.forms++;
+	// a single cell form evaluates to the value of the cell
+	return LVAL_SEXPR == LVAL_TYPE(x) ? x : lval_add_toback(lval_sexpr(), x);
+}
+
+// rewritten again after a name it relies on was rebound
+lval* opt_body(lenv* e, lval* f)
+{
+	lopt** slot = _slot(e, f);
+	lopt* o = slot ? *slot : NULL;
+	if (NULL == o || 0 == opt_passes)
+		return f->body;
+	if (opt_valid(e, o))
+		return o->body;
+
+	lenv* root = e->root ? e->root : e;
+	for (int i = 0; i < o->nsyms; i++) {
+		if (1 != SYM_BINDS(o->syms[i]) || root != o->root) {
+			stats.skipped++;
+			return NULL;
+		}
+	}
+	stats.redone++;
+	*slot = opt_lambda(e, f);
+	lopt_release(o);
+	return *slot ? (*slot)->body : f->body;
+}
+
+lopt* opt_of(lval* f)
+{
+	if (!image_contains(f))
+		return f->opt;
+	for (struct image_opt* x = image_opts[((uintptr_t)f >> 4) % IMAGE_OPT_BUCKETS]; x; x = x->next) {
+		if (x->f == f)
+			return x->opt;
+	}
+	return NULL;
+}
+
+lclos** opt_clos(lval* f, lval* body)
+{
+	lopt* o = opt_of(f);
+	return o && body == o->body ? &o->clos : NULL;
+}
+
+ljit** opt_jit(lval* f)
+{
+	lopt* o = opt_of(f);
+	return o ? &o->jit : NULL;
+}
+
+int opt_valid(lenv* e, lopt* o)
+{
+	if ((e->root ? e->root : e) != o->root)
+		return 0;
+	for (int i = 0; i < o->nsyms; i++) {
+		if (1 != SYM_BINDS(o->syms[i]) || o->rebinds[i] != SYM_REBINDS(o->syms[i]))
+			return 0;
+	}
+	return 1;
+}
+
+lopt* lopt_retain(lopt* o)
+{
+	o->refs++;
+	return o;
+}
+
+void lopt_release(lopt* o)
+{
+	if (NULL == o || --o->refs > 0)
+		return;
+	lval_del(o->body);
+	lclos_release(o->clos);
+	ljit_release(o->jit);
+	free(o->syms);
+	free(o->rebinds);
+	free(o);
+}
+
+void lopt_trace(lopt* o, unsigned epoch, void (*visit)(lval*))
+{
+	if (o->gc_epoch == epoch)
+		return;
+	o->gc_epoch = epoch;
+	visit(o->body);
+	if (o->clos)
+		lclos_trace(o->clos, epoch, visit);
+}
+
+void opt_trace(unsigned epoch, void (*visit)(lval*))
+{
+	for (int i = 0; i < IMAGE_OPT_BUCKETS; i++) {
+		for (struct image_opt* x = image_opts[i]; x; x = x->next) {
+			if (x->opt)
+				lopt_trace(x->opt, epoch, visit);
+		}
+	}
+}
+
+void opt_get_stats(struct opt_stats* st)
+{
+	*st = stats;
+}
+
+void opt_print_stats(FILE* fp)
+{
+	fprintf(fp, "passes:");
+	for (int i = 0; i < NPASSES; i++)
+		fprintf(fp, " %s %s", PASSES[i].name, (opt_passes & PASSES[i].pass) ? "on" : "off");
+	fprintf(fp, ", dump %s\n", opt_dump ? "on" : "off");
+	fprintf(fp, "rewritten: %lu lambdas, %lu forms, %lu again\n", stats.lambdas, stats.forms, stats.redone);
+	fprintf(fp, "inlined: %lu, folded: %lu, pruned: %lu\n", stats.inlined, stats.folded, stats.pruned);
+	fprintf(fp, "run as written: %lu\n", stats.skipped);
+}
+
+// private functions: //////////////////////////////////////////////////////////
+
+// where the lopt of f is kept, one of an image lambda is made on its first
+// call, as eval.c makes one when any other lambda is built
+static lopt** _slot(lenv* e, lval* f)
+{
+	if (!image_contains(f))
+		return &f->opt;
+
+	struct image_opt** b = &image_opts[((uintptr_t)f >> 4) % IMAGE_OPT_BUCKETS];
+	for (struct image_opt* x = *b; x; x = x->next) {
+		if (x->f == f)
+			return &x->opt;
+	}
+	if (!opt_passes && !clos_enabled && !jit_enabled)
+		return NULL;
+
+	struct image_opt* x = (struct image_opt*)malloc(sizeof(struct image_opt));
+	if (NULL == x)
+		return NULL;
+	x->f = f;
+	x->opt = opt_lambda(e, f);
+	x->next = *b;
+	*b = x;
+	return &x->opt;
+}
+
+// the lists are new and can be changed in place, everything else is shared
+static lval* _copy(lval* x)
+{
+	if (LVAL_SEXPR != LVAL_TYPE(x) && LVAL_QEXPR != LVAL_TYPE(x))
+		return lval_copy(x);
+
+	lval* y = LVAL_SEXPR == LVAL_TYPE(x) ? lval_sexpr() : lval_qexpr();
+	for (int i = 0; i < x->count; i++)
+		lval_add_toback(y, _copy(x->cell[i]));
+	return y;
+}
+
+static int _cells(lval* x)
+{
+	int n = 1;
+	if (LVAL_SEXPR == LVAL_TYPE(x) || LVAL_QEXPR == LVAL_TYPE(x)) {
+		for (int i = 0; i < x->count; i++)
+			n += _cells(x->cell[i]);
+	}
+	return n;
+}
+
+// evaluates to itself
+static int _constant(lval* x)
+{
+	int t = LVAL_TYPE(x);
+	return LVAL_LNG == t || LVAL_DBL == t || LVAL_BIG == t || LVAL_STR == t || LVAL_QEXPR == t;
+}
+
+static int _local(struct opt* o, const char* sym)
+{
+	for (int i = 0; o->formals && i < o->formals->count; i++) {
+		if (o->formals->cell[i]->sym == sym && SYM_AMP != sym)
+			return 1;
+	}
+	return 0;
+}
+
+// the global value of sym, NULL when a frame could bind it
+static lval* _global(struct opt* o, const char* sym)
+{
+	if (_local(o, sym) || 1 != SYM_BINDS(sym))
+		return NULL;
+	int i = lenv_slot(o->root, sym);
+	return i < 0 ? NULL : o->root->vals[i];
+}
+
+static void _rely(struct opt* o, const char* sym)
+{
+	for (int i = 0; i < o->nsyms; i++) {
+		if (o->syms[i] == sym)
+			return;
+	}
+	if (o->nsyms == o->syms_cap) {
+		int cap = o->syms_cap ? 2 * o->syms_cap : 8;
+		const char** syms = (const char**)realloc(o->syms, sizeof(char*) * cap);
+		if (NULL == syms)
+			return;
+		o->syms = syms;
+		o->syms_cap = cap;
+	}
+	o->syms[o->nsyms++] = sym;
+}
+
+// the pure builtin head names, relied on from then on
+static lbuiltin _pure(struct opt* o, lval* head, int fold)
+{
+	if (LVAL_SYM != LVAL_TYPE(head))
+		return NULL;
+	lval* f = _global(o, head->sym);
+	if (NULL == f || LVAL_FUN != LVAL_TYPE(f) || NULL == f->builtin)
+		return NULL;
+
+	for (size_t i = 0; i < sizeof(PURE) / sizeof(PURE[0]); i++) {
+		if (PURE[i].func == f->builtin && (PURE[i].fold || !fold)) {
+			_rely(o, head->sym);
+			return f->builtin;
+		}
+	}
+	return NULL;
+}
+
+// if cond {then} {else} with if the builtin, the branches are code
+static int _is_if(struct opt* o, lval* x)
+{
+	if (4 != x->count || LVAL_SYM != LVAL_TYPE(x->cell[0])
+		|| LVAL_QEXPR != LVAL_TYPE(x->cell[2]) || LVAL_QEXPR != LVAL_TYPE(x->cell[3]))
+		return 0;
+	lval* f = _global(o, x->cell[0]->sym);
+	if (NULL == f || LVAL_FUN != LVAL_TYPE(f) || builtin_if != f->builtin)
+		return 0;
+	_rely(o, x->cell[0]->sym);
+	return 1;
+}
+
+// Applies rule to the calls in the code x in the order they run, up to the
+// first one that could change what the rules rely on. The cells of a call run
+// before it, the branches of an if after its condition. Takes x.
+static lval* _walk(struct opt* o, lval* x, opt_rule rule)
+{
+	if (o->effects || NULL == (x = lval_own(x)))
+		return x;
+
+	lval* head = x->count ? x->cell[0] : NULL;
+	int quoted = head && LVAL_SYM == LVAL_TYPE(head) && (SYM_QUOTE == head->sym || SYM_LIST == head->sym);
+	int branches = _is_if(o, x);
+	for (int i = 0; i < x->count && !o->effects; i++) {
+		if ((i && quoted) || (branches && i > 1))
+			break;
+		if (LVAL_SEXPR == LVAL_TYPE(x->cell[i]))
+			x->cell[i] = _walk(o, x->cell[i], rule);
+	}
+	if (o->effects || x->count < 2)
+		return x;
+
+	if (branches) {
+		int effects = 0;
+		for (int i = 2; i < 4; i++) {
+			x->cell[i] = _code(o, x->cell[i], rule);
+			effects |= o->effects;
+			o->effects = 0;
+		}
+		o->effects = effects;
+	}
+
+	int rewrites = o->rewrites;
+	x = rule(o, x);
+	if (rewrites == o->rewrites && !branches && !_harmless(o, x->cell[0]))
+		o->effects = 1;
+	return x;
+}
+
+// the qexpr q run as code, a qexpr again, takes q
+static lval* _code(struct opt* o, lval* q, opt_rule rule)
+{
+	if (NULL == (q = lval_own(q)))
+		return q;
+	q->type = LVAL_SEXPR;
+	lval* x = _walk(o, q, rule);
+	if (LVAL_SEXPR == LVAL_TYPE(x)) {
+		x->type = LVAL_QEXPR;
+		return x;
+	}
+	return lval_add_toback(lval_qexpr(), x);
+}
+
+// whether the code x only calls pure builtins and if, and never one of formals
+static int _calls_pure(struct opt* o, lval* x, lval* formals)
+{
+	lval* head = x->count ? x->cell[0] : NULL;
+	int quoted = head && LVAL_SYM == LVAL_TYPE(head) && (SYM_QUOTE == head->sym || SYM_LIST == head->sym);
+	int branches = _is_if(o, x);
+	if (x->count > 1 && !branches) {
+		for (int i = 0; LVAL_SYM == LVAL_TYPE(head) && i < formals->count; i++) {
+			if (formals->cell[i]->sym == head->sym)
+				return 0;
+		}
+		if (NULL == _pure(o, head, 0))
+			return 0;
+	}
+
+	for (int i = 0; i < x->count; i++) {
+		if (i && quoted)
+			break;
+		lval* c = x->cell[i];
+		if ((LVAL_SEXPR == LVAL_TYPE(c) || (branches && i > 1)) && !_calls_pure(o, c, formals))
+			return 0;
+	}
+	return 1;
+}
+
+// whether calling head leaves every binding as it was
+static int _harmless(struct opt* o, lval* head)
+{
+	if (_pure(o, head, 0))
+		return 1;
+	if (LVAL_SYM != LVAL_TYPE(head))
+		return 0;
+	lval* f = _global(o, head->sym);
+	if (NULL == f || LVAL_FUN != LVAL_TYPE(f) || f->builtin || !_calls_pure(o, f->body, f->formals))
+		return 0;
+	_rely(o, head->sym);
+	return 1;
+}
+
+// a copy of the code x with the arguments of call in place of formals, in
+// the cells that are evaluated
+static lval* _subst(struct opt* o, lval* x, lval* formals, lval* call)
+{
+	lval* head = x->count ? x->cell[0] : NULL;
+	int quoted = head && LVAL_SYM == LVAL_TYPE(head) && (SYM_QUOTE == head->sym || SYM_LIST == head->sym);
+	int branches = _is_if(o, x);
+	lval* y = lval_sexpr();
+
+	for (int i = 0; i < x->count; i++) {
+		lval* c = x->cell[i];
+		lval* r = NULL;
+		if (i && quoted)
+			r = _copy(c);
+		else if (LVAL_SYM == LVAL_TYPE(c)) {
+			for (int k = 0; k < formals->count && NULL == r; k++) {
+				if (formals->cell[k]->sym == c->sym)
+					r = lval_copy(call->cell[k + 1]);
+			}
+		}
+		else if (LVAL_SEXPR == LVAL_TYPE(c))
+			r = _subst(o, c, formals, call);
+		else if (branches && i > 1) {
+			r = _subst(o, c, formals, call);
+			r->type = LVAL_QEXPR;
+		}
+		lval_add_toback(y, r ? r : _copy(c));
+	}
+	return y;
+}
+
+// (f a b) for f (\ {x y} {body}), body with a and b put in for x and y when
+// the body calls pure builtins only, so nothing could look for x and y in the
+// frame the call would have had, and the arguments can neither fail nor
+// change anything when they are evaluated in another order, or not at all
+static lval* _inline(struct opt* o, lval* x)
+{
+	lval* head = x->cell[0];
+	if (LVAL_SYM != LVAL_TYPE(head))
+		return x;
+	lval* f = _global(o, head->sym);
+	if (NULL == f || LVAL_FUN != LVAL_TYPE(f) || f->builtin || f->args
+		|| f->formals->count != x->count - 1 || _cells(f->body) > OPT_INLINE_MAX)
+		return x;
+	for (int i = 0; i < f->formals->count; i++) {
+		if (SYM_AMP == f->formals->cell[i]->sym)
+			return x;
+	}
+
+	for (int i = 1; i < x->count; i++) {
+		lval* a = x->cell[i];
+		if (_constant(a) || (LVAL_SYM == LVAL_TYPE(a) && _local(o, a->sym)))
+			continue;
+		if (LVAL_SYM != LVAL_TYPE(a) || NULL == _global(o, a->sym))
+			return x;
+	}
+	if (!_calls_pure(o, f->body, f->formals))
+		return x;
+
+	_rely(o, head->sym);
+	for (int i = 1; i < x->count; i++) {
+		if (LVAL_SYM == LVAL_TYPE(x->cell[i]) && !_local(o, x->cell[i]->sym))
+			_rely(o, x->cell[i]->sym);
+	}
+
+	// a body of one cell is the value of that cell
+	lval* r = _subst(o, f->body, f->formals, x);
+	if (1 == r->count) {
+		lval* y = lval_copy(r->cell[0]);
+		lval_del(r);
+		r = y;
+	}
+	lval_del(x);
+	o->rewrites++;
+	stats.inlined++;
+	return r;
+}
+
+static lval* _fold(struct opt* o, lval* x)
+{
+	for (int i = 1; i < x->count; i++) {
+		if (!_constant(x->cell[i]))
+			return x;
+	}
+	lbuiltin func = _pure(o, x->cell[0], 1);
+	if (NULL == func)
+		return x;
+
+	lval* a = lval_sexpr();
+	for (int i = 1; i < x->count; i++)
+		lval_add_toback(a, lval_copy(x->cell[i]));
+	lval* r = func(o->root, a);
+	if (LVAL_ERR == LVAL_TYPE(r)) {
+		lval_del(r);
+		return x;
+	}
+	lval_del(x);
+	o->rewrites++;
+	stats.folded++;
+	return r;
+}
+
+// the branch a constant condition takes, run like if would run it
+static lval* _dce(struct opt* o, lval* x)
+{
+	lval* cond = x->cell[1];
+	if (!LVAL_IS_NUM(cond) || !_is_if(o, x))
+		return x;
+
+	lval* b = lval_copy(x->cell[GET_LVAL_NUM_TYPE(cond) ? 2 : 3]);
+	lval_del(x);
+	o->rewrites++;
+	stats.pruned++;
+	if (1 == b->count) {
+		lval* y = lval_copy(b->cell[0]);
+		lval_del(b);
+		return y;
+	}
+	b = lval_own(b);
+	b->type = LVAL_SEXPR;
+	return b;
+}
+
+// a rewritten copy of x, a lambda body or a top level form
+static lval* _passes(struct opt* o, lval* x, int body)
+{
+	x = _copy(x);
+	for (int i = 0; i < NPASSES; i++) {
+		if (0 == (opt_passes & PASSES[i].pass))
+			continue;
+		o->effects = 0;
+		if (body)
+			x = _code(o, x, PASSES[i].rule);
+		else if (LVAL_SEXPR == LVAL_TYPE(x))
+			x = _walk(o, x, PASSES[i].rule);
+		if (opt_dump) {
+			printf("%-8s", PASSES[i].name);
+			lval_println(x);
+		}
+	}
+	return x;
+}
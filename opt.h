@@ -0,0 +1,63 @@
+#ifndef OPT_H_
+#define OPT_H_
+
+#include "common.h"
+
+// Rewrites of code before it runs, of a lambda body when the lambda is built
+// and of a top level form before it is evaluated. The passes run in order:
+//
+//   inline: a call of a small global lambda whose body calls nothing but pure
+//           builtins, given constants or bound names, becomes that body with
+//           the arguments put in for the formals, arguments of unused formals
+//           are dropped
+//   fold:   a call of a pure builtin on constants becomes its value, unless
+//           that is an error
+//   dce:    if with a constant condition becomes the branch it takes
+//
+// Scoping is dynamic and any name can be rebound, so a rewrite relies on the
+// global bindings of the names it looked at and on no frame binding them, and
+// is only made in code that runs before the first call that could change
+// that. A lambda keeps its body as written and runs the rewritten one while
+// those names are bound as they were, see opt_body(). Its lopt also holds what
+// the body is compiled to for the tree walker and the machine code of the
+// lambda, so a lambda gets one even when nothing could be rewritten. Image
+// lambdas are read-only and get theirs on their first call, kept aside.
+
+enum OPT_PASS { OPT_INLINE = 1, OPT_FOLD = 2, OPT_DCE = 4, OPT_ALL = 7 };
+
+#define OPT_INLINE_MAX 16 // cells in the body of a lambda that is inlined
+
+extern int opt_passes; // OPT_ALL, 0 runs code as written
+extern int opt_dump; // print the code after each pass
+
+struct opt_stats
+{
+	unsigned long lambdas; // bodies rewritten
+	unsigned long forms; // top level forms rewritten
+	unsigned long inlined;
+	unsigned long folded;
+	unsigned long pruned; // if branches dropped
+	unsigned long redone; // bodies rewritten again after a name was rebound
+	unsigned long skipped; // runs of a body as written because a frame binds a name
+};
+
+lopt* opt_lambda(lenv* e, lval* f); // the body as written when the passes are off
+lval* opt_form(lenv* e, lval* v); // takes v
+
+// the body to run f with in e, which the caller holds on to as long as f,
+// NULL while a frame binds a name the rewrite relied on, f->body is run then
+lval* opt_body(lenv* e, lval* f);
+lopt* opt_of(lval* f); // f->opt, of an image lambda the one kept for it
+lclos** opt_clos(lval* f, lval* body); // where body is kept compiled, NULL if not by f
+ljit** opt_jit(lval* f); // where f keeps its machine code, NULL if it cannot
+int opt_valid(lenv* e, lopt* o); // whether o still holds in e
+
+lopt* lopt_retain(lopt* o);
+void lopt_release(lopt* o);
+void lopt_trace(lopt* o, unsigned epoch, void (*visit)(lval*));
+void opt_trace(unsigned epoch, void (*visit)(lval*)); // those of image lambdas
+
+void opt_get_stats(struct opt_stats* st);
+void opt_print_stats(FILE* fp);
+
+#endif
@@ -1,66 +1,623 @@
 
+
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
 
 #include "parser.h"
 #include "common.h"
+#include "big.h"
 
-static int all_isspace(const char* input)
-{
-	while (isspace(*input))
-		input++;
+#define MAX_EXACT_DIGITS 15 // digits that always fit in the 53 bit mantissa
 
-	if (*input== '\0')
-		return 1;
+struct reader
+{
+	const char* start;
+	const char* p; // current position
+	const char* end;
+	const char* err; // NULL if no error
+	const char* err_pos;
+};
 
-	return 0;
-}
+static const double POW10[] =
+{
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
 
-int init_parser()
+struct lreader
 {
-	Long		= mpc_new("long");
-	Double		= mpc_new("double");
-	Symbol		= mpc_new("symbol");
-	Sexpr		= mpc_new("sexpr");
-	Qexpr		= mpc_new("qexpr");
-	Expr		= mpc_new("expr");
-	Lisp		= mpc_new("lisp");
+	const char* name;
+	lreader_emit emit;
+	void* ctx;
+
+	lval** stack; // lists that are still open, innermost last
+	int depth;
+	int cap;
+
+	char* tok; // token split across chunks
+	size_t tok_len;
+	size_t tok_cap;
+	int tok_str; // tok is an unterminated string literal
+	int tok_esc; // and it ends with a backslash
+
+	int skip; // open lists of a broken form still to pass over
+	int skip_str; // inside a string literal of it
+	int skip_esc;
+
+	long line;
+	long col;
+};
 
-	mpca_lang(MPCA_LANG_DEFAULT,
-		"long		: /-?\\d+/ ;"
-		"double		: /-?\\d*\\.\\d+|-?\\d+\\./ ;"
-		// symbol can't have some special characters like ', ", {, (, etc
-		"symbol		: /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&\\^]+/ ; "
-		"sexpr		: '(' <expr>* ')' ;"
-		"qexpr		: '{' <expr>* '}' ;"
-		"expr		: <double> | <long> | <symbol> | <sexpr> | <qexpr> ;"
-		"lisp		: /^/ <expr>* /$/ ;",
-		Long, Double, Symbol, Sexpr, Qexpr, Expr, Lisp);
-	return 0; // TODO error checking
+static unsigned char sym_chars[UCHAR_MAX+1];
+static int sym_chars_ready = 0;
+
+static void _init_sym_chars(void);
+static void _skip_space(struct reader* r);
+static lval* _read_expr(struct reader* r);
+static lval* _read_list(struct reader* r, lval* x, const char close);
+static lval* _read_atom(struct reader* r);
+static lval* _read_string(struct reader* r);
+static const char* _string_end(const char* p, const char* end, int* esc);
+static lval* _unescape(const char* s, size_t n);
+static lval* _read_long(const char* s, const char* end);
+static lval* _read_double(const char* s, const char* end, int ndigits, int nfrac);
+static void _print_error(struct reader* r);
+static int _is_tok_char(char c);
+static void _lreader_add(lreader* r, lval* x, int* n);
+static int _lreader_atoms(lreader* r, const char* s, size_t len, int* n);
+static int _lreader_error(lreader* r, const char* err);
+static void _lreader_reset(lreader* r);
+static const char* _lreader_skip(lreader* r, const char* p, const char* end, int open);
+static void _lreader_tok(lreader* r, const char* s, size_t n);
+static void _lreader_lines(lreader* r, const char* s, size_t n);
+
+lval* parse(const char* input)
+{
+	return parse_n(input, strlen(input));
 }
 
-// abstract syntax tree
-mpc_ast_t* parse(const char* input)
+lval* parse_n(const char* input, size_t len)
 {
-	if (all_isspace(input))
+	struct reader r = { input, input, input+len, NULL, NULL };
+
+	if (!sym_chars_ready)
+		_init_sym_chars();
+
+	_skip_space(&r);
+	if (r.p == r.end)
 	{
-		log_info_to(logfp, "Parsing failed: %s (empty) ", input);
+		log_info_to(logfp, "Parsing failed: %.*s (empty) ", (int)len, input);
 		return NULL;
 	}
 
-	mpc_result_t r;
-	if (mpc_parse("<stdin>", input, Lisp, &r))
+	lval* x = _read_list(&r, lval_sexpr(), '\0');
+	if (NULL == x)
 	{
-		log_info_to(logfp, "Parsing successful: %s", input);
-		mpc_ast_print_to(r.output, logfp);
-		return r.output;
+		log_info_to(logfp, "Parsing failed: %.*s", (int)len, input);
+		_print_error(&r);
+		return NULL;
+	}
+
+	debug_to(logfp, "Parsing successful: %.*s", (int)len, input);
+	return x;
+}
+
+lreader* lreader_new(const char* name, lreader_emit emit, void* ctx)
+{
+	lreader* r = (lreader*)calloc(1, sizeof(lreader));
+	if (NULL == r)
+		return NULL;
+	r->name = name;
+	r->emit = emit;
+	r->ctx = ctx;
+	r->line = 1;
+	r->col = 1;
+
+	if (!sym_chars_ready)
+		_init_sym_chars();
+	return r;
+}
+
+void lreader_del(lreader* r)
+{
+	_lreader_reset(r);
+	free(r->stack);
+	free(r->tok);
+	free(r);
+}
+
+int lreader_feed(lreader* r, const char* buf, size_t len)
+{
+	const char* p = buf;
+	const char* end = buf+len;
+	int n = 0;
+	int err = 0;
+
+	// pass over the rest of a broken form first
+	if (r->skip || r->skip_str) {
+		p = _lreader_skip(r, p, end, r->skip);
+		if (r->skip || r->skip_str)
+			return 0;
+	}
+
+	// finish the string from the last chunk first
+	if (r->tok_str) {
+		const char* q = _string_end(p, end, &r->tok_esc);
+		_lreader_tok(r, p, (q ? q+1 : end) - p);
+		_lreader_lines(r, p, (q ? q+1 : end) - p);
+		if (NULL == q)
+			return 0;
+		p = q+1;
+
+		// tok holds the literal with both quotes
+		_lreader_add(r, _unescape(r->tok+1, r->tok_len-2), &n);
+		r->tok_str = 0;
+		r->tok_len = 0;
+	}
+
+	// finish the token from the last chunk first
+	if (r->tok_len) {
+		const char* q = p;
+		while (q < end && _is_tok_char(*q))
+			q++;
+
+		_lreader_tok(r, p, q-p);
+		p = q;
+
+		if (p == end)
+			return 0;
+
+		size_t tok_len = r->tok_len;
+		int open = r->depth;
+		r->tok_len = 0;
+		if (_lreader_atoms(r, r->tok, tok_len, &n)) {
+			err = 1;
+			p = _lreader_skip(r, p, end, open);
+		}
+	}
+
+	while (p < end) {
+		char c = *p;
+
+		if (isspace((unsigned char)c)) {
+			if ('\n' == c) {
+				r->line++;
+				r->col = 1;
+			}
+			else
+				r->col++;
+			p++;
+		}
+		else if ('(' == c || '{' == c) {
+			if (r->depth == r->cap) {
+				r->cap = r->cap ? 2 * r->cap : 16;
+				r->stack = realloc(r->stack, sizeof(lval*) * r->cap);
+			}
+			r->stack[r->depth++] = ('(' == c) ? lval_sexpr() : lval_qexpr();
+			r->col++;
+			p++;
+		}
+		else if (')' == c || '}' == c) {
+			int type = (')' == c) ? LVAL_SEXPR : LVAL_QEXPR;
+			if (0 == r->depth || r->stack[r->depth-1]->type != type) {
+				// taken as the close of the innermost list
+				int open = r->depth > 0 ? r->depth-1 : 0;
+				_lreader_error(r, "unexpected closing bracket");
+				err = 1;
+				r->col++;
+				p = _lreader_skip(r, p+1, end, open);
+				continue;
+			}
+			lval* x = r->stack[--r->depth];
+			r->col++;
+			p++;
+			_lreader_add(r, x, &n);
+		}
+		else if ('"' == c) {
+			int esc = 0;
+			const char* q = _string_end(p+1, end, &esc);
+			_lreader_lines(r, p, (q ? q+1 : end) - p);
+
+			// the string may go on in the next chunk
+			if (NULL == q) {
+				_lreader_tok(r, p, end-p);
+				r->tok_str = 1;
+				r->tok_esc = esc;
+				break;
+			}
+
+			_lreader_add(r, _unescape(p+1, q-p-1), &n);
+			p = q+1;
+		}
+		else if (_is_tok_char(c)) {
+			const char* q = p;
+			while (q < end && _is_tok_char(*q))
+				q++;
+
+			// the token may go on in the next chunk
+			if (q == end) {
+				_lreader_tok(r, p, q-p);
+				break;
+			}
+
+			int open = r->depth;
+			if (_lreader_atoms(r, p, q-p, &n)) {
+				err = 1;
+				p = _lreader_skip(r, q, end, open);
+				continue;
+			}
+			p = q;
+		}
+		else {
+			int open = r->depth;
+			_lreader_error(r, "unexpected character");
+			err = 1;
+			r->col++;
+			p = _lreader_skip(r, p+1, end, open);
+		}
+	}
+
+	return err ? -1 : n;
+}
+
+int lreader_finish(lreader* r)
+{
+	int n = 0;
+
+	// the broken form was reported already
+	r->skip = 0;
+	r->skip_str = 0;
+	r->skip_esc = 0;
+
+	if (r->tok_str)
+		return _lreader_error(r, "expected '\"' at end of input");
+
+	if (r->tok_len) {
+		size_t tok_len = r->tok_len;
+		r->tok_len = 0;
+		if (_lreader_atoms(r, r->tok, tok_len, &n))
+			return -1;
+	}
+
+	if (r->depth > 0)
+		return _lreader_error(r, LVAL_SEXPR == r->stack[r->depth-1]->type
+			? "expected ')' at end of input" : "expected '}' at end of input");
+	return n;
+}
+
+int lreader_pending(lreader* r)
+{
+	return r->depth > 0 || r->tok_len > 0 || r->tok_str || r->skip || r->skip_str;
+}
+
+// private functions: //////////////////////////////////////////////////////////
+
+static void _init_sym_chars(void)
+{
+	for (int c = 0; c <= UCHAR_MAX; c++)
+		sym_chars[c] = isalnum(c) ? 1 : 0;
+
+	for (const char* c = "_+-*/\\=<>!&^%"; *c; c++)
+		sym_chars[(unsigned char)*c] = 1;
+
+	sym_chars_ready = 1;
+}
+
+static void _skip_space(struct reader* r)
+{
+	while (r->p < r->end && isspace((unsigned char)*r->p))
+		r->p++;
+}
+
+// reads expressions into x until the close character, '\0' means end of input
+static lval* _read_list(struct reader* r, lval* x, const char close)
+{
+	for (;;) {
+		_skip_space(r);
+
+		if (r->p == r->end) {
+			if ('\0' == close)
+				return x;
+			r->err = (')' == close) ? "expected ')' at end of input"
+				: "expected '}' at end of input";
+			break;
+		}
+
+		if (*r->p == close) {
+			r->p++;
+			return x;
+		}
+
+		lval* y = _read_expr(r);
+		if (NULL == y)
+			break;
+		x = lval_add_toback(x, y);
+	}
+
+	r->err_pos = r->p;
+	lval_del(x);
+	return NULL;
+}
+
+static lval* _read_expr(struct reader* r)
+{
+	switch (*r->p) {
+	case '(':
+		r->p++;
+		return _read_list(r, lval_sexpr(), ')');
+	case '{':
+		r->p++;
+		return _read_list(r, lval_qexpr(), '}');
+	case '"':
+		return _read_string(r);
+	case ')':
+	case '}':
+		r->err = "unexpected closing bracket";
+		return NULL;
+	default:
+		return _read_atom(r);
+	}
+}
+
+// try double, long and then symbol, like the ordered choice in the grammar
+static lval* _read_atom(struct reader* r)
+{
+	const char* s = r->p;
+	const char* p = s;
+	int ndigits = 0;
+	int nfrac = 0;
+
+	if (p < r->end && '-' == *p)
+		p++;
+	while (p < r->end && isdigit((unsigned char)*p)) {
+		p++;
+		ndigits++;
+	}
+
+	if (p < r->end && '.' == *p) {
+		const char* q = p+1;
+		while (q < r->end && isdigit((unsigned char)*q)) {
+			q++;
+			nfrac++;
+		}
+		if (nfrac > 0 || ndigits > 0) {
+			r->p = q;
+			return _read_double(s, q, ndigits, nfrac);
+		}
 	}
 
-	log_info_to(logfp, "Parsing failed: %s", input);
-	mpc_err_print_to(r.error, stderr);
-	mpc_err_delete(r.error);
+	if (ndigits > 0) {
+		r->p = p;
+		return _read_long(s, p);
+	}
+
+	p = s;
+	while (p < r->end && sym_chars[(unsigned char)*p])
+		p++;
+
+	if (p == s) {
+		r->err = "unexpected character";
+		return NULL;
+	}
+
+	r->p = p;
+	return lval_sym_n(s, p-s);
+}
+
+static lval* _read_string(struct reader* r)
+{
+	int esc = 0;
+	const char* q = _string_end(r->p+1, r->end, &esc);
+	if (NULL == q) {
+		r->err = "expected '\"' at end of input";
+		return NULL;
+	}
+
+	lval* x = _unescape(r->p+1, q - r->p - 1);
+	r->p = q+1;
+	return x;
+}
+
+// the closing quote or NULL, esc carries a trailing backslash across chunks
+static const char* _string_end(const char* p, const char* end, int* esc)
+{
+	for (; p < end; p++) {
+		if (*esc)
+			*esc = 0;
+		else if ('\\' == *p)
+			*esc = 1;
+		else if ('"' == *p)
+			return p;
+	}
 	return NULL;
 }
 
+static lval* _unescape(const char* s, size_t n)
+{
+	lval* x = lval_str_n(s, n);
+	char* q = x->str;
+
+	for (const char* p = x->str; *p; p++) {
+		if ('\\' != *p) {
+			*q++ = *p;
+			continue;
+		}
+		switch (*++p) {
+		case 'n': *q++ = '\n'; break;
+		case 't': *q++ = '\t'; break;
+		default: *q++ = *p; break;
+		}
+	}
+	*q = '\0';
+	return x;
+}
+
+// a bigint past int64, see big.h
+static lval* _read_long(const char* s, const char* end)
+{
+	int neg = ('-' == *s);
+	uint64_t limit = neg ? (uint64_t)INT64_MAX + 1 : (uint64_t)INT64_MAX;
+	uint64_t x = 0;
+
+	for (const char* p = s + neg; p < end; p++) {
+		unsigned d = *p - '0';
+		if (x > (limit - d) / 10)
+			return big_parse(s, end);
+		x = x*10 + d;
+	}
+
+	if (neg)
+		return lval_long(x == limit ? INT64_MIN : -(int64_t)x);
+	return lval_long((int64_t)x);
+}
+
+static lval* _read_double(const char* s, const char* end, int ndigits, int nfrac)
+{
+	// exact when both the mantissa and the power of ten are representable
+	if (ndigits + nfrac <= MAX_EXACT_DIGITS) {
+		int64_t m = 0;
+		for (const char* p = s + ('-' == *s); p < end; p++) {
+			if ('.' != *p)
+				m = m*10 + (*p - '0');
+		}
+		double x = (double)m / POW10[nfrac];
+		return lval_double('-' == *s ? -x : x);
+	}
 
+	// the token is not '\0' terminated so strtod needs a copy
+	char buf[64];
+	char* tmp = buf;
+	size_t n = end - s;
+	if (n >= sizeof(buf) && NULL == (tmp = malloc(n+1)))
+		return lval_err(LERR_OTHER);
+	memcpy(tmp, s, n);
+	tmp[n] = '\0';
 
+	errno = 0;
+	double x = strtod(tmp, NULL);
+	int err = errno;
+	if (tmp != buf)
+		free(tmp);
+
+	if (err)
+		return lval_err(LERR_BAD_NUM);
+	return lval_double(x);
+}
+
+static void _print_error(struct reader* r)
+{
+	int line = 1;
+	int col = 1;
+	for (const char* p = r->start; p < r->err_pos; p++) {
+		if ('\n' == *p) {
+			line++;
+			col = 1;
+		}
+		else
+			col++;
+	}
+
+	if (r->err_pos < r->end)
+		fprintf(stderr, "<stdin>:%d:%d: error: %s, got '%c'\n",
+			line, col, r->err, *r->err_pos);
+	else
+		fprintf(stderr, "<stdin>:%d:%d: error: %s\n", line, col, r->err);
+}
+
+static int _is_tok_char(char c)
+{
+	return sym_chars[(unsigned char)c] || '.' == c;
+}
+
+static void _lreader_add(lreader* r, lval* x, int* n)
+{
+	if (r->depth > 0) {
+		lval_add_toback(r->stack[r->depth-1], x);
+		return;
+	}
+	r->emit(lval_add_toback(lval_sexpr(), x), r->ctx);
+	(*n)++;
+}
+
+// a complete run of token characters holds one or more atoms, e.g. "1abc"
+static int _lreader_atoms(lreader* r, const char* s, size_t len, int* n)
+{
+	struct reader rd = { s, s, s+len, NULL, NULL };
+	while (rd.p < rd.end) {
+		lval* x = _read_atom(&rd);
+		if (NULL == x) {
+			_lreader_error(r, rd.err);
+			r->col += len;
+			return -1;
+		}
+		_lreader_add(r, x, n);
+	}
+	r->col += len;
+	return 0;
+}
+
+static int _lreader_error(lreader* r, const char* err)
+{
+	fprintf(stderr, "%s:%ld:%ld: error: %s\n", r->name, r->line, r->col, err);
+	_lreader_reset(r);
+	return -1;
+}
+
+static void _lreader_tok(lreader* r, const char* s, size_t n)
+{
+	if (r->tok_len + n > r->tok_cap) {
+		r->tok_cap = 2 * (r->tok_len + n);
+		r->tok = realloc(r->tok, r->tok_cap);
+	}
+	memcpy(r->tok + r->tok_len, s, n);
+	r->tok_len += n;
+}
+
+static void _lreader_lines(lreader* r, const char* s, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		if ('\n' == s[i]) {
+			r->line++;
+			r->col = 1;
+		}
+		else
+			r->col++;
+	}
+}
+
+static void _lreader_reset(lreader* r)
+{
+	while (r->depth > 0)
+		lval_del(r->stack[--r->depth]);
+	r->tok_len = 0;
+	r->tok_str = 0;
+}
+
+
+// after a syntax error, passes over the rest of the broken form, the open
+// lists it had and the brackets and strings that follow, so reading resumes
+// at the next top level form wherever the chunks are split
+static const char* _lreader_skip(lreader* r, const char* p, const char* end, int open)
+{
+	const char* s = p;
+	r->skip = open;
+	for (; p < end && (r->skip > 0 || r->skip_str); p++) {
+		if (r->skip_str) {
+			if (r->skip_esc)
+				r->skip_esc = 0;
+			else if ('\\' == *p)
+				r->skip_esc = 1;
+			else if ('"' == *p)
+				r->skip_str = 0;
+		}
+		else if ('"' == *p)
+			r->skip_str = 1;
+		else if ('(' == *p || '{' == *p)
+			r->skip++;
+		else if (')' == *p || '}' == *p)
+			r->skip--;
+	}
+	_lreader_lines(r, s, p-s);
+	return p;
+}
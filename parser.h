@@ -1,21 +1,45 @@
 #ifndef PARSER_H_
 #define PARSER_H_
 
-// TODO might be better to write parser from scratch
-#include "mpc/mpc.h"
+#include <stddef.h>
 
-mpc_parser_t* Long;
-mpc_parser_t* Double;
-mpc_parser_t* Symbol;
-mpc_parser_t* Sexpr;
-mpc_parser_t* Qexpr;
-mpc_parser_t* Expr;
-mpc_parser_t* Lisp;
+#include "common.h"
 
-int init_parser();
-mpc_ast_t* parse(const char* input);
-void del_ast(mpc_ast_t*  ast);
+// Hand-written recursive descent reader, it scans the input once and builds
+// the lval tree directly. The grammar is the same as the old mpc one:
+//
+//	long	: /-?\d+/
+//	double	: /-?\d*\.\d+|-?\d+\./
+//	symbol	: /[a-zA-Z0-9_+\-*\/\\=<>!&\^%]+/
+//	string	: /"(\\.|[^"])*"/
+//	sexpr	: '(' <expr>* ')'
+//	qexpr	: '{' <expr>* '}'
+//	expr	: <double> | <long> | <symbol> | <string> | <sexpr> | <qexpr>
+//	lisp	: /^/ <expr>* /$/
+//
+// All top level expressions are wrapped in a single sexpr. NULL is returned
+// if the input is empty or malformed, the error is printed to stderr.
+lval* parse(const char* input);
+lval* parse_n(const char* input, size_t len); // input need not be '\0' terminated
 
-#endif
+// Push style reader for chunked input (pipes, sockets, big files). Bytes are
+// fed in arbitrary chunks, open lists and tokens split across chunks are kept
+// between calls, and every top level expression is passed to emit as soon as
+// it is complete, wrapped in a sexpr like parse() does. Only a token that
+// straddles two chunks is ever copied.
+typedef struct lreader lreader;
+typedef void (*lreader_emit)(lval* form, void* ctx); // emit owns form
+
+lreader* lreader_new(const char* name, lreader_emit emit, void* ctx);
+void lreader_del(lreader* r);
+
+// both return the number of forms emitted, or -1 on a syntax error, the error
+// is printed to stderr and the rest of the broken form is dropped, up to the
+// bracket that closes its outermost list, reading goes on from there
+int lreader_feed(lreader* r, const char* buf, size_t len);
+int lreader_finish(lreader* r); // end of input
 
+int lreader_pending(lreader* r); // non zero inside an unfinished form
+
+#endif
 
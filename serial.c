@@ -0,0 +1,192 @@
+#include "serial.h"
+#include "big.h"
+
+void sbuf_free(struct sbuf* b)
+{
+	free(b->data);
+	b->data = NULL;
+	b->len = b->cap = 0;
+}
+
+void sbuf_put(struct sbuf* b, const void* src, size_t n)
+{
+	if (b->len + n > b->cap) {
+		size_t cap = b->cap ? 2 * b->cap : 256;
+		while (cap < b->len + n)
+			cap *= 2;
+		b->data = (char*)realloc(b->data, cap);
+		b->cap = cap;
+	}
+	memcpy(b->data + b->len, src, n);
+	b->len += n;
+}
+
+void sbuf_put_uint(struct sbuf* b, uint64_t x)
+{
+	unsigned char tmp[10];
+	int n = 0;
+	do {
+		tmp[n] = x & 0x7f;
+		x >>= 7;
+		if (x)
+			tmp[n] |= 0x80;
+		n++;
+	} while (x);
+	sbuf_put(b, tmp, n);
+}
+
+void sbuf_put_int(struct sbuf* b, int64_t x)
+{
+	sbuf_put_uint(b, ((uint64_t)x << 1) ^ (uint64_t)(x >> 63));
+}
+
+void sbuf_put_str(struct sbuf* b, const char* s)
+{
+	size_t n = strlen(s);
+	sbuf_put_uint(b, n);
+	sbuf_put(b, s, n);
+}
+
+int sbuf_get(const char** p, const char* end, void* dst, size_t n)
+{
+	if ((size_t)(end - *p) < n)
+		return 1;
+	memcpy(dst, *p, n);
+	*p += n;
+	return 0;
+}
+
+int sbuf_get_uint(const char** p, const char* end, uint64_t* x)
+{
+	*x = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		if (*p == end)
+			return 1;
+		unsigned char c = *(*p)++;
+		*x |= (uint64_t)(c & 0x7f) << shift;
+		if (!(c & 0x80))
+			return 0;
+	}
+	return 1;
+}
+
+int sbuf_get_int(const char** p, const char* end, int64_t* x)
+{
+	uint64_t u;
+	if (sbuf_get_uint(p, end, &u))
+		return 1;
+	*x = (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+	return 0;
+}
+
+int lval_serialize(struct sbuf* b, lval* v)
+{
+	unsigned char type = LVAL_TYPE(v);
+	sbuf_put(b, &type, 1);
+
+	switch (LVAL_TYPE(v)) {
+	case LVAL_LNG:
+		sbuf_put_int(b, lval_get_long(v));
+		return 0;
+	case LVAL_DBL: {
+		double d = lval_get_double(v);
+		sbuf_put(b, &d, sizeof(double));
+		return 0;
+	}
+	case LVAL_SYM:
+		sbuf_put_str(b, v->sym);
+		return 0;
+	case LVAL_STR:
+		sbuf_put_str(b, v->str);
+		return 0;
+	case LVAL_BIG:
+		sbuf_put_uint(b, v->neg);
+		sbuf_put_uint(b, v->nlimbs);
+		for (int i = 0; i < v->nlimbs; i++)
+			sbuf_put_uint(b, v->limbs[i]);
+		return 0;
+	case LVAL_ERR:
+		sbuf_put_uint(b, v->err);
+		return 0;
+	case LVAL_SEXPR:
+	case LVAL_QEXPR:
+		sbuf_put_uint(b, v->count);
+		for (int i = 0; i < v->count; i++) {
+			if (lval_serialize(b, v->cell[i]))
+				return 1;
+		}
+		return 0;
+	default:
+		return 1;
+	}
+}
+
+lval* lval_deserialize(const char** p, const char* end)
+{
+	unsigned char type;
+	uint64_t n;
+	lval* x = NULL;
+
+	if (sbuf_get(p, end, &type, 1))
+		return NULL;
+
+	switch (type) {
+	case LVAL_LNG: {
+		int64_t lng;
+		if (sbuf_get_int(p, end, &lng))
+			return NULL;
+		return lval_long(lng);
+	}
+	case LVAL_DBL: {
+		double dbl;
+		if (sbuf_get(p, end, &dbl, sizeof(double)))
+			return NULL;
+		return lval_double(dbl);
+	}
+	case LVAL_SYM:
+	case LVAL_STR:
+		if (sbuf_get_uint(p, end, &n) || (uint64_t)(end - *p) < n)
+			return NULL;
+		x = (LVAL_SYM == type) ? lval_sym_n(*p, n) : lval_str_n(*p, n);
+		*p += n;
+		return x;
+	case LVAL_ERR:
+		if (sbuf_get_uint(p, end, &n) || n > LERR_DEPTH)
+			return NULL;
+		return lval_err(n);
+	case LVAL_BIG: {
+		uint64_t neg;
+		if (sbuf_get_uint(p, end, &neg) || sbuf_get_uint(p, end, &n) || n > (uint64_t)(end - *p))
+			return NULL;
+		uint32_t* limbs = (uint32_t*)malloc(sizeof(uint32_t) * (n ? n : 1));
+		for (uint64_t i = 0; limbs && i < n; i++) {
+			uint64_t limb;
+			if (sbuf_get_uint(p, end, &limb) || limb > UINT32_MAX) {
+				free(limbs);
+				return NULL;
+			}
+			limbs[i] = (uint32_t)limb;
+		}
+		x = limbs ? big_new(limbs, n, 0 != neg) : NULL;
+		free(limbs);
+		return x;
+	}
+	case LVAL_SEXPR:
+	case LVAL_QEXPR:
+		if (sbuf_get_uint(p, end, &n) || n > (uint64_t)(end - *p))
+			return NULL;
+		x = (LVAL_SEXPR == type) ? lval_sexpr() : lval_qexpr();
+		for (uint64_t i = 0; i < n; i++) {
+			lval* y = lval_deserialize(p, end);
+			if (NULL == y) {
+				lval_del(x);
+				return NULL;
+			}
+			lval_add_toback(x, y);
+		}
+		return x;
+	default:
+		return NULL;
+	}
+}
+
@@ -0,0 +1,39 @@
+#ifndef SERIAL_H_
+#define SERIAL_H_
+
+#include <stddef.h>
+
+#include "common.h"
+
+// Compact binary encoding of lval trees. Every value is a type byte followed
+// by its payload, integers and lengths are LEB128 varints (longs zigzagged)
+// and doubles are the raw 8 bytes, so the encoding is only meant for the
+// machine that wrote it.
+
+// bump whenever the encoding, or what the reader makes of the same text,
+// changes, precompiled files written before are read again, see load.h
+#define SERIAL_VERSION 2 // 2: literals past int64 are bigints
+
+struct sbuf
+{
+	char* data;
+	size_t len;
+	size_t cap;
+};
+
+void sbuf_free(struct sbuf* b);
+void sbuf_put(struct sbuf* b, const void* src, size_t n);
+void sbuf_put_uint(struct sbuf* b, uint64_t x);
+void sbuf_put_int(struct sbuf* b, int64_t x);
+void sbuf_put_str(struct sbuf* b, const char* s); // length prefixed
+
+// the reading side moves *p forward, all return non zero on truncated input
+int sbuf_get(const char** p, const char* end, void* dst, size_t n);
+int sbuf_get_uint(const char** p, const char* end, uint64_t* x);
+int sbuf_get_int(const char** p, const char* end, int64_t* x);
+
+int lval_serialize(struct sbuf* b, lval* v); // non zero if v has no encoding
+lval* lval_deserialize(const char** p, const char* end); // NULL if malformed
+
+#endif
+
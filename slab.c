@@ -0,0 +1,181 @@
+#define _DEFAULT_SOURCE
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "slab.h"
+
+static struct slab_stats stats;
+
+#ifdef USE_SLAB
+
+// a free block holds the next one
+struct block
+{
+	struct block* next;
+};
+
+static struct block* free_lists[SLAB_CLASSES];
+static char* bump = NULL;
+static char* bump_end = NULL;
+
+static int _class(size_t size);
+static void* _carve(size_t size);
+static char* _chunk(void);
+
+void* slab_alloc(size_t size)
+{
+	if (size > SLAB_MAX) {
+		stats.large++;
+		return calloc(1, size);
+	}
+
+	int c = _class(size);
+	struct block* b = free_lists[c];
+	stats.allocs++;
+	if (b) {
+		free_lists[c] = b->next;
+		stats.reused++;
+	}
+	else {
+		b = (struct block*)_carve((size_t)(c + 1) * SLAB_GRAIN);
+		if (NULL == b)
+			return NULL;
+	}
+	memset(b, 0, size);
+	return b;
+}
+
+void slab_free(void* p, size_t size)
+{
+	if (NULL == p)
+		return;
+	if (size > SLAB_MAX) {
+		free(p);
+		return;
+	}
+
+	int c = _class(size);
+	struct block* b = (struct block*)p;
+	b->next = free_lists[c];
+	free_lists[c] = b;
+	stats.frees++;
+}
+
+// the header before the array is the capacity, a header and an array over
+// SLAB_MAX are one malloc'd block
+void* slab_array(void* p, size_t size)
+{
+	if (0 == size) {
+		slab_array_free(p);
+		return NULL;
+	}
+
+	size_t* h = p ? (size_t*)p - 1 : NULL;
+	if (h && size <= *h)
+		return p;
+
+	size_t total = SLAB_GRAIN;
+	while (total < size + sizeof(size_t))
+		total *= 2;
+
+	size_t* n;
+	if (h && *h + sizeof(size_t) > SLAB_MAX) {
+		n = (size_t*)realloc(h, total);
+		if (NULL == n)
+			return NULL;
+		*n = total - sizeof(size_t);
+		return n + 1;
+	}
+
+	n = (size_t*)slab_alloc(total);
+	if (NULL == n)
+		return NULL;
+	*n = total - sizeof(size_t);
+	if (h) {
+		memcpy(n + 1, p, *h);
+		slab_free(h, *h + sizeof(size_t));
+	}
+	return n + 1;
+}
+
+void slab_array_free(void* p)
+{
+	if (p) {
+		size_t* h = (size_t*)p - 1;
+		slab_free(h, *h + sizeof(size_t));
+	}
+}
+
+#endif
+
+void slab_get_stats(struct slab_stats* st)
+{
+	*st = stats;
+}
+
+void slab_print_stats(FILE* fp)
+{
+#ifdef USE_SLAB
+	fprintf(fp, "slab: %zu chunks, %zu bytes mapped\n", stats.chunks, stats.mapped);
+	fprintf(fp, "slab: %lu allocs, %lu reused, %lu frees, %lu large\n",
+		stats.allocs, stats.reused, stats.frees, stats.large);
+#else
+	fprintf(fp, "slab: off, built without USE_SLAB\n");
+#endif
+}
+
+// private functions: //////////////////////////////////////////////////////////
+
+#ifdef USE_SLAB
+
+static int _class(size_t size)
+{
+	return size ? (int)((size - 1) / SLAB_GRAIN) : 0;
+}
+
+// what is left of a chunk too small for size is dropped
+static void* _carve(size_t size)
+{
+	if ((size_t)(bump_end - bump) < size) {
+		bump = _chunk();
+		if (NULL == bump) {
+			bump_end = NULL;
+			return NULL;
+		}
+		bump_end = bump + SLAB_CHUNK;
+	}
+
+	void* p = bump;
+	bump += size;
+	return p;
+}
+
+static char* _chunk(void)
+{
+#ifdef SLAB_HUGEPAGES
+	// twice the size, to cut an aligned chunk out of it
+	char* p = (char*)mmap(NULL, 2 * SLAB_CHUNK, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (MAP_FAILED == p)
+		return NULL;
+	char* a = (char*)(((uintptr_t)p + SLAB_CHUNK - 1) & ~(uintptr_t)(SLAB_CHUNK - 1));
+	if (a > p)
+		munmap(p, a - p);
+	munmap(a + SLAB_CHUNK, p + SLAB_CHUNK - a);
+	madvise(a, SLAB_CHUNK, MADV_HUGEPAGE);
+	p = a;
+#else
+	char* p = (char*)mmap(NULL, SLAB_CHUNK, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (MAP_FAILED == p)
+		return NULL;
+#endif
+	stats.chunks++;
+	stats.mapped += SLAB_CHUNK;
+	return p;
+}
+
+#endif
+
@@ -0,0 +1,56 @@
+#ifndef SLAB_H_
+#define SLAB_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Built with USE_SLAB (the default, make SLAB=0 for plain malloc), lval and
+// lenv objects and small cell arrays come from chunks mapped from the system
+// and cut up with a bump pointer. Freed blocks go on a free list per size
+// class, SLAB_GRAIN bytes apart, and are taken from there first. There is
+// one set of free lists, chunk and stats for the process and nothing takes a
+// lock: only one thread evaluates at a time, the ones that carry a deep
+// evaluation on other stack segments wait for each other (see eval.h).
+// Chunks are never given back. Built with SLAB_HUGEPAGES as well, chunks are
+// 2MB, aligned to that and advised as huge pages.
+//
+// Objects are freed with the size they were allocated with. Arrays keep their
+// capacity in a header, grow to powers of two and never shrink, so adding to
+// a list one cell at a time moves it log(n) times.
+
+#define SLAB_GRAIN 16
+#define SLAB_MAX 512 // larger blocks go to malloc
+#define SLAB_CLASSES (SLAB_MAX / SLAB_GRAIN)
+#ifdef SLAB_HUGEPAGES
+#define SLAB_CHUNK (2 << 20)
+#else
+#define SLAB_CHUNK (256 << 10)
+#endif
+
+struct slab_stats
+{
+	unsigned long allocs;
+	unsigned long reused; // allocs served from a free list
+	unsigned long frees;
+	unsigned long large; // blocks over SLAB_MAX, left to malloc
+	size_t chunks;
+	size_t mapped; // bytes
+};
+
+#ifdef USE_SLAB
+void* slab_alloc(size_t size); // zeroed
+void slab_free(void* p, size_t size);
+void* slab_array(void* p, size_t size); // like realloc(), for arrays
+void slab_array_free(void* p);
+#else
+static inline void* slab_alloc(size_t size) { return calloc(1, size); }
+static inline void slab_free(void* p, size_t size) { (void)size; free(p); }
+static inline void* slab_array(void* p, size_t size) { return realloc(p, size); }
+static inline void slab_array_free(void* p) { free(p); }
+#endif
+
+void slab_get_stats(struct slab_stats* st);
+void slab_print_stats(FILE* fp);
+
+#endif
+
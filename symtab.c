@@ -0,0 +1,224 @@
+#define _DEFAULT_SOURCE
+
+#include <sys/mman.h>
+
+#include "symtab.h"
+#include "common.h"
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000 // linux >= 4.17, a plain hint before that
+#endif
+
+// arena entries are a uint32_t id and length followed by the '\0' terminated
+// name, padded to 4 bytes, the interned pointer is the name
+#define ENTRY_HEAD (2 * sizeof(uint32_t))
+#define ENTRY_SIZE(n) ((ENTRY_HEAD + (n) + 1 + 3) & ~(size_t)3)
+
+struct slot
+{
+	uint64_t hash;
+	const char* name; // NULL when empty
+};
+
+uint32_t* symtab_binds = NULL;
+uint32_t* symtab_rebinds = NULL;
+
+const char* SYM_QUOTE = NULL;
+const char* SYM_LIST = NULL;
+const char* SYM_AMP = NULL;
+const char* SYM_IF = NULL;
+
+static char* arena = NULL;
+static size_t used = 0;
+static struct slot* slots = NULL;
+static size_t nslots = 0;
+static size_t count = 0;
+static size_t binds_cap = 0;
+
+static int _init(void);
+static const char* _find(const char* s, size_t n, uint64_t h, size_t* at);
+static int _grow(void);
+static const char* _append(const char* s, size_t n, uint64_t h, size_t at);
+
+const char* sym_intern(const char* s, size_t n)
+{
+	if (NULL == arena && _init())
+		return NULL;
+
+	uint64_t h = hash_bytes(s, n);
+	size_t at;
+	const char* name = _find(s, n, h, &at);
+	if (name)
+		return name;
+
+	if (2 * (count + 1) > nslots) {
+		if (_grow())
+			return NULL;
+		_find(s, n, h, &at);
+	}
+	return _append(s, n, h, at);
+}
+
+int symtab_contains(const void* p)
+{
+	return (uintptr_t)p - (uintptr_t)arena < used;
+}
+
+size_t symtab_count(void)
+{
+	return count;
+}
+
+uintptr_t symtab_base(void)
+{
+	if (NULL == arena)
+		_init();
+	return (uintptr_t)arena;
+}
+
+size_t symtab_used(void)
+{
+	return used;
+}
+
+const char* symtab_data(void)
+{
+	return arena;
+}
+
+int symtab_restore(const char* snap, size_t n, uintptr_t base, intptr_t* delta)
+{
+	if (NULL == arena && _init())
+		return 1;
+	if (memcmp(arena, snap, MIN(used, n)))
+		return 1;
+
+	// only the names this run has not interned yet are appended, they end up
+	// at the same offsets as in the snapshot
+	const char* p = snap + used;
+	while (p < snap + n) {
+		uint32_t id, len;
+		memcpy(&id, p, sizeof(id));
+		memcpy(&len, p + sizeof(id), sizeof(len));
+		const char* name = p + ENTRY_HEAD;
+		uint64_t h = hash_bytes(name, len);
+		size_t at;
+
+		if (ENTRY_SIZE(len) > (size_t)(snap + n - p) || id != count
+			|| _find(name, len, h, &at))
+			return 1;
+		if (2 * (count + 1) > nslots) {
+			if (_grow())
+				return 1;
+			_find(name, len, h, &at);
+		}
+		_append(name, len, h, at);
+		p += ENTRY_SIZE(len);
+	}
+
+	*delta = (intptr_t)((uintptr_t)arena - base);
+	return 0;
+}
+
+// private functions: //////////////////////////////////////////////////////////
+
+static int _init(void)
+{
+	char* p = mmap((void*)(uintptr_t)SYMTAB_BASE, SYMTAB_SIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE, -1, 0);
+
+	if (MAP_FAILED == p) {
+		p = mmap(NULL, SYMTAB_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (MAP_FAILED == p) {
+			log_err("could not map %llu bytes for symbols", SYMTAB_SIZE);
+			return 1;
+		}
+	}
+	arena = p;
+
+	// always first, so every run agrees on them
+	SYM_QUOTE = sym_intern("quote", 5);
+	SYM_LIST = sym_intern("list", 4);
+	SYM_AMP = sym_intern("&", 1);
+	SYM_IF = sym_intern("if", 2);
+	return 0;
+}
+
+// the interned name, or NULL and the empty slot it would go into
+static const char* _find(const char* s, size_t n, uint64_t h, size_t* at)
+{
+	if (0 == nslots) {
+		*at = 0;
+		return NULL;
+	}
+
+	size_t mask = nslots - 1;
+	for (size_t i = h & mask; ; i = (i + 1) & mask) {
+		struct slot* sl = &slots[i];
+		if (NULL == sl->name) {
+			*at = i;
+			return NULL;
+		}
+		if (sl->hash == h && 0 == memcmp(sl->name, s, n) && '\0' == sl->name[n])
+			return sl->name;
+	}
+}
+
+static int _grow(void)
+{
+	size_t n = nslots ? 2 * nslots : 256;
+	struct slot* s = (struct slot*)calloc(n, sizeof(struct slot));
+	if (NULL == s)
+		return 1;
+
+	for (size_t i = 0; i < nslots; i++) {
+		if (NULL == slots[i].name)
+			continue;
+		size_t j = slots[i].hash & (n - 1);
+		while (s[j].name)
+			j = (j + 1) & (n - 1);
+		s[j] = slots[i];
+	}
+	free(slots);
+	slots = s;
+	nslots = n;
+	return 0;
+}
+
+static const char* _append(const char* s, size_t n, uint64_t h, size_t at)
+{
+	uint32_t id = (uint32_t)count;
+	uint32_t len = (uint32_t)n;
+	if (n > UINT32_MAX || used + ENTRY_SIZE(n) > SYMTAB_SIZE) {
+		log_err("symbol table full, %zu names", count);
+		return NULL;
+	}
+
+	if (count == binds_cap) {
+		size_t cap = binds_cap ? 2 * binds_cap : 1024;
+		uint32_t* b = (uint32_t*)realloc(symtab_binds, sizeof(uint32_t) * cap);
+		if (NULL == b)
+			return NULL;
+		memset(b + binds_cap, 0, sizeof(uint32_t) * (cap - binds_cap));
+		symtab_binds = b;
+		b = (uint32_t*)realloc(symtab_rebinds, sizeof(uint32_t) * cap);
+		if (NULL == b)
+			return NULL;
+		memset(b + binds_cap, 0, sizeof(uint32_t) * (cap - binds_cap));
+		symtab_rebinds = b;
+		binds_cap = cap;
+	}
+
+	char* e = arena + used;
+	memcpy(e, &id, sizeof(id));
+	memcpy(e + sizeof(id), &len, sizeof(len));
+	memcpy(e + ENTRY_HEAD, s, n);
+	e[ENTRY_HEAD + n] = '\0';
+	used += ENTRY_SIZE(n);
+
+	slots[at].hash = h;
+	slots[at].name = e + ENTRY_HEAD;
+	count++;
+	return slots[at].name;
+}
@@ -0,0 +1,50 @@
+#ifndef SYMTAB_H_
+#define SYMTAB_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Interned symbols. Every symbol name exists once and an LVAL_SYM, an env
+// binding or a special form check only ever holds or compares the canonical
+// pointer, copying a symbol allocates nothing.
+//
+// Names live in an append-only arena mapped at SYMTAB_BASE when possible, and
+// interning is deterministic (the special forms first, then whatever the
+// program interns in order), so two runs of the same binary that do the same
+// startup get the same pointers. Heap images rely on this to store symbol
+// pointers as they are, see symtab_restore().
+
+#define SYMTAB_BASE 0x3d0000000000ULL
+#define SYMTAB_SIZE (1ULL << 28) // reserved, only touched pages are backed
+
+// every name also has a dense id, in interning order, a count of the env
+// bindings of it that exist right now and a count of the times one of those
+// was replaced or a global one removed, both kept by common.c
+#define SYM_ID(s) (((const uint32_t*)(s))[-2])
+#define SYM_BINDS(s) (symtab_binds[SYM_ID(s)])
+#define SYM_REBINDS(s) (symtab_rebinds[SYM_ID(s)])
+
+extern uint32_t* symtab_binds;
+extern uint32_t* symtab_rebinds;
+
+extern const char* SYM_QUOTE;
+extern const char* SYM_LIST;
+extern const char* SYM_AMP;
+extern const char* SYM_IF;
+
+const char* sym_intern(const char* s, size_t n);
+int symtab_contains(const void* p);
+size_t symtab_count(void);
+
+// snapshot support for heap images
+uintptr_t symtab_base(void);
+size_t symtab_used(void);
+const char* symtab_data(void);
+
+// extends the table to a snapshot taken in another run, the current table
+// must be a prefix of it (or the other way round), returns non zero otherwise
+// and sets *delta to how far the names moved, 0 if the arenas share the base
+int symtab_restore(const char* snap, size_t used, uintptr_t base, intptr_t* delta);
+
+#endif
+
@@ -1,14 +1,26 @@
 
 #include <assert.h>
-
-#include "mpc/mpc.h"
+#include <math.h>
 
 #include "common.h"
 #include "eval.h"
 #include "parser.h"
+#include "cache.h"
+#include "load.h"
+#include "serial.h"
+#include "image.h"
+#include "symtab.h"
+#include "vm.h"
+#include "gc.h"
+#include "opt.h"
+#include "clos.h"
+#include "jit.h"
+#include "big.h"
+#include "slab.h"
 
 // TODO logging is weird, need to be improved
 #define RUN_TEST(fn_name)\
+	log_flush();\
 	printf("%s", #fn_name);\
 	fprintf(logfp, "\n%s\n", #fn_name);\
 	fprintf(stderr, "\n%s\n", #fn_name);\
@@ -23,160 +35,656 @@
 		return 1; \
 	} \
 
-#define STARTUP(AST, V, STR) \
-	mpc_ast_t* AST = parse(STR); \
-	lval* V = eval(environment, ast_to_lval(AST))
+#define STARTUP(V, STR) \
+	lval* V = eval(environment, parse(STR))
 
 // TODO need to check argument type
-#define STARTUP_NO_DECLARE(AST, V, STR) \
-	AST = parse(STR); \
-	V = eval(environment, ast_to_lval(AST))
+#define STARTUP_NO_DECLARE(V, STR) \
+	V = eval(environment, parse(STR))
 
-#define TEARDOWN(AST, V) \
-	lval_del(V); mpc_ast_delete(AST); V = NULL; AST = NULL;
+#define TEARDOWN(V) \
+	lval_del(V); V = NULL;
 
 lenv* environment = NULL;
 
-int ast_size(mpc_ast_t* ast)
+// TODO, add tests for lval count and sexpr count
+
+int test_parse_type()
 {
-	if (!ast) { return -1; }
+	lval* v = parse("+ 1.1 1");
+	TEST_ASSERT(LVAL_SEXPR == LVAL_TYPE(v));
+	TEST_ASSERT(3 == v->count);
+	TEST_ASSERT(LVAL_SYM == LVAL_TYPE(v->cell[0]));
+	TEST_ASSERT(LVAL_DBL == LVAL_TYPE(v->cell[1]));
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v->cell[2]));
+	lval_del(v);
+	return 0;
+}
 
-	int ctr = 1;
-	if (ast->children_num > 0) // if child_num is 0, 1 is returned
-	{
-		for (int i = 0; i < ast->children_num; i++)
-		{
-			ctr += ast_size(ast->children[i]);
-		}
+int test_parse_failure()
+{
+	lval* v = parse("+ 4 (");
+	TEST_ASSERT(NULL == v);
+	v = parse("+ 4 }");
+	TEST_ASSERT(NULL == v);
+	v = parse("+ 4 'a");
+	TEST_ASSERT(NULL == v);
+	return 0;
+}
+
+int test_parse_tokens()
+{
+	const int N = 64;
+	char output[N];
+
+	// numbers end where the grammar says so, even without whitespace
+	lval* v = parse("-5 -.5 20. 1abc x-5 - {%}");
+	TEST_ASSERT(lval_snprintln(v, output, N));
+	TEST_ASSERT(0 == strcmp("(-5 -0.500000 20.000000 1 abc x-5 - {%})", output));
+	lval_del(v);
+
+	// past int64 a number is a bigint
+	v = parse("9223372036854775807 -9223372036854775808 9223372036854775808");
+	TEST_ASSERT(INT64_MAX == lval_get_long(v->cell[0]));
+	TEST_ASSERT(INT64_MIN == lval_get_long(v->cell[1]));
+	TEST_ASSERT(LVAL_BIG == LVAL_TYPE(v->cell[2]));
+	TEST_ASSERT(lval_snprintln(v->cell[2], output, N));
+	TEST_ASSERT(0 == strcmp("9223372036854775808", output));
+	lval_del(v);
+
+	v = parse("0.1 3.14159265358979323846");
+	TEST_ASSERT(0.1 == lval_get_double(v->cell[0]));
+	TEST_ASSERT(3.14159265358979323846 == lval_get_double(v->cell[1]));
+	lval_del(v);
+	return 0;
+}
+
+static void collect_form(lval* form, void* ctx)
+{
+	lval_add_toback((lval*)ctx, form);
+}
+
+int test_reader_chunks()
+{
+	const int N = 64;
+	char output[N];
+	const char* chunks[] = { "(def {x} 1", "2) (+ x", " 3", "4.", "5) {a", " b}c", "d" };
+
+	lval* forms = lval_qexpr();
+	lreader* r = lreader_new("<test>", collect_form, forms);
+	int n = 0;
+	for (size_t i = 0; i < sizeof(chunks)/sizeof(chunks[0]); i++) {
+		n += lreader_feed(r, chunks[i], strlen(chunks[i]));
+		if (1 == i) // first form is emitted as soon as it closes
+			TEST_ASSERT(1 == n);
 	}
-	return ctr;
+	TEST_ASSERT(lreader_pending(r));
+	n += lreader_finish(r);
+	TEST_ASSERT(!lreader_pending(r));
+	TEST_ASSERT(4 == n);
+
+	TEST_ASSERT(lval_snprintln(forms, output, N));
+	TEST_ASSERT(0 == strcmp("{((def {x} 12)) ((+ x 34.500000)) ({a b}) (cd)}", output));
+
+	// errors drop the partial form, the reader can be fed again
+	TEST_ASSERT(-1 == lreader_feed(r, "(+ 1 }", 6));
+	TEST_ASSERT(!lreader_pending(r));
+	TEST_ASSERT(1 == lreader_feed(r, "(+ 1 2)", 7));
+	TEST_ASSERT(0 == lreader_feed(r, "{1", 2));
+	TEST_ASSERT(-1 == lreader_finish(r));
+
+	lreader_del(r);
+	lval_del(forms);
+	return 0;
 }
 
-// TODO, add tests for lval count and sexpr count
+// a syntax error drops the rest of its form, wherever the chunks are split
+int test_reader_resync()
+{
+	const int N = 64;
+	char output[N];
+	const char* in = "(+ 1 2) ) (+ 3 4) (* 2 $ (5 \"a)\") 6) (- 9 a.b\n1) {x}\n(- 9 1)";
+	size_t len = strlen(in);
+
+	for (size_t i = 0; i <= len; i++) {
+		lval* forms = lval_qexpr();
+		lreader* r = lreader_new("<test>", collect_form, forms);
+		int a = lreader_feed(r, in, i);
+		int b = lreader_feed(r, in+i, len-i);
+		TEST_ASSERT(-1 == a || -1 == b);
+		TEST_ASSERT(0 == lreader_finish(r));
+		TEST_ASSERT(lval_snprintln(forms, output, N));
+		TEST_ASSERT(0 == strcmp("{((+ 1 2)) ((+ 3 4)) ({x}) ((- 9 1))}", output));
+		lreader_del(r);
+		lval_del(forms);
+	}
+	return 0;
+}
+
+int test_parse_cache()
+{
+	struct pcache_stats st;
+	pcache_clear();
+	pcache_set_budget(PCACHE_DEFAULT_BUDGET);
+
+	lval* v = eval_str(environment, "+ 1 2 (* 3 4)");
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && 15 == lval_get_long(v));
+	lval_del(v);
+	v = eval_str(environment, "+ 1 2 (* 3 4)"); // the template is not consumed
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && 15 == lval_get_long(v));
+	lval_del(v);
+	TEST_ASSERT(NULL == eval_str(environment, "+ 1 ("));
+
+	pcache_get_stats(&st);
+	TEST_ASSERT(1 == st.hits && 2 == st.misses && 1 == st.entries);
+
+	// a budget for about one entry evicts the least recently used
+	pcache_set_budget(st.bytes);
+	lval_del(pcache_parse("+ 3 4 (* 5 6)"));
+	pcache_get_stats(&st);
+	TEST_ASSERT(1 == st.entries && 1 == st.evictions);
+	lval_del(pcache_parse("+ 3 4 (* 5 6)"));
+	pcache_get_stats(&st);
+	TEST_ASSERT(2 == st.hits);
+
+	pcache_set_budget(PCACHE_DEFAULT_BUDGET);
+	pcache_clear();
+	return 0;
+}
 
-int test_ast_type()
+int test_parse_string()
 {
-	mpc_ast_t* ast = parse("+ 1.1 1");
-	TEST_ASSERT(6 == ast_size(ast));
-	TEST_ASSERT(strstr(ast->children[1]->tag, "symbol"));
-	TEST_ASSERT(strstr(ast->children[2]->tag, "double"));
-	TEST_ASSERT(strstr(ast->children[3]->tag, "long"));
-	mpc_ast_delete(ast);
+	const int N = 64;
+	char output[N];
+
+	lval* v = parse("\"a (b) {c}\" \"\\\"q\\\"\\n\"");
+	TEST_ASSERT(LVAL_STR == LVAL_TYPE(v->cell[0]));
+	TEST_ASSERT(0 == strcmp("a (b) {c}", v->cell[0]->str));
+	TEST_ASSERT(0 == strcmp("\"q\"\n", v->cell[1]->str));
+	TEST_ASSERT(lval_snprintln(v, output, N));
+	TEST_ASSERT(0 == strcmp("(\"a (b) {c}\" \"\\\"q\\\"\\n\")", output));
+	lval_del(v);
+	TEST_ASSERT(NULL == parse("\"abc"));
+
+	// split inside a string, right after a backslash
+	lval* forms = lval_qexpr();
+	lreader* r = lreader_new("<test>", collect_form, forms);
+	TEST_ASSERT(0 == lreader_feed(r, "{\"x) \\", 6));
+	TEST_ASSERT(1 == lreader_feed(r, "\"y\"}", 4));
+	TEST_ASSERT(0 == strcmp("x) \"y", forms->cell[0]->cell[0]->cell[0]->str));
+	lreader_del(r);
+	lval_del(forms);
 	return 0;
 }
 
-int test_ast_failure()
+int test_load()
 {
-	mpc_ast_t* ast = parse("+ 4 (");
-	TEST_ASSERT(NULL == ast);
-	mpc_ast_delete(ast);
+	const char* path = "logs/test_load.lsp";
+	struct load_stats st;
+	FILE* fp = fopen(path, "w");
+	TEST_ASSERT(fp);
+	fprintf(fp, "(def {loaded} 42)\n(def {loaded_s}\n \"a b\")\n(def {loaded_b} -18446744073709551616)\n");
+	fclose(fp);
+	remove("logs/test_load.lspc");
+
+	STARTUP(v, "load \"logs/test_load.lsp\"");
+	TEST_ASSERT(LVAL_SEXPR == LVAL_TYPE(v));
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "+ loaded 1");
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && 43 == lval_get_long(v));
+	TEARDOWN(v);
+	load_get_stats(&st);
+	TEST_ASSERT(0 == st.hits && 1 == st.misses && 1 == st.writes);
+
+	// unchanged, served from logs/test_load.lspc
+	STARTUP_NO_DECLARE(v, "def {loaded} 0");
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "load \"logs/test_load.lsp\"");
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "+ loaded 1");
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && 43 == lval_get_long(v));
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "loaded_s");
+	TEST_ASSERT(LVAL_STR == LVAL_TYPE(v) && 0 == strcmp("a b", v->str));
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "== loaded_b (* -4294967296 4294967296)");
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && 1 == lval_get_long(v));
+	TEARDOWN(v);
+	load_get_stats(&st);
+	TEST_ASSERT(1 == st.hits && 1 == st.misses);
+
+	// a changed source is read again
+	fp = fopen(path, "w");
+	fprintf(fp, "(def {loaded} 7 )\n");
+	fclose(fp);
+	STARTUP_NO_DECLARE(v, "load \"logs/test_load.lsp\"");
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "loaded");
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && 7 == lval_get_long(v));
+	TEARDOWN(v);
+	load_get_stats(&st);
+	TEST_ASSERT(1 == st.hits && 2 == st.misses && 2 == st.writes);
+
+	// and so is one precompiled with another SERIAL_VERSION, after the magic
+	// and the interpreter version
+	fp = fopen("logs/test_load.lspc", "r+b");
+	TEST_ASSERT(fp && 0 == fseek(fp, 8 + 16, SEEK_SET) && SERIAL_VERSION == fgetc(fp));
+	fseek(fp, 8 + 16, SEEK_SET);
+	fputc(SERIAL_VERSION - 1, fp);
+	fclose(fp);
+	STARTUP_NO_DECLARE(v, "load \"logs/test_load.lsp\"");
+	TEARDOWN(v);
+	load_get_stats(&st);
+	TEST_ASSERT(1 == st.hits && 3 == st.misses && 3 == st.writes);
+
+	STARTUP_NO_DECLARE(v, "load \"logs/does_not_exist.lsp\"");
+	TEST_ASSERT(LVAL_ERR == LVAL_TYPE(v) && LERR_IO == v->err);
+	TEARDOWN(v);
+	return 0;
+}
+
+// streamed forms reach the collector's safepoint one by one
+int test_load_stream()
+{
+	const char* path = "logs/test_load_stream.lsp";
+	struct gc_stats st0, st;
+	FILE* fp = fopen(path, "w");
+	TEST_ASSERT(fp);
+	for (int i = 0; i < 10; i++)
+		fprintf(fp, "(def {streamed} {%d %d})\n", i, i+1);
+	fclose(fp);
+
+	gc_get_stats(&st0);
+	gc_set_threshold(1);
+	fp = fopen(path, "r");
+	TEST_ASSERT(0 == load_stream(environment, fp, path, 0));
+	fclose(fp);
+	gc_set_threshold(GC_DEFAULT_THRESHOLD);
+	gc_get_stats(&st);
+	TEST_ASSERT(st.collections >= st0.collections + 10);
+
+	lval* v = eval_str(environment, "streamed");
+	TEST_ASSERT(LVAL_QEXPR == LVAL_TYPE(v) && 10 == lval_get_long(v->cell[1]));
+	lval_del(v);
+	return 0;
+}
+
+int test_symbols()
+{
+	lval* a = lval_sym("sym_a");
+	lval* b = lval_sym_n("sym_a sym_b", 5);
+	lval* c = lval_copy(a);
+	TEST_ASSERT(a->sym == b->sym && a->sym == c->sym);
+	TEST_ASSERT(0 == strcmp("sym_a", c->sym) && symtab_contains(c->sym));
+	TEST_ASSERT(sym_intern("&", 1) == SYM_AMP);
+	TEST_ASSERT(sym_intern("sym_b", 5) != a->sym);
+	size_t n = symtab_count();
+	lval_del(a);
+	lval_del(b);
+	lval_del(c);
+	TEST_ASSERT(sym_intern("sym_a", 5) && n == symtab_count());
+
+	// a snapshot that does not start like the current table is refused
+	intptr_t delta = 1;
+	char* snap = (char*)malloc(symtab_used());
+	memcpy(snap, symtab_data(), symtab_used());
+	TEST_ASSERT(0 == symtab_restore(snap, symtab_used(), symtab_base(), &delta) && 0 == delta);
+	snap[2 * sizeof(uint32_t)] = 'Q';
+	TEST_ASSERT(1 == symtab_restore(snap, symtab_used(), symtab_base(), &delta));
+	free(snap);
+	return 0;
+}
+
+int test_env_index()
+{
+	const int N = 200;
+	char name[32];
+	lval* keys[N];
+	lenv* e = lenv_new();
+
+	for (int i = 0; i < N; i++) {
+		sprintf(name, "env_%d", i);
+		keys[i] = lval_sym(name);
+		TEST_ASSERT(0 == lenv_bind(e, keys[i]->sym, lval_long(i)));
+		TEST_ASSERT((i + 1 >= LENV_INDEX_MIN) == (NULL != e->index));
+	}
+	TEST_ASSERT(N == e->count && 2 * N <= (int)e->index_cap);
+
+	// every third binding goes, the rest keep their values and their order
+	for (int i = 0; i < N; i += 3)
+		TEST_ASSERT(0 == lenv_remove(e, keys[i]->sym));
+	TEST_ASSERT(1 == lenv_remove(e, keys[0]->sym));
+	for (int i = 0, j = 0; i < N; i++) {
+		lval* x = lenv_get(e, keys[i]);
+		if (i % 3) {
+			TEST_ASSERT(LVAL_LNG == LVAL_TYPE(x) && i == lval_get_long(x));
+			TEST_ASSERT(e->syms[j++] == keys[i]->sym);
+		}
+		else
+			TEST_ASSERT(LVAL_ERR == LVAL_TYPE(x) && LERR_BAD_SYMBOL == x->err);
+		lval_del(x);
+	}
+
+	// copies get their own index, rebinding replaces in place
+	lenv* c = lenv_copy(e);
+	TEST_ASSERT(c->index && c->index != e->index && c->count == e->count);
+	lval* v = lval_long(-1);
+	lenv_put(c, keys[1], v);
+	lval_del(v);
+	lval* x = lenv_get(c, keys[1]);
+	TEST_ASSERT(-1 == lval_get_long(x) && c->count == e->count);
+	lval_del(x);
+	x = lenv_get(e, keys[1]);
+	TEST_ASSERT(1 == lval_get_long(x));
+	lval_del(x);
+
+	for (int i = 0; i < N; i++)
+		lval_del(keys[i]);
+	lenv_del(c);
+	lenv_del(e);
+	return 0;
+}
+
+int test_image()
+{
+	const int N = 64;
+	char output[N];
+
+	STARTUP(v, "def {img_n img_l img_hd img_b} 5 {1 {2 3} \"s\"} head 18446744073709551616");
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "def {img_f img_g} (\\ {x y} {+ (* x 10) y}) ((\\ {x y} {- x y}) 100)");
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "def {img_k img_fib} (\\ {x} {+ x (* 2 3)}) (\\ {n} {if (< n 2) {n} {+ (img_fib (- n 1)) (img_fib (- n 2))}})");
+	TEARDOWN(v);
+	TEST_ASSERT(0 == image_save(environment, "logs/test.img"));
+
+	lenv* e = lenv_new();
+	init_env(e);
+	TEST_ASSERT(0 == image_load(e, "logs/test.img"));
+	TEST_ASSERT(1 == image_load(e, "logs/test.img")); // only one per process
+
+	lval* x = eval(e, parse("img_f img_n 3"));
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(x) && 53 == lval_get_long(x));
+	lval_del(x);
+	x = eval(e, parse("img_g 1")); // partial application, x is among its arguments
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(x) && 99 == lval_get_long(x));
+	lval_del(x);
+	x = eval(e, parse("img_hd img_l"));
+	TEST_ASSERT(lval_snprintln(x, output, N));
+	TEST_ASSERT(0 == strcmp("{1}", output));
+	lval_del(x);
+	x = eval(e, parse("- img_b 1"));
+	TEST_ASSERT(lval_snprintln(x, output, N));
+	TEST_ASSERT(0 == strcmp("18446744073709551615", output));
+	lval_del(x);
+
+	// image lambdas get a closure tree on their first call like any other,
+	// and code on the vm
+	struct clos_stats clos_before, clos_after;
+	clos_get_stats(&clos_before);
+	x = eval(e, parse("img_fib 15"));
+	clos_get_stats(&clos_after);
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(x) && 610 == lval_get_long(x));
+	TEST_ASSERT(1 == clos_after.compiles - clos_before.compiles);
+	lval_del(x);
+	eval_engine = ENGINE_VM;
+	x = eval(e, parse("img_k 2"));
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(x) && 8 == lval_get_long(x));
+	lval_del(x);
+	eval_engine = ENGINE_TREE;
+
+	// image values are read-only and never freed, rebinding just drops them
+	x = eval(e, parse("def {img_n} 6"));
+	lval_del(x);
+	x = eval(e, parse("+ img_n 1"));
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(x) && 7 == lval_get_long(x));
+	lval_del(x);
+
+	lenv_del(e);
 	return 0;
 }
 
 int test_eval_arithmetic()
 {
-	STARTUP(ast, v, "+ 1 2 (- 20 23) (* 3 7) (/ 9 (/ 14 2))");
-	TEST_ASSERT(LVAL_LNG == v->type);
-	TEST_ASSERT(22 == v->data.lng);
-	TEARDOWN(ast, v);
+	STARTUP(v, "+ 1 2 (- 20 23) (* 3 7) (/ 9 (/ 14 2))");
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v));
+	TEST_ASSERT(22 == lval_get_long(v));
+	TEARDOWN(v);
 	return 0;
 }
 
 int test_eval_arithmetic_dbl()
 {
-	STARTUP(ast, v, "+ 1.5 1.5 (- 20. 23) (* 3. 7) (/ 9 (/ 6.0 2))");
-	TEST_ASSERT(LVAL_DBL == v->type);
-	TEST_ASSERT(24. == v->data.dbl);
-	TEARDOWN(ast, v);
+	STARTUP(v, "+ 1.5 1.5 (- 20. 23) (* 3. 7) (/ 9 (/ 6.0 2))");
+	TEST_ASSERT(LVAL_DBL == LVAL_TYPE(v));
+	TEST_ASSERT(24. == lval_get_double(v));
+	TEARDOWN(v);
 	return 0;
 }
 
 int test_eval_pow()
 {
-	STARTUP(ast, v, "^ 2 2 2 2 2");
-	TEST_ASSERT(LVAL_LNG == v->type);
-	TEST_ASSERT(65536 == v->data.lng);
-	TEARDOWN(ast, v);
+	STARTUP(v, "^ 2 2 2 2 2");
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v));
+	TEST_ASSERT(65536 == lval_get_long(v));
+	TEARDOWN(v);
 	return 0;
 }
 
 int test_eval_pow_dbl()
 {
-	STARTUP(ast, v, "^ 2 .5");
-	TEST_ASSERT(LVAL_DBL == v->type);
-	TEST_ASSERT(sqrt(2.0) == v->data.dbl);
-	TEARDOWN(ast, v);
+	STARTUP(v, "^ 2 .5");
+	TEST_ASSERT(LVAL_DBL == LVAL_TYPE(v));
+	TEST_ASSERT(sqrt(2.0) == lval_get_double(v));
+	TEARDOWN(v);
 	return 0;
 }
 
 int test_eval_maxmin()
 {
-	STARTUP(ast, v, "max 1 2 3 4 (min 5 6 7 8)");
-	TEST_ASSERT(LVAL_LNG == v->type);
-	TEST_ASSERT(5 == v->data.lng);
-	TEARDOWN(ast, v);
+	STARTUP(v, "max 1 2 3 4 (min 5 6 7 8)");
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v));
+	TEST_ASSERT(5 == lval_get_long(v));
+	TEARDOWN(v);
 	return 0;
 }
 
 int test_eval_maxmin_dbl()
 {
-	STARTUP(ast, v, "max 1 2 3.3 4.4 (min 5.5 6 7 8)");
-	TEST_ASSERT(LVAL_DBL == v->type);
-	TEST_ASSERT(5.5 == v->data.dbl);
-	TEARDOWN(ast, v);
+	STARTUP(v, "max 1 2 3.3 4.4 (min 5.5 6 7 8)");
+	TEST_ASSERT(LVAL_DBL == LVAL_TYPE(v));
+	TEST_ASSERT(5.5 == lval_get_double(v));
+	TEARDOWN(v);
+	return 0;
+}
+
+int test_eval_mixed()
+{
+	STARTUP(v, "+ 1 2 0.5 1");
+	TEST_ASSERT(LVAL_DBL == LVAL_TYPE(v) && 4.5 == lval_get_double(v));
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "- 5");
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && -5 == lval_get_long(v));
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "/ 1 -2.0");
+	TEST_ASSERT(LVAL_DBL == LVAL_TYPE(v) && -0.5 == lval_get_double(v));
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "% 7.5 2");
+	TEST_ASSERT(LVAL_DBL == LVAL_TYPE(v) && 1.5 == lval_get_double(v));
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "% 7 0");
+	TEST_ASSERT(LVAL_ERR == LVAL_TYPE(v) && LERR_DIV_ZERO == v->err);
+	TEARDOWN(v);
+	return 0;
+}
+
+int test_eval_int64()
+{
+	STARTUP(v, "^ 3 39");
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && 4052555153018976267 == lval_get_long(v));
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "+ (^ 2 -1) (^ -1 -3) (^ 7 0)");
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && 0 == lval_get_long(v));
+	TEARDOWN(v);
+
+	// 2^53 + 1 is no double
+	STARTUP_NO_DECLARE(v, "> 9007199254740993 9007199254740992");
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && 1 == lval_get_long(v));
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "<= 9007199254740993 9007199254740992");
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && 0 == lval_get_long(v));
+	TEARDOWN(v);
+
+	const int N = 20000;
+	char* input = (char*)malloc(8 * N);
+	int n = sprintf(input, "+");
+	for (int i = 1; i <= N; i++)
+		n += sprintf(input + n, " %d", i);
+	STARTUP_NO_DECLARE(v, input);
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && (int64_t)N * (N + 1) / 2 == lval_get_long(v));
+	TEARDOWN(v);
+	free(input);
+	return 0;
+}
+
+int test_eval_bigint()
+{
+	const int N = 64;
+	char output[N];
+	struct big_stats st;
+
+	// overflow promotes to a bigint, results that fit are longs again
+	STARTUP(v, "+ 9223372036854775807 1");
+	TEST_ASSERT(LVAL_BIG == LVAL_TYPE(v));
+	TEST_ASSERT(lval_snprintln(v, output, N));
+	TEST_ASSERT(0 == strcmp("9223372036854775808", output));
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "- (* 9223372036854775807 4 5) (* 9223372036854775807 20) 7");
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && -7 == lval_get_long(v));
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "/ -9223372036854775808 -1");
+	TEST_ASSERT(LVAL_BIG == LVAL_TYPE(v));
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "- (- -9223372036854775808) 1");
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && INT64_MAX == lval_get_long(v));
+	TEARDOWN(v);
+
+	// ^ is exact, division truncates like it does for longs
+	STARTUP_NO_DECLARE(v, "^ 2 100");
+	TEST_ASSERT(lval_snprintln(v, output, N));
+	TEST_ASSERT(0 == strcmp("1267650600228229401496703205376", output));
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "/ (^ -7 40) (^ 7 38)");
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && 49 == lval_get_long(v));
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "% (- 5 (^ 7 40)) (^ 7 38)");
+	TEST_ASSERT(lval_snprintln(v, output, N));
+	TEST_ASSERT(0 == strcmp("-129934811447123020117172145698444", output));
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "/ (^ 10 30) 0");
+	TEST_ASSERT(LVAL_ERR == LVAL_TYPE(v) && LERR_DIV_ZERO == v->err);
+	TEARDOWN(v);
+
+	// bigints compare exactly, with doubles as doubles
+	STARTUP_NO_DECLARE(v, "+ (< (^ 2 64) (+ (^ 2 64) 1)) (== (^ 2 64) (* 4294967296 4294967296)) (== (^ 2 64) 18446744073709551616.0)");
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && 3 == lval_get_long(v));
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "max 1 (^ 3 50) 2.5");
+	TEST_ASSERT(LVAL_DBL == LVAL_TYPE(v) && 717897987691852578422784.0 == lval_get_double(v));
+	TEARDOWN(v);
+
+	// a Karatsuba product is the one of the limb by limb loop
+	lval* p = eval_str(environment, "* (- (^ 3 3000) 1) (^ 7 2000)");
+	int karatsuba = big_karatsuba;
+	big_karatsuba = 1 << 30;
+	lval* q = eval_str(environment, "* (- (^ 3 3000) 1) (^ 7 2000)");
+	big_karatsuba = karatsuba;
+	TEST_ASSERT(LVAL_BIG == LVAL_TYPE(p) && LVAL_BIG == LVAL_TYPE(q));
+	TEST_ASSERT(p->nlimbs == q->nlimbs && 0 == memcmp(p->limbs, q->limbs, sizeof(uint32_t) * p->nlimbs));
+	lval_del(p);
+	lval_del(q);
+	big_get_stats(&st);
+	TEST_ASSERT(st.karatsuba > 0 && st.promotions > 0 && st.demotions > 0);
+	return 0;
+}
+
+int test_immediates()
+{
+	int64_t lngs[] = { 0, -1, ((int64_t)1 << 61) - 1, -((int64_t)1 << 61), (int64_t)1 << 61, INT64_MIN };
+	for (size_t i = 0; i < sizeof(lngs) / sizeof(lngs[0]); i++) {
+		lval* x = lval_long(lngs[i]);
+		TEST_ASSERT(LVAL_LNG == LVAL_TYPE(x) && lngs[i] == lval_get_long(x));
+		TEST_ASSERT(LVAL_IS_IMM(x) == (i < 4));
+		lval_del(x);
+	}
+
+	double dbls[] = { 0.0, -0.0, 1.5, -1e-70, 1e70, 1e100, 1e-100, 5e-324 };
+	for (size_t i = 0; i < sizeof(dbls) / sizeof(dbls[0]); i++) {
+		lval* x = lval_double(dbls[i]);
+		TEST_ASSERT(LVAL_DBL == LVAL_TYPE(x) && 0 == memcmp(&dbls[i], &(double){ lval_get_double(x) }, sizeof(double)));
+		TEST_ASSERT(LVAL_IS_IMM(x) == (i < 5));
+		lval_del(x);
+	}
+
+	// across the boundary and back
+	STARTUP(v, "- (+ 2305843009213693951 5) 5");
+	TEST_ASSERT(LVAL_IS_IMM(v) && 2305843009213693951 == lval_get_long(v));
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "/ (* 2.0 (^ 10.0 100)) (^ 10.0 100)");
+	TEST_ASSERT(LVAL_IS_IMM(v) && 2.0 == lval_get_double(v));
+	TEARDOWN(v);
 	return 0;
 }
 
 int test_non_number()
 {
-	STARTUP(ast, v, "( / ( ) )");
-	TEST_ASSERT(LVAL_ERR == v->type);
+	STARTUP(v, "( / ( ) )");
+	TEST_ASSERT(LVAL_ERR == LVAL_TYPE(v));
 	TEST_ASSERT(LERR_BAD_NUM == v->err);
-	TEARDOWN(ast, v);
+	TEARDOWN(v);
 	return 0;
 }
 
 int test_bad_sexpr_start()
 {
-	STARTUP(ast, v, "( 1 () )");
-	TEST_ASSERT(LVAL_ERR == v->type);
+	STARTUP(v, "( 1 () )");
+	TEST_ASSERT(LVAL_ERR == LVAL_TYPE(v));
 	TEST_ASSERT(LERR_BAD_SEXPR_START == v->err);
-	TEARDOWN(ast, v);
+	TEARDOWN(v);
 	return 0;
 }
 
 int test_div_zero()
 {
-	STARTUP(ast, v, "(/ 1 0 )");
-	TEST_ASSERT(LVAL_ERR == v->type);
+	STARTUP(v, "(/ 1 0 )");
+	TEST_ASSERT(LVAL_ERR == LVAL_TYPE(v));
 	TEST_ASSERT(LERR_DIV_ZERO == v->err);
-	TEARDOWN(ast, v);
+	TEARDOWN(v);
 	return 0;
 }
 
 int test_div_zero_dbl()
 {
-	STARTUP(ast, v, "(/ 1 0.0000000000000001)");
-	TEST_ASSERT(LVAL_ERR == v->type);
+	STARTUP(v, "(/ 1 0.0000000000000001)");
+	TEST_ASSERT(LVAL_ERR == LVAL_TYPE(v));
 	TEST_ASSERT(LERR_DIV_ZERO == v->err);
-	TEARDOWN(ast, v);
+	TEARDOWN(v);
 	return 0;
 }
 
 int test_unknown_symbol()
 {
-	STARTUP(ast, v, "asdf 1 2 3");
-	TEST_ASSERT(LVAL_ERR == v->type);
+	STARTUP(v, "asdf 1 2 3");
+	TEST_ASSERT(LVAL_ERR == LVAL_TYPE(v));
 	TEST_ASSERT(LERR_BAD_SYMBOL == v->err);
-	TEARDOWN(ast, v);
+	TEARDOWN(v);
 	return 0;
 }
 
 int test_empty_input()
 {
-	mpc_ast_t* ast = parse("  ");
-	TEST_ASSERT(NULL == ast);
-	mpc_ast_delete(ast);
+	lval* v = parse("  ");
+	TEST_ASSERT(NULL == v);
 	return 0;
 }
 
@@ -185,10 +693,10 @@ int test_qexpr_basic()
 	const int N = 32;
 	char output[N];
 
-	STARTUP(ast, v, "{ {a}  b }");
+	STARTUP(v, "{ {a}  b }");
 	TEST_ASSERT(lval_snprintln(v, output, N));
 	TEST_ASSERT(0 == strncmp("{{a} b}", output, N));
-	TEARDOWN(ast, v);
+	TEARDOWN(v);
 
 	return 0;
 }
@@ -198,23 +706,23 @@ int test_qexpr_quote()
 	const int N = 32;
 	char output[N];
 
-	STARTUP(ast, v, "eval {car (quote 1 2 3 4)}");
+	STARTUP(v, "eval {car (quote 1 2 3 4)}");
 	TEST_ASSERT(lval_snprintln(v, output, N));
 	TEST_ASSERT(0 == strncmp("{1}", output, N));
-	TEST_ASSERT(LVAL_QEXPR == v->type);
-	TEARDOWN(ast, v);
+	TEST_ASSERT(LVAL_QEXPR == LVAL_TYPE(v));
+	TEARDOWN(v);
 
-	STARTUP_NO_DECLARE(ast, v, "quote a b");
+	STARTUP_NO_DECLARE(v, "quote a b");
 	TEST_ASSERT(lval_snprintln(v, output, N));
 	TEST_ASSERT(0 == strncmp("{a b}", output, N));
-	TEST_ASSERT(LVAL_QEXPR == v->type);
-	TEARDOWN(ast, v);
+	TEST_ASSERT(LVAL_QEXPR == LVAL_TYPE(v));
+	TEARDOWN(v);
 
-	STARTUP_NO_DECLARE(ast, v, "list a b (c d)");
+	STARTUP_NO_DECLARE(v, "list a b (c d)");
 	TEST_ASSERT(lval_snprintln(v, output, N));
 	TEST_ASSERT(0 == strncmp("{a b (c d)}", output, N));
-	TEST_ASSERT(LVAL_QEXPR == v->type);
-	TEARDOWN(ast, v);
+	TEST_ASSERT(LVAL_QEXPR == LVAL_TYPE(v));
+	TEARDOWN(v);
 
 	return 0;
 }
@@ -224,11 +732,11 @@ int test_qexpr_head() // same as car
 	const int N = 32;
 	char output[N];
 
-	STARTUP(ast, v, "eval {head (car { {1 2} 3 4 })}");
+	STARTUP(v, "eval {head (car { {1 2} 3 4 })}");
 	TEST_ASSERT(lval_snprintln(v, output, N));
 	TEST_ASSERT(0 == strncmp("{{1 2}}", output, N));
-	TEST_ASSERT(LVAL_QEXPR == v->type);
-	TEARDOWN(ast, v);
+	TEST_ASSERT(LVAL_QEXPR == LVAL_TYPE(v));
+	TEARDOWN(v);
 
 	return 0;
 }
@@ -238,11 +746,11 @@ int test_qexpr_tail()
 	const int N = 32;
 	char output[N];
 
-	STARTUP(ast, v, "eval {tail (cdr {5 6 7})}");
+	STARTUP(v, "eval {tail (cdr {5 6 7})}");
 	TEST_ASSERT(lval_snprintln(v, output, N));
 	TEST_ASSERT(0 == strncmp("{7}", output, N));
-	TEST_ASSERT(LVAL_QEXPR == v->type);
-	TEARDOWN(ast, v);
+	TEST_ASSERT(LVAL_QEXPR == LVAL_TYPE(v));
+	TEARDOWN(v);
 
 	return 0;
 }
@@ -252,11 +760,11 @@ int test_qexpr_join()
 	const int N = 32;
 	char output[N];
 
-	STARTUP(ast, v, "join {1 2 3 } {4 5 6}");
+	STARTUP(v, "join {1 2 3 } {4 5 6}");
 	TEST_ASSERT(lval_snprintln(v, output, N));
 	TEST_ASSERT(0 == strncmp("{1 2 3 4 5 6}", output, N));
-	TEST_ASSERT(LVAL_QEXPR == v->type);
-	TEARDOWN(ast, v);
+	TEST_ASSERT(LVAL_QEXPR == LVAL_TYPE(v));
+	TEARDOWN(v);
 
 	return 0;
 }
@@ -266,21 +774,21 @@ int test_qexpr_init()
 	const int N = 32;
 	char output[N];
 
-	STARTUP(ast, v, "init {1 2 z}");
+	STARTUP(v, "init {1 2 z}");
 	TEST_ASSERT(lval_snprintln(v, output, N));
 	TEST_ASSERT(0 == strncmp("{1 2}", output, N));
-	TEST_ASSERT(LVAL_QEXPR == v->type);
-	TEARDOWN(ast, v);
+	TEST_ASSERT(LVAL_QEXPR == LVAL_TYPE(v));
+	TEARDOWN(v);
 
 	return 0;
 }
 
 int test_qexpr_len()
 {
-	STARTUP(ast, v, "len {1 2 3.3 a b c}");
-	TEST_ASSERT(LVAL_LNG == v->type);
-	TEST_ASSERT(6 == v->data.lng);
-	TEARDOWN(ast, v);
+	STARTUP(v, "len {1 2 3.3 a b c}");
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v));
+	TEST_ASSERT(6 == lval_get_long(v));
+	TEARDOWN(v);
 
 	return 0;
 }
@@ -290,70 +798,100 @@ int test_qexpr_cons()
 	const int N = 32;
 	char output[N];
 
-	STARTUP(ast, v, "cons {a} {1 2 3}");
+	STARTUP(v, "cons {a} {1 2 3}");
 	TEST_ASSERT(lval_snprintln(v, output, N));
 	TEST_ASSERT(0 == strncmp("{a 1 2 3}", output, N)); // should it be {{a} 2 3 4}?
-	TEST_ASSERT(LVAL_QEXPR == v->type);
-	TEARDOWN(ast, v);
+	TEST_ASSERT(LVAL_QEXPR == LVAL_TYPE(v));
+	TEARDOWN(v);
 
-	STARTUP(ast1, v1, "cons {a b} {1 2 3}");
+	STARTUP(v1, "cons {a b} {1 2 3}");
 	TEST_ASSERT(lval_snprintln(v1, output, N));
 	TEST_ASSERT(0 == strncmp("{{a b} 1 2 3}", output, N));
-	TEST_ASSERT(LVAL_QEXPR == v1->type);
-	TEARDOWN(ast1, v1);
+	TEST_ASSERT(LVAL_QEXPR == LVAL_TYPE(v1));
+	TEARDOWN(v1);
 
 	return 0;
 }
 
+int test_qexpr_shared()
+{
+	const int N = 32;
+	char output[N];
+
+	lval_del(eval_str(environment, "def {shared_xs} {1 2 {3 4}}"));
+	lval* k = lval_sym("shared_xs");
+	lval* xs = lenv_ref(environment, k);
+	int refs = xs->refs; // the parse cache may hold it too
+
+	// lookups share the bound value, changes go to copies
+	STARTUP(v, "shared_xs");
+	TEST_ASSERT(v == xs && refs + 1 == xs->refs);
+	TEARDOWN(v);
+	const char* exprs[] = { "tail shared_xs", "init shared_xs", "join shared_xs {5}",
+		"cons 0 shared_xs", "eval (head (tail (tail shared_xs)))", "(\\ {x} {x}) shared_xs" };
+	for (size_t i = 0; i < sizeof(exprs) / sizeof(exprs[0]); i++) {
+		STARTUP_NO_DECLARE(v, exprs[i]);
+		TEST_ASSERT(LVAL_ERR != LVAL_TYPE(v));
+		TEARDOWN(v);
+	}
+	TEST_ASSERT(lval_snprintln(xs, output, N));
+	TEST_ASSERT(0 == strncmp("{1 2 {3 4}}", output, N));
+	TEST_ASSERT(refs == xs->refs);
+
+	lenv_remove(environment, k->sym);
+	lval_del(k);
+	return 0;
+}
+
 int test_qexpr_incorrect_type()
 {
-	STARTUP(ast, v, "tail (+ 1 2)");
-	TEST_ASSERT(LVAL_ERR == v->type);
+	STARTUP(v, "tail (+ 1 2)");
+	TEST_ASSERT(LVAL_ERR == LVAL_TYPE(v));
 	TEST_ASSERT(LERR_BAD_TYPE == v->err);
-	TEARDOWN(ast, v);
+	TEARDOWN(v);
 
-	STARTUP(ast1, v1, "cons {1 2} 3");
-	TEST_ASSERT(LVAL_ERR == v1->type);
+	STARTUP(v1, "cons {1 2} 3");
+	TEST_ASSERT(LVAL_ERR == LVAL_TYPE(v1));
 	TEST_ASSERT(LERR_BAD_TYPE == v1->err);
-	TEARDOWN(ast1, v1);
+	TEARDOWN(v1);
 	return 0;
 }
 
 int test_qexpr_empty()
 {
-	STARTUP(ast, v, "cdr {}");
-	TEST_ASSERT(LVAL_ERR == v->type);
+	STARTUP(v, "cdr {}");
+	TEST_ASSERT(LVAL_ERR == LVAL_TYPE(v));
 	TEST_ASSERT(LERR_EMPTY == v->err);
-	TEARDOWN(ast, v);
+	TEARDOWN(v);
 	return 0;
 }
 
 int test_qexpr_too_many_args()
 {
-	STARTUP(ast, v, "tail {1 2} {3}");
-	TEST_ASSERT(LVAL_ERR == v->type);
+	STARTUP(v, "tail {1 2} {3}");
+	TEST_ASSERT(LVAL_ERR == LVAL_TYPE(v));
 	TEST_ASSERT(LERR_TOO_MANY_ARGS == v->err);
-	TEARDOWN(ast, v);
+	TEARDOWN(v);
 
-	STARTUP(ast1, v1, "head {1 2} {3}");
-	TEST_ASSERT(LVAL_ERR == v1->type);
+	STARTUP(v1, "head {1 2} {3}");
+	TEST_ASSERT(LVAL_ERR == LVAL_TYPE(v1));
 	TEST_ASSERT(LERR_TOO_MANY_ARGS == v1->err);
-	TEARDOWN(ast1, v1);
+	TEARDOWN(v1);
 
-	STARTUP(ast2, v2, "init {1 2} {3}");
-	TEST_ASSERT(LVAL_ERR == v2->type);
+	STARTUP(v2, "init {1 2} {3}");
+	TEST_ASSERT(LVAL_ERR == LVAL_TYPE(v2));
 	TEST_ASSERT(LERR_TOO_MANY_ARGS == v2->err);
-	TEARDOWN(ast2, v2);
+	TEARDOWN(v2);
 
 	return 0;
 }
 
 int test_qexpr_bad_args_count()
 {
-	STARTUP(ast, v, "cons (quote 1 2)");
-	TEST_ASSERT(LVAL_ERR == v->type);
+	STARTUP(v, "cons (quote 1 2)");
+	TEST_ASSERT(LVAL_ERR == LVAL_TYPE(v));
 	TEST_ASSERT(LERR_BAD_ARGS_COUNT == v->err);
-	TEARDOWN(ast, v);
+	TEARDOWN(v);
 	return 0;
 }
 
@@ -363,8 +901,7 @@ int test_snprint_exprs_good()
 	char output[N];
 	memset(output, 'z', sizeof(output));
 
-	mpc_ast_t* ast = parse(" { (+ 1 2 3 ) }");
-	lval* v = ast_to_lval(ast); // NOTE, no eval
+	lval* v = parse(" { (+ 1 2 3 ) }"); // NOTE, no eval
 
 	int ret = lval_snprintln(v, output, N);
 	TEST_ASSERT(0 <= ret);
@@ -372,7 +909,7 @@ int test_snprint_exprs_good()
 	TEST_ASSERT('\0' == output[N-2]);
 	TEST_ASSERT('z' == output[N-1]);
 
-	TEARDOWN(ast, v);
+	TEARDOWN(v);
 	return 0;
 }
 
@@ -382,14 +919,13 @@ int test_snprint_exprs_bad()
 	char output[N];
 	memset(output, 'z', sizeof(output));
 
-	mpc_ast_t* ast = parse(" { (+ 1 2 3 ) }");
-	lval* v = ast_to_lval(ast); // NOTE, no eval
+	lval* v = parse(" { (+ 1 2 3 ) }"); // NOTE, no eval
 
 	int ret = lval_snprintln(v, output, N);
 	TEST_ASSERT(N-1 == ret);
 	TEST_ASSERT('\0' == output[N-1]); // need to be null terminated
 
-	TEARDOWN(ast, v);
+	TEARDOWN(v);
 
 	return 0;
 }
@@ -400,14 +936,13 @@ int test_snprint_exprs_bad2()
 	char output[N];
 	memset(output, 'z', sizeof(output));
 
-	mpc_ast_t* ast = parse(" { (+ 1 2 3 ) }");
-	lval* v = ast_to_lval(ast); // NOTE, no eval
+	lval* v = parse(" { (+ 1 2 3 ) }"); // NOTE, no eval
 
 	int ret = lval_snprintln(v, output, N);
 	TEST_ASSERT(N-1 == ret);
 	TEST_ASSERT('\0' == output[N-1]); // need to be null terminated
 
-	TEARDOWN(ast, v);
+	TEARDOWN(v);
 
 	return 0;
 }
@@ -417,44 +952,44 @@ int test_def()
 	const int N = 32;
 	char output[N];
 
-	STARTUP(ast, v, "def {x} 100");
+	STARTUP(v, "def {x} 100");
 	TEST_ASSERT(lval_snprintln(v, output, N));
 	TEST_ASSERT(0 == strncmp("()", output, N));
-	TEST_ASSERT(LVAL_SEXPR == v->type); // TODO better to return nothing
-	TEARDOWN(ast, v);
+	TEST_ASSERT(LVAL_SEXPR == LVAL_TYPE(v)); // TODO better to return nothing
+	TEARDOWN(v);
 
-	STARTUP_NO_DECLARE(ast, v, "x");
-	TEST_ASSERT(LVAL_LNG == v->type);
-	TEST_ASSERT(100 == v->data.lng);
-	TEARDOWN(ast, v);
+	STARTUP_NO_DECLARE(v, "x");
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v));
+	TEST_ASSERT(100 == lval_get_long(v));
+	TEARDOWN(v);
 
-	STARTUP_NO_DECLARE(ast, v, "def {y} 200.0");
+	STARTUP_NO_DECLARE(v, "def {y} 200.0");
 	TEST_ASSERT(lval_snprintln(v, output, N));
 	TEST_ASSERT(0 == strncmp("()", output, N));
-	TEST_ASSERT(LVAL_SEXPR == v->type); // TODO better to return nothing
-	TEARDOWN(ast, v);
+	TEST_ASSERT(LVAL_SEXPR == LVAL_TYPE(v)); // TODO better to return nothing
+	TEARDOWN(v);
 
-	STARTUP_NO_DECLARE(ast, v, "y");
-	TEST_ASSERT(LVAL_DBL == v->type);
-	TEST_ASSERT(200.0 == v->data.dbl);
-	TEARDOWN(ast, v);
+	STARTUP_NO_DECLARE(v, "y");
+	TEST_ASSERT(LVAL_DBL == LVAL_TYPE(v));
+	TEST_ASSERT(200.0 == lval_get_double(v));
+	TEARDOWN(v);
 
-	STARTUP_NO_DECLARE(ast, v, "+ x y");
-	TEST_ASSERT(LVAL_DBL == v->type);
-	TEST_ASSERT(300.0 == v->data.dbl);
-	TEARDOWN(ast, v);
+	STARTUP_NO_DECLARE(v, "+ x y");
+	TEST_ASSERT(LVAL_DBL == LVAL_TYPE(v));
+	TEST_ASSERT(300.0 == lval_get_double(v));
+	TEARDOWN(v);
 
-	STARTUP_NO_DECLARE(ast, v, "def {y} {tail {a b c}}");
+	STARTUP_NO_DECLARE(v, "def {y} {tail {a b c}}");
 	TEST_ASSERT(lval_snprintln(v, output, N));
 	TEST_ASSERT(0 == strncmp("()", output, N));
-	TEST_ASSERT(LVAL_SEXPR == v->type); // TODO better to return nothing
-	TEARDOWN(ast, v);
+	TEST_ASSERT(LVAL_SEXPR == LVAL_TYPE(v)); // TODO better to return nothing
+	TEARDOWN(v);
 
-	STARTUP_NO_DECLARE(ast, v, "eval y"); // redefine y
+	STARTUP_NO_DECLARE(v, "eval y"); // redefine y
 	TEST_ASSERT(lval_snprintln(v, output, N));
 	TEST_ASSERT(0 == strncmp("{b c}", output, N));
-	TEST_ASSERT(LVAL_QEXPR == v->type); // TODO better to return nothing
-	TEARDOWN(ast, v);
+	TEST_ASSERT(LVAL_QEXPR == LVAL_TYPE(v)); // TODO better to return nothing
+	TEARDOWN(v);
 
 	return 0;
 }
@@ -464,16 +999,16 @@ int test_put()
 	const int N = 32;
 	char output[N];
 
-	STARTUP(ast, v, "= {x} 100");
+	STARTUP(v, "= {x} 100");
 	TEST_ASSERT(lval_snprintln(v, output, N));
 	TEST_ASSERT(0 == strncmp("()", output, N));
-	TEST_ASSERT(LVAL_SEXPR == v->type); // TODO better to return nothing
-	TEARDOWN(ast, v);
+	TEST_ASSERT(LVAL_SEXPR == LVAL_TYPE(v)); // TODO better to return nothing
+	TEARDOWN(v);
 
-	STARTUP_NO_DECLARE(ast, v, "x");
-	TEST_ASSERT(LVAL_LNG == v->type);
-	TEST_ASSERT(100 == v->data.lng);
-	TEARDOWN(ast, v);
+	STARTUP_NO_DECLARE(v, "x");
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v));
+	TEST_ASSERT(100 == lval_get_long(v));
+	TEARDOWN(v);
 
 	return 0;
 }
@@ -483,29 +1018,648 @@ int test_lambda()
 	const int N = 32;
 	char output[N];
 
-	STARTUP(ast, v, "(\\ {x y z} {+ x y z}) 1 2 3");
+	STARTUP(v, "(\\ {x y z} {+ x y z}) 1 2 3");
 	TEST_ASSERT(lval_snprintln(v, output, N));
 	TEST_ASSERT(0 == strncmp("6", output, N));
-	TEARDOWN(ast, v);
+	TEARDOWN(v);
 
-	STARTUP_NO_DECLARE(ast, v, "(\\ {f & xs} {f xs}) head 1 2 3 4");
+	STARTUP_NO_DECLARE(v, "(\\ {f & xs} {f xs}) head 1 2 3 4");
 	TEST_ASSERT(lval_snprintln(v, output, N));
-	TEST_ASSERT(LVAL_QEXPR == v->type);
+	TEST_ASSERT(LVAL_QEXPR == LVAL_TYPE(v));
 	TEST_ASSERT(0 == strncmp("{1}", output, N));
-	TEARDOWN(ast, v);
+	TEARDOWN(v);
 
-	STARTUP_NO_DECLARE(ast, v, "def {fun} (\\ {x y} { + (* 7 x) (* 2 y)})");
+	STARTUP_NO_DECLARE(v, "def {fun} (\\ {x y} { + (* 7 x) (* 2 y)})");
 	TEST_ASSERT(lval_snprintln(v, output, N));
 	TEST_ASSERT(0 == strncmp("()", output, N));
-	TEST_ASSERT(LVAL_SEXPR == v->type);
-	TEARDOWN(ast, v);
+	TEST_ASSERT(LVAL_SEXPR == LVAL_TYPE(v));
+	TEARDOWN(v);
 
-	STARTUP_NO_DECLARE(ast, v, "fun 3 8");
+	STARTUP_NO_DECLARE(v, "fun 3 8");
 	TEST_ASSERT(lval_snprintln(v, output, N));
-	TEST_ASSERT(LVAL_LNG == v->type);
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v));
 	TEST_ASSERT(0 == strncmp("37", output, N));
-	TEARDOWN(ast, v);
+	TEARDOWN(v);
+
+	return 0;
+}
+
+int test_if()
+{
+	const int N = 32;
+	char output[N];
+
+	STARTUP(v, "if (== 2 2.0) {+ 1 1} {undefined_symbol}");
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && 2 == lval_get_long(v));
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "+ (* 8 (== {1 {a}} {1 {a}})) (* 4 (!= {1 {a}} {1 {b}})) (* 2 (== head car)) (== \"a\" 1)");
+	TEST_ASSERT(lval_snprintln(v, output, N));
+	TEST_ASSERT(0 == strncmp("14", output, N));
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "if {1} {2} {3}");
+	TEST_ASSERT(LVAL_ERR == LVAL_TYPE(v) && LERR_BAD_TYPE == v->err);
+	TEARDOWN(v);
+
+	// zero of either type picks the else branch, only the branch taken runs
+	STARTUP_NO_DECLARE(v, "if 0.0 {undefined_symbol} {+ 2 3}");
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && 5 == lval_get_long(v));
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "if 0 {1} {undefined_symbol}");
+	TEST_ASSERT(LVAL_ERR == LVAL_TYPE(v) && LERR_BAD_SYMBOL == v->err);
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "if -1 {} {2}");
+	TEST_ASSERT(LVAL_SEXPR == LVAL_TYPE(v) && 0 == v->count);
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "if 1 {1}");
+	TEST_ASSERT(LVAL_ERR == LVAL_TYPE(v) && LERR_BAD_ARGS_COUNT == v->err);
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "if 1 2 3");
+	TEST_ASSERT(LVAL_ERR == LVAL_TYPE(v) && LERR_BAD_TYPE == v->err);
+	TEARDOWN(v);
+
+	STARTUP_NO_DECLARE(v, "def {fib} (\\ {n} {if (< n 2) {n} {+ (fib (- n 1)) (fib (- n 2))}})");
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "fib 15");
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && 610 == lval_get_long(v));
+	TEARDOWN(v);
+	return 0;
+}
+
+int test_eq()
+{
+	// numbers by value whatever their type, anything else by structure
+	STARTUP(v, "+ (== 1 1.0) (* 2 (!= 1 2)) (* 4 (== 18446744073709551616 (* 4294967296 4294967296)))");
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && 7 == lval_get_long(v));
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "+ (== {} {}) (* 2 (== \"a\" \"a\")) (* 4 (!= \"a\" \"b\")) (* 8 (== (\\ {x} {x}) (\\ {x} {x})))");
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && 15 == lval_get_long(v));
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "+ (== 1 {1}) (== {1 2} {1 3}) (== 1 \"1\") (== (\\ {x} {x}) (\\ {y} {y}))");
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && 0 == lval_get_long(v));
+	TEARDOWN(v);
+
+	STARTUP_NO_DECLARE(v, "== 1");
+	TEST_ASSERT(LVAL_ERR == LVAL_TYPE(v) && LERR_BAD_ARGS_COUNT == v->err);
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "!= 1 2 3");
+	TEST_ASSERT(LVAL_ERR == LVAL_TYPE(v) && LERR_BAD_ARGS_COUNT == v->err);
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "== undefined_symbol 1");
+	TEST_ASSERT(LVAL_ERR == LVAL_TYPE(v) && LERR_BAD_SYMBOL == v->err);
+	TEARDOWN(v);
+	return 0;
+}
+
+int test_resolve()
+{
+	lval* k = lval_sym("res_g");
+	lval* v;
+
+	// formals get local slots, & is skipped, known globals get global slots
+	STARTUP_NO_DECLARE(v, "def {res_g} 100");
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "\\ {a & rest} {+ a res_g (len rest) unbound}");
+	lval* body = v->body;
+	TEST_ASSERT(LVAL_SLOT_LOCAL(0) == body->cell[1]->slot);
+	TEST_ASSERT(LVAL_SLOT_GLOBAL(lenv_slot(environment, k->sym)) == body->cell[2]->slot);
+	TEST_ASSERT(LVAL_SLOT_LOCAL(1) == body->cell[3]->cell[1]->slot);
+	TEST_ASSERT(0 == body->cell[4]->slot);
+	TEARDOWN(v);
+
+	// scoping stays dynamic, a caller's binding still shadows the global one
+	STARTUP_NO_DECLARE(v, "def {res_f res_h} (\\ {x} {+ x res_g}) (\\ {res_g} {res_f 1})");
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "res_f 1");
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && 101 == lval_get_long(v));
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "res_h 5");
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && 6 == lval_get_long(v));
+	TEARDOWN(v);
+
+	// a stale global slot falls back to the normal lookup
+	STARTUP_NO_DECLARE(v, "def {res_a res_b} 1 2");
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "def {res_k} (\\ {_} {res_b})");
+	TEARDOWN(v);
+	lval* a = lval_sym("res_a");
+	TEST_ASSERT(0 == lenv_remove(environment, a->sym));
+	lval_del(a);
+	STARTUP_NO_DECLARE(v, "res_k 0");
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && 2 == lval_get_long(v));
+	TEARDOWN(v);
+
+	lval_del(k);
+	return 0;
+}
+
+int test_global_caches()
+{
+	struct lenv_stats before, after;
+	lval* v;
+
+	// the second call finds the globals in the body in their symbols, only
+	// the freshly parsed ic_g is looked up, compiled bodies would not look up
+	// the builtins at all
+	clos_enabled = 0;
+	STARTUP_NO_DECLARE(v, "def {ic_k ic_f ic_g} 10 (\\ {x} {+ x ic_k}) (\\ {x} {ic_f x})");
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "ic_g 1");
+	TEARDOWN(v);
+	lenv_get_stats(&before);
+	STARTUP_NO_DECLARE(v, "ic_g 1");
+	lenv_get_stats(&after);
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && 11 == lval_get_long(v));
+	TEST_ASSERT(3 == after.hits - before.hits && 1 == after.misses - before.misses);
+	TEARDOWN(v);
+
+	// rebinding a global is seen by every site, and so is a caller binding it
+	STARTUP_NO_DECLARE(v, "def {ic_k} 20");
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "ic_f 1");
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && 21 == lval_get_long(v));
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "(\\ {ic_k} {ic_f 1}) 5");
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && 6 == lval_get_long(v));
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "(\\ {_} {= {ic_k} 30}) 0");
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "ic_f 1");
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && 21 == lval_get_long(v));
+	TEARDOWN(v);
+
+	lval* k = lval_sym("ic_k");
+	TEST_ASSERT(0 == lenv_remove(environment, k->sym));
+	lval_del(k);
+	STARTUP_NO_DECLARE(v, "ic_f 1");
+	TEST_ASSERT(LVAL_ERR == LVAL_TYPE(v) && LERR_BAD_SYMBOL == v->err);
+	TEARDOWN(v);
+
+	// with the caches off every global is looked up
+	lenv_cache_globals = 0;
+	STARTUP_NO_DECLARE(v, "def {ic_k} 40");
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "ic_f 1");
+	TEARDOWN(v);
+	lenv_get_stats(&before);
+	STARTUP_NO_DECLARE(v, "ic_f 1");
+	lenv_get_stats(&after);
+	lenv_cache_globals = 1;
+	clos_enabled = 1;
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && 41 == lval_get_long(v));
+	TEST_ASSERT(after.hits == before.hits);
+	TEARDOWN(v);
+	return 0;
+}
+
+int test_optimizer()
+{
+	struct opt_stats before, after;
+	lval* v;
+
+	// both calls are inlined, then the constants folded and the if pruned
+	STARTUP_NO_DECLARE(v, "def {op_sq op_dec} (\\ {x} {* x x}) (\\ {x} {- x 1})");
+	TEARDOWN(v);
+	opt_get_stats(&before);
+	STARTUP_NO_DECLARE(v, "def {op_f} (\\ {n} {+ (op_sq n) (op_dec n) (* 7 2) (if (> 2 1) {n} {0})})");
+	TEARDOWN(v);
+	opt_get_stats(&after);
+	TEST_ASSERT(1 == after.lambdas - before.lambdas);
+	TEST_ASSERT(2 == after.inlined - before.inlined && 2 == after.folded - before.folded);
+	TEST_ASSERT(1 == after.pruned - before.pruned);
+	STARTUP_NO_DECLARE(v, "op_f 5");
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && 48 == lval_get_long(v));
+	TEARDOWN(v);
+
+	// a redefinition is seen, a frame binding an inlined name runs the body
+	// as written
+	STARTUP_NO_DECLARE(v, "def {op_sq} (\\ {x} {+ x x})");
+	TEARDOWN(v);
+	opt_get_stats(&before);
+	STARTUP_NO_DECLARE(v, "op_f 5");
+	opt_get_stats(&after);
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && 33 == lval_get_long(v));
+	TEST_ASSERT(1 == after.redone - before.redone);
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "(\\ {op_dec} {op_f 5}) 0");
+	opt_get_stats(&before);
+	TEST_ASSERT(LVAL_ERR == LVAL_TYPE(v) && LERR_BAD_SEXPR_START == v->err);
+	TEST_ASSERT(before.skipped > after.skipped);
+	TEARDOWN(v);
+
+	// top level forms are rewritten too
+	STARTUP_NO_DECLARE(v, "+ 1 (op_sq 3)");
+	opt_get_stats(&after);
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && 7 == lval_get_long(v));
+	TEST_ASSERT(1 == after.forms - before.forms);
+	TEARDOWN(v);
+
+	opt_passes = 0;
+	STARTUP_NO_DECLARE(v, "op_f 5");
+	opt_passes = OPT_ALL;
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && 33 == lval_get_long(v));
+	TEARDOWN(v);
+	return 0;
+}
+
+int test_closures()
+{
+	struct clos_stats before, after;
+	int jit = jit_enabled;
+	lval* v;
+
+	// bodies are compiled once as the lambda is built, calls run them, the
+	// optimizer would inline some of them away and the jit run them itself
+	opt_passes = 0;
+	jit_enabled = 0;
+	clos_get_stats(&before);
+	STARTUP_NO_DECLARE(v, "def {cl_inc cl_sum} (\\ {x} {+ x 1}) (\\ {n acc} {if (== n 0) {acc} {cl_sum (- n 1) (+ acc n)}})");
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "cl_sum 100000 (cl_inc -1)");
+	clos_get_stats(&after);
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && 5000050000 == lval_get_long(v));
+	if (ENGINE_TREE == eval_engine)
+		TEST_ASSERT(after.runs - before.runs > 100000);
+	TEST_ASSERT(2 == after.compiles - before.compiles);
+	TEARDOWN(v);
+
+	// a frame binding a builtin's name is seen, a global rebinding compiles
+	// the body again
+	clos_get_stats(&before);
+	STARTUP_NO_DECLARE(v, "(\\ {+} {cl_inc 5}) -");
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && 4 == lval_get_long(v));
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "def {cl_old} +");
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "def {+} *");
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "cl_inc 5");
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && 5 == lval_get_long(v));
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "def {+} cl_old");
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "cl_inc 5");
+	clos_get_stats(&after);
+	opt_passes = OPT_ALL;
+	jit_enabled = jit;
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && 6 == lval_get_long(v));
+	if (ENGINE_TREE == eval_engine)
+		TEST_ASSERT(1 == after.guards - before.guards && 3 == after.compiles - before.compiles);
+	TEARDOWN(v);
+	return 0;
+}
+
+int test_jit()
+{
+	struct jit_stats before, after;
+	lval* v;
+
+	if (0 == jit_enabled)
+		return 0;
+
+	// compiled on the third call for the types of its arguments, calls made
+	// as written so the optimizer does not inline them away
+	opt_passes = 0;
+	jit_threshold = 3;
+	jit_get_stats(&before);
+	STARTUP_NO_DECLARE(v, "def {jt_fib jt_div jt_add jt_len} (\\ {n} {if (< n 2) {n} {+ (jt_fib (- n 1)) (jt_fib (- n 2))}}) (\\ {a b} {/ a b}) (\\ {a b} {+ a b}) (\\ {x} {len {x y}})");
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "jt_fib 20");
+	jit_get_stats(&after);
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && 6765 == lval_get_long(v));
+	TEST_ASSERT(1 == after.compiles - before.compiles && after.runs > before.runs);
+	TEARDOWN(v);
+
+	// other argument types are interpreted, and compiled for once they are
+	// seen as often
+	STARTUP_NO_DECLARE(v, "jt_fib 10.0");
+	jit_get_stats(&after);
+	TEST_ASSERT(LVAL_DBL == LVAL_TYPE(v) && 55.0 == lval_get_double(v));
+	TEST_ASSERT(3 == after.guards - before.guards && 2 == after.compiles - before.compiles);
+	TEARDOWN(v);
+
+	// a division by zero leaves the code, the interpreter gives the error
+	for (int i = 0; i < 3; i++) {
+		STARTUP_NO_DECLARE(v, "jt_div -7 2");
+		TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && -3 == lval_get_long(v));
+		TEARDOWN(v);
+	}
+	STARTUP_NO_DECLARE(v, "jt_div 7 0");
+	jit_get_stats(&after);
+	TEST_ASSERT(LVAL_ERR == LVAL_TYPE(v) && LERR_DIV_ZERO == v->err);
+	TEST_ASSERT(1 == after.bails - before.bails);
+	TEARDOWN(v);
+	// and so does a long that overflows, the interpreter gives the bigint
+	STARTUP_NO_DECLARE(v, "jt_div -9223372036854775808 -1");
+	jit_get_stats(&after);
+	TEST_ASSERT(LVAL_BIG == LVAL_TYPE(v) && 2 == after.bails - before.bails);
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "jt_div 1.5 0.5");
+	TEST_ASSERT(LVAL_DBL == LVAL_TYPE(v) && 3.0 == lval_get_double(v));
+	TEARDOWN(v);
+
+	// a frame binding a name called is seen, a global rebinding drops the code
+	for (int i = 0; i < 3; i++) {
+		STARTUP_NO_DECLARE(v, "jt_add 3 4.5");
+		TEST_ASSERT(LVAL_DBL == LVAL_TYPE(v) && 7.5 == lval_get_double(v));
+		TEARDOWN(v);
+	}
+	STARTUP_NO_DECLARE(v, "(\\ {+} {jt_add 3 4.5}) -");
+	TEST_ASSERT(LVAL_DBL == LVAL_TYPE(v) && -1.5 == lval_get_double(v));
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "def {jt_old} +");
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "def {+} *");
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "jt_add 3 4.5");
+	TEST_ASSERT(LVAL_DBL == LVAL_TYPE(v) && 13.5 == lval_get_double(v));
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "def {+} jt_old");
+	TEARDOWN(v);
+
+	// a body that is not numeric is never compiled
+	for (int i = 0; i < 4; i++) {
+		STARTUP_NO_DECLARE(v, "jt_len 1");
+		TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && 2 == lval_get_long(v));
+		TEARDOWN(v);
+	}
+	jit_get_stats(&after);
+	opt_passes = OPT_ALL;
+	jit_threshold = JIT_THRESHOLD;
+	TEST_ASSERT(1 == after.dropped - before.dropped && 1 == after.failed - before.failed);
+	TEST_ASSERT(4 == after.compiles - before.compiles);
+	return 0;
+}
+
+// runs on both engines, the results have to agree
+int test_engines()
+{
+	const int N = 64;
+	char output[N];
+	struct vm_stats before, after;
+	vm_get_stats(&before);
+
+	STARTUP(v, "def {ack} (\\ {m n} {if (== m 0) {+ n 1} {if (== n 0) {ack (- m 1) 1} {ack (- m 1) (ack m (- n 1))}}})");
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "ack 2 3");
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && 9 == lval_get_long(v));
+	TEARDOWN(v);
+
+	// partial application, variadic formals, the first error wins
+	STARTUP_NO_DECLARE(v, "def {add3 rest} (\\ {a b c} {+ a b c}) (\\ {x & xs} {xs})");
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "(add3 1) 2 3");
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && 6 == lval_get_long(v));
+	TEARDOWN(v);
+	// a partial application holds only its arguments, the rest is shared
+	STARTUP_NO_DECLARE(v, "def {add1} (add3 1)");
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "+ ((add1 2) 3) (add1 4 5) (add3 0 0 0)");
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && 16 == lval_get_long(v));
+	TEARDOWN(v);
+	lval* kf = lval_sym("add3");
+	lval* kg = lval_sym("add1");
+	lval* f = lenv_ref(environment, kf);
+	lval* g = lenv_ref(environment, kg);
+	TEST_ASSERT(NULL == f->args && g->args && 1 == g->args->count);
+	TEST_ASSERT(f->formals == g->formals && f->body == g->body);
+	lval_del(kf);
+	lval_del(kg);
+	STARTUP_NO_DECLARE(v, "join (rest 1) (rest 1 2 3)");
+	TEST_ASSERT(lval_snprintln(v, output, N));
+	TEST_ASSERT(0 == strncmp("{2 3}", output, N));
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "add3 1 2 3 4");
+	TEST_ASSERT(LVAL_ERR == LVAL_TYPE(v) && LERR_TOO_MANY_ARGS == v->err);
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "+ (/ 1 0) (undefined_fn 1) (def {never} 1)");
+	TEST_ASSERT(LVAL_ERR == LVAL_TYPE(v) && LERR_DIV_ZERO == v->err);
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "never");
+	TEST_ASSERT(LVAL_ERR == LVAL_TYPE(v) && LERR_BAD_SYMBOL == v->err);
+	TEARDOWN(v);
+
+	// a rebound if is called like any other function
+	STARTUP_NO_DECLARE(v, "(\\ {if} {if 1 {2} {3}}) list");
+	TEST_ASSERT(lval_snprintln(v, output, N));
+	TEST_ASSERT(0 == strncmp("{1 {2} {3}}", output, N));
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "if {1} {2} {3}");
+	TEST_ASSERT(LVAL_ERR == LVAL_TYPE(v) && LERR_BAD_TYPE == v->err);
+	TEARDOWN(v);
+
+	// a function may redefine itself while it runs
+	STARTUP_NO_DECLARE(v, "def {once} (\\ {x} {(\\ {_ y} {y}) (def {once} 0) (* x 2)})");
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "once 5");
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && 10 == lval_get_long(v));
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "once");
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && 0 == lval_get_long(v));
+	TEARDOWN(v);
+
+	vm_get_stats(&after);
+	if (ENGINE_VM == eval_engine) {
+		TEST_ASSERT(after.compiles > before.compiles);
+		TEST_ASSERT(after.calls - before.calls >= 9);
+		TEST_ASSERT(after.fallbacks > before.fallbacks);
+		TEST_ASSERT(after.fast > before.fast);
+	}
+	else
+		TEST_ASSERT(after.calls == before.calls && after.fast == before.fast);
+	return 0;
+}
+
+int test_tail_calls()
+{
+	// deep enough to overflow the C stack if every call nested
+	STARTUP(v, "def {loop} (\\ {n acc} {if (== n 0) {acc} {loop (- n 1) (+ acc n)}})");
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "loop 300000 0");
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && 45000150000 == lval_get_long(v));
+	TEARDOWN(v);
+
+	// the frames are kept when the callee binds other names
+	STARTUP_NO_DECLARE(v, "def {even odd} (\\ {n} {if (== n 0) {1} {odd (- n 1)}}) (\\ {m} {if (== m 0) {0} {even (- m 1)}})");
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "even 100001");
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && 0 == lval_get_long(v));
+	TEARDOWN(v);
+
+	// and a tail call still sees the frame of its caller
+	STARTUP_NO_DECLARE(v, "def {peek} (\\ {m} {+ m n})");
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "(\\ {n} {peek 1}) 5");
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && 6 == lval_get_long(v));
+	TEARDOWN(v);
+
+	// a hot lambda taking a list has no machine code, its calls stay in place
+	STARTUP_NO_DECLARE(v, "def {build} (\\ {n acc} {if (== n 0) {acc} {build (- n 1) (cons n acc)}})");
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "len (build 50000 {})");
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && 50000 == lval_get_long(v));
+	TEARDOWN(v);
+
+	STARTUP_NO_DECLARE(v, "def {spin} (\\ {n} {if (== n 0) {n} {eval {spin (- n 1)}}})");
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "spin 300000");
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && 0 == lval_get_long(v));
+	TEARDOWN(v);
+	TEST_ASSERT(0 == eval_depth);
+	return 0;
+}
+
+int test_depth_limit()
+{
+	STARTUP(v, "def {count} (\\ {n} {if (== n 0) {0} {+ 1 (count (- n 1))}})");
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "count 5000");
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && 5000 == lval_get_long(v));
+	TEARDOWN(v);
+
+	int max = eval_max_depth;
+	eval_max_depth = 1000;
+	STARTUP_NO_DECLARE(v, "count 5000");
+	TEST_ASSERT(LVAL_ERR == LVAL_TYPE(v) && LERR_DEPTH == v->err);
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "count 500");
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && 500 == lval_get_long(v));
+	TEARDOWN(v);
+	eval_max_depth = max;
+
+	// deeper than the C stack holds, the tree walker carries on on new
+	// segments up to the max depth
+	STARTUP_NO_DECLARE(v, "count 90000");
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && 90000 == lval_get_long(v));
+	TEARDOWN(v);
+#ifdef USE_SLAB
+	// the segments allocate from the same slab, the second time from what the
+	// first one freed
+	struct slab_stats st0, st;
+	slab_get_stats(&st0);
+	STARTUP_NO_DECLARE(v, "count 90000");
+	TEST_ASSERT(LVAL_LNG == LVAL_TYPE(v) && 90000 == lval_get_long(v));
+	TEARDOWN(v);
+	slab_get_stats(&st);
+	TEST_ASSERT(st.chunks == st0.chunks);
+	TEST_ASSERT(ENGINE_VM == eval_engine || st.allocs - st0.allocs > 90000);
+#endif
+	STARTUP_NO_DECLARE(v, "count 5000000");
+	TEST_ASSERT(LVAL_ERR == LVAL_TYPE(v) && LERR_DEPTH == v->err);
+	TEARDOWN(v);
+	TEST_ASSERT(0 == eval_depth);
+	return 0;
+}
+
+int test_gc()
+{
+	const int N = 32;
+	char output[N];
+	struct gc_stats st;
+
+	lval_del(eval_str(environment, "def {gc_xs} {1 2 {3 4}}"));
+	lval* k = lval_sym("gc_xs");
+	gc_protect(k);
+	lval* xs = lenv_ref(environment, k);
+	int refs = xs->refs;
+	gc_get_stats(&st);
+	unsigned long collected = st.collected;
+
+	// two lists dropped without lval_del(), one of them holding xs
+	lval_add_toback(lval_qexpr(), lval_str("leaked"));
+	lval_add_toback(lval_qexpr(), lval_copy(xs));
+	TEST_ASSERT(refs + 1 == xs->refs);
+
+	TEST_ASSERT(3 <= gc_collect());
+	gc_get_stats(&st);
+	TEST_ASSERT(collected + 3 <= st.collected && 0 == st.queued);
+	TEST_ASSERT(refs == xs->refs);
+	TEST_ASSERT(lval_snprintln(xs, output, N));
+	TEST_ASSERT(0 == strncmp("{1 2 {3 4}}", output, N));
+
+	// only at the top level
+	eval_depth++;
+	TEST_ASSERT(-1 == gc_collect());
+	eval_depth--;
+
+	STARTUP(v, "eval (head (tail (tail gc_xs)))");
+	TEST_ASSERT(lval_snprintln(v, output, N));
+	TEST_ASSERT(0 == strncmp("{3 4}", output, N));
+	TEARDOWN(v);
 
+	gc_unprotect(k);
+	lenv_remove(environment, k->sym);
+	lval_del(k);
+	return 0;
+}
+
+int test_lval_layout()
+{
+	const int N = 64;
+	char output[N];
+
+	// short lists keep their cells in the lval, longer ones move them out
+	STARTUP(v, "{1 2 3}");
+	TEST_ASSERT(v->cell == v->cells_inline);
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "join {1 2 3} {4 5 6 7 8 9 10}");
+	TEST_ASSERT(v->cell != v->cells_inline && 10 == v->count);
+	TEST_ASSERT(lval_snprintln(v, output, N));
+	TEST_ASSERT(0 == strncmp("{1 2 3 4 5 6 7 8 9 10}", output, N));
+	TEARDOWN(v);
+
+	TEST_ASSERT(lval_sizeof(LVAL_SYM) < sizeof(lval));
+	TEST_ASSERT(lval_sizeof(LVAL_QEXPR) == sizeof(lval));
+	return 0;
+}
+
+int test_list_slices()
+{
+	const int N = 64;
+	char output[N];
+
+	lval_del(eval_str(environment, "def {sl_xs} {1 2 3 4 5 6 7 8}"));
+	lval* k = lval_sym("sl_xs");
+	lval* xs = lenv_ref(environment, k);
+
+	// tail and init share the cells of xs
+	STARTUP(v, "tail (tail sl_xs)");
+	TEST_ASSERT(lval_is_slice(v) && v->base == xs && v->cell == xs->cell + 2);
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "cons 0 (init sl_xs)");
+	TEST_ASSERT(lval_snprintln(v, output, N));
+	TEST_ASSERT(0 == strncmp("{0 1 2 3 4 5 6 7}", output, N));
+	TEARDOWN(v);
+
+	// appends to the shared xs do not see each other
+	lval_del(eval_str(environment, "def {sl_a} (join sl_xs {9})"));
+	STARTUP_NO_DECLARE(v, "join sl_xs {10}");
+	TEST_ASSERT(lval_snprintln(v, output, N));
+	TEST_ASSERT(0 == strncmp("{1 2 3 4 5 6 7 8 10}", output, N));
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "join sl_a (tail sl_a)");
+	TEST_ASSERT(lval_snprintln(v, output, N));
+	TEST_ASSERT(0 == strncmp("{1 2 3 4 5 6 7 8 9 2 3 4 5 6 7 8 9}", output, N));
+	TEARDOWN(v);
+	TEST_ASSERT(lval_snprintln(xs, output, N));
+	TEST_ASSERT(0 == strncmp("{1 2 3 4 5 6 7 8}", output, N));
+
+	// and neither do conses onto a long one, which go into room before it
+	lval_del(eval_str(environment, "def {sl_a} (join sl_xs sl_xs sl_xs sl_xs sl_xs sl_xs sl_xs sl_xs)"));
+	lval_del(eval_str(environment, "def {sl_a} (cons 0 (join sl_a sl_a))"));
+	STARTUP_NO_DECLARE(v, "cons -1 sl_a");
+	TEST_ASSERT(lval_is_slice(v) && 130 == v->count);
+	TEST_ASSERT(-1 == lval_get_long(v->cell[0]) && 0 == lval_get_long(v->cell[1]));
+	TEARDOWN(v);
+	STARTUP_NO_DECLARE(v, "cons -2 sl_a");
+	TEST_ASSERT(130 == v->count);
+	TEST_ASSERT(-2 == lval_get_long(v->cell[0]) && 0 == lval_get_long(v->cell[1]));
+	TEARDOWN(v);
+
+	lenv_remove(environment, k->sym);
+	lval_del(k);
+	k = lval_sym("sl_a");
+	lenv_remove(environment, k->sym);
+	lval_del(k);
 	return 0;
 }
 
@@ -519,17 +1673,36 @@ int test_order() {
 	return 0;
 }
 
-int run_tests(void)
+// the engine independent tests only run once, images can only be loaded once
+int run_tests(int engine)
 {
 	int count = 0; // used in RUN_TEST macro
-	RUN_TEST(test_ast_type);
-	RUN_TEST(test_ast_failure);
+	printf("engine: %s\n", ENGINE_VM == engine ? "vm" : "tree");
+	eval_engine = engine;
+	if (ENGINE_TREE == engine) {
+		RUN_TEST(test_parse_type);
+		RUN_TEST(test_parse_failure);
+		RUN_TEST(test_parse_tokens);
+		RUN_TEST(test_reader_chunks);
+		RUN_TEST(test_reader_resync);
+		RUN_TEST(test_parse_cache);
+		RUN_TEST(test_parse_string);
+		RUN_TEST(test_load);
+		RUN_TEST(test_load_stream);
+		RUN_TEST(test_symbols);
+		RUN_TEST(test_env_index);
+		RUN_TEST(test_image);
+	}
 	RUN_TEST(test_eval_arithmetic);
 	RUN_TEST(test_eval_arithmetic_dbl);
 	RUN_TEST(test_eval_pow);
 	RUN_TEST(test_eval_pow_dbl);
 	RUN_TEST(test_eval_maxmin);
 	RUN_TEST(test_eval_maxmin_dbl);
+	RUN_TEST(test_eval_mixed);
+	RUN_TEST(test_eval_int64);
+	RUN_TEST(test_eval_bigint);
+	RUN_TEST(test_immediates);
 	RUN_TEST(test_non_number);
 	RUN_TEST(test_bad_sexpr_start);
 	RUN_TEST(test_div_zero);
@@ -544,6 +1717,7 @@ int run_tests(void)
 	RUN_TEST(test_qexpr_len);
 	RUN_TEST(test_qexpr_cons);
 	RUN_TEST(test_qexpr_join);
+	RUN_TEST(test_qexpr_shared);
 	RUN_TEST(test_qexpr_incorrect_type);
 	RUN_TEST(test_qexpr_empty);
 	RUN_TEST(test_qexpr_too_many_args);
@@ -552,8 +1726,21 @@ int run_tests(void)
 	RUN_TEST(test_snprint_exprs_bad);
 	RUN_TEST(test_snprint_exprs_bad2);
 	RUN_TEST(test_def);
+	RUN_TEST(test_if);
+	RUN_TEST(test_eq);
+	RUN_TEST(test_resolve);
+	RUN_TEST(test_global_caches);
+	RUN_TEST(test_optimizer);
+	RUN_TEST(test_closures);
+	RUN_TEST(test_jit);
 	RUN_TEST(test_put);
 	RUN_TEST(test_lambda);
+	RUN_TEST(test_engines);
+	RUN_TEST(test_tail_calls);
+	RUN_TEST(test_depth_limit);
+	RUN_TEST(test_gc);
+	RUN_TEST(test_lval_layout);
+	RUN_TEST(test_list_slices);
 	printf("\tDone. (%d tests passed)\n", count);
 	return 0;
 }
@@ -574,17 +1761,21 @@ int main(void)
 		return 1;
 	}
 
-	init_parser();
-	environment = lenv_new();
-	init_env(environment);
+	log_init();
+	log_level = LOG_DEBUG;
 
 	// TODO a lot of these tests are functional tests rather than unit tests
-	int ret = run_tests();
+	int ret = 0;
+	for (int engine = ENGINE_TREE; engine <= ENGINE_VM && 0 == ret; engine++) {
+		environment = lenv_new();
+		init_env(environment);
+		ret = run_tests(engine);
+		lenv_del(environment);
+	}
 
-	lenv_del(environment);
+	log_shutdown();
 	fclose(logfp);
 	fclose(errfp);
-	mpc_cleanup(7, Long, Double, Symbol, Qexpr, Sexpr, Expr, Lisp);
 	return ret;
 }
 
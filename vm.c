@@ -0,0 +1,795 @@
+#include "vm.h"
+#include "eval.h"
+#include "gc.h"
+#include "image.h"
+#include "jit.h"
+#include "opt.h"
+#include "symtab.h"
+
+// every op is followed by its operands in the ops array
+enum OPS
+{
+	OP_CONST,	// k: push consts[k]
+	OP_LOOKUP,	// k: push the value bound to the symbol consts[k]
+	OP_CALLEE,	// k: push the function bound to consts[k], see _callee()
+	OP_IF,		// k, to: go on if consts[k] is the if builtin, else push it and jump
+	OP_BRANCH,	// to, end: pop a number and jump if it is 0, an error if it is no number
+	OP_JMP,		// to
+	OP_ERRJMP,	// n, to: if the top is an error drop the n values below it and jump
+	OP_CALL,	// n: call the function below the top n values with them
+	OP_TAILCALL,	// n: the same as the last thing before OP_RET, in place of the frame
+	OP_RET,
+};
+
+struct lcode
+{
+	int refs;
+	unsigned gc_epoch; // of the last lcode_trace() that reached it
+	int once; // top level code, constants are moved out rather than copied
+	int* ops;
+	int nops;
+	int ops_cap;
+	lval** consts;
+	int nconsts;
+	int consts_cap;
+	int depth; // of the stack at the current op while compiling
+	int max_depth;
+
+	// lambdas only
+	lval* formals;
+	lval* body;
+	lopt* opt; // the rewritten body it was compiled from, NULL for body
+	const char** params; // in slot order, without &
+	int nparams;
+	int rest; // slot of the symbol after &, -1 without &
+};
+
+// a call in progress, the caller of the frame running now
+struct vm_frame
+{
+	lcode* c;
+	int pc;
+	lenv* e;
+	int base; // where the callee and then its result are on the value stack
+};
+
+// image lambdas are read-only, their code is kept here
+struct image_code
+{
+	const lval* f;
+	lcode* code;
+	struct image_code* next;
+};
+
+#define IMAGE_CODE_BUCKETS 256
+#define FRAME_POOL 64
+
+enum VM_FAST { FAST_ARITH, FAST_ORD, FAST_CMP };
+
+// builtins run on two longs without building the sexpr of their arguments,
+// see _fast()
+static const struct
+{
+	lbuiltin func;
+	int kind;
+	int op;
+} FAST[] =
+{
+	{ builtin_add, FAST_ARITH, ARITH_ADD },
+	{ builtin_sub, FAST_ARITH, ARITH_SUB },
+	{ builtin_mul, FAST_ARITH, ARITH_MUL },
+	{ builtin_gt, FAST_ORD, ORD_GT },
+	{ builtin_lt, FAST_ORD, ORD_LT },
+	{ builtin_ge, FAST_ORD, ORD_GE },
+	{ builtin_le, FAST_ORD, ORD_LE },
+	{ builtin_eq, FAST_CMP, CMP_EQ },
+	{ builtin_ne, FAST_CMP, CMP_NE },
+};
+
+#define NFAST ((int)(sizeof(FAST) / sizeof(FAST[0])))
+
+static struct vm_stats stats = { 0, 0, 0, 0 };
+static struct image_code* image_codes[IMAGE_CODE_BUCKETS];
+
+// cleared call frames, their arrays are reused by the next calls
+static lenv* frames[FRAME_POOL];
+static int nframes = 0;
+
+static lcode* _code_new(void);
+static int _emit(lcode* c, int x);
+static int _const(lcode* c, lval* v);
+static void _depth(lcode* c, int n);
+static int _may_fail(lval* x);
+static void _compile_expr(lcode* c, lval* x);
+static void _compile_sexpr(lcode* c, lval* v, int tail);
+static int _compile_if(lcode* c, lval* v, int tail);
+static lcode* _compile_lambda(lval* f, lval* body);
+static lcode* _lambda_code(lenv* e, lval* f);
+static lcode** _code_slot(lval* f);
+static lcode* _eval_code(lval* q);
+static lval* _callee(lenv* e, lval* k);
+static lval* _args(lval** argv, int n);
+static lval* _fast(lbuiltin func, lval* x, lval* y);
+static lval* _call(lenv* e, lval* f, lval** argv, int n);
+static lenv* _frame(lcode* c, lval* args, lval** argv, int n);
+static void _frame_release(lenv* frame);
+static lval* _run(lenv* e, lcode* c);
+
+lval* vm_eval(lenv* e, lval* v)
+{
+	lcode* c = _code_new();
+	if (NULL == c) {
+		lval_del(v);
+		return lval_err(LERR_OTHER);
+	}
+
+	// the cells of v are shared with the constants
+	c->once = 1;
+	_compile_sexpr(c, v, 1);
+	lval_del(v);
+	_emit(c, OP_RET);
+
+	lval* r = _run(e, c);
+	lcode_release(c);
+	return r;
+}
+
+lcode* lcode_retain(lcode* c)
+{
+	c->refs++;
+	return c;
+}
+
+void lcode_release(lcode* c)
+{
+	if (NULL == c || --c->refs > 0)
+		return;
+
+	for (int i = 0; i < c->nconsts; i++) {
+		if (c->consts[i])
+			lval_del(c->consts[i]);
+	}
+	if (c->formals)
+		lval_del(c->formals);
+	if (c->body)
+		lval_del(c->body);
+	lopt_release(c->opt);
+	free(c->consts);
+	free(c->ops);
+	free(c->params);
+	free(c);
+}
+
+void lcode_trace(lcode* c, unsigned epoch, void (*visit)(lval*))
+{
+	if (c->gc_epoch == epoch)
+		return;
+	c->gc_epoch = epoch;
+
+	for (int i = 0; i < c->nconsts; i++) {
+		if (c->consts[i])
+			visit(c->consts[i]);
+	}
+	if (c->formals)
+		visit(c->formals);
+	if (c->body)
+		visit(c->body);
+	if (c->opt)
+		lopt_trace(c->opt, epoch, visit);
+}
+
+void vm_trace(unsigned epoch, void (*visit)(lval*), void (*visit_env)(lenv*))
+{
+	for (int i = 0; i < nframes; i++)
+		visit_env(frames[i]);
+	for (int i = 0; i < IMAGE_CODE_BUCKETS; i++) {
+		for (struct image_code* x = image_codes[i]; x; x = x->next) {
+			if (x->code)
+				lcode_trace(x->code, epoch, visit);
+		}
+	}
+}
+
+void vm_get_stats(struct vm_stats* st)
+{
+	*st = stats;
+}
+
+// private functions: //////////////////////////////////////////////////////////
+
+static lcode* _code_new(void)
+{
+	lcode* c = (lcode*)calloc(1, sizeof(lcode));
+	if (NULL == c)
+		return NULL;
+	c->refs = 1;
+	c->rest = -1;
+	return c;
+}
+
+// the position of x
+static int _emit(lcode* c, int x)
+{
+	if (c->nops == c->ops_cap) {
+		c->ops_cap = c->ops_cap ? 2 * c->ops_cap : 32;
+		c->ops = (int*)realloc(c->ops, sizeof(int) * c->ops_cap);
+	}
+	c->ops[c->nops] = x;
+	return c->nops++;
+}
+
+// takes v
+static int _const(lcode* c, lval* v)
+{
+	if (c->nconsts == c->consts_cap) {
+		c->consts_cap = c->consts_cap ? 2 * c->consts_cap : 8;
+		c->consts = (lval**)realloc(c->consts, sizeof(lval*) * c->consts_cap);
+	}
+	c->consts[c->nconsts] = v;
+	return c->nconsts++;
+}
+
+static void _depth(lcode* c, int n)
+{
+	c->depth += n;
+	c->max_depth = MAX(c->max_depth, c->depth);
+}
+
+// whether evaluating x can give an error
+static int _may_fail(lval* x)
+{
+	return LVAL_SYM == LVAL_TYPE(x) || LVAL_SEXPR == LVAL_TYPE(x) || LVAL_ERR == LVAL_TYPE(x);
+}
+
+// pushes one value
+static void _compile_expr(lcode* c, lval* x)
+{
+	switch (LVAL_TYPE(x)) {
+	case LVAL_SYM:
+		_emit(c, OP_LOOKUP);
+		_emit(c, _const(c, lval_copy(x)));
+		_depth(c, 1);
+		break;
+	case LVAL_SEXPR:
+		_compile_sexpr(c, x, 0);
+		break;
+	default:
+		_emit(c, OP_CONST);
+		_emit(c, _const(c, lval_copy(x)));
+		_depth(c, 1);
+		break;
+	}
+}
+
+// pushes one value, with tail the value is the result of the code and nothing
+// runs after the call
+static void _compile_sexpr(lcode* c, lval* v, int tail)
+{
+	int base = c->depth;
+
+	if (0 == v->count) {
+		_emit(c, OP_CONST);
+		_emit(c, _const(c, lval_sexpr()));
+		_depth(c, 1);
+		return;
+	}
+	if (1 == v->count) {
+		_compile_expr(c, v->cell[0]);
+		return;
+	}
+
+	lval* head = v->cell[0];
+	if (LVAL_SYM == LVAL_TYPE(head) && SYM_IF == head->sym && _compile_if(c, v, tail))
+		return;
+	int quoted = LVAL_SYM == LVAL_TYPE(head) && (SYM_QUOTE == head->sym || SYM_LIST == head->sym);
+
+	int patch[v->count];
+	int npatch = 0;
+	for (int i = 0; i < v->count; i++) {
+		lval* x = v->cell[i];
+		int fail = (i && quoted) ? LVAL_ERR == LVAL_TYPE(x) : _may_fail(x);
+
+		if (0 == i && LVAL_SYM == LVAL_TYPE(x)) {
+			_emit(c, OP_CALLEE);
+			_emit(c, _const(c, lval_copy(x)));
+			_depth(c, 1);
+		}
+		else if (i && quoted) {
+			_emit(c, OP_CONST);
+			_emit(c, _const(c, lval_copy(x)));
+			_depth(c, 1);
+		}
+		else
+			_compile_expr(c, x);
+
+		if (fail) {
+			_emit(c, OP_ERRJMP);
+			_emit(c, i);
+			patch[npatch++] = _emit(c, 0);
+		}
+	}
+
+	_emit(c, tail ? OP_TAILCALL : OP_CALL);
+	_emit(c, v->count - 1);
+	c->depth = base + 1;
+	for (int i = 0; i < npatch; i++)
+		c->ops[patch[i]] = c->nops;
+}
+
+// if cond {then} {else} with both branches inline, and the plain call for
+// when if has been rebound, 0 if v does not have that shape
+static int _compile_if(lcode* c, lval* v, int tail)
+{
+	if (4 != v->count || LVAL_QEXPR != LVAL_TYPE(v->cell[2]) || LVAL_QEXPR != LVAL_TYPE(v->cell[3]))
+		return 0;
+
+	int base = c->depth;
+	lval* head = v->cell[0];
+	lval* cond = v->cell[1];
+	int fail = _may_fail(cond);
+	int patch[4];
+	int npatch = 0;
+
+	// for the plain call
+	int kthen = _const(c, lval_copy(v->cell[2]));
+	int kelse = _const(c, lval_copy(v->cell[3]));
+
+	_emit(c, OP_IF);
+	_emit(c, _const(c, lval_copy(head)));
+	int generic = _emit(c, 0);
+
+	_compile_expr(c, cond);
+	if (fail) {
+		_emit(c, OP_ERRJMP);
+		_emit(c, 0);
+		patch[npatch++] = _emit(c, 0);
+	}
+	_emit(c, OP_BRANCH);
+	int to_else = _emit(c, 0);
+	patch[npatch++] = _emit(c, 0);
+
+	for (int i = 2; i < 4; i++) {
+		if (3 == i)
+			c->ops[to_else] = c->nops;
+		c->depth = base;
+		_compile_sexpr(c, v->cell[i], tail);
+		_emit(c, OP_JMP);
+		patch[npatch++] = _emit(c, 0);
+	}
+
+	// if is something else, it was pushed like any other function
+	c->ops[generic] = c->nops;
+	c->depth = base + 1;
+	int gpatch[2];
+	int ngpatch = 0;
+	_emit(c, OP_ERRJMP);
+	_emit(c, 0);
+	gpatch[ngpatch++] = _emit(c, 0);
+	_compile_expr(c, cond);
+	if (fail) {
+		_emit(c, OP_ERRJMP);
+		_emit(c, 1);
+		gpatch[ngpatch++] = _emit(c, 0);
+	}
+	_emit(c, OP_CONST);
+	_emit(c, kthen);
+	_emit(c, OP_CONST);
+	_emit(c, kelse);
+	_depth(c, 2);
+	_emit(c, tail ? OP_TAILCALL : OP_CALL);
+	_emit(c, 3);
+	c->depth = base + 1;
+
+	for (int i = 0; i < npatch; i++)
+		c->ops[patch[i]] = c->nops;
+	for (int i = 0; i < ngpatch; i++)
+		c->ops[gpatch[i]] = c->nops;
+	return 1;
+}
+
+// NULL if the formals are not something a call can bind directly, body is
+// that of f or its rewrite, see opt_body()
+static lcode* _compile_lambda(lval* f, lval* body)
+{
+	lval* formals = f->formals;
+	for (int i = 0; i < formals->count; i++) {
+		if (SYM_AMP == formals->cell[i]->sym && i != formals->count - 2)
+			return NULL;
+	}
+
+	lcode* c = _code_new();
+	if (NULL == c)
+		return NULL;
+	c->formals = lval_copy(formals);
+	c->body = lval_copy(f->body);
+	c->opt = body != f->body ? lopt_retain(opt_of(f)) : NULL;
+	c->params = (const char**)malloc(sizeof(char*) * (formals->count + 1));
+	for (int i = 0; i < formals->count; i++) {
+		if (SYM_AMP == formals->cell[i]->sym)
+			c->rest = c->nparams;
+		else
+			c->params[c->nparams++] = formals->cell[i]->sym;
+	}
+
+	// the body runs like the sexpr it would be turned into
+	_compile_sexpr(c, body, 1);
+	_emit(c, OP_RET);
+	stats.compiles++;
+	return c;
+}
+
+// NULL while a frame binds a name the rewrite of f relied on, lval_call()
+// runs the body as written then
+static lcode* _lambda_code(lenv* e, lval* f)
+{
+	lval* body = opt_body(e, f);
+	if (NULL == body)
+		return NULL;
+	lcode** slot = _code_slot(f);
+	if (NULL == slot)
+		return NULL;
+	if (*slot && (*slot)->opt == (body == f->body ? NULL : opt_of(f)))
+		return *slot;
+	lcode_release(*slot);
+	return *slot = _compile_lambda(f, body);
+}
+
+// where the code of f is kept
+static lcode** _code_slot(lval* f)
+{
+	if (!image_contains(f))
+		return &f->code;
+
+	struct image_code** b = &image_codes[((uintptr_t)f >> 4) % IMAGE_CODE_BUCKETS];
+	for (struct image_code* x = *b; x; x = x->next) {
+		if (x->f == f)
+			return &x->code;
+	}
+
+	struct image_code* x = (struct image_code*)malloc(sizeof(struct image_code));
+	if (NULL == x)
+		return NULL;
+	x->f = f;
+	x->code = NULL;
+	x->next = *b;
+	*b = x;
+	return &x->code;
+}
+
+// the code of eval with the qexpr q, it runs in the frame of the caller
+static lcode* _eval_code(lval* q)
+{
+	lcode* c = _code_new();
+	if (NULL == c)
+		return NULL;
+	c->once = 1;
+	_compile_sexpr(c, q, 1);
+	_emit(c, OP_RET);
+	return c;
+}
+
+// shared like a lookup would, a lambda is only looked at once its arguments
+// are there, they could rebind a name its code relies on
+static lval* _callee(lenv* e, lval* k)
+{
+	lval* f = lenv_ref(e, k);
+	return f ? lval_copy(f) : lval_err(LERR_BAD_SYMBOL);
+}
+
+static lval* _args(lval** argv, int n)
+{
+	lval* a = lval_sexpr();
+	if (n) {
+		gc_cells(a, n);
+		memcpy(a->cell, argv, sizeof(lval*) * n);
+		a->count = n;
+	}
+	return a;
+}
+
+// what func gives for the longs x and y, NULL when it is not in FAST, either
+// is not a long or the result would overflow, nothing is taken
+static lval* _fast(lbuiltin func, lval* x, lval* y)
+{
+	if (LVAL_LNG != LVAL_TYPE(x) || LVAL_LNG != LVAL_TYPE(y))
+		return NULL;
+	int64_t a = lval_get_long(x);
+	int64_t b = lval_get_long(y);
+	int64_t r;
+	for (int i = 0; i < NFAST; i++) {
+		if (FAST[i].func != func)
+			continue;
+		switch (FAST[i].kind) {
+		case FAST_ORD:
+			return lval_long(ORD_APPLY(FAST[i].op, a, b));
+		case FAST_CMP:
+			return lval_long(CMP_EQ == FAST[i].op ? a == b : a != b);
+		}
+		if (ARITH_ADD == FAST[i].op ? __builtin_add_overflow(a, b, &r)
+			: ARITH_SUB == FAST[i].op ? __builtin_sub_overflow(a, b, &r)
+			: __builtin_mul_overflow(a, b, &r))
+			return NULL;
+		return lval_long(r);
+	}
+	return NULL;
+}
+
+// takes f and the arguments, for everything but a full call of a lambda with
+// code
+static lval* _call(lenv* e, lval* f, lval** argv, int n)
+{
+	lval* r;
+
+	if (LVAL_FUN != LVAL_TYPE(f)) {
+		debug("First element must be a symbol, not of type %d", LVAL_TYPE(f));
+		lval_del(f);
+		for (int i = 0; i < n; i++)
+			lval_del(argv[i]);
+		return lval_err(LERR_BAD_SEXPR_START);
+	}
+
+	if (f->formals && (r = jit_run(e, f, argv, n))) {
+		lval_del(f);
+		for (int i = 0; i < n; i++)
+			lval_del(argv[i]);
+		return r;
+	}
+	if (NULL == f->builtin)
+		stats.fallbacks++;
+	r = lval_call(e, f, _args(argv, n));
+	lval_del(f);
+	return r;
+}
+
+// a frame with the arguments given before, if any, and then those in argv
+// bound, the caller checked their number
+static lenv* _frame(lcode* c, lval* args, lval** argv, int n)
+{
+	int given = args ? args->count : 0;
+	int fixed = c->rest < 0 ? c->nparams : c->nparams - 1;
+	lenv* frame = nframes ? frames[--nframes] : lenv_new();
+
+	for (int i = 0; i < fixed; i++)
+		lenv_bind(frame, c->params[i], i < given ? lval_copy(args->cell[i]) : argv[i - given]);
+	if (c->rest >= 0) {
+		lval* q = lval_qexpr();
+		for (int i = fixed; i < given + n; i++)
+			lval_add_toback(q, i < given ? lval_copy(args->cell[i]) : argv[i - given]);
+		lenv_bind(frame, c->params[fixed], q);
+	}
+	return frame;
+}
+
+static void _frame_release(lenv* frame)
+{
+	if (nframes < FRAME_POOL) {
+		lenv_clear(frame);
+		frames[nframes++] = frame;
+	}
+	else
+		lenv_del(frame);
+}
+
+// Calls of lambdas push a frame on a heap stack rather than recursing, the
+// values of all frames share one stack. A frame owns the envs between its own
+// and its caller's: its own, and those of tail calls it could not drop.
+static lval* _run(lenv* e, lcode* c)
+{
+	lenv* top = e;
+	int cap = c->max_depth + 1;
+	lval** stack = (lval**)malloc(sizeof(lval*) * cap);
+	struct vm_frame* calls = NULL;
+	int ncalls = 0;
+	int calls_cap = 0;
+	const int* ops = c->ops;
+	int base = 0;
+	int sp = 0;
+	int pc = 0;
+
+	if (NULL == stack)
+		return lval_err(LERR_OTHER);
+	lcode_retain(c);
+
+	for (;;) {
+		switch (ops[pc]) {
+		case OP_CONST: {
+			int k = ops[pc+1];
+			if (c->once) {
+				stack[sp++] = c->consts[k];
+				c->consts[k] = NULL;
+			}
+			else
+				stack[sp++] = lval_copy(c->consts[k]);
+			pc += 2;
+			break;
+		}
+		case OP_LOOKUP: {
+			lval* x = lenv_ref(e, c->consts[ops[pc+1]]);
+			stack[sp++] = x ? lval_copy(x) : lval_err(LERR_BAD_SYMBOL);
+			pc += 2;
+			break;
+		}
+		case OP_CALLEE:
+			stack[sp++] = _callee(e, c->consts[ops[pc+1]]);
+			pc += 2;
+			break;
+		case OP_IF: {
+			lval* f = lenv_ref(e, c->consts[ops[pc+1]]);
+			if (f && LVAL_FUN == LVAL_TYPE(f) && builtin_if == f->builtin)
+				pc += 3;
+			else {
+				stack[sp++] = _callee(e, c->consts[ops[pc+1]]);
+				pc = ops[pc+2];
+			}
+			break;
+		}
+		case OP_BRANCH: {
+			lval* x = stack[--sp];
+			if (!LVAL_IS_NUM(x)) {
+				stack[sp++] = lval_err(LERR_BAD_TYPE);
+				pc = ops[pc+2];
+			}
+			else
+				pc = GET_LVAL_NUM_TYPE(x) ? pc + 3 : ops[pc+1];
+			lval_del(x);
+			break;
+		}
+		case OP_JMP:
+			pc = ops[pc+1];
+			break;
+		case OP_ERRJMP:
+			if (LVAL_ERR == LVAL_TYPE(stack[sp-1])) {
+				lval* err = stack[--sp];
+				for (int n = ops[pc+1]; n > 0; n--)
+					lval_del(stack[--sp]);
+				stack[sp++] = err;
+				pc = ops[pc+2];
+			}
+			else
+				pc += 3;
+			break;
+		case OP_CALL:
+		case OP_TAILCALL: {
+			int tail = OP_TAILCALL == ops[pc];
+			int n = ops[pc+1];
+			int at = sp - n - 1;
+			lval* f = stack[at];
+			lcode* code = NULL;
+			int given = 0;
+			int fixed = 0;
+			int is_eval = 0;
+			int err = -1;
+
+			// lambdas get a frame, unless they run as machine code, eval
+			// {...} runs in this one
+			sp = at + 1;
+			lval* r = 2 == n && LVAL_FUN == LVAL_TYPE(f) && f->builtin
+				? _fast(f->builtin, stack[at+1], stack[at+2]) : NULL;
+			if (r) {
+				stats.fast++;
+				lval_del(f);
+				lval_del(stack[at+1]);
+				lval_del(stack[at+2]);
+				stack[at] = r;
+				pc += 2;
+				break;
+			}
+			if (LVAL_FUN == LVAL_TYPE(f) && NULL == f->builtin && !jit_hot(e, f)) {
+				code = _lambda_code(e, f);
+				given = f->args ? f->args->count : 0;
+				if (code) {
+					fixed = code->rest < 0 ? code->nparams : code->nparams - 1;
+					if (given + n > fixed && code->rest < 0)
+						err = LERR_TOO_MANY_ARGS;
+				}
+			}
+			else if (LVAL_FUN == LVAL_TYPE(f) && builtin_eval == f->builtin
+				&& 1 == n && LVAL_QEXPR == LVAL_TYPE(stack[at+1])) {
+				code = _eval_code(stack[at+1]);
+				is_eval = 1;
+			}
+
+			if (NULL == code || given + n < fixed) {
+				stack[at] = _call(e, f, stack + at + 1, n);
+				pc += 2;
+				break;
+			}
+			if (err < 0 && !tail && eval_depth >= eval_max_depth)
+				err = LERR_DEPTH;
+			if (err < 0 && !tail && ncalls == calls_cap) {
+				int ncap = calls_cap ? 2 * calls_cap : 16;
+				struct vm_frame* x = (struct vm_frame*)realloc(calls, sizeof(struct vm_frame) * ncap);
+				if (NULL == x)
+					err = LERR_OTHER;
+				else {
+					calls = x;
+					calls_cap = ncap;
+				}
+			}
+			if (err < 0 && at + code->max_depth + 1 > cap) {
+				int ncap = MAX(2 * cap, at + code->max_depth + 1);
+				lval** x = (lval**)realloc(stack, sizeof(lval*) * ncap);
+				if (NULL == x)
+					err = LERR_OTHER;
+				else {
+					stack = x;
+					cap = ncap;
+				}
+			}
+			if (err >= 0) {
+				if (is_eval)
+					lcode_release(code);
+				for (int i = at; i <= at + n; i++)
+					lval_del(stack[i]);
+				stack[at] = lval_err(err);
+				pc += 2;
+				break;
+			}
+
+			lenv* frame = e;
+			if (!is_eval) {
+				stats.calls++;
+				frame = _frame(code, f->args, stack + at + 1, n);
+				lenv_set_par(frame, e);
+				lcode_retain(code);
+			}
+			else
+				lval_del(stack[at+1]);
+			lval_del(f);
+
+			if (tail) {
+				// the frame replaces this one, this one's env goes too when
+				// nothing in it can be seen from the new one
+				lenv* stop = ncalls ? calls[ncalls-1].e : top;
+				if (frame != e && e != stop && lenv_shadows(frame, e)) {
+					lenv_set_par(frame, e->par);
+					_frame_release(e);
+				}
+				lcode_release(c);
+			}
+			else {
+				calls[ncalls].c = c;
+				calls[ncalls].pc = pc + 2;
+				calls[ncalls].e = e;
+				calls[ncalls].base = base;
+				ncalls++;
+				eval_depth++;
+			}
+
+			c = code;
+			ops = c->ops;
+			e = frame;
+			base = at;
+			sp = at;
+			pc = 0;
+			break;
+		}
+		case OP_RET: {
+			lval* r = stack[--sp];
+			lenv* stop = ncalls ? calls[ncalls-1].e : top;
+			while (e != stop) {
+				lenv* par = e->par;
+				_frame_release(e);
+				e = par;
+			}
+			lcode_release(c);
+
+			if (0 == ncalls) {
+				free(stack);
+				free(calls);
+				return r;
+			}
+
+			stack[base] = r;
+			sp = base + 1;
+			ncalls--;
+			eval_depth--;
+			c = calls[ncalls].c;
+			ops = c->ops;
+			pc = calls[ncalls].pc;
+			base = calls[ncalls].base;
+			break;
+		}
+		}
+	}
+}
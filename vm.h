@@ -0,0 +1,43 @@
+#ifndef VM_H_
+#define VM_H_
+
+#include "common.h"
+
+// The second engine behind eval(), selected with eval_engine. A sexpr is
+// compiled to a flat array of ops for a stack machine that calls the same
+// builtins and follows the tree walker's rules: evaluation order, the first
+// error wins, quote and list leave their arguments alone, dynamic scoping.
+//
+// A lambda body is compiled on the first call and the code is shared by all
+// copies of the lambda. A call of a lambda, given some of its arguments before
+// or not, binds them in a fresh frame and runs that code. if with literal
+// branches is compiled inline, guarded by a check that if still is the
+// builtin. Everything else, partial application itself included, goes through
+// lval_call().
+//
+// Calls of lambdas do not recurse in C, their frames are kept on a heap stack
+// that counts against eval_max_depth. A call in tail position replaces the
+// frame of its caller instead.
+
+struct vm_stats
+{
+	unsigned long compiles; // lambda bodies
+	unsigned long calls; // of compiled lambdas
+	unsigned long fallbacks; // calls left to lval_call()
+	unsigned long fast; // builtins run on two longs in place, see vm.c
+};
+
+lval* vm_eval(lenv* e, lval* v); // v is a sexpr and consumed
+
+lcode* lcode_retain(lcode* c);
+void lcode_release(lcode* c);
+
+// for gc_collect(): the values held by c, once per epoch, and then
+// everything the vm holds between evals
+void lcode_trace(lcode* c, unsigned epoch, void (*visit)(lval*));
+void vm_trace(unsigned epoch, void (*visit)(lval*), void (*visit_env)(lenv*));
+
+void vm_get_stats(struct vm_stats* st);
+
+#endif
+